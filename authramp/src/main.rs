@@ -0,0 +1,790 @@
+//! # AuthRamp CLI
+//!
+//! `authramp` administers the tallies of the authramp PAM module.
+//!
+//! ## Commands
+//!
+//! - **List:** Print the tallies with failures, or all tallies with `--all`. The tally
+//!   directory is read in parallel, see the `store::scan` module.
+//! - **Show:** Print the tally of a single user.
+//! - **Reset:** Clear the tally of a user, or of every user with `--all`. Resets are written
+//!   under the lock of the tally, so they never race with a concurrent login. With the `daemon`
+//!   backend the reset is sent to the daemon, which keeps the tallies in memory.
+//! - **Compact:** Remove clear tallies and tallies older than `tally_ttl` from the tally
+//!   directory. The compaction works in batches and skips tallies that are in use, so it can run
+//!   from a timer next to live logins. Cached tallies whose write back failed are written first.
+//! - **Metrics:** Print the phase latencies and event counters recorded with `metrics` enabled in
+//!   the Prometheus text format, or write them atomically to a node_exporter textfile.
+//! - **Simulate:** Replay sshd authentication logs against the configuration and candidate
+//!   policies, see the `simulate` module of the library.
+//!
+//! `list`, `show`, `reset` and `simulate` print JSON instead of a table with `--json`.
+//!
+//! ## License
+//!
+//! pam-authramp
+//! Copyright (C) 2023 github.com/34N0
+//!
+//! This program is free software: you can redistribute it and/or modify
+//! it under the terms of the GNU General Public License as published by
+//! the Free Software Foundation, either version 3 of the License, or
+//! (at your option) any later version.
+//!
+//! This program is distributed in the hope that it will be useful,
+//! but WITHOUT ANY WARRANTY; without even the implied warranty of
+//! MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//! GNU General Public License for more details.
+//!
+//! You should have received a copy of the GNU General Public License
+//! along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+use chrono::{DateTime, Datelike, Utc};
+use clap::{Parser, Subcommand};
+use pam_authramp::settings::{Settings, DEFAULT_CONFIG_FILE_PATH};
+use pam_authramp::simulate::{self, SimReport, TraceBuilder};
+use pam_authramp::store::cache;
+use pam_authramp::store::compact::{self, CompactStats};
+use pam_authramp::store::mmap::TallyDb;
+use pam_authramp::store::scan::{self, TallyEntry, TallyScan};
+use pam_authramp::store::{daemon, file, TallyBackend, TALLY_DB_FILE};
+use pam_authramp::tally::Tally;
+use pam_authramp::utils::metrics::Metrics;
+use pam_authramp::Actions;
+use std::ffi::{OsStr, OsString};
+use std::fmt::Write as _;
+use std::fs::File;
+use std::io::{self, BufReader, Write};
+use std::path::{Path, PathBuf};
+use std::process::ExitCode;
+use std::time::Duration;
+use users::{get_user_by_name, get_user_by_uid};
+
+#[derive(Parser)]
+#[command(author, version, about)]
+struct Cli {
+    /// Path of the authramp configuration file
+    #[arg(long, default_value = DEFAULT_CONFIG_FILE_PATH)]
+    config: PathBuf,
+    /// Print JSON instead of a table
+    #[arg(long, global = true)]
+    json: bool,
+    #[command(subcommand)]
+    command: Command,
+}
+
+#[derive(Subcommand)]
+enum Command {
+    /// List the tallies with failures
+    List {
+        /// Also list tallies without failures
+        #[arg(long)]
+        all: bool,
+    },
+    /// Show the tally of a user
+    Show {
+        /// Name of the user
+        user: String,
+    },
+    /// Clear the tally of a user
+    Reset {
+        /// Name of the user
+        #[arg(required_unless_present = "all")]
+        user: Option<String>,
+        /// Clear the tallies of all users
+        #[arg(long, conflicts_with = "user")]
+        all: bool,
+    },
+    /// Remove clear and expired tallies
+    Compact {
+        /// Number of tally files processed between pauses
+        #[arg(long, default_value_t = 100)]
+        batch_size: usize,
+        /// Pause between batches in milliseconds
+        #[arg(long, default_value_t = 10)]
+        pause_ms: u64,
+    },
+    /// Print the metrics in the Prometheus text format
+    Metrics {
+        /// Atomically replace this file instead of printing, e.g. for the node_exporter textfile collector
+        #[arg(long)]
+        output: Option<PathBuf>,
+    },
+    /// Replay sshd authentication logs against ramp policies
+    Simulate {
+        /// auth.log or `journalctl -o short-iso` exports, `-` for stdin
+        #[arg(required = true)]
+        traces: Vec<PathBuf>,
+        /// A policy of whitespace separated key=value settings over the configuration, e.g.
+        /// "free_tries=3 base_delay_seconds=60". Repeat to compare policies
+        #[arg(long)]
+        policy: Vec<String>,
+        /// Year of timestamps without a year, the current year by default
+        #[arg(long)]
+        year: Option<i32>,
+        /// Seconds after which the server drops a waiting session, e.g. LoginGraceTime of sshd
+        #[arg(long, default_value_t = 120)]
+        login_grace_seconds: i64,
+    },
+}
+
+/// Reads all tallies of the configured backend. Tallies of the `file` and `daemon` backends are
+/// read from the tally directory, the daemon writes every change through.
+///
+/// # Arguments
+/// - `settings`: The authramp settings
+///
+/// # Returns
+/// The tallies sorted by user name, or the error that occurred while reading them
+fn load_tallies(settings: &Settings) -> io::Result<TallyScan> {
+    if settings.tally_backend != TallyBackend::Mmap {
+        return scan::scan_tally_dir(settings);
+    }
+
+    let mut scan = TallyScan::default();
+    let path = settings.tally_dir.join(TALLY_DB_FILE);
+    if !path.is_file() {
+        return Ok(scan);
+    }
+
+    let db = TallyDb::open_cached(&path, settings.tally_db_slots)?;
+    for (uid, slot) in db.entries() {
+        let mut tally = Tally::default();
+        slot.load(&mut tally);
+        let name = get_user_by_uid(uid).map_or_else(
+            || OsString::from(uid.to_string()),
+            |user| user.name().into(),
+        );
+        scan.entries.push(TallyEntry { name, tally });
+    }
+    scan.entries.sort_unstable_by(|a, b| a.name.cmp(&b.name));
+    Ok(scan)
+}
+
+/// Reads the tally of a single user.
+///
+/// # Arguments
+/// - `settings`: The authramp settings
+/// - `user`: Name of the user
+///
+/// # Returns
+/// The tally, `None` if the user has no tally, or the error that occurred while reading it
+fn load_tally(settings: &Settings, user: &str) -> io::Result<Option<Tally>> {
+    if settings.tally_backend != TallyBackend::Mmap {
+        return Tally::load_tally_file(&settings.tally_dir.join(user))
+            .map_err(|_| io::Error::new(io::ErrorKind::InvalidData, "invalid tally file"));
+    }
+
+    let path = settings.tally_dir.join(TALLY_DB_FILE);
+    let Some(uid) = get_user_by_name(user).map(|user| user.uid()) else {
+        return Ok(None);
+    };
+    if !path.is_file() {
+        return Ok(None);
+    }
+
+    let db = TallyDb::open_cached(&path, settings.tally_db_slots)?;
+    Ok(db.find(uid).map(|slot| {
+        let mut tally = Tally::default();
+        slot.load(&mut tally);
+        tally
+    }))
+}
+
+/// Clears the tally of a user of the configured backend.
+///
+/// # Arguments
+/// - `settings`: The authramp settings
+/// - `user`: Name of the user
+///
+/// # Returns
+/// The failures count before the reset, `None` if there was nothing to reset, or the error
+/// that occurred
+fn reset_tally(settings: &Settings, user: &OsStr) -> io::Result<Option<i32>> {
+    match settings.tally_backend {
+        TallyBackend::Mmap => {
+            let path = settings.tally_dir.join(TALLY_DB_FILE);
+            let Some(uid) = get_user_by_name(user).map(|user| user.uid()) else {
+                return Ok(None);
+            };
+            if !path.is_file() {
+                return Ok(None);
+            }
+
+            let db = TallyDb::open_cached(&path, settings.tally_db_slots)?;
+            let Some(slot) = db.find(uid) else {
+                return Ok(None);
+            };
+            let mut tally = Tally::default();
+            slot.load(&mut tally);
+            if tally.is_clear() {
+                return Ok(None);
+            }
+            slot.reset();
+            Ok(Some(tally.failures_count))
+        }
+        TallyBackend::Daemon => match get_user_by_name(user) {
+            // The daemon answers from memory and writes the reset through to the tally file
+            Some(account) => match daemon::request(settings, Actions::AUTHSUCC, &account) {
+                Ok(response) => Ok(Some(response.previous_failures_count).filter(|&n| n > 0)),
+                Err(_) => Tally::reset_tally_file(
+                    &settings.tally_dir.join(user),
+                    settings,
+                    Some(&account),
+                ),
+            },
+            None => Tally::reset_tally_file(&settings.tally_dir.join(user), settings, None),
+        },
+        // A cached tally is reset after the tally file, under the tally file lock, so a
+        // concurrent cache miss cannot seed it from the old tally file
+        TallyBackend::File => {
+            Tally::reset_tally_file(&settings.tally_dir.join(user), settings, None)
+        }
+    }
+}
+
+/// Clears the tallies of all users with failures, in parallel.
+///
+/// # Arguments
+/// - `settings`: The authramp settings
+///
+/// # Returns
+/// The reset users with their failures count before the reset, and the number of failed
+/// resets, or the error that occurred while reading the tallies
+fn reset_all(settings: &Settings) -> io::Result<(Vec<(OsString, i32)>, usize)> {
+    let names: Vec<OsString> = load_tallies(settings)?
+        .entries
+        .into_iter()
+        .filter(|entry| !entry.tally.is_clear())
+        .map(|entry| entry.name)
+        .collect();
+
+    let results = scan::parallel_map(&names, |name| reset_tally(settings, name));
+
+    let mut reset = Vec::new();
+    let mut failed = 0;
+    for (name, result) in names.into_iter().zip(results) {
+        match result {
+            Ok(Some(failures_count)) => reset.push((name, failures_count)),
+            Ok(None) => {}
+            Err(_) => failed += 1,
+        }
+    }
+    Ok((reset, failed))
+}
+
+/// State of a tally at `now`: "locked" until the unlock instant, "expired" once older than
+/// `tally_ttl`, "counting" otherwise.
+fn tally_state(tally: &Tally, settings: &Settings, now: DateTime<Utc>) -> &'static str {
+    if tally.unlock_instant.map_or(false, |unlock| unlock > now) {
+        "locked"
+    } else if tally.is_expired(settings, now) {
+        "expired"
+    } else {
+        "counting"
+    }
+}
+
+/// Appends `s` as a JSON string.
+fn push_json_string(out: &mut String, s: &str) {
+    out.push('"');
+    for c in s.chars() {
+        match c {
+            '"' => out.push_str("\\\""),
+            '\\' => out.push_str("\\\\"),
+            c if (c as u32) < 0x20 => {
+                let _ = write!(out, "\\u{:04x}", c as u32);
+            }
+            c => out.push(c),
+        }
+    }
+    out.push('"');
+}
+
+/// Renders tallies as a table or as a JSON array.
+///
+/// # Arguments
+/// - `entries`: The tallies
+/// - `settings`: The authramp settings
+/// - `json`: Render JSON instead of a table
+///
+/// # Returns
+/// The rendered tallies
+fn render_tallies(entries: &[TallyEntry], settings: &Settings, json: bool) -> String {
+    let now = Utc::now();
+    let mut out = String::with_capacity(entries.len() * 128 + 128);
+
+    if json {
+        out.push('[');
+        for (i, entry) in entries.iter().enumerate() {
+            if i > 0 {
+                out.push(',');
+            }
+            out.push_str("{\"user\":");
+            push_json_string(&mut out, &entry.name.to_string_lossy());
+            let _ = write!(
+                out,
+                ",\"failures\":{},\"last_failure\":\"{}\",\"unlock\":",
+                entry.tally.failures_count,
+                entry.tally.failure_instant.to_rfc3339()
+            );
+            match entry.tally.unlock_instant {
+                Some(unlock) => {
+                    let _ = write!(out, "\"{}\"", unlock.to_rfc3339());
+                }
+                None => out.push_str("null"),
+            }
+            let _ = write!(
+                out,
+                ",\"state\":\"{}\"}}",
+                tally_state(&entry.tally, settings, now)
+            );
+        }
+        out.push_str("]\n");
+    } else {
+        let _ = writeln!(
+            out,
+            "{:<32} {:>8} {:<8} {:<25} UNLOCK",
+            "USER", "FAILURES", "STATE", "LAST FAILURE"
+        );
+        for entry in entries {
+            let _ = writeln!(
+                out,
+                "{:<32} {:>8} {:<8} {:<25} {}",
+                entry.name.to_string_lossy(),
+                entry.tally.failures_count,
+                tally_state(&entry.tally, settings, now),
+                entry.tally.failure_instant.format("%Y-%m-%d %H:%M:%S UTC"),
+                entry.tally.unlock_instant.map_or_else(
+                    || String::from("-"),
+                    |unlock| unlock.format("%Y-%m-%d %H:%M:%S UTC").to_string()
+                )
+            );
+        }
+    }
+
+    out
+}
+
+/// Renders the result of a reset as a table or as a JSON array.
+///
+/// # Arguments
+/// - `reset`: The reset users with their failures count before the reset
+/// - `json`: Render JSON instead of a table
+///
+/// # Returns
+/// The rendered result
+fn render_reset(reset: &[(OsString, i32)], json: bool) -> String {
+    let mut out = String::with_capacity(reset.len() * 64 + 16);
+    if json {
+        out.push('[');
+        for (i, (name, failures_count)) in reset.iter().enumerate() {
+            if i > 0 {
+                out.push(',');
+            }
+            out.push_str("{\"user\":");
+            push_json_string(&mut out, &name.to_string_lossy());
+            let _ = write!(out, ",\"failures\":{}}}", failures_count);
+        }
+        out.push_str("]\n");
+    } else {
+        for (name, failures_count) in reset {
+            let _ = writeln!(
+                out,
+                "reset {} ({} failures)",
+                name.to_string_lossy(),
+                failures_count
+            );
+        }
+        let _ = writeln!(out, "reset {} tallies", reset.len());
+    }
+    out
+}
+
+/// Reads sshd authentication logs into a trace.
+///
+/// # Arguments
+/// - `paths`: The logs, `-` reads stdin
+/// - `year`: Year of timestamps without a year
+///
+/// # Returns
+/// The trace, or the path and the error that occurred while reading
+fn load_trace(paths: &[PathBuf], year: i32) -> Result<simulate::Trace, (PathBuf, io::Error)> {
+    let mut builder = TraceBuilder::new(year);
+    for path in paths {
+        let read = if path.as_os_str() == "-" {
+            builder.read(io::stdin().lock())
+        } else {
+            File::open(path).and_then(|file| builder.read(BufReader::with_capacity(1 << 16, file)))
+        };
+        read.map_err(|e| (path.clone(), e))?;
+    }
+    Ok(builder.finish())
+}
+
+/// Renders simulation reports as a table or as a JSON array.
+///
+/// # Arguments
+/// - `policies`: The policy labels
+/// - `reports`: The reports, in the order of the labels
+/// - `json`: Render JSON instead of a table
+///
+/// # Returns
+/// The rendered reports
+fn render_simulation(policies: &[String], reports: &[SimReport], json: bool) -> String {
+    let mut out = String::with_capacity(reports.len() * 256 + 128);
+    let mean_delay = |report: &SimReport| {
+        if report.legitimate_delayed == 0 {
+            0.0
+        } else {
+            report.legitimate_delay.num_milliseconds() as f64
+                / 1000.0
+                / report.legitimate_delayed as f64
+        }
+    };
+
+    if json {
+        out.push('[');
+        for (i, (policy, report)) in policies.iter().zip(reports).enumerate() {
+            if i > 0 {
+                out.push(',');
+            }
+            out.push_str("{\"policy\":");
+            push_json_string(&mut out, policy);
+            let _ = write!(
+                out,
+                ",\"attacker_attempts\":{},\"attacker_allowed\":{},\"unknown_user_attempts\":{},\
+                 \"legitimate_attempts\":{},\"legitimate_delayed\":{},\"legitimate_rejected\":{},\
+                 \"legitimate_mean_delay_seconds\":{:.3},\"legitimate_max_delay_seconds\":{:.3},\
+                 \"peak_blocked\":{}}}",
+                report.attacker_attempts,
+                report.attacker_allowed,
+                report.unknown_user_attempts,
+                report.legitimate_attempts,
+                report.legitimate_delayed,
+                report.legitimate_rejected,
+                mean_delay(report),
+                report.legitimate_max_delay.num_milliseconds() as f64 / 1000.0,
+                report.peak_blocked
+            );
+        }
+        out.push_str("]\n");
+    } else {
+        let _ = writeln!(
+            out,
+            "{:>10} {:>10} {:>10} {:>8} {:>8} {:>10} {:>10} {:>6}  POLICY",
+            "ATTACKS", "ALLOWED", "LEGIT", "DELAYED", "REJECTED", "MEAN DELAY", "MAX DELAY", "PEAK"
+        );
+        for (policy, report) in policies.iter().zip(reports) {
+            let _ = writeln!(
+                out,
+                "{:>10} {:>10} {:>10} {:>8} {:>8} {:>9.1}s {:>9}s {:>6}  {}",
+                report.attacker_attempts,
+                report.attacker_allowed,
+                report.legitimate_attempts,
+                report.legitimate_delayed,
+                report.legitimate_rejected,
+                mean_delay(report),
+                report.legitimate_max_delay.num_seconds(),
+                report.peak_blocked,
+                policy
+            );
+        }
+    }
+    out
+}
+
+/// Writes rendered output to stdout in one go.
+fn print_output(out: &str) -> ExitCode {
+    match io::stdout().lock().write_all(out.as_bytes()) {
+        Ok(()) => ExitCode::SUCCESS,
+        Err(_) => ExitCode::FAILURE,
+    }
+}
+
+/// Compacts the tally directory and the tally database.
+///
+/// # Arguments
+/// - `settings`: The authramp settings
+/// - `batch_size`: Number of tally files processed between pauses
+/// - `pause`: Pause between batches
+///
+/// # Returns
+/// The combined statistics of both compactions
+fn compact(settings: &Settings, batch_size: usize, pause: Duration) -> io::Result<CompactStats> {
+    // The module writes cached tallies through, dirty slots are left by failed writes
+    if settings.tally_cache {
+        cache::flush_dirty(&*cache::open(settings)?, settings);
+    }
+    let files = compact::compact_tally_dir(settings, batch_size, pause)?;
+    let db = compact::compact_tally_db(settings)?;
+    Ok(CompactStats {
+        scanned: files.scanned + db.scanned,
+        removed: files.removed + db.removed,
+        cleared: files.cleared + db.cleared,
+        skipped: files.skipped + db.skipped,
+    })
+}
+
+/// Renders the metrics segment and prints it or writes it to `output`.
+///
+/// # Arguments
+/// - `settings`: The authramp settings
+/// - `output`: File to replace with the metrics
+///
+/// # Returns
+/// The result of opening the segment or writing the file
+fn export_metrics(settings: &Settings, output: Option<&Path>) -> io::Result<()> {
+    let text = Metrics::open(&settings.metrics_name)?.render();
+    match output {
+        // The textfile collector must never read a partially written file
+        Some(output) => file::replace(output, text.as_bytes()),
+        None => {
+            print!("{}", text);
+            Ok(())
+        }
+    }
+}
+
+fn main() -> ExitCode {
+    let cli = Cli::parse();
+    let settings = Settings::load_cached_conf_file(&cli.config);
+
+    match cli.command {
+        Command::List { all } => match load_tallies(&settings) {
+            Ok(scan) => {
+                if scan.unreadable > 0 {
+                    eprintln!("Skipped {} unreadable tally files", scan.unreadable);
+                }
+                let entries: Vec<TallyEntry> = scan
+                    .entries
+                    .into_iter()
+                    .filter(|entry| all || !entry.tally.is_clear())
+                    .collect();
+                print_output(&render_tallies(&entries, &settings, cli.json))
+            }
+            Err(e) => {
+                eprintln!("Error listing {}: {}", settings.tally_dir.display(), e);
+                ExitCode::FAILURE
+            }
+        },
+        Command::Show { user } => match load_tally(&settings, &user) {
+            Ok(Some(tally)) => {
+                let entry = TallyEntry {
+                    name: user.into(),
+                    tally,
+                };
+                print_output(&render_tallies(&[entry], &settings, cli.json))
+            }
+            Ok(None) => {
+                eprintln!("No tally for the {:?} account", user);
+                ExitCode::FAILURE
+            }
+            Err(e) => {
+                eprintln!("Error reading the tally of {:?}: {}", user, e);
+                ExitCode::FAILURE
+            }
+        },
+        Command::Reset {
+            user: Some(user), ..
+        } => match reset_tally(&settings, OsStr::new(&user)) {
+            Ok(previous) => {
+                let reset: Vec<_> = previous.map(|n| (user.into(), n)).into_iter().collect();
+                print_output(&render_reset(&reset, cli.json))
+            }
+            Err(e) => {
+                eprintln!("Error resetting the tally of {:?}: {}", user, e);
+                ExitCode::FAILURE
+            }
+        },
+        Command::Reset { user: None, .. } => match reset_all(&settings) {
+            Ok((reset, failed)) => {
+                let code = print_output(&render_reset(&reset, cli.json));
+                if failed > 0 {
+                    eprintln!("Failed to reset {} tallies", failed);
+                    return ExitCode::FAILURE;
+                }
+                code
+            }
+            Err(e) => {
+                eprintln!("Error resetting {}: {}", settings.tally_dir.display(), e);
+                ExitCode::FAILURE
+            }
+        },
+        Command::Compact {
+            batch_size,
+            pause_ms,
+        } => match compact(&settings, batch_size, Duration::from_millis(pause_ms)) {
+            Ok(stats) => {
+                println!(
+                    "scanned {}, removed {}, cleared {}, skipped {} in use",
+                    stats.scanned, stats.removed, stats.cleared, stats.skipped
+                );
+                ExitCode::SUCCESS
+            }
+            Err(e) => {
+                eprintln!("Error compacting {}: {}", settings.tally_dir.display(), e);
+                ExitCode::FAILURE
+            }
+        },
+        Command::Metrics { output } => match export_metrics(&settings, output.as_deref()) {
+            Ok(()) => ExitCode::SUCCESS,
+            Err(e) => {
+                eprintln!("Error exporting metrics {}: {}", settings.metrics_name, e);
+                ExitCode::FAILURE
+            }
+        },
+        Command::Simulate {
+            traces,
+            mut policy,
+            year,
+            login_grace_seconds,
+        } => {
+            let trace = match load_trace(&traces, year.unwrap_or_else(|| Utc::now().year())) {
+                Ok(trace) => trace,
+                Err((path, e)) => {
+                    eprintln!("Error reading {}: {}", path.display(), e);
+                    return ExitCode::FAILURE;
+                }
+            };
+            if trace.events.is_empty() {
+                eprintln!("No sshd authentication attempts in the traces");
+                return ExitCode::FAILURE;
+            }
+
+            if policy.is_empty() {
+                policy.push(String::new());
+            }
+            let policies: Vec<Settings> = policy
+                .iter()
+                .map(|args| {
+                    let args: Vec<&str> = args.split_whitespace().collect();
+                    Settings::clone(&settings).with_args(&args)
+                })
+                .collect();
+            let labels: Vec<String> = policy
+                .into_iter()
+                .map(|args| {
+                    if args.is_empty() {
+                        String::from("config")
+                    } else {
+                        args
+                    }
+                })
+                .collect();
+
+            let reports = simulate::simulate_policies(
+                &trace,
+                &policies,
+                chrono::Duration::seconds(login_grace_seconds),
+            );
+            eprintln!(
+                "Replayed {} attempts on {} users",
+                trace.events.len(),
+                trace.users.len()
+            );
+            print_output(&render_simulation(&labels, &reports, cli.json))
+        }
+    }
+}
+
+// Unit Tests
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::fs;
+    use tempdir::TempDir;
+
+    #[test]
+    fn test_compact_combines_tally_dir_and_db() {
+        let temp_dir = TempDir::new("test_compact_combines").unwrap();
+        fs::write(
+            temp_dir.path().join("test_user"),
+            "[Fails]\ncount = 0\ninstant = \"2023-01-01T00:00:00Z\"",
+        )
+        .unwrap();
+
+        let settings = Settings {
+            tally_dir: temp_dir.path().to_path_buf(),
+            ..Default::default()
+        };
+
+        let stats = compact(&settings, 100, Duration::ZERO).unwrap();
+        assert_eq!((stats.scanned, stats.removed), (1, 1));
+        assert!(!temp_dir.path().join("test_user").exists());
+    }
+
+    #[test]
+    fn test_reset_all_clears_tallies_with_failures() {
+        let temp_dir = TempDir::new("test_reset_all").unwrap();
+        fs::write(
+            temp_dir.path().join("locked_user"),
+            "[Fails]\ncount = 8\ninstant = \"2023-01-01T00:00:00Z\"\nunlock_instant = \"2099-01-01T00:00:00Z\"",
+        )
+        .unwrap();
+        fs::write(
+            temp_dir.path().join("clear_user"),
+            "[Fails]\ncount = 0\ninstant = \"2023-01-01T00:00:00Z\"",
+        )
+        .unwrap();
+
+        let settings = Settings {
+            tally_dir: temp_dir.path().to_path_buf(),
+            ..Default::default()
+        };
+
+        let scan = load_tallies(&settings).unwrap();
+        assert_eq!(scan.entries.len(), 2);
+        let text = render_tallies(&scan.entries, &settings, false);
+        assert!(text.contains("locked"));
+
+        let (reset, failed) = reset_all(&settings).unwrap();
+        assert_eq!(reset, vec![(OsString::from("locked_user"), 8)]);
+        assert_eq!(failed, 0);
+
+        let tally = load_tally(&settings, "locked_user").unwrap().unwrap();
+        assert!(tally.is_clear());
+        assert_eq!(
+            reset_tally(&settings, OsStr::new("locked_user")).unwrap(),
+            None
+        );
+    }
+
+    #[test]
+    fn test_render_simulation_as_json() {
+        let report = SimReport {
+            attacker_attempts: 10,
+            attacker_allowed: 7,
+            legitimate_attempts: 2,
+            legitimate_delayed: 1,
+            legitimate_delay: chrono::Duration::seconds(3),
+            legitimate_max_delay: chrono::Duration::seconds(3),
+            peak_blocked: 2,
+            ..Default::default()
+        };
+
+        let json = render_simulation(&[String::from("free_tries=6")], &[report], true);
+        assert_eq!(
+            json,
+            "[{\"policy\":\"free_tries=6\",\"attacker_attempts\":10,\"attacker_allowed\":7,\"unknown_user_attempts\":0,\"legitimate_attempts\":2,\"legitimate_delayed\":1,\"legitimate_rejected\":0,\"legitimate_mean_delay_seconds\":3.000,\"legitimate_max_delay_seconds\":3.000,\"peak_blocked\":2}]\n"
+        );
+    }
+
+    #[test]
+    fn test_render_tallies_as_json() {
+        let settings = Settings::default();
+        let entry = TallyEntry {
+            name: OsString::from("we\"ird\\user"),
+            tally: Tally {
+                failures_count: 3,
+                failure_instant: "2023-01-01T00:00:00Z".parse().unwrap(),
+                ..Default::default()
+            },
+        };
+
+        let json = render_tallies(&[entry], &settings, true);
+        assert_eq!(
+            json,
+            "[{\"user\":\"we\\\"ird\\\\user\",\"failures\":3,\"last_failure\":\"2023-01-01T00:00:00+00:00\",\"unlock\":null,\"state\":\"counting\"}]\n"
+        );
+    }
+}
@@ -0,0 +1,855 @@
+//! # AuthRamp Daemon
+//!
+//! `authrampd` holds the authramp settings and all tallies in memory and answers the tally
+//! requests of the PAM module over a Unix datagram socket. It is used by the module when
+//! `tally_backend` is set to `daemon`. The protocol is described in the
+//! `pam_authramp::store::daemon` module.
+//!
+//! Requests are processed one at a time, so the tally of a user is never updated concurrently.
+//! PREAUTH requests are answered from memory. Every changed tally is written through to its
+//! tally file, so the PAM module keeps working with the tally files if the daemon is stopped.
+//! A tally file that changed since the daemon read or wrote it, e.g. by a client that fell back to
+//! the tally files while the daemon was slow, is read again. Tally files are read and written
+//! under their lock like in the PAM module, and requests whose client already fell back to the
+//! tally files are dropped. At most `MAX_TALLIES` tallies are kept in memory, evicted tallies are
+//! read from their tally file again.
+//!
+//! ## Cluster
+//!
+//! With `gossip_bind` set, the daemons listed in `gossip_peers` share the failures of every
+//! account over UDP, see the `pam_authramp::store::gossip` module. Requests are still answered
+//! from memory only. A changed counter is sent to all peers right after the response and
+//! repeated every `GOSSIP_INTERVAL` for `GOSSIP_REPEAT`, so a lost datagram delays convergence
+//! by at most one interval. Updates from other nodes are merged as they arrive and applied to
+//! the tally the next time the account is used on this node. At most `MAX_ACCOUNTS` accounts
+//! are kept, accounts without failures are evicted first. Undecodable messages are counted and
+//! reported once per `GOSSIP_ERROR_INTERVAL`.
+//!
+//! ## License
+//!
+//! pam-authramp
+//! Copyright (C) 2023 github.com/34N0
+//!
+//! This program is free software: you can redistribute it and/or modify
+//! it under the terms of the GNU General Public License as published by
+//! the Free Software Foundation, either version 3 of the License, or
+//! (at your option) any later version.
+//!
+//! This program is distributed in the hope that it will be useful,
+//! but WITHOUT ANY WARRANTY; without even the implied warranty of
+//! MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//! GNU General Public License for more details.
+//!
+//! You should have received a copy of the GNU General Public License
+//! along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+use chrono::Utc;
+use clap::Parser;
+use pam_authramp::settings::{Settings, DEFAULT_CONFIG_FILE_PATH};
+use pam_authramp::store;
+use pam_authramp::store::daemon::{self, Request, REQUEST_SIZE};
+use pam_authramp::store::gossip::{self, ClusterTally, GossipKey, MESSAGE_SIZE};
+use pam_authramp::tally::Tally;
+use pam_authramp::Actions;
+use std::collections::HashMap;
+use std::ffi::OsStr;
+use std::fs::{self, DirBuilder, File, Permissions};
+use std::io;
+use std::net::{SocketAddr, ToSocketAddrs, UdpSocket};
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::fs::{DirBuilderExt, MetadataExt, PermissionsExt};
+use std::os::unix::io::AsRawFd;
+use std::os::unix::net::UnixDatagram;
+use std::path::{Path, PathBuf};
+use std::process::ExitCode;
+use std::time::{Duration, Instant};
+
+/// Interval at which recently changed counters are gossiped again.
+const GOSSIP_INTERVAL: Duration = Duration::from_millis(250);
+/// Time a changed counter keeps being gossiped.
+const GOSSIP_REPEAT: Duration = Duration::from_secs(5);
+/// Number of tallies kept in memory.
+const MAX_TALLIES: usize = 65536;
+/// Number of cluster accounts kept in memory.
+const MAX_ACCOUNTS: usize = 65536;
+/// Interval at which undecodable gossip messages are reported.
+const GOSSIP_ERROR_INTERVAL: Duration = Duration::from_secs(60);
+
+#[derive(Parser)]
+#[command(author, version, about)]
+struct Cli {
+    /// Path of the authramp configuration file
+    #[arg(long, default_value = DEFAULT_CONFIG_FILE_PATH)]
+    config: PathBuf,
+    /// Socket to listen on, overrides the daemon_socket setting
+    #[arg(long)]
+    socket: Option<PathBuf>,
+}
+
+/// Cluster state of an account.
+#[derive(Default)]
+struct ClusterAccount {
+    tally: ClusterTally,
+    /// Whether the failures of the tally file were added to the cluster tally.
+    seeded: bool,
+    /// The own counter is gossiped again until this instant.
+    repeat_until: Option<Instant>,
+}
+
+/// Gossip state of the daemon.
+struct Gossip {
+    socket: UdpSocket,
+    peers: Vec<SocketAddr>,
+    key: GossipKey,
+    node: u64,
+    accounts: HashMap<Vec<u8>, ClusterAccount>,
+    next_repeat: Instant,
+    /// Undecodable messages since the last report and the last of their errors.
+    decode_errors: u64,
+    last_decode_error: &'static str,
+    next_error_report: Instant,
+}
+
+impl Gossip {
+    /// Binds the gossip socket if `gossip_bind` is set.
+    ///
+    /// # Arguments
+    /// - `settings`: Settings with the gossip configuration
+    ///
+    /// # Returns
+    /// The gossip state, `None` if gossip is disabled, or the error that occurred while loading
+    /// the key, resolving the peers or binding the socket.
+    fn bind(settings: &Settings) -> io::Result<Option<Gossip>> {
+        let Some(bind) = &settings.gossip_bind else {
+            return Ok(None);
+        };
+
+        let key = GossipKey::load(&settings.gossip_key_file)?;
+        let socket = UdpSocket::bind(bind)?;
+        socket.set_nonblocking(true)?;
+
+        let mut peers = Vec::new();
+        for peer in &settings.gossip_peers {
+            peers.extend(peer.to_socket_addrs()?);
+        }
+
+        Ok(Some(Gossip {
+            socket,
+            peers,
+            key,
+            node: gossip::random_node_id(),
+            accounts: HashMap::new(),
+            next_repeat: Instant::now() + GOSSIP_INTERVAL,
+            decode_errors: 0,
+            last_decode_error: "",
+            next_error_report: Instant::now(),
+        }))
+    }
+
+    /// Adds the failures of a tally file that was changed outside the daemon to the cluster
+    /// tally on the next sync.
+    fn reseed(&mut self, name: &[u8]) {
+        if let Some(account) = self.accounts.get_mut(name) {
+            account.seeded = false;
+        }
+    }
+
+    /// Brings a local tally up to date with the cluster tally of the account.
+    ///
+    /// # Returns
+    /// Whether the local tally changed.
+    fn sync(&mut self, name: &[u8], tally: &mut Tally, settings: &Settings) -> bool {
+        self.make_room(name);
+        let account = self.accounts.entry(name.to_vec()).or_default();
+        if !account.seeded {
+            account.tally.seed(self.node, tally);
+            account.seeded = true;
+        }
+
+        let failures_count = account.tally.failures_count();
+        let changed = failures_count != tally.failures_count;
+        if changed {
+            tally.failures_count = failures_count;
+            // The unlock instant follows from the last failure and the delay
+            tally.unlock_instant = None;
+            if let Some(last_failure) = account.tally.last_failure() {
+                tally.failure_instant = last_failure;
+            }
+        }
+
+        // Expiry depends on the clock only, every node expires the account by itself
+        tally.expire(settings);
+        if tally.failures_count == 0 && failures_count > 0 {
+            account.tally.reset(Utc::now());
+        }
+        changed
+    }
+
+    /// Counts an applied action in the cluster tally and gossips the own counter.
+    fn record(&mut self, name: &[u8], action: Actions, tally: &Tally, applied: bool) {
+        let Some(account) = self.accounts.get_mut(name) else {
+            return;
+        };
+
+        match action {
+            Actions::AUTHFAIL => account.tally.add_failure(self.node, tally.failure_instant),
+            Actions::AUTHSUCC if applied => account.tally.reset(Utc::now()),
+            _ => return,
+        }
+
+        account.repeat_until = Some(Instant::now() + GOSSIP_REPEAT);
+        Self::send(
+            &self.socket,
+            &self.peers,
+            &self.key,
+            self.node,
+            name,
+            &account.tally,
+        );
+    }
+
+    /// Sends the own counter of an account to all peers. Lost datagrams are repeated later.
+    fn send(
+        socket: &UdpSocket,
+        peers: &[SocketAddr],
+        key: &GossipKey,
+        node: u64,
+        name: &[u8],
+        tally: &ClusterTally,
+    ) {
+        if let Ok(message) = gossip::encode(&tally.update(node, name), key) {
+            for peer in peers {
+                let _ = socket.send_to(&message, peer);
+            }
+        }
+    }
+
+    /// Merges all pending updates of other nodes.
+    fn receive(&mut self) {
+        let mut buf = [0u8; MESSAGE_SIZE];
+        loop {
+            let len = match self.socket.recv_from(&mut buf) {
+                Ok((len, _)) => len,
+                Err(e) if e.kind() == io::ErrorKind::Interrupted => continue,
+                Err(_) => return,
+            };
+            if len != MESSAGE_SIZE {
+                continue;
+            }
+
+            match gossip::decode(&buf, &self.key) {
+                Ok(update) if update.node != self.node => {
+                    self.make_room(update.name);
+                    self.accounts
+                        .entry(update.name.to_vec())
+                        .or_default()
+                        .tally
+                        .merge(self.node, &update);
+                }
+                Ok(_) => {}
+                Err(e) => {
+                    self.decode_errors += 1;
+                    self.last_decode_error = e;
+                }
+            }
+        }
+    }
+
+    /// Makes room for the account `name` if it is not known yet. Accounts without failures
+    /// that are not gossiped anymore are evicted first; if that is not enough, all accounts
+    /// that are not gossiped anymore are, local accounts are seeded from their tally file again.
+    fn make_room(&mut self, name: &[u8]) {
+        if self.accounts.len() < MAX_ACCOUNTS || self.accounts.contains_key(name) {
+            return;
+        }
+
+        self.accounts.retain(|_, account| {
+            account.repeat_until.is_some() || account.tally.failures_count() > 0
+        });
+        if self.accounts.len() >= MAX_ACCOUNTS / 2 {
+            self.accounts
+                .retain(|_, account| account.repeat_until.is_some());
+        }
+    }
+
+    /// Reports the undecodable messages since the last report, at most once per
+    /// `GOSSIP_ERROR_INTERVAL`.
+    fn report_errors(&mut self, now: Instant) {
+        if self.decode_errors == 0 || now < self.next_error_report {
+            return;
+        }
+
+        eprintln!(
+            "Error decoding gossip: {} ({} messages dropped)",
+            self.last_decode_error, self.decode_errors
+        );
+        self.decode_errors = 0;
+        self.next_error_report = now + GOSSIP_ERROR_INTERVAL;
+    }
+
+    /// Gossips the recently changed counters again once the interval is over.
+    fn repeat(&mut self) {
+        let now = Instant::now();
+        if now < self.next_repeat {
+            return;
+        }
+        self.next_repeat = now + GOSSIP_INTERVAL;
+        self.report_errors(now);
+
+        for (name, account) in &mut self.accounts {
+            match account.repeat_until {
+                Some(until) if until > now => Self::send(
+                    &self.socket,
+                    &self.peers,
+                    &self.key,
+                    self.node,
+                    name,
+                    &account.tally,
+                ),
+                Some(_) => account.repeat_until = None,
+                None => {}
+            }
+        }
+    }
+
+    /// Waits until `socket` is readable, receiving and repeating gossip meanwhile.
+    fn wait_for_request(&mut self, socket: &UnixDatagram) -> io::Result<()> {
+        loop {
+            let mut fds = [
+                libc::pollfd {
+                    fd: socket.as_raw_fd(),
+                    events: libc::POLLIN,
+                    revents: 0,
+                },
+                libc::pollfd {
+                    fd: self.socket.as_raw_fd(),
+                    events: libc::POLLIN,
+                    revents: 0,
+                },
+            ];
+            let timeout = self
+                .next_repeat
+                .saturating_duration_since(Instant::now())
+                .as_millis() as libc::c_int;
+
+            if unsafe { libc::poll(fds.as_mut_ptr(), fds.len() as libc::nfds_t, timeout) } < 0 {
+                let e = io::Error::last_os_error();
+                if e.kind() == io::ErrorKind::Interrupted {
+                    continue;
+                }
+                return Err(e);
+            }
+
+            if fds[1].revents != 0 {
+                self.receive();
+            }
+            self.repeat();
+            if fds[0].revents != 0 {
+                return Ok(());
+            }
+        }
+    }
+}
+
+/// Identity of a tally file on disk. Tally files are replaced atomically, so every write
+/// changes it.
+#[derive(Clone, Copy, PartialEq)]
+struct FileVersion {
+    dev: u64,
+    ino: u64,
+    mtime_nsec: i64,
+    mtime: i64,
+}
+
+impl FileVersion {
+    /// Returns the version of a tally file, `None` if it does not exist.
+    fn of(path: &Path) -> Option<FileVersion> {
+        fs::metadata(path).ok().map(|meta| FileVersion {
+            dev: meta.dev(),
+            ino: meta.ino(),
+            mtime_nsec: meta.mtime_nsec(),
+            mtime: meta.mtime(),
+        })
+    }
+}
+
+/// A tally in memory and the version of the tally file it was read from or written to.
+struct CachedTally {
+    tally: Tally,
+    version: Option<FileVersion>,
+}
+
+/// In-memory tally state of the daemon.
+struct Daemon {
+    config_file: PathBuf,
+    tallies: HashMap<u32, CachedTally>,
+    gossip: Option<Gossip>,
+}
+
+impl Daemon {
+    fn new(config_file: PathBuf, gossip: Option<Gossip>) -> Self {
+        Daemon {
+            config_file,
+            tallies: HashMap::new(),
+            gossip,
+        }
+    }
+
+    /// Applies a request to the tally of the user.
+    ///
+    /// The settings are taken from the cached configuration file, so configuration changes are
+    /// picked up without restarting the daemon. A tally that is not in memory yet, or whose tally
+    /// file changed since, is loaded from its tally file. The tally file is read and written
+    /// under its exclusive lock, so updates of clients that fell back to the tally files are
+    /// never lost. Requests whose client stopped waiting are dropped once the lock is held, the
+    /// client counted them itself.
+    ///
+    /// # Arguments
+    /// - `request`: The decoded request
+    ///
+    /// # Returns
+    /// The failures count before the request and the updated tally, or `None` if the request
+    /// failed or expired.
+    fn handle(&mut self, request: &Request) -> Option<(i32, &Tally)> {
+        // The action of the request is applied explicitly, no hook call settings are needed
+        let settings = Settings::load_cached_conf_file(&self.config_file);
+
+        let tally_file = settings.tally_dir.join(OsStr::from_bytes(request.name));
+
+        // PREAUTH and AUTHSUCC of a user without a tally file do not create one, unless the
+        // cluster has failures of the user
+        let mut lock = None;
+        if request.action == Actions::AUTHFAIL || tally_file.exists() {
+            lock = Some(lock_tally_file(&tally_file)?);
+        }
+        if request.is_expired() {
+            return None;
+        }
+
+        let mut synced = self.load(request, &tally_file, &settings)?;
+        if synced && lock.is_none() {
+            lock = Some(lock_tally_file(&tally_file)?);
+            synced = self.load(request, &tally_file, &settings)? || synced;
+        }
+
+        let cached = self.tallies.get_mut(&request.uid)?;
+        let tally = &mut cached.tally;
+        let previous_failures_count = tally.failures_count;
+        let applied = tally.apply_action(request.action, &settings);
+        if let Some(gossip) = self.gossip.as_mut() {
+            gossip.record(request.name, request.action, tally, applied);
+        }
+
+        if synced || applied {
+            let _lock = match lock {
+                Some(lock) => lock,
+                None => lock_tally_file(&tally_file)?,
+            };
+            // The in-memory tally stays authoritative if the write fails
+            match Tally::write_tally_file(tally, &tally_file, &settings) {
+                Ok(()) => cached.version = FileVersion::of(&tally_file),
+                Err(e) => eprintln!("Error writing tally file {}: {}", tally_file.display(), e),
+            }
+        }
+
+        Some((previous_failures_count, &cached.tally))
+    }
+
+    /// Loads the tally of the user if it is not in memory yet or its tally file changed, and
+    /// brings it up to date with the cluster.
+    ///
+    /// # Arguments
+    /// - `request`: The decoded request
+    /// - `tally_file`: Path of the tally file of the user
+    /// - `settings`: Settings of the request
+    ///
+    /// # Returns
+    /// Whether the cluster changed the tally, or `None` if the tally file could not be read.
+    fn load(&mut self, request: &Request, tally_file: &Path, settings: &Settings) -> Option<bool> {
+        let version = FileVersion::of(tally_file);
+        let is_current = self
+            .tallies
+            .get(&request.uid)
+            .map_or(false, |cached| cached.version == version);
+        if !is_current {
+            let tally = Tally::load_tally_file(tally_file).ok()?.unwrap_or_default();
+            if self.tallies.len() >= MAX_TALLIES && !self.tallies.contains_key(&request.uid) {
+                self.evict();
+            }
+            self.tallies
+                .insert(request.uid, CachedTally { tally, version });
+            if let Some(gossip) = self.gossip.as_mut() {
+                gossip.reseed(request.name);
+            }
+        }
+
+        let tally = &mut self.tallies.get_mut(&request.uid)?.tally;
+        Some(match self.gossip.as_mut() {
+            Some(gossip) => gossip.sync(request.name, tally, settings),
+            None => {
+                tally.expire(settings);
+                false
+            }
+        })
+    }
+
+    /// Makes room for a tally. Clear tallies are evicted first; if that is not enough, all
+    /// tallies are, they are read from their tally files again.
+    fn evict(&mut self) {
+        self.tallies.retain(|_, cached| !cached.tally.is_clear());
+        if self.tallies.len() >= MAX_TALLIES / 2 {
+            self.tallies.clear();
+        }
+    }
+}
+
+/// Takes the exclusive lock of a tally file, creating it if needed.
+///
+/// # Returns
+/// The locked tally file, `None` if it could not be locked.
+fn lock_tally_file(tally_file: &Path) -> Option<File> {
+    store::file::open_locked(tally_file, true)
+        .map_err(|e| eprintln!("Error locking tally file {}: {}", tally_file.display(), e))
+        .ok()
+}
+
+/// Binds the daemon socket. Only root can send requests.
+///
+/// # Arguments
+/// - `path`: Path of the socket
+///
+/// # Returns
+/// The bound socket
+fn bind(path: &Path) -> io::Result<UnixDatagram> {
+    if let Some(dir) = path.parent() {
+        DirBuilder::new().recursive(true).mode(0o700).create(dir)?;
+    }
+
+    // Remove the socket of a previous daemon
+    match fs::remove_file(path) {
+        Err(e) if e.kind() != io::ErrorKind::NotFound => return Err(e),
+        _ => {}
+    }
+
+    let socket = UnixDatagram::bind(path)?;
+    fs::set_permissions(path, Permissions::from_mode(0o600))?;
+    Ok(socket)
+}
+
+/// Answers requests until the socket fails.
+///
+/// # Arguments
+/// - `socket`: The bound daemon socket
+/// - `daemon`: The daemon state
+fn serve(socket: &UnixDatagram, daemon: &mut Daemon) -> io::Result<()> {
+    let mut buf = [0u8; REQUEST_SIZE];
+    loop {
+        if let Some(gossip) = daemon.gossip.as_mut() {
+            gossip.wait_for_request(socket)?;
+        }
+
+        let (len, addr) = match socket.recv_from(&mut buf) {
+            Ok(received) => received,
+            Err(e) if e.kind() == io::ErrorKind::Interrupted => continue,
+            Err(e) => return Err(e),
+        };
+        if len != REQUEST_SIZE {
+            continue;
+        }
+
+        let response = match daemon::decode_request(&buf) {
+            Ok(request) => daemon::encode_response(request.id, daemon.handle(&request)),
+            Err(e) => {
+                eprintln!("Error decoding request: {}", e);
+                continue;
+            }
+        };
+
+        // The client may have given up waiting
+        let _ = socket.send_to_addr(&response, &addr);
+    }
+}
+
+fn main() -> ExitCode {
+    let cli = Cli::parse();
+
+    let settings = Settings::load_cached_conf_file(&cli.config);
+    let socket_path = cli.socket.unwrap_or_else(|| settings.daemon_socket.clone());
+
+    let gossip = match Gossip::bind(&settings) {
+        Ok(gossip) => gossip,
+        Err(e) => {
+            eprintln!("Error setting up gossip: {}", e);
+            return ExitCode::FAILURE;
+        }
+    };
+
+    let socket = match bind(&socket_path) {
+        Ok(socket) => socket,
+        Err(e) => {
+            eprintln!("Error binding {}: {}", socket_path.display(), e);
+            return ExitCode::FAILURE;
+        }
+    };
+
+    let mut daemon = Daemon::new(cli.config, gossip);
+    match serve(&socket, &mut daemon) {
+        Ok(()) => ExitCode::SUCCESS,
+        Err(e) => {
+            eprintln!("Error receiving request: {}", e);
+            ExitCode::FAILURE
+        }
+    }
+}
+
+// Unit Tests
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use pam_authramp::settings::HookSettings;
+    use std::sync::Arc;
+    use tempdir::TempDir;
+    use users::User;
+
+    fn request(action: Actions) -> Request<'static> {
+        Request {
+            id: 1,
+            action,
+            uid: 9999,
+            name: b"test_user",
+            deadline_ms: daemon::deadline_after(Duration::from_secs(60)),
+        }
+    }
+
+    #[test]
+    fn test_handle_updates_tally_in_memory_and_on_disk() {
+        let temp_dir = TempDir::new("test_handle_updates_tally").unwrap();
+        let tally_dir = temp_dir.path().join("tally");
+        let config_file = temp_dir.path().join("authramp.conf");
+        fs::write(
+            &config_file,
+            format!("[Settings]\ntally_dir = \"{}\"\n", tally_dir.display()),
+        )
+        .unwrap();
+
+        let mut daemon = Daemon::new(config_file, None);
+
+        let (previous, tally) = daemon.handle(&request(Actions::PREAUTH)).unwrap();
+        assert_eq!((previous, tally.failures_count), (0, 0));
+        assert!(!tally_dir.join("test_user").exists());
+
+        daemon.handle(&request(Actions::AUTHFAIL)).unwrap();
+        let (previous, tally) = daemon.handle(&request(Actions::AUTHFAIL)).unwrap();
+        assert_eq!((previous, tally.failures_count), (1, 2));
+
+        let on_disk = Tally::load_tally_file(&tally_dir.join("test_user"))
+            .unwrap()
+            .unwrap();
+        assert_eq!(on_disk.failures_count, 2);
+
+        let (previous, tally) = daemon.handle(&request(Actions::AUTHSUCC)).unwrap();
+        assert_eq!((previous, tally.failures_count), (2, 0));
+    }
+
+    #[test]
+    fn test_handle_loads_existing_tally_file() {
+        let temp_dir = TempDir::new("test_handle_loads_existing").unwrap();
+        let tally_dir = temp_dir.path().join("tally");
+        let config_file = temp_dir.path().join("authramp.conf");
+        fs::write(
+            &config_file,
+            format!("[Settings]\ntally_dir = \"{}\"\n", tally_dir.display()),
+        )
+        .unwrap();
+        fs::create_dir_all(&tally_dir).unwrap();
+        fs::write(
+            tally_dir.join("test_user"),
+            "[Fails]\ncount = 3\ninstant = \"2023-01-01T00:00:00Z\"",
+        )
+        .unwrap();
+
+        let mut daemon = Daemon::new(config_file, None);
+        let (_, tally) = daemon.handle(&request(Actions::PREAUTH)).unwrap();
+        assert_eq!(tally.failures_count, 3);
+    }
+
+    #[test]
+    fn test_handle_reads_tally_files_changed_by_clients() {
+        let temp_dir = TempDir::new("test_handle_reads_changed").unwrap();
+        let tally_dir = temp_dir.path().join("tally");
+        let config_file = temp_dir.path().join("authramp.conf");
+        fs::write(
+            &config_file,
+            format!("[Settings]\ntally_dir = \"{}\"\n", tally_dir.display()),
+        )
+        .unwrap();
+
+        let mut daemon = Daemon::new(config_file, None);
+        daemon.handle(&request(Actions::AUTHFAIL)).unwrap();
+
+        // A client that fell back to the tally file counted two more failures
+        let settings = Settings {
+            tally_dir: tally_dir.clone(),
+            ..Default::default()
+        };
+        let tally = Tally {
+            failures_count: 3,
+            failure_instant: Utc::now(),
+            ..Default::default()
+        };
+        Tally::save_tally_file(&tally, &tally_dir.join("test_user"), &settings).unwrap();
+
+        let (previous, tally) = daemon.handle(&request(Actions::AUTHFAIL)).unwrap();
+        assert_eq!((previous, tally.failures_count), (3, 4));
+    }
+
+    #[test]
+    fn test_handle_drops_requests_of_clients_that_fell_back() {
+        let temp_dir = TempDir::new("test_handle_drops_late_requests").unwrap();
+        let tally_dir = temp_dir.path().join("tally");
+        let config_file = temp_dir.path().join("authramp.conf");
+        fs::write(
+            &config_file,
+            format!("[Settings]\ntally_dir = \"{}\"\n", tally_dir.display()),
+        )
+        .unwrap();
+
+        let mut daemon = Daemon::new(config_file, None);
+        daemon.handle(&request(Actions::AUTHFAIL)).unwrap();
+
+        // The client timed out and counted the failure in the tally file itself
+        let settings = Settings {
+            tally_dir: tally_dir.clone(),
+            action: Some(Actions::AUTHFAIL),
+            ..Default::default()
+        };
+        let settings = HookSettings::new(
+            Arc::new(settings),
+            User::new(9999, "test_user", 9999),
+            "test",
+        );
+        let tally = Tally::new_from_tally_file(&settings).unwrap();
+        assert_eq!(tally.failures_count, 2);
+
+        // Its request arrives late and is not counted again
+        let late = Request {
+            deadline_ms: daemon::deadline_after(Duration::ZERO),
+            ..request(Actions::AUTHFAIL)
+        };
+        assert!(daemon.handle(&late).is_none());
+
+        let (previous, tally) = daemon.handle(&request(Actions::PREAUTH)).unwrap();
+        assert_eq!((previous, tally.failures_count), (2, 2));
+        let on_disk = Tally::load_tally_file(&tally_dir.join("test_user"))
+            .unwrap()
+            .unwrap();
+        assert_eq!(on_disk.failures_count, 2);
+    }
+
+    fn gossip_daemon(temp_dir: &TempDir, node: &str) -> Daemon {
+        let tally_dir = temp_dir.path().join(node);
+        let config_file = temp_dir.path().join(format!("{}.conf", node));
+        fs::write(
+            &config_file,
+            format!("[Settings]\ntally_dir = \"{}\"\n", tally_dir.display()),
+        )
+        .unwrap();
+
+        let key_file = temp_dir.path().join("gossip.key");
+        fs::write(&key_file, [7u8; 16]).unwrap();
+        let settings = Settings {
+            gossip_bind: Some("127.0.0.1:0".to_string()),
+            gossip_key_file: key_file,
+            ..Settings::default()
+        };
+        Daemon::new(config_file, Gossip::bind(&settings).unwrap())
+    }
+
+    #[test]
+    fn test_handle_shares_failures_between_nodes() {
+        let temp_dir = TempDir::new("test_handle_shares_failures").unwrap();
+        let mut a = gossip_daemon(&temp_dir, "a");
+        let mut b = gossip_daemon(&temp_dir, "b");
+        let addr_a = a.gossip.as_ref().unwrap().socket.local_addr().unwrap();
+        let addr_b = b.gossip.as_ref().unwrap().socket.local_addr().unwrap();
+        a.gossip.as_mut().unwrap().peers = vec![addr_b];
+        b.gossip.as_mut().unwrap().peers = vec![addr_a];
+
+        a.handle(&request(Actions::AUTHFAIL)).unwrap();
+        b.handle(&request(Actions::AUTHFAIL)).unwrap();
+
+        // Loopback datagrams arrive almost immediately, give them a moment anyway
+        std::thread::sleep(Duration::from_millis(50));
+        a.gossip.as_mut().unwrap().receive();
+        b.gossip.as_mut().unwrap().receive();
+
+        let (_, tally) = a.handle(&request(Actions::PREAUTH)).unwrap();
+        assert_eq!(tally.failures_count, 2);
+        let (_, tally) = b.handle(&request(Actions::AUTHFAIL)).unwrap();
+        assert_eq!(tally.failures_count, 3);
+
+        std::thread::sleep(Duration::from_millis(50));
+        a.gossip.as_mut().unwrap().receive();
+        let (_, tally) = a.handle(&request(Actions::AUTHSUCC)).unwrap();
+        assert_eq!(tally.failures_count, 0);
+
+        std::thread::sleep(Duration::from_millis(50));
+        b.gossip.as_mut().unwrap().receive();
+        let (_, tally) = b.handle(&request(Actions::PREAUTH)).unwrap();
+        assert_eq!(tally.failures_count, 0);
+        let on_disk = Tally::load_tally_file(&temp_dir.path().join("b").join("test_user"))
+            .unwrap()
+            .unwrap();
+        assert_eq!(on_disk.failures_count, 0);
+    }
+
+    #[test]
+    fn test_gossip_accounts_are_bounded() {
+        let temp_dir = TempDir::new("test_gossip_accounts_are_bounded").unwrap();
+        let mut daemon = gossip_daemon(&temp_dir, "a");
+        let gossip = daemon.gossip.as_mut().unwrap();
+
+        for i in 0..MAX_ACCOUNTS {
+            let account = gossip
+                .accounts
+                .entry(i.to_string().into_bytes())
+                .or_default();
+            if i % 4 == 0 {
+                account.tally.add_failure(1, Utc::now());
+            }
+        }
+
+        // Accounts without failures make room for a new one
+        let settings = Settings::default();
+        gossip.sync(b"test_user", &mut Tally::default(), &settings);
+        assert_eq!(gossip.accounts.len(), MAX_ACCOUNTS / 4 + 1);
+        assert!(gossip.accounts.contains_key(b"0".as_slice()));
+        assert!(!gossip.accounts.contains_key(b"1".as_slice()));
+    }
+
+    #[test]
+    fn test_gossip_decode_errors_are_counted() {
+        let temp_dir = TempDir::new("test_gossip_decode_errors_are_counted").unwrap();
+        let mut daemon = gossip_daemon(&temp_dir, "a");
+        let gossip = daemon.gossip.as_mut().unwrap();
+        let addr = gossip.socket.local_addr().unwrap();
+
+        let sender = UdpSocket::bind("127.0.0.1:0").unwrap();
+        for _ in 0..3 {
+            sender.send_to(&[0u8; MESSAGE_SIZE], addr).unwrap();
+        }
+        std::thread::sleep(Duration::from_millis(50));
+        gossip.receive();
+        assert_eq!(gossip.decode_errors, 3);
+
+        // Reported once, then again only after the interval
+        let now = Instant::now();
+        gossip.report_errors(now);
+        assert_eq!(gossip.decode_errors, 0);
+        gossip.decode_errors = 1;
+        gossip.report_errors(now);
+        assert_eq!(gossip.decode_errors, 1);
+        gossip.report_errors(now + GOSSIP_ERROR_INTERVAL);
+        assert_eq!(gossip.decode_errors, 0);
+    }
+}
@@ -0,0 +1,385 @@
+//! # Hot Path Benchmarks
+//!
+//! Criterion benchmarks of the code that runs on every login: building the settings, loading and
+//! updating the tally for the PREAUTH, AUTHFAIL and AUTHSUCC actions, calculating the delay,
+//! formatting the remaining lockout time and resolving the syslog process name of `init_log`.
+//! `init_log` itself needs a PAM handle, so only its process name lookup is measured.
+//!
+//! The tally benchmarks run against tally directories holding 10, 1000 and 100000 users. Other
+//! sizes are set with a comma separated list in `AUTHRAMP_BENCH_USERS`, e.g.
+//! `cargo xtask bench --users 10,1000000`. Every file benchmark runs with a warm page cache and
+//! with a cold one, where the pages of the touched file are dropped with `posix_fadvise` before
+//! each iteration.
+//!
+//! Next to the criterion report the p50, p90, p99 and p99.9 latency of each benchmark is printed.
+//!
+//! ## License
+//!
+//! pam-authramp
+//! Copyright (C) 2023 github.com/34N0
+//!
+//! This program is free software: you can redistribute it and/or modify
+//! it under the terms of the GNU General Public License as published by
+//! the Free Software Foundation, either version 3 of the License, or
+//! (at your option) any later version.
+//!
+//! This program is distributed in the hope that it will be useful,
+//! but WITHOUT ANY WARRANTY; without even the implied warranty of
+//! MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//! GNU General Public License for more details.
+//!
+//! You should have received a copy of the GNU General Public License
+//! along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+use chrono::Duration as ChronoDuration;
+use criterion::{criterion_group, criterion_main, BenchmarkId, Criterion};
+use pam_authramp::settings::{HookSettings, Settings};
+use pam_authramp::tally::Tally;
+use pam_authramp::utils::syslog::get_process_name;
+use pam_authramp::{format_remaining_time, Actions};
+use std::env;
+use std::ffi::CStr;
+use std::fmt;
+use std::fs::{self, File};
+use std::hint::black_box;
+use std::os::unix::io::AsRawFd;
+use std::path::{Path, PathBuf};
+use std::time::{Duration, Instant};
+use tempdir::TempDir;
+use users::User;
+
+const USERS_ENV: &str = "AUTHRAMP_BENCH_USERS";
+const DEFAULT_USERS: [usize; 3] = [10, 1_000, 100_000];
+const BENCH_USER: &str = "user0";
+const TALLY_CONTENT: &str = "[Fails]\ncount = 2\ninstant = \"2023-12-25T00:00:00Z\"";
+
+/// Page cache state of the touched files.
+#[derive(Clone, Copy)]
+enum Cache {
+    Warm,
+    Cold,
+}
+
+impl fmt::Display for Cache {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        match self {
+            Cache::Warm => write!(f, "warm"),
+            Cache::Cold => write!(f, "cold"),
+        }
+    }
+}
+
+/// A tally directory populated with tally files and a configuration file pointing to it.
+struct Fixture {
+    _dir: TempDir,
+    users: usize,
+    tally_dir: PathBuf,
+    conf_file: PathBuf,
+}
+
+impl Fixture {
+    fn new(users: usize) -> Self {
+        let dir = TempDir::new("authramp_bench").unwrap();
+        let tally_dir = dir.path().join("tally");
+        fs::create_dir(&tally_dir).unwrap();
+        for i in 0..users {
+            fs::write(tally_dir.join(format!("user{}", i)), TALLY_CONTENT).unwrap();
+        }
+
+        let conf_file = dir.path().join("authramp.conf");
+        write_conf_file(&conf_file, &tally_dir, false);
+
+        Fixture {
+            _dir: dir,
+            users,
+            tally_dir,
+            conf_file,
+        }
+    }
+
+    fn settings(&self, action: Actions) -> HookSettings {
+        let args = match action {
+            Actions::PREAUTH => "preauth\0",
+            Actions::AUTHSUCC => "authsucc\0",
+            Actions::AUTHFAIL => "authfail\0",
+        };
+        Settings::build(
+            Some(User::new(1000, BENCH_USER, 1000)),
+            vec![CStr::from_bytes_with_nul(args.as_bytes()).unwrap()],
+            0,
+            Some(self.conf_file.clone()),
+            "auth",
+            None,
+        )
+        .unwrap()
+    }
+
+    fn tally_file(&self) -> PathBuf {
+        self.tally_dir.join(BENCH_USER)
+    }
+}
+
+/// Writes the configuration file. `toggle` changes its size so the cached settings are reloaded.
+fn write_conf_file(conf_file: &Path, tally_dir: &Path, toggle: bool) {
+    let padding = if toggle { "\n# reload" } else { "" };
+    fs::write(
+        conf_file,
+        format!(
+            "[Settings]\ntally_dir = \"{}\"\nfree_tries = 6{}",
+            tally_dir.display(),
+            padding
+        ),
+    )
+    .unwrap();
+}
+
+/// Drops the cached pages of a file.
+fn evict(path: &Path) {
+    let file = File::open(path).unwrap();
+    // Dirty pages are not dropped
+    file.sync_all().unwrap();
+    unsafe {
+        libc::posix_fadvise(file.as_raw_fd(), 0, 0, libc::POSIX_FADV_DONTNEED);
+    }
+}
+
+/// Runs `iters` timed iterations of `routine`, each after an untimed `setup`, and records the
+/// duration of every iteration.
+fn timed<S, R>(samples: &mut Vec<Duration>, iters: u64, mut setup: S, mut routine: R) -> Duration
+where
+    S: FnMut(),
+    R: FnMut(),
+{
+    let mut total = Duration::ZERO;
+    for _ in 0..iters {
+        setup();
+        let start = Instant::now();
+        routine();
+        let elapsed = start.elapsed();
+        samples.push(elapsed);
+        total += elapsed;
+    }
+    total
+}
+
+/// Prints the latency percentiles of the recorded iterations.
+fn report(name: &str, samples: &mut Vec<Duration>) {
+    if samples.is_empty() {
+        return;
+    }
+    samples.sort_unstable();
+    let percentile = |p: f64| samples[((samples.len() - 1) as f64 * p) as usize];
+    println!(
+        "{:<48} p50 {:>10.2?}  p90 {:>10.2?}  p99 {:>10.2?}  p99.9 {:>10.2?}  ({} samples)",
+        name,
+        percentile(0.5),
+        percentile(0.9),
+        percentile(0.99),
+        percentile(0.999),
+        samples.len()
+    );
+    samples.clear();
+}
+
+fn user_counts() -> Vec<usize> {
+    env::var(USERS_ENV)
+        .ok()
+        .map(|users| {
+            users
+                .split(',')
+                .filter_map(|count| count.trim().parse().ok())
+                .collect()
+        })
+        .filter(|counts: &Vec<usize>| !counts.is_empty())
+        .unwrap_or_else(|| DEFAULT_USERS.to_vec())
+}
+
+fn bench_settings_build(c: &mut Criterion) {
+    let fixture = Fixture::new(1);
+    let mut samples = Vec::new();
+    let mut group = c.benchmark_group("Settings::build");
+
+    group.bench_function("cached", |b| {
+        b.iter_custom(|iters| {
+            timed(
+                &mut samples,
+                iters,
+                || {},
+                || {
+                    black_box(fixture.settings(Actions::PREAUTH));
+                },
+            )
+        })
+    });
+    report("Settings::build/cached", &mut samples);
+
+    for cache in [Cache::Warm, Cache::Cold] {
+        let mut toggle = false;
+        group.bench_with_input(BenchmarkId::new("reload", cache), &cache, |b, &cache| {
+            b.iter_custom(|iters| {
+                timed(
+                    &mut samples,
+                    iters,
+                    || {
+                        toggle = !toggle;
+                        write_conf_file(&fixture.conf_file, &fixture.tally_dir, toggle);
+                        if let Cache::Cold = cache {
+                            evict(&fixture.conf_file);
+                        }
+                    },
+                    || {
+                        black_box(fixture.settings(Actions::PREAUTH));
+                    },
+                )
+            })
+        });
+        report(&format!("Settings::build/reload/{}", cache), &mut samples);
+    }
+
+    group.finish();
+}
+
+fn bench_tally(c: &mut Criterion) {
+    let mut samples = Vec::new();
+    let mut group = c.benchmark_group("Tally::new_from_tally_file");
+
+    for users in user_counts() {
+        let fixture = Fixture::new(users);
+
+        for action in [Actions::PREAUTH, Actions::AUTHFAIL, Actions::AUTHSUCC] {
+            let settings = fixture.settings(action);
+
+            for cache in [Cache::Warm, Cache::Cold] {
+                let id = format!("{:?}/{}/{}", action, cache, fixture.users);
+                group.bench_function(id.as_str(), |b| {
+                    b.iter_custom(|iters| {
+                        timed(
+                            &mut samples,
+                            iters,
+                            || {
+                                // Every iteration starts from the same tally
+                                if action != Actions::PREAUTH {
+                                    fs::write(fixture.tally_file(), TALLY_CONTENT).unwrap();
+                                }
+                                if let Cache::Cold = cache {
+                                    evict(&fixture.tally_file());
+                                }
+                            },
+                            || {
+                                black_box(Tally::new_from_tally_file(&settings).unwrap());
+                            },
+                        )
+                    })
+                });
+                report(&format!("Tally::new_from_tally_file/{}", id), &mut samples);
+            }
+        }
+    }
+
+    group.finish();
+}
+
+fn bench_get_delay(c: &mut Criterion) {
+    let settings = Settings::default();
+    let mut samples = Vec::new();
+    let mut group = c.benchmark_group("Tally::get_delay");
+
+    for failures_count in [7, 20, 1000] {
+        let tally = Tally {
+            failures_count,
+            ..Default::default()
+        };
+        group.bench_with_input(
+            BenchmarkId::from_parameter(failures_count),
+            &tally,
+            |b, tally| {
+                b.iter_custom(|iters| {
+                    timed(
+                        &mut samples,
+                        iters,
+                        || {},
+                        || {
+                            black_box(black_box(tally).get_delay(&settings));
+                        },
+                    )
+                })
+            },
+        );
+        report(
+            &format!("Tally::get_delay/{}", failures_count),
+            &mut samples,
+        );
+    }
+
+    group.finish();
+}
+
+fn bench_format_remaining_time(c: &mut Criterion) {
+    let mut samples = Vec::new();
+    let mut group = c.benchmark_group("format_remaining_time");
+
+    for seconds in [59, 3_599, 86_399] {
+        let remaining_time = ChronoDuration::seconds(seconds);
+        group.bench_with_input(
+            BenchmarkId::from_parameter(seconds),
+            &remaining_time,
+            |b, &remaining_time| {
+                b.iter_custom(|iters| {
+                    timed(
+                        &mut samples,
+                        iters,
+                        || {},
+                        || {
+                            black_box(format_remaining_time(black_box(remaining_time)));
+                        },
+                    )
+                })
+            },
+        );
+        report(&format!("format_remaining_time/{}", seconds), &mut samples);
+    }
+
+    group.finish();
+}
+
+fn bench_init_log(c: &mut Criterion) {
+    let mut samples = Vec::new();
+    let mut group = c.benchmark_group("init_log");
+
+    for sysinfo_process_name in [false, true] {
+        let settings = Settings {
+            sysinfo_process_name,
+            ..Default::default()
+        };
+        let id = if sysinfo_process_name {
+            "sysinfo"
+        } else {
+            "comm"
+        };
+        group.bench_function(BenchmarkId::new("process_name", id), |b| {
+            b.iter_custom(|iters| {
+                timed(
+                    &mut samples,
+                    iters,
+                    || {},
+                    || {
+                        black_box(get_process_name(&settings));
+                    },
+                )
+            })
+        });
+        report(&format!("init_log/process_name/{}", id), &mut samples);
+    }
+
+    group.finish();
+}
+
+criterion_group!(
+    benches,
+    bench_settings_build,
+    bench_tally,
+    bench_get_delay,
+    bench_format_remaining_time,
+    bench_init_log
+);
+criterion_main!(benches);
@@ -0,0 +1,196 @@
+//! # Delay Module
+//!
+//! The `delay` module maps the number of failures beyond `free_tries` to the lockout delay. The
+//! delay curve is selected with the `delay_curve` setting:
+//!
+//! - `nlogn`: `ramp_multiplier * n * ln(n) + base_delay_seconds`. This is the default curve.
+//! - `linear`: `ramp_multiplier * (n - 1) + base_delay_seconds`
+//! - `exponential`: `base_delay_seconds * ramp_multiplier ^ (n - 1)`
+//! - `stepped`: The n-th value of `delay_steps`. The last step is repeated.
+//!
+//! where `n` is the number of failures beyond `free_tries`.
+//!
+//! ## Delay Table
+//!
+//! The curve is compiled into a `DelayTable` when the settings are loaded. The table holds the
+//! delay for every `n` until the delay reaches `MAX_DELAY_SECONDS`, so looking up a delay is a
+//! bounds-checked index and the cap is applied in one place. Failures beyond the end of the table
+//! get the delay of its last entry.
+//!
+//! ## License
+//!
+//! pam-authramp
+//! Copyright (C) 2023 github.com/34N0
+//!
+//! This program is free software: you can redistribute it and/or modify
+//! it under the terms of the GNU General Public License as published by
+//! the Free Software Foundation, either version 3 of the License, or
+//! (at your option) any later version.
+//!
+//! This program is distributed in the hope that it will be useful,
+//! but WITHOUT ANY WARRANTY; without even the implied warranty of
+//! MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//! GNU General Public License for more details.
+//!
+//! You should have received a copy of the GNU General Public License
+//! along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+use std::str::FromStr;
+use std::sync::Arc;
+
+use chrono::Duration;
+
+/// Upper bound of every delay, 24 hours.
+pub const MAX_DELAY_SECONDS: i64 = 24 * 60 * 60;
+
+/// Maximum number of entries of a delay table. Curves that are still below the cap at this
+/// point keep the delay of the last entry.
+const MAX_TABLE_LEN: usize = 4096;
+
+/// Curve of the delay over the failures beyond `free_tries`.
+#[derive(Debug, Default, Clone, PartialEq)]
+pub enum DelayCurve {
+    /// `ramp_multiplier * n * ln(n) + base_delay_seconds`
+    #[default]
+    NLogN,
+    /// `ramp_multiplier * (n - 1) + base_delay_seconds`
+    Linear,
+    /// `base_delay_seconds * ramp_multiplier ^ (n - 1)`
+    Exponential,
+    /// The n-th step in seconds, the last step is repeated.
+    Stepped(Vec<i64>),
+}
+
+impl FromStr for DelayCurve {
+    type Err = ();
+
+    /// Parses the `delay_curve` setting value. The steps of `stepped` are set separately from
+    /// the `delay_steps` setting.
+    fn from_str(s: &str) -> Result<Self, Self::Err> {
+        match s {
+            "nlogn" => Ok(DelayCurve::NLogN),
+            "linear" => Ok(DelayCurve::Linear),
+            "exponential" => Ok(DelayCurve::Exponential),
+            "stepped" => Ok(DelayCurve::Stepped(Vec::new())),
+            _ => Err(()),
+        }
+    }
+}
+
+impl DelayCurve {
+    /// Returns the uncapped delay in seconds for the n-th failure beyond `free_tries`.
+    fn seconds(&self, n: usize, base_delay_seconds: i32, ramp_multiplier: f64) -> f64 {
+        let base = base_delay_seconds as f64;
+        let x = n as f64;
+        match self {
+            DelayCurve::NLogN => ramp_multiplier * x * x.ln() + base,
+            DelayCurve::Linear => ramp_multiplier * (x - 1.0) + base,
+            DelayCurve::Exponential => base * ramp_multiplier.powf(x - 1.0),
+            DelayCurve::Stepped(steps) => steps
+                .get(n - 1)
+                .or(steps.last())
+                .map_or(base, |&step| step as f64),
+        }
+    }
+
+    /// Returns true if the curve is constant from the n-th failure on.
+    fn is_constant_from(&self, n: usize) -> bool {
+        match self {
+            DelayCurve::Stepped(steps) => n >= steps.len(),
+            _ => false,
+        }
+    }
+}
+
+/// Capped delays of a delay curve, indexed by the number of failures beyond `free_tries`.
+#[derive(Debug, Clone, PartialEq)]
+pub struct DelayTable {
+    seconds: Arc<[i64]>,
+}
+
+impl DelayTable {
+    /// Compiles a delay curve into a table.
+    ///
+    /// # Arguments
+    /// - `curve`: The delay curve
+    /// - `base_delay_seconds`: Delay of the first failure beyond `free_tries`
+    /// - `ramp_multiplier`: Steepness of the curve
+    ///
+    /// # Returns
+    /// The compiled delay table
+    pub fn compile(curve: &DelayCurve, base_delay_seconds: i32, ramp_multiplier: f64) -> Self {
+        // No delay within the free tries
+        let mut seconds = vec![0];
+        for n in 1..MAX_TABLE_LEN {
+            // Casting saturates and maps NaN to 0
+            let delay = (curve.seconds(n, base_delay_seconds, ramp_multiplier) as i64)
+                .clamp(0, MAX_DELAY_SECONDS);
+            seconds.push(delay);
+            if delay == MAX_DELAY_SECONDS || curve.is_constant_from(n) {
+                break;
+            }
+        }
+        DelayTable {
+            seconds: seconds.into(),
+        }
+    }
+
+    /// Returns the delay after `excess` failures beyond `free_tries`.
+    pub fn get(&self, excess: i32) -> Duration {
+        let index = usize::try_from(excess).unwrap_or(0);
+        let seconds = match self.seconds.get(index) {
+            Some(&seconds) => seconds,
+            None => self.seconds[self.seconds.len() - 1],
+        };
+        Duration::seconds(seconds)
+    }
+}
+
+// Unit Tests
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_nlogn_table_matches_formula() {
+        let table = DelayTable::compile(&DelayCurve::NLogN, 30, 50.0);
+        assert_eq!(table.get(-3), Duration::zero());
+        assert_eq!(table.get(0), Duration::zero());
+        assert_eq!(table.get(1), Duration::seconds(30));
+        // 50 * 4 * ln(4) + 30 = 307.25
+        assert_eq!(table.get(4), Duration::seconds(307));
+        // The table ends at the cap
+        assert_eq!(table.get(1000), Duration::seconds(MAX_DELAY_SECONDS));
+        assert!(table.seconds.len() < 1000);
+    }
+
+    #[test]
+    fn test_fractional_ramp_multiplier() {
+        let table = DelayTable::compile(&DelayCurve::Linear, 10, 1.5);
+        assert_eq!(table.get(1), Duration::seconds(10));
+        assert_eq!(table.get(3), Duration::seconds(13));
+    }
+
+    #[test]
+    fn test_exponential_table_is_capped() {
+        let table = DelayTable::compile(&DelayCurve::Exponential, 30, 2.0);
+        assert_eq!(table.get(1), Duration::seconds(30));
+        assert_eq!(table.get(4), Duration::seconds(240));
+        assert_eq!(table.get(i32::MAX), Duration::seconds(MAX_DELAY_SECONDS));
+    }
+
+    #[test]
+    fn test_stepped_table_repeats_last_step() {
+        let curve = DelayCurve::Stepped(vec![5, 60, 100_000]);
+        let table = DelayTable::compile(&curve, 30, 50.0);
+        assert_eq!(table.seconds.len(), 4);
+        assert_eq!(table.get(1), Duration::seconds(5));
+        assert_eq!(table.get(2), Duration::seconds(60));
+        assert_eq!(table.get(3), Duration::seconds(MAX_DELAY_SECONDS));
+        assert_eq!(table.get(9), Duration::seconds(MAX_DELAY_SECONDS));
+
+        // Without steps the base delay is used
+        let table = DelayTable::compile(&DelayCurve::Stepped(Vec::new()), 30, 50.0);
+        assert_eq!(table.get(7), Duration::seconds(30));
+    }
+}
@@ -28,6 +28,7 @@
 //! - `free_tries`: Number of allowed free authentication attempts before applying delays.
 //! - `base_delay_seconds`: Base delay applied to each authentication failure.
 //! - `ramp_multiplier`: Multiplier for the delay calculation based on the number of failures.
+//! - `delay_curve`: Curve of the delay over the failures, see the `delay` module.
 //!
 //! ## License
 //!
@@ -47,28 +48,59 @@
 //! You should have received a copy of the GNU General Public License
 //! along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
-mod settings;
-mod tally;
-mod utils;
+pub mod delay;
+pub mod settings;
+pub mod simulate;
+pub mod store;
+pub mod tally;
+pub mod utils;
 
 extern crate chrono;
 extern crate once_cell;
 extern crate pam;
-extern crate tempdir;
 extern crate users;
 
-use chrono::{Duration, Utc};
+use chrono::{DateTime, Duration, Utc};
+use delay::MAX_DELAY_SECONDS;
 use pam::constants::{PamFlag, PamResultCode, PAM_ERROR_MSG};
 use pam::conv::Conv;
+use pam::items::{RemoteHost, Service};
 use pam::module::{PamHandle, PamHooks};
 use pam::pam_try;
-use settings::Settings;
+use settings::{HookSettings, Settings};
 use std::cmp::min;
 use std::ffi::CStr;
+use std::io;
 
 use std::thread::sleep;
+use std::time::Instant;
+use store::admission::ShedReason;
+use store::storm::LogEvent;
+use store::watch::TallyWatch;
 use tally::Tally;
-use users::get_user_by_name;
+use utils::metrics::{self, Counter, Phase};
+use users::{get_user_by_name, User};
+
+/// Key of the resolved user in the PAM handle data.
+const USER_DATA_KEY: &str = "pam_authramp_user";
+
+/// The user resolved for a PAM user name, kept on the PAM handle for the transaction.
+struct ResolvedUser {
+    name: String,
+    user: Option<User>,
+}
+
+/// Key of the log finisher in the PAM handle data.
+const LOG_DATA_KEY: &str = "pam_authramp_log";
+
+/// Finishes the logger when PAM cleans up the handle data at the end of the transaction.
+struct LogFinisher;
+
+impl Drop for LogFinisher {
+    fn drop(&mut self) {
+        utils::syslog::finish_log();
+    }
+}
 
 // Action argument defines position in PAM stack
 #[derive(Debug, Default, Clone, Copy, PartialEq)]
@@ -89,6 +121,7 @@ impl PamHooks for Pamauthramp {
     /// This can be called with the PREAUTH action argument:
     /// auth        required                                     libpam_authramp.so preauth
     /// It then checks if an account is locked. And if that is true it bounces the auth.
+    /// With `fail_fast` enabled a locked account is rejected with PAM_MAXTRIES right away.
     ///
     /// It can also be called with the AUTHFAIL action argument:
     /// auth        [default=die]                                libpam_authramp.so authfail
@@ -100,21 +133,32 @@ impl PamHooks for Pamauthramp {
     /// - `flags`: PAM flags indicating the context of the PAM operation
     ///
     /// # Returns
-    /// PAM_SUCCESS OR PAM_AUTH_ERR
+    /// PAM_SUCCESS, PAM_AUTH_ERR OR PAM_MAXTRIES
     fn sm_authenticate(pamh: &mut PamHandle, args: Vec<&CStr>, flags: PamFlag) -> PamResultCode {
         init_authramp(pamh, args, flags, "auth", |pamh, settings, tally| {
             // match action parameter
             match settings.get_action()? {
                 Actions::PREAUTH => {
+                    metrics::count(Counter::Preauth);
+
                     // if account is locked then bounce
                     if tally.failures_count > settings.free_tries {
-                        Err(bounce_auth(pamh, settings, tally))
+                        match metrics::timed(Phase::Bounce, || bounce_auth(pamh, settings, tally)) {
+                            // fail-fast lockout rejects the attempt
+                            PamResultCode::PAM_MAXTRIES => Ok(PamResultCode::PAM_MAXTRIES),
+                            res => Err(res),
+                        }
                     } else {
                         Ok(PamResultCode::PAM_SUCCESS)
                     }
                 }
                 // bounce if called with authfail
-                Actions::AUTHFAIL => Err(bounce_auth(pamh, settings, tally)),
+                Actions::AUTHFAIL => {
+                    store::admission::record_failure(settings);
+                    Err(metrics::timed(Phase::Bounce, || {
+                        bounce_auth(pamh, settings, tally)
+                    }))
+                }
                 Actions::AUTHSUCC => Err(PamResultCode::PAM_AUTH_ERR),
             }
         })
@@ -161,27 +205,90 @@ fn init_authramp<F, R>(
     pamh: &mut PamHandle,
     _args: Vec<&CStr>,
     _flags: PamFlag,
-    pam_hook_desc: &str,
+    pam_hook_desc: &'static str,
     pam_hook: F,
 ) -> Result<R, PamResultCode>
 where
-    F: FnOnce(&mut PamHandle, &Settings, &Tally) -> Result<R, PamResultCode>,
+    F: FnOnce(&mut PamHandle, &HookSettings, &Tally) -> Result<R, PamResultCode>,
 {
+    let start = Instant::now();
+
     // Try to get PAM user
-    let user = get_user_by_name(pam_try!(
-        &pamh.get_user(None),
-        Err(PamResultCode::PAM_AUTH_ERR)
-    ));
+    let user = resolve_user(
+        pamh,
+        pam_try!(pamh.get_user(None), Err(PamResultCode::PAM_AUTH_ERR)),
+    );
+    let user_lookup = start.elapsed();
 
-    // Read configuration file
-    let settings = Settings::build(user.clone(), _args, _flags, None, pam_hook_desc)?;
+    // Read configuration file, with the overlays of the service
+    let service = pamh
+        .get_item::<Service>()
+        .ok()
+        .flatten()
+        .and_then(|service| service.to_str().ok());
+    let mut settings =
+        Settings::build(user, _args, _flags, None, pam_hook_desc, service)?;
 
-    utils::syslog::init_log(pamh, &settings)?;
+    // The first two phases are recorded once the settings tell if metrics are enabled
+    metrics::init(&settings);
+    metrics::record(Phase::UserLookup, user_lookup);
+    metrics::record(Phase::SettingsBuild, start.elapsed() - user_lookup);
+
+    if settings.rhost_tracking {
+        settings.rhost = pamh
+            .get_item::<RemoteHost>()
+            .ok()
+            .flatten()
+            .and_then(|rhost| rhost.to_str().ok().map(String::from))
+            .filter(|rhost| !rhost.is_empty());
+    }
+
+    metrics::timed(Phase::InitLog, || utils::syslog::init_log(&settings));
+    // Safety: only this module stores data under LOG_DATA_KEY, always as LogFinisher
+    if unsafe { pamh.get_data::<LogFinisher>(LOG_DATA_KEY) }.is_err() {
+        let _ = pamh.set_data(LOG_DATA_KEY, Box::new(LogFinisher));
+    }
 
     // Get and Set tally
-    let tally = Tally::new_from_tally_file(&settings)?;
+    let tally = metrics::timed(Phase::Tally, || Tally::new_from_tally_file(&settings))?;
+
+    let result = pam_hook(pamh, &settings, &tally);
+    // Send the records the syslog socket did not take yet, without blocking
+    log::logger().flush();
+    result
+}
+
+/// Resolves the PAM user name to a system user.
+///
+/// The result is stored on the PAM handle, so the preauth, authfail and account hooks of one
+/// transaction share a single NSS lookup. A changed PAM user name is resolved again.
+///
+/// # Arguments
+/// - `pamh`: PamHandle instance of the transaction
+/// - `name`: The PAM user name
+///
+/// # Returns
+/// The user, or `None` if the name is unknown
+fn resolve_user(pamh: &mut PamHandle, name: String) -> Option<User> {
+    // Safety: only this module stores data under USER_DATA_KEY, always as ResolvedUser
+    if let Ok(resolved) = unsafe { pamh.get_data::<ResolvedUser>(USER_DATA_KEY) } {
+        if resolved.name == name {
+            return resolved.user.clone();
+        }
+    }
+
+    let user = get_user_by_name(&name);
+
+    // Without the cached user the next hook just resolves it again
+    let _ = pamh.set_data(
+        USER_DATA_KEY,
+        Box::new(ResolvedUser {
+            name,
+            user: user.clone(),
+        }),
+    );
 
-    pam_hook(pamh, &settings, &tally)
+    user
 }
 
 /// Formats a Duration into a human-readable string representation.
@@ -192,7 +299,7 @@ where
 ///
 /// # Returns
 /// Formatted string indicating the remaining time
-fn format_remaining_time(remaining_time: Duration) -> String {
+pub fn format_remaining_time(remaining_time: Duration) -> String {
     let mut formatted_time = String::new();
 
     fn append_unit(value: i64, unit: &str, formatted_time: &mut String) {
@@ -221,8 +328,131 @@ fn format_remaining_time(remaining_time: Duration) -> String {
     formatted_time
 }
 
+/// Sends the remaining lockout time to the conversation function.
+/// The remaining time is capped at the maximum delay, in case the tally holds an unlock instant
+/// further in the future.
+///
+/// # Arguments
+/// - `conv`: PAM conversation
+/// - `unlock_instant`: Time when the account will be unlocked
+fn send_remaining_time(conv: &Conv, unlock_instant: DateTime<Utc>) {
+    // Calculate remaining time until unlock
+    let remaining_time = unlock_instant - Utc::now();
+
+    let capped_remaining_time = min(remaining_time, Duration::seconds(MAX_DELAY_SECONDS));
+
+    // Send a message to the conversation function
+    let _ = conv.send(
+        PAM_ERROR_MSG,
+        &format!(
+            "Account locked! Unlocking in {}.",
+            format_remaining_time(capped_remaining_time)
+        ),
+    );
+}
+
+/// Loads the tally of a watch and returns until when the account is still locked.
+///
+/// # Arguments
+/// - `watch`: The watch of the tally
+/// - `settings`: Settings for the authramp module
+///
+/// # Returns
+/// The unlock instant, `None` if the account is not locked anymore, or the error that occurred
+fn watched_unlock(watch: &mut TallyWatch, settings: &Settings) -> io::Result<Option<DateTime<Utc>>> {
+    let Some(mut tally) = watch.load()? else {
+        return Ok(None);
+    };
+    tally.expire(settings);
+
+    Ok((tally.failures_count > settings.free_tries).then(|| {
+        tally
+            .unlock_instant
+            .unwrap_or(tally.failure_instant + tally.get_delay(settings))
+    }))
+}
+
+/// Sends the countdown messages according to the `countdown_refresh` policy and sleeps until the
+/// next message or the unlock, whichever comes first.
+///
+/// The tally is watched while waiting, so an admin reset or a successful login from another
+/// session releases the session right away, and a lock extended by another session is followed.
+/// Sessions of a tracked remote host keep their unlock instant, because a reset of the user does
+/// not clear the remote host. If the watch cannot be set up, the session sleeps until the unlock.
+///
+/// # Arguments
+/// - `settings`: Settings for the authramp module
+/// - `conv`: The PAM conversation
+/// - `unlock_instant`: The instant the account is unlocked at
+fn wait_for_unlock(settings: &HookSettings, conv: &Conv, mut unlock_instant: DateTime<Utc>) {
+    let mut watch = if settings.rhost.is_none() {
+        TallyWatch::new(settings)
+            .map_err(|e| syslog_error!("PAM_SYSTEM_ERR: Error watching tally: {}", e))
+            .ok()
+    } else {
+        None
+    };
+
+    // Read again after the watch is set up, so no change is missed
+    if let Some(w) = watch.as_mut() {
+        match watched_unlock(w, settings) {
+            Ok(Some(instant)) => unlock_instant = instant,
+            Ok(None) => return,
+            Err(e) => {
+                syslog_error!("PAM_SYSTEM_ERR: Error watching tally: {}", e);
+                watch = None;
+            }
+        }
+    }
+
+    let mut sent = 0;
+    loop {
+        let now = Utc::now();
+        if now >= unlock_instant {
+            return;
+        }
+
+        send_remaining_time(conv, unlock_instant);
+        sent += 1;
+
+        // Wait until the next message is due or the account is unlocked
+        let next = settings
+            .countdown_refresh
+            .next_refresh(sent)
+            .and_then(|next| Duration::from_std(next).ok())
+            .map(|next| now + next);
+        loop {
+            let deadline = next.map_or(unlock_instant, |next| min(next, unlock_instant));
+            let Some(w) = watch.as_mut() else {
+                sleep((deadline - Utc::now()).to_std().unwrap_or_default());
+                break;
+            };
+
+            // Load again after a timeout as well, a wake-up of the lock extension may be missed
+            match w
+                .wait(deadline)
+                .and_then(|changed| Ok((changed, watched_unlock(w, settings)?)))
+            {
+                Ok((_, None)) => return,
+                Ok((changed, Some(instant))) => {
+                    unlock_instant = instant;
+                    if !changed {
+                        break;
+                    }
+                }
+                Err(e) => {
+                    syslog_error!("PAM_SYSTEM_ERR: Error watching tally: {}", e);
+                    watch = None;
+                }
+            }
+        }
+    }
+}
+
 /// Handles the account lockout mechanism based on the number of failures and settings.
-/// If the account is locked, it sends periodic messages to the user until the account is unlocked.
+/// If the account is locked, it holds the session until the unlock, see `wait_for_unlock`.
+/// Attempts that the admission control sheds are rejected like in fail-fast mode.
+/// With `fail_fast` enabled, it sends a single message and rejects the attempt instead of waiting.
 ///
 /// # Arguments
 /// - `pamh`: PamHandle instance for interacting with PAM
@@ -230,13 +460,11 @@ fn format_remaining_time(remaining_time: Duration) -> String {
 /// - `tally`: Tally information containing failure count and timestamps
 ///
 /// # Returns
-/// PAM_SUCCESS if the account is successfully unlocked, PAM_AUTH_ERR otherwise
-fn bounce_auth(pamh: &mut PamHandle, settings: &Settings, tally: &Tally) -> PamResultCode {
+/// PAM_SUCCESS if the account is successfully unlocked, PAM_MAXTRIES if the account is still
+/// locked in fail-fast mode or the attempt was shed, PAM_AUTH_ERR otherwise
+fn bounce_auth(pamh: &mut PamHandle, settings: &HookSettings, tally: &Tally) -> PamResultCode {
     // get user
-    let user = match settings.get_user() {
-        Ok(user) => user,
-        Err(res) => return res,
-    };
+    let user = &settings.user;
 
     // ignore root except when configured
     if user.uid().eq(&0) && !settings.even_deny_root {
@@ -245,6 +473,8 @@ fn bounce_auth(pamh: &mut PamHandle, settings: &Settings, tally: &Tally) -> PamR
 
     if tally.failures_count > settings.free_tries {
         if let Ok(Some(conv)) = pamh.get_item::<Conv>() {
+            metrics::count(Counter::Bounces);
+
             let delay = tally.get_delay(settings);
 
             // Calculate the time when the account will be unlocked
@@ -252,32 +482,48 @@ fn bounce_auth(pamh: &mut PamHandle, settings: &Settings, tally: &Tally) -> PamR
                 .unlock_instant
                 .unwrap_or(tally.failure_instant + delay);
 
-            syslog_info!(
-                "PAM_AUTH_ERR: Account {:?} is getting bounced. Account still locked until {}",
-                user,
-                unlock_instant,
-            );
-
-            while Utc::now() < unlock_instant {
-                // Calculate remaining time until unlock
-                let remaining_time = unlock_instant - Utc::now();
-
-                // Cap remaining time at 24 hours
-                let capped_remaining_time = min(remaining_time, Duration::hours(24));
-
-                // Send a message to the conversation function
-                let _ = conv.send(
-                    PAM_ERROR_MSG,
-                    &format!(
-                        "Account locked! Unlocking in {}.",
-                        format_remaining_time(capped_remaining_time)
-                    ),
-                );
-
-                // Wait for one second
-                sleep(std::time::Duration::from_secs(1));
+            utils::syslog::log_collapsed(settings, &user, LogEvent::Bounce, || {
+                syslog_info!(
+                    "PAM_AUTH_ERR: Account {:?} is getting bounced. Account still locked until {}",
+                    user.name(),
+                    unlock_instant,
+                )
+            });
+
+            // Reject right away instead of holding the session until the unlock
+            if settings.fail_fast {
+                if Utc::now() < unlock_instant {
+                    send_remaining_time(&conv, unlock_instant);
+                    return PamResultCode::PAM_MAXTRIES;
+                }
+                return PamResultCode::PAM_SUCCESS;
             }
 
+            // Reject right away while too many sessions wait or the host is under attack
+            let _session = match store::admission::admit(settings) {
+                Ok(session) => session,
+                Err(reason) => {
+                    metrics::count(Counter::Shed);
+                    let reason = match reason {
+                        ShedReason::Sessions => "too many sessions waiting for an unlock",
+                        ShedReason::FailureRate => "host-wide failure rate exceeded",
+                    };
+                    utils::syslog::log_collapsed(settings, &user, LogEvent::Shed, || {
+                        syslog_info!(
+                            "PAM_MAXTRIES: Bounced attempt on account {:?} rejected: {}",
+                            user.name(),
+                            reason
+                        )
+                    });
+                    if Utc::now() < unlock_instant {
+                        send_remaining_time(&conv, unlock_instant);
+                        return PamResultCode::PAM_MAXTRIES;
+                    }
+                    return PamResultCode::PAM_SUCCESS;
+                }
+            };
+
+            wait_for_unlock(settings, &conv, unlock_instant);
             // Account is now unlocked, continue with PAM_SUCCESS
             return PamResultCode::PAM_SUCCESS;
         }
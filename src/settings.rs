@@ -7,8 +7,14 @@
 //! ## Overview
 //!
 //! The `Settings` structure represents the configuration settings for the authramp PAM module.
-//! It includes fields such as `action`, `user`, `tally_dir`, `free_tries`, `base_delay_seconds`,
-//! and `ramp_multiplier`.
+//! It includes fields such as `action`, `tally_dir`, `free_tries`, `base_delay_seconds`,
+//! and `ramp_multiplier`. `HookSettings` adds the PAM user, hook and remote host of a hook call.
+//!
+//! ## Caching
+//!
+//! Parsed configuration files are cached process-wide. A cached configuration is reused until
+//! the device, inode, size or modification time of the file changes, so long-lived PAM consumers
+//! do not read and parse the configuration file on every hook invocation.
 //!
 //! ## License
 //!
@@ -28,20 +34,203 @@
 //! You should have received a copy of the GNU General Public License
 //! along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
+use crate::delay::{DelayCurve, DelayTable};
+use crate::store::admission::SESSION_SLOTS;
+use crate::store::{Durability, TallyBackend, TallyFormat};
 use crate::Actions;
+use once_cell::sync::Lazy;
 use pam::constants::{PamFlag, PamResultCode};
 use std::collections::HashMap;
-use std::ffi::CStr;
+use std::ffi::{CStr, CString};
 use std::fs;
-use std::path::PathBuf;
+use std::ops::Deref;
+use std::os::unix::fs::MetadataExt;
+use std::path::{Path, PathBuf};
+use std::str::FromStr;
+use std::sync::{Arc, RwLock};
 
 use users::User;
 
 const DEFAULT_TALLY_DIR: &str = "/var/run/authramp";
-const DEFAULT_CONFIG_FILE_PATH: &str = "/etc/security/authramp.conf";
+pub const DEFAULT_CONFIG_FILE_PATH: &str = "/etc/security/authramp.conf";
+const DEFAULT_TALLY_CACHE_NAME: &str = "/authramp-cache";
+const DEFAULT_DAEMON_SOCKET: &str = "/run/authramp/authrampd.sock";
+const DEFAULT_METRICS_NAME: &str = "/authramp-metrics";
+const DEFAULT_GOSSIP_KEY_FILE: &str = "/etc/security/authramp-gossip.key";
+const DEFAULT_BASE_DELAY_SECONDS: i32 = 30;
+const DEFAULT_RAMP_MULTIPLIER: f64 = 50.0;
+
+/// Upper bound for the interval between exponentially spaced countdown messages.
+const MAX_COUNTDOWN_REFRESH_SECONDS: u64 = 3600;
+
+/// Policy for sending the remaining lockout time while a session waits for the unlock.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum CountdownRefresh {
+    /// Send the remaining time once, when the session starts waiting.
+    Start,
+    /// Send the remaining time after 1, 2, 4, 8, ... seconds.
+    Exponential,
+    /// Send the remaining time every N seconds.
+    Interval(u32),
+}
+
+impl CountdownRefresh {
+    /// Parses the `countdown_refresh` setting, which is either "start", "exponential" or a
+    /// number of seconds.
+    fn from_value(val: &toml::Value) -> Option<Self> {
+        match val.as_str() {
+            Some("start") => Some(CountdownRefresh::Start),
+            Some("exponential") => Some(CountdownRefresh::Exponential),
+            Some(_) => None,
+            None => val
+                .as_integer()
+                .filter(|&secs| secs > 0)
+                .map(|secs| CountdownRefresh::Interval(secs.min(u32::MAX as i64) as u32)),
+        }
+    }
+
+    /// Returns the time to wait before sending the next countdown message, or `None` if no
+    /// further message is sent.
+    ///
+    /// # Arguments
+    ///
+    /// * `sent`: Number of countdown messages sent so far.
+    pub fn next_refresh(&self, sent: u32) -> Option<std::time::Duration> {
+        match self {
+            CountdownRefresh::Start => None,
+            CountdownRefresh::Exponential => Some(std::time::Duration::from_secs(
+                1u64.checked_shl(sent.saturating_sub(1))
+                    .unwrap_or(u64::MAX)
+                    .min(MAX_COUNTDOWN_REFRESH_SECONDS),
+            )),
+            CountdownRefresh::Interval(secs) => Some(std::time::Duration::from_secs(*secs as u64)),
+        }
+    }
+}
+
+impl Default for CountdownRefresh {
+    /// A message every second.
+    fn default() -> Self {
+        CountdownRefresh::Interval(1)
+    }
+}
+
+/// Parses the `delay_curve` setting together with the `delay_steps` of the stepped curve.
+fn parse_delay_curve(s: &toml::Value) -> Option<DelayCurve> {
+    let curve = s.get("delay_curve")?.as_str()?.parse().ok()?;
+    match curve {
+        DelayCurve::Stepped(_) => Some(DelayCurve::Stepped(
+            s.get("delay_steps")
+                .and_then(|val| val.as_array())
+                .map(|steps| {
+                    steps
+                        .iter()
+                        .filter_map(|step| step.as_integer())
+                        .filter(|step| *step >= 0)
+                        .collect()
+                })
+                .unwrap_or_default(),
+        )),
+        curve => Some(curve),
+    }
+}
+
+/// Parses the value of a `key=value` module argument like a TOML value, e.g. `free_tries=3` or
+/// `fail_fast=true`. Values that are not valid TOML are taken as strings, so
+/// `tally_backend=mmap` does not need quotes on the PAM line.
+fn parse_arg_value(value: &str) -> toml::Value {
+    toml::from_str::<toml::value::Table>(&format!("value = {}", value))
+        .ok()
+        .and_then(|mut table| table.remove("value"))
+        .unwrap_or_else(|| toml::Value::String(value.to_string()))
+}
+
+/// How log messages are sent to syslog.
+#[derive(Debug, Default, Clone, Copy, PartialEq)]
+pub enum LogMode {
+    /// Write every message to the syslog socket before continuing.
+    #[default]
+    Sync,
+    /// Queue messages in a bounded ring buffer and send them without blocking, see the
+    /// `utils::async_log` module.
+    Async,
+}
+
+impl FromStr for LogMode {
+    type Err = ();
+
+    /// Parses the `log_mode` setting value.
+    fn from_str(s: &str) -> Result<Self, Self::Err> {
+        match s {
+            "sync" => Ok(LogMode::Sync),
+            "async" => Ok(LogMode::Async),
+            _ => Err(()),
+        }
+    }
+}
+
+/// Identity of a configuration file on disk. A cached configuration is only reused as long as
+/// the file still has the same identity.
+#[derive(Debug, Clone, Copy, PartialEq)]
+struct ConfFileStamp {
+    dev: u64,
+    ino: u64,
+    size: u64,
+    mtime: i64,
+    mtime_nsec: i64,
+}
+
+impl ConfFileStamp {
+    /// Stats the configuration file. Returns `None` if the file does not exist or is unreadable.
+    fn from_path(path: &Path) -> Option<Self> {
+        fs::metadata(path).ok().map(|meta| ConfFileStamp {
+            dev: meta.dev(),
+            ino: meta.ino(),
+            size: meta.size(),
+            mtime: meta.mtime(),
+            mtime_nsec: meta.mtime_nsec(),
+        })
+    }
+}
+
+/// Parsed configuration snapshot together with the stamp of the file it was parsed from.
+struct CachedConf {
+    stamp: Option<ConfFileStamp>,
+    settings: Arc<Settings>,
+    /// The `[Service]` table of the file.
+    services: toml::value::Table,
+    /// Settings already resolved for a service and argument list. Dropped with the snapshot
+    /// when the file changes.
+    overlays: RwLock<Vec<CachedOverlay>>,
+}
+
+/// Settings resolved for a PAM service and the module arguments of its PAM line.
+struct CachedOverlay {
+    service: Option<String>,
+    args: Vec<CString>,
+    settings: Arc<Settings>,
+}
+
+impl CachedOverlay {
+    /// Returns true if the overlay was resolved for `service` and `args`. Compares in place,
+    /// so a cache hit does not allocate.
+    fn matches(&self, service: Option<&str>, args: &[&CStr]) -> bool {
+        self.service.as_deref() == service
+            && self.args.len() == args.len()
+            && self.args.iter().zip(args).all(|(a, b)| a.as_c_str() == *b)
+    }
+}
+
+/// Upper bound of the cached overlays per configuration file. A process only ever sees a
+/// handful of PAM lines, further overlays are resolved on every call.
+const MAX_CACHED_OVERLAYS: usize = 64;
+
+/// Process-wide cache of parsed configuration files, keyed by configuration file path.
+static CONF_CACHE: Lazy<RwLock<HashMap<PathBuf, Arc<CachedConf>>>> =
+    Lazy::new(|| RwLock::new(HashMap::new()));
 
 // Settings struct represents the configuration loaded from default values, configuration file and parameters
-#[derive(Debug)]
+#[derive(Debug, Clone)]
 pub struct Settings {
     // Directory where tally information is stored.
     pub tally_dir: PathBuf,
@@ -50,15 +239,117 @@ pub struct Settings {
     // Base delay applied to each authentication failure.
     pub base_delay_seconds: i32,
     // Multiplier for the delay calculation based on the number of failures.
-    pub ramp_multiplier: i32,
-    // PAM Hook
-    pub pam_hook: String,
+    pub ramp_multiplier: f64,
+    // Curve of the delay over the failures beyond free_tries
+    pub delay_curve: DelayCurve,
+    // Delays of the curve, compiled by compile_delay_table when the settings are loaded
+    pub delay_table: DelayTable,
+    // PAM service the settings were resolved for
+    pub service: Option<String>,
     // PAM action
     pub action: Option<Actions>,
-    // PAM user
-    pub user: Option<User>,
     // Even lock out root user
     pub even_deny_root: bool,
+    // Resolve the syslog process name with a full sysinfo process scan instead of /proc/self/comm
+    pub sysinfo_process_name: bool,
+    // Format used to write tally files
+    pub tally_format: TallyFormat,
+    // How tally file writes are synced to disk
+    pub durability: Durability,
+    // Time the first writer of a group commit waits for more updates before it syncs
+    pub group_commit_ms: u64,
+    // Storage backend for the tallies
+    pub tally_backend: TallyBackend,
+    // Number of slots of a newly created mmap tally database
+    pub tally_db_slots: u32,
+    // Reject bounced attempts immediately instead of waiting for the unlock
+    pub fail_fast: bool,
+    // When to send the remaining lockout time while waiting for the unlock
+    pub countdown_refresh: CountdownRefresh,
+    // Skip the tally files of users without failures with a shared filter
+    pub tally_filter: bool,
+    // Maximum number of sessions waiting for an unlock on the host, 0 is unlimited
+    pub bounce_max_sessions: u32,
+    // Host-wide failures within the shed window that reject bounced attempts, 0 never
+    pub bounce_shed_failures: u64,
+    // Length of the sliding window of the host-wide failures
+    pub bounce_shed_window_seconds: u64,
+    // Cache tallies of the file backend in POSIX shared memory
+    pub tally_cache: bool,
+    // Name prefix of the shared memory tally caches, one per tally directory
+    pub tally_cache_name: String,
+    // Number of slots of a newly created shared memory tally cache
+    pub tally_cache_slots: u32,
+    // Unix datagram socket of the authramp daemon
+    pub daemon_socket: PathBuf,
+    // Time to wait for a daemon reply before falling back to the tally files
+    pub daemon_timeout_ms: u64,
+    // UDP address the daemon receives the gossip of other nodes on, no gossip if unset
+    pub gossip_bind: Option<String>,
+    // UDP addresses of the daemons of the other nodes
+    pub gossip_peers: Vec<String>,
+    // File with the key authenticating gossip messages, the same on all nodes
+    pub gossip_key_file: PathBuf,
+    // Track failures per remote host across all users
+    pub rhost_tracking: bool,
+    // Number of failures from a remote host before its delay ramps up
+    pub rhost_free_tries: i32,
+    // Length of the remote host counting window
+    pub rhost_window_seconds: u64,
+    // Number of counters per row of a newly created remote host sketch
+    pub rhost_sketch_width: u32,
+    // Seconds after the last failure until an unlocked tally expires, 0 never expires
+    pub tally_ttl: u64,
+    // Record phase latencies and event counters in POSIX shared memory
+    pub metrics: bool,
+    // Name of the shared memory metrics segment
+    pub metrics_name: String,
+    // How log messages are sent to syslog
+    pub log_mode: LogMode,
+    // Seconds in which repeated bounce and lockout messages of an account are collapsed, 0 logs all
+    pub log_storm_window: u64,
+}
+
+/// Settings of a PAM hook call.
+///
+/// The shared settings snapshot of the PAM line, see `Settings::load_cached_overlay`, with the
+/// PAM user, hook and remote host of the call next to it, so a hook call never copies the
+/// snapshot. Derefs to the snapshot.
+#[derive(Debug, Clone)]
+pub struct HookSettings {
+    settings: Arc<Settings>,
+    // PAM user
+    pub user: User,
+    // PAM Hook
+    pub pam_hook: &'static str,
+    // PAM remote host
+    pub rhost: Option<String>,
+}
+
+impl HookSettings {
+    /// Creates the settings of a hook call of `user` without a remote host.
+    ///
+    /// # Arguments
+    ///
+    /// * `settings`: The settings snapshot.
+    /// * `user`: The PAM user.
+    /// * `pam_hook`: Name of the PAM hook, used in log messages.
+    pub fn new(settings: Arc<Settings>, user: User, pam_hook: &'static str) -> Self {
+        HookSettings {
+            settings,
+            user,
+            pam_hook,
+            rhost: None,
+        }
+    }
+}
+
+impl Deref for HookSettings {
+    type Target = Settings;
+
+    fn deref(&self) -> &Settings {
+        &self.settings
+    }
 }
 
 impl Default for Settings {
@@ -67,20 +358,58 @@ impl Default for Settings {
         Settings {
             tally_dir: PathBuf::from(DEFAULT_TALLY_DIR),
             action: Some(Actions::AUTHSUCC),
-            user: None,
             free_tries: 6,
-            base_delay_seconds: 30,
-            ramp_multiplier: 50,
-            pam_hook: String::from("auth"),
+            base_delay_seconds: DEFAULT_BASE_DELAY_SECONDS,
+            ramp_multiplier: DEFAULT_RAMP_MULTIPLIER,
+            delay_curve: DelayCurve::default(),
+            delay_table: DelayTable::compile(
+                &DelayCurve::default(),
+                DEFAULT_BASE_DELAY_SECONDS,
+                DEFAULT_RAMP_MULTIPLIER,
+            ),
+            service: None,
             even_deny_root: false,
+            sysinfo_process_name: false,
+            tally_format: TallyFormat::default(),
+            durability: Durability::default(),
+            group_commit_ms: 10,
+            tally_backend: TallyBackend::default(),
+            tally_db_slots: 262144,
+            fail_fast: false,
+            countdown_refresh: CountdownRefresh::default(),
+            tally_filter: true,
+            bounce_max_sessions: 0,
+            bounce_shed_failures: 0,
+            bounce_shed_window_seconds: 60,
+            tally_cache: false,
+            tally_cache_name: String::from(DEFAULT_TALLY_CACHE_NAME),
+            tally_cache_slots: 65536,
+            daemon_socket: PathBuf::from(DEFAULT_DAEMON_SOCKET),
+            daemon_timeout_ms: 100,
+            gossip_bind: None,
+            gossip_peers: Vec::new(),
+            gossip_key_file: PathBuf::from(DEFAULT_GOSSIP_KEY_FILE),
+            rhost_tracking: false,
+            rhost_free_tries: 30,
+            rhost_window_seconds: 3600,
+            rhost_sketch_width: 8192,
+            tally_ttl: 0,
+            metrics: false,
+            metrics_name: String::from(DEFAULT_METRICS_NAME),
+            log_mode: LogMode::default(),
+            log_storm_window: 0,
         }
     }
 }
 
 impl Settings {
-    /// Constructs a `Settings` instance based on input parameters, including user
+    /// Constructs the `HookSettings` of a hook call based on input parameters, including user
     /// information, PAM flags, and an optional configuration file path.
     ///
+    /// The configuration file is overlaid with the `[Service.<service>]` section of the PAM
+    /// service and the `key=value` module arguments, in this order. The result is cached per
+    /// service and argument list, see `load_cached_overlay`, and shared with the call.
+    ///
     /// # Arguments
     ///
     /// * `user`: An optional `User` instance representing the user associated with
@@ -89,48 +418,31 @@ impl Settings {
     /// * `_flags`: PAM flags indicating the context of the PAM operation (unused).
     /// * `config_file`: An optional `PathBuf` specifying the path to the INI file. If
     ///   not provided, the default configuration file path is used.
+    /// * `pam_hook`: Name of the PAM hook, used in log messages.
+    /// * `service`: The PAM service, `None` if unknown.
     ///
     /// # Returns
     ///
-    /// A `Result` containing the constructed `Settings` instance or a `PamResultCode`
+    /// A `Result` containing the constructed `HookSettings` instance or a `PamResultCode`
     /// indicating an error during the construction process.
     pub fn build(
         user: Option<User>,
         args: Vec<&CStr>,
         _flags: PamFlag,
         config_file: Option<PathBuf>,
-        pam_hook: &str,
-    ) -> Result<Settings, PamResultCode> {
-        // Load INI file.
-        let mut settings = Self::load_conf_file(config_file);
-
-        // create possible action collection
-        let action_map: HashMap<&str, Actions> = [
-            ("preauth", Actions::PREAUTH),
-            ("authsucc", Actions::AUTHSUCC),
-            ("authfail", Actions::AUTHFAIL),
-        ]
-        .iter()
-        .cloned()
-        .collect();
-
-        // map argument to action
-        settings.action = args.iter().find_map(|&carg| {
-            carg.to_str()
-                .ok()
-                .and_then(|arg| action_map.get(arg).cloned())
-        });
-
-        // set default action if none is provided
-        settings.action.get_or_insert(Actions::AUTHSUCC);
-
+        pam_hook: &'static str,
+        service: Option<&str>,
+    ) -> Result<HookSettings, PamResultCode> {
         // get user
-        settings.user = Some(user.ok_or(PamResultCode::PAM_SYSTEM_ERR)?);
+        let user = user.ok_or(PamResultCode::PAM_SYSTEM_ERR)?;
 
-        // pam hook
-        settings.pam_hook = String::from(pam_hook);
+        // Load INI file.
+        let config_file = config_file
+            .as_deref()
+            .unwrap_or(Path::new(DEFAULT_CONFIG_FILE_PATH));
+        let settings = Self::load_cached_overlay(config_file, service, &args);
 
-        Ok(settings)
+        Ok(HookSettings::new(settings, user, pam_hook))
     }
 
     /// Gets the PAM action associated with the current settings.
@@ -143,68 +455,381 @@ impl Settings {
         self.action.ok_or(PamResultCode::PAM_ABORT)
     }
 
-    /// Gets the PAM user associated with the current settings.
+    /// Returns the configuration snapshot for `config_file` from the process-wide cache.
+    ///
+    /// The file is only parsed again if its device, inode, size or modification time changed
+    /// since it was cached. The common path is a single `stat` call.
+    ///
+    /// # Arguments
+    ///
+    /// * `config_file`: A `Path` specifying the path to the INI file.
+    ///
+    /// # Returns
+    ///
+    /// A shared `Settings` snapshot populated with values from the configuration file, or the
+    /// default values if the file is not present or cannot be loaded.
+    pub fn load_cached_conf_file(config_file: &Path) -> Arc<Settings> {
+        Arc::clone(&Self::load_cached_conf(config_file).settings)
+    }
+
+    /// Returns the settings of `service` with the module arguments `args` from the
+    /// process-wide cache.
+    ///
+    /// On the first call for a service and argument list, the `[Service.<service>]` section
+    /// and the `key=value` arguments are overlaid on the configuration snapshot. Later calls
+    /// only compare the service and arguments with the cached overlays.
+    ///
+    /// # Arguments
+    ///
+    /// * `config_file`: A `Path` specifying the path to the INI file.
+    /// * `service`: The PAM service, `None` if unknown.
+    /// * `args`: The PAM module arguments.
+    ///
+    /// # Returns
+    ///
+    /// A shared `Settings` snapshot with the overlays applied and the action of the arguments
+    /// set.
+    pub fn load_cached_overlay(
+        config_file: &Path,
+        service: Option<&str>,
+        args: &[&CStr],
+    ) -> Arc<Settings> {
+        let conf = Self::load_cached_conf(config_file);
+
+        if let Ok(overlays) = conf.overlays.read() {
+            if let Some(cached) = overlays.iter().find(|o| o.matches(service, args)) {
+                return Arc::clone(&cached.settings);
+            }
+        }
+
+        let settings = Arc::new(Self::resolve_overlay(&conf, service, args));
+
+        if let Ok(mut overlays) = conf.overlays.write() {
+            if overlays.len() < MAX_CACHED_OVERLAYS {
+                overlays.push(CachedOverlay {
+                    service: service.map(String::from),
+                    args: args.iter().map(|&arg| CString::from(arg)).collect(),
+                    settings: Arc::clone(&settings),
+                });
+            }
+        }
+
+        settings
+    }
+
+    /// Returns the cache entry of `config_file`, parsing the file again if it changed.
+    fn load_cached_conf(config_file: &Path) -> Arc<CachedConf> {
+        let stamp = ConfFileStamp::from_path(config_file);
+
+        if let Ok(cache) = CONF_CACHE.read() {
+            if let Some(cached) = cache.get(config_file).filter(|c| c.stamp == stamp) {
+                return Arc::clone(cached);
+            }
+        }
+
+        let (settings, services) = Self::load_conf_file(config_file);
+        let conf = Arc::new(CachedConf {
+            stamp,
+            settings: Arc::new(settings),
+            services,
+            overlays: RwLock::new(Vec::new()),
+        });
+
+        if let Ok(mut cache) = CONF_CACHE.write() {
+            cache.insert(config_file.to_path_buf(), Arc::clone(&conf));
+        }
+
+        conf
+    }
+
+    /// Overrides settings with `key=value` PAM line arguments. Values are parsed as TOML values
+    /// and fall back to strings, arguments without a `=` are ignored.
+    ///
+    /// # Arguments
+    ///
+    /// * `args`: The arguments, e.g. `["free_tries=3", "base_delay_seconds=10"]`
     ///
     /// # Returns
     ///
-    /// A `Result` containing a reference to the PAM user (`&User`) if available, or a `PamResultCode`
-    /// indicating a user_unknown error if the user is not present.
-    pub fn get_user(&self) -> Result<&User, PamResultCode> {
-        self.user.as_ref().ok_or(PamResultCode::PAM_USER_UNKNOWN)
+    /// The settings with the arguments applied.
+    pub fn with_args(self, args: &[&str]) -> Settings {
+        let arg_table: toml::value::Table = args
+            .iter()
+            .filter_map(|arg| arg.split_once('='))
+            .map(|(key, value)| (key.to_string(), parse_arg_value(value)))
+            .collect();
+
+        match arg_table.is_empty() {
+            true => self,
+            false => self.overlay(&toml::Value::Table(arg_table)),
+        }
+    }
+
+    /// Overlays the service section and the module arguments on a configuration snapshot.
+    ///
+    /// # Arguments
+    ///
+    /// * `conf`: The configuration snapshot.
+    /// * `service`: The PAM service, `None` if unknown.
+    /// * `args`: The PAM module arguments.
+    ///
+    /// # Returns
+    ///
+    /// The resolved settings.
+    fn resolve_overlay(conf: &CachedConf, service: Option<&str>, args: &[&CStr]) -> Settings {
+        let mut settings = Settings::clone(&conf.settings);
+
+        if let Some(section) = service.and_then(|service| conf.services.get(service)) {
+            settings = settings.overlay(section);
+        }
+
+        let args: Vec<&str> = args.iter().filter_map(|arg| arg.to_str().ok()).collect();
+        let mut action = None;
+        for &arg in &args {
+            match arg {
+                "preauth" => action = action.or(Some(Actions::PREAUTH)),
+                "authsucc" => action = action.or(Some(Actions::AUTHSUCC)),
+                "authfail" => action = action.or(Some(Actions::AUTHFAIL)),
+                _ => {}
+            }
+        }
+        settings = settings.with_args(&args);
+
+        // set default action if none is provided
+        settings.action = action.or(Some(Actions::AUTHSUCC));
+        settings.service = service.map(String::from);
+        settings
     }
 
     /// Loads configuration settings from an INI file, returning a `Settings` instance.
     ///
     /// # Arguments
     ///
-    /// * `config_file`: An optional `PathBuf` specifying the path to the INI file. If
-    ///   not provided, the default configuration file path is used.
+    /// * `config_file`: A `Path` specifying the path to the INI file.
     ///
     /// # Returns
     ///
     /// A `Settings` instance populated with values from the configuration file, or the
-    /// default values if the file is not present or cannot be loaded.
-    fn load_conf_file(config_file: Option<PathBuf>) -> Settings {
+    /// default values if the file is not present or cannot be loaded, and the `[Service]`
+    /// table holding the overlays of the services.
+    fn load_conf_file(config_file: &Path) -> (Settings, toml::value::Table) {
         // Read TOML file using the toml crate
-        let content =
-            fs::read_to_string(config_file.unwrap_or(PathBuf::from(DEFAULT_CONFIG_FILE_PATH))).ok();
+        let content = fs::read_to_string(config_file).ok();
 
         // Parse TOML content into a TomlTable
-        let toml_table: Option<toml::value::Table> =
-            content.and_then(|c| toml::de::from_str(&c).ok());
+        let mut toml_table: toml::value::Table = content
+            .and_then(|c| toml::de::from_str(&c).ok())
+            .unwrap_or_default();
+
+        // Per-service overlays are resolved when a service uses them
+        let services = match toml_table.remove("Service") {
+            Some(toml::Value::Table(services)) => services,
+            _ => toml::value::Table::new(),
+        };
 
         // Extract the "Settings" section from the TOML table
-        let settings = toml_table.and_then(|t| t.get("Settings").cloned());
+        let settings = match toml_table.get("Settings") {
+            Some(s) => Settings::default().overlay(s),
+            None => Settings::default(),
+        };
+
+        (settings, services)
+    }
+
+    /// Overlays the values of a settings table on these settings. Keys that are missing or
+    /// invalid keep their current value. The delay table is compiled again.
+    ///
+    /// # Arguments
+    ///
+    /// * `s`: A table with the keys of the `[Settings]` section.
+    ///
+    /// # Returns
+    ///
+    /// The overlaid settings.
+    fn overlay(self, s: &toml::Value) -> Settings {
+        let base = self;
 
-        // Map the settings to the Settings struct
+        let mut settings = Settings {
+            tally_dir: s
+                .get("tally_dir")
+                .and_then(|val| val.as_str().map(PathBuf::from))
+                .unwrap_or(base.tally_dir),
+            free_tries: s
+                .get("free_tries")
+                .and_then(|val| val.as_integer())
+                .map(|val| val as i32)
+                .unwrap_or(base.free_tries),
+            base_delay_seconds: s
+                .get("base_delay_seconds")
+                .and_then(|val| val.as_integer())
+                .map(|val| val as i32)
+                .unwrap_or(base.base_delay_seconds),
+            ramp_multiplier: s
+                .get("ramp_multiplier")
+                .and_then(|val| val.as_float().or(val.as_integer().map(|val| val as f64)))
+                .filter(|val| val.is_finite())
+                .unwrap_or(base.ramp_multiplier),
+            delay_curve: parse_delay_curve(&s).unwrap_or(base.delay_curve),
+            even_deny_root: s
+                .get("even_deny_root")
+                .and_then(|val| val.as_bool())
+                .unwrap_or(base.even_deny_root),
+            sysinfo_process_name: s
+                .get("sysinfo_process_name")
+                .and_then(|val| val.as_bool())
+                .unwrap_or(base.sysinfo_process_name),
+            tally_format: s
+                .get("tally_format")
+                .and_then(|val| val.as_str())
+                .and_then(|val| val.parse().ok())
+                .unwrap_or(base.tally_format),
+            durability: s
+                .get("durability")
+                .and_then(|val| val.as_str())
+                .and_then(|val| val.parse().ok())
+                .unwrap_or(base.durability),
+            group_commit_ms: s
+                .get("group_commit_ms")
+                .and_then(|val| val.as_integer())
+                .and_then(|val| u64::try_from(val).ok())
+                .unwrap_or(base.group_commit_ms),
+            tally_backend: s
+                .get("tally_backend")
+                .and_then(|val| val.as_str())
+                .and_then(|val| val.parse().ok())
+                .unwrap_or(base.tally_backend),
+            tally_db_slots: s
+                .get("tally_db_slots")
+                .and_then(|val| val.as_integer())
+                .and_then(|val| u32::try_from(val).ok())
+                .unwrap_or(base.tally_db_slots),
+            fail_fast: s
+                .get("fail_fast")
+                .and_then(|val| val.as_bool())
+                .unwrap_or(base.fail_fast),
+            countdown_refresh: s
+                .get("countdown_refresh")
+                .and_then(CountdownRefresh::from_value)
+                .unwrap_or(base.countdown_refresh),
+            tally_filter: s
+                .get("tally_filter")
+                .and_then(|val| val.as_bool())
+                .unwrap_or(base.tally_filter),
+            bounce_max_sessions: s
+                .get("bounce_max_sessions")
+                .and_then(|val| val.as_integer())
+                .and_then(|val| u32::try_from(val).ok())
+                .map(|val| val.min(SESSION_SLOTS))
+                .unwrap_or(base.bounce_max_sessions),
+            bounce_shed_failures: s
+                .get("bounce_shed_failures")
+                .and_then(|val| val.as_integer())
+                .and_then(|val| u64::try_from(val).ok())
+                .unwrap_or(base.bounce_shed_failures),
+            bounce_shed_window_seconds: s
+                .get("bounce_shed_window_seconds")
+                .and_then(|val| val.as_integer())
+                .and_then(|val| u64::try_from(val).ok())
+                .filter(|val| *val > 0)
+                .unwrap_or(base.bounce_shed_window_seconds),
+            tally_cache: s
+                .get("tally_cache")
+                .and_then(|val| val.as_bool())
+                .unwrap_or(base.tally_cache),
+            tally_cache_name: s
+                .get("tally_cache_name")
+                .and_then(|val| val.as_str().map(String::from))
+                .unwrap_or(base.tally_cache_name),
+            tally_cache_slots: s
+                .get("tally_cache_slots")
+                .and_then(|val| val.as_integer())
+                .and_then(|val| u32::try_from(val).ok())
+                .unwrap_or(base.tally_cache_slots),
+            daemon_socket: s
+                .get("daemon_socket")
+                .and_then(|val| val.as_str().map(PathBuf::from))
+                .unwrap_or(base.daemon_socket),
+            daemon_timeout_ms: s
+                .get("daemon_timeout_ms")
+                .and_then(|val| val.as_integer())
+                .and_then(|val| u64::try_from(val).ok())
+                .unwrap_or(base.daemon_timeout_ms),
+            gossip_bind: s
+                .get("gossip_bind")
+                .and_then(|val| val.as_str().map(String::from))
+                .or(base.gossip_bind),
+            gossip_peers: s
+                .get("gossip_peers")
+                .and_then(|val| val.as_array())
+                .map(|peers| {
+                    peers
+                        .iter()
+                        .filter_map(|peer| peer.as_str().map(String::from))
+                        .collect()
+                })
+                .unwrap_or(base.gossip_peers),
+            gossip_key_file: s
+                .get("gossip_key_file")
+                .and_then(|val| val.as_str().map(PathBuf::from))
+                .unwrap_or(base.gossip_key_file),
+            rhost_tracking: s
+                .get("rhost_tracking")
+                .and_then(|val| val.as_bool())
+                .unwrap_or(base.rhost_tracking),
+            rhost_free_tries: s
+                .get("rhost_free_tries")
+                .and_then(|val| val.as_integer())
+                .map(|val| val as i32)
+                .unwrap_or(base.rhost_free_tries),
+            rhost_window_seconds: s
+                .get("rhost_window_seconds")
+                .and_then(|val| val.as_integer())
+                .and_then(|val| u64::try_from(val).ok())
+                .filter(|val| *val > 0)
+                .unwrap_or(base.rhost_window_seconds),
+            rhost_sketch_width: s
+                .get("rhost_sketch_width")
+                .and_then(|val| val.as_integer())
+                .and_then(|val| u32::try_from(val).ok())
+                .unwrap_or(base.rhost_sketch_width),
+            tally_ttl: s
+                .get("tally_ttl")
+                .and_then(|val| val.as_integer())
+                .and_then(|val| u64::try_from(val).ok())
+                .unwrap_or(base.tally_ttl),
+            metrics: s
+                .get("metrics")
+                .and_then(|val| val.as_bool())
+                .unwrap_or(base.metrics),
+            metrics_name: s
+                .get("metrics_name")
+                .and_then(|val| val.as_str().map(String::from))
+                .unwrap_or(base.metrics_name),
+            log_mode: s
+                .get("log_mode")
+                .and_then(|val| val.as_str())
+                .and_then(|val| val.parse().ok())
+                .unwrap_or(base.log_mode),
+            log_storm_window: s
+                .get("log_storm_window")
+                .and_then(|val| val.as_integer())
+                .and_then(|val| u64::try_from(val).ok())
+                .unwrap_or(base.log_storm_window),
+            ..base
+        };
+
+        settings.compile_delay_table();
         settings
-            .map(|s| Settings {
-                tally_dir: s
-                    .get("tally_dir")
-                    .and_then(|val| val.as_str().map(PathBuf::from))
-                    .unwrap_or_else(|| Settings::default().tally_dir),
-                free_tries: s
-                    .get("free_tries")
-                    .and_then(|val| val.as_integer())
-                    .map(|val| val as i32)
-                    .unwrap_or_else(|| Settings::default().free_tries),
-                base_delay_seconds: s
-                    .get("base_delay_seconds")
-                    .and_then(|val| val.as_integer())
-                    .map(|val| val as i32)
-                    .unwrap_or_else(|| Settings::default().base_delay_seconds),
-                ramp_multiplier: s
-                    .get("ramp_multiplier")
-                    .and_then(|val| val.as_float())
-                    .map(|val| val as i32)
-                    .unwrap_or_else(|| Settings::default().ramp_multiplier),
-                even_deny_root: s
-                    .get("even_deny_root")
-                    .and_then(|val| val.as_bool())
-                    .unwrap_or_else(|| Settings::default().even_deny_root),
-                ..Settings::default()
-            })
-            .unwrap_or_default()
+    }
+
+    /// Compiles the delay curve into the delay table. Has to be called whenever the delay
+    /// settings are changed.
+    pub fn compile_delay_table(&mut self) {
+        self.delay_table = DelayTable::compile(
+            &self.delay_curve,
+            self.base_delay_seconds,
+            self.ramp_multiplier,
+        );
     }
 }
 
@@ -221,11 +846,49 @@ mod tests {
         let default_settings = Settings::default();
         assert_eq!(default_settings.tally_dir, PathBuf::from(DEFAULT_TALLY_DIR));
         assert_eq!(default_settings.action, Some(Actions::AUTHSUCC));
-        assert!(default_settings.user.is_none());
         assert_eq!(default_settings.free_tries, 6);
         assert_eq!(default_settings.base_delay_seconds, 30);
-        assert_eq!(default_settings.ramp_multiplier, 50);
+        assert_eq!(default_settings.ramp_multiplier, 50.0);
+        assert_eq!(default_settings.delay_curve, DelayCurve::NLogN);
         assert_eq!(default_settings.even_deny_root, false);
+        assert_eq!(default_settings.sysinfo_process_name, false);
+        assert_eq!(default_settings.tally_format, TallyFormat::Toml);
+        assert_eq!(default_settings.durability, Durability::None);
+        assert_eq!(default_settings.group_commit_ms, 10);
+        assert_eq!(default_settings.tally_backend, TallyBackend::File);
+        assert_eq!(default_settings.tally_db_slots, 262144);
+        assert_eq!(default_settings.fail_fast, false);
+        assert_eq!(
+            default_settings.countdown_refresh,
+            CountdownRefresh::Interval(1)
+        );
+        assert_eq!(default_settings.tally_filter, true);
+        assert_eq!(default_settings.bounce_max_sessions, 0);
+        assert_eq!(default_settings.bounce_shed_failures, 0);
+        assert_eq!(default_settings.bounce_shed_window_seconds, 60);
+        assert_eq!(default_settings.tally_cache, false);
+        assert_eq!(default_settings.tally_cache_name, DEFAULT_TALLY_CACHE_NAME);
+        assert_eq!(default_settings.tally_cache_slots, 65536);
+        assert_eq!(
+            default_settings.daemon_socket,
+            PathBuf::from(DEFAULT_DAEMON_SOCKET)
+        );
+        assert_eq!(default_settings.daemon_timeout_ms, 100);
+        assert_eq!(default_settings.gossip_bind, None);
+        assert!(default_settings.gossip_peers.is_empty());
+        assert_eq!(
+            default_settings.gossip_key_file,
+            PathBuf::from(DEFAULT_GOSSIP_KEY_FILE)
+        );
+        assert_eq!(default_settings.rhost_tracking, false);
+        assert_eq!(default_settings.rhost_free_tries, 30);
+        assert_eq!(default_settings.rhost_window_seconds, 3600);
+        assert_eq!(default_settings.rhost_sketch_width, 8192);
+        assert_eq!(default_settings.tally_ttl, 0);
+        assert_eq!(default_settings.metrics, false);
+        assert_eq!(default_settings.metrics_name, DEFAULT_METRICS_NAME);
+        assert_eq!(default_settings.log_mode, LogMode::Sync);
+        assert_eq!(default_settings.log_storm_window, 0);
     }
 
     #[test]
@@ -241,6 +904,34 @@ mod tests {
         base_delay_seconds = 15
         ramp_multiplier = 20.0
         even_deny_root = true
+        sysinfo_process_name = true
+        tally_format = "binary"
+        durability = "group-commit"
+        group_commit_ms = 5
+        tally_backend = "mmap"
+        tally_db_slots = 1024
+        fail_fast = true
+        countdown_refresh = "exponential"
+        tally_filter = false
+        bounce_max_sessions = 100000
+        bounce_shed_failures = 500
+        bounce_shed_window_seconds = 30
+        tally_cache = true
+        tally_cache_slots = 128
+        daemon_socket = "/tmp/authrampd.sock"
+        daemon_timeout_ms = 250
+        gossip_bind = "0.0.0.0:7946"
+        gossip_peers = ["10.0.0.2:7946", "10.0.0.3:7946"]
+        gossip_key_file = "/tmp/gossip.key"
+        rhost_tracking = true
+        rhost_free_tries = 100
+        rhost_window_seconds = 600
+        rhost_sketch_width = 1024
+        tally_ttl = 86400
+        metrics = true
+        metrics_name = "/authramp-test-metrics"
+        log_mode = "async"
+        log_storm_window = 60
     "#;
         std::fs::write(&conf_file_path, toml_content).unwrap();
 
@@ -255,6 +946,7 @@ mod tests {
             flags,
             Some(conf_file_path.clone()),
             "test",
+            None,
         );
 
         // Validate the result
@@ -262,12 +954,40 @@ mod tests {
         let settings = result.unwrap();
         assert_eq!(settings.action, Some(Actions::PREAUTH));
         assert_eq!(settings.tally_dir, PathBuf::from("/tmp/tally_dir"));
-        assert!(settings.user.is_some());
-        assert_eq!(settings.user.unwrap().name(), "test_user");
+        assert_eq!(settings.user.name(), "test_user");
+        assert_eq!(settings.pam_hook, "test");
         assert_eq!(settings.free_tries, 10);
         assert_eq!(settings.base_delay_seconds, 15);
-        assert_eq!(settings.ramp_multiplier, 20);
+        assert_eq!(settings.ramp_multiplier, 20.0);
         assert_eq!(settings.even_deny_root, true);
+        assert_eq!(settings.sysinfo_process_name, true);
+        assert_eq!(settings.tally_format, TallyFormat::Binary);
+        assert_eq!(settings.durability, Durability::GroupCommit);
+        assert_eq!(settings.group_commit_ms, 5);
+        assert_eq!(settings.tally_backend, TallyBackend::Mmap);
+        assert_eq!(settings.tally_db_slots, 1024);
+        assert_eq!(settings.fail_fast, true);
+        assert_eq!(settings.countdown_refresh, CountdownRefresh::Exponential);
+        assert_eq!(settings.tally_filter, false);
+        assert_eq!(settings.bounce_max_sessions, 4096);
+        assert_eq!(settings.bounce_shed_failures, 500);
+        assert_eq!(settings.bounce_shed_window_seconds, 30);
+        assert_eq!(settings.tally_cache, true);
+        assert_eq!(settings.tally_cache_slots, 128);
+        assert_eq!(settings.daemon_socket, PathBuf::from("/tmp/authrampd.sock"));
+        assert_eq!(settings.daemon_timeout_ms, 250);
+        assert_eq!(settings.gossip_bind.as_deref(), Some("0.0.0.0:7946"));
+        assert_eq!(settings.gossip_peers, ["10.0.0.2:7946", "10.0.0.3:7946"]);
+        assert_eq!(settings.gossip_key_file, PathBuf::from("/tmp/gossip.key"));
+        assert_eq!(settings.rhost_tracking, true);
+        assert_eq!(settings.rhost_free_tries, 100);
+        assert_eq!(settings.rhost_window_seconds, 600);
+        assert_eq!(settings.rhost_sketch_width, 1024);
+        assert_eq!(settings.tally_ttl, 86400);
+        assert_eq!(settings.metrics, true);
+        assert_eq!(settings.metrics_name, "/authramp-test-metrics");
+        assert_eq!(settings.log_mode, LogMode::Async);
+        assert_eq!(settings.log_storm_window, 60);
     }
 
     #[test]
@@ -280,6 +1000,7 @@ mod tests {
             flags,
             None,
             "test",
+            None,
         );
         assert!(result.is_ok());
     }
@@ -311,6 +1032,7 @@ mod tests {
             flags,
             Some(conf_file_path.clone()),
             "test",
+            None,
         );
 
         // Validate the result
@@ -321,7 +1043,7 @@ mod tests {
         assert_eq!(settings.tally_dir, PathBuf::from(DEFAULT_TALLY_DIR));
         assert_eq!(settings.free_tries, 6);
         assert_eq!(settings.base_delay_seconds, 30);
-        assert_eq!(settings.ramp_multiplier, 50);
+        assert_eq!(settings.ramp_multiplier, 50.0);
         assert_eq!(settings.even_deny_root, false);
     }
 
@@ -329,8 +1051,191 @@ mod tests {
     fn test_build_settings_missing_user() {
         let args = [CStr::from_bytes_with_nul("preauth\0".as_bytes()).unwrap()].to_vec();
         let flags: PamFlag = 0;
-        let result = Settings::build(None, args, flags, None, "test");
+        let result = Settings::build(None, args, flags, None, "test", None);
         assert!(result.is_err());
         assert_eq!(result.unwrap_err(), PamResultCode::PAM_SYSTEM_ERR);
     }
+
+    #[test]
+    fn test_build_settings_reuses_cached_conf_file() {
+        let temp_dir = TempDir::new("test_build_settings_reuses_cached_conf_file").unwrap();
+        let conf_file_path = temp_dir.path().join("config.conf");
+
+        std::fs::write(&conf_file_path, "[Settings]\nfree_tries = 10\n").unwrap();
+
+        // Unchanged file is served from the cache
+        let first = Settings::load_cached_conf_file(&conf_file_path);
+        let second = Settings::load_cached_conf_file(&conf_file_path);
+        assert!(Arc::ptr_eq(&first, &second));
+        assert_eq!(second.free_tries, 10);
+
+        // Changed file is parsed again
+        std::fs::write(
+            &conf_file_path,
+            "[Settings]\nfree_tries = 3\nbase_delay_seconds = 5\n",
+        )
+        .unwrap();
+
+        let result = Settings::build(
+            Some(User::new(9999, "test_user", 9999)),
+            vec![],
+            0,
+            Some(conf_file_path.clone()),
+            "test",
+            None,
+        );
+        let settings = result.unwrap();
+        assert_eq!(settings.free_tries, 3);
+        assert_eq!(settings.base_delay_seconds, 5);
+
+        // Removed file falls back to the default values
+        std::fs::remove_file(&conf_file_path).unwrap();
+        let settings = Settings::load_cached_conf_file(&conf_file_path);
+        assert_eq!(settings.free_tries, Settings::default().free_tries);
+    }
+
+    #[test]
+    fn test_build_settings_shares_the_cached_snapshot() {
+        let temp_dir = TempDir::new("test_build_settings_shares_the_cached_snapshot").unwrap();
+        let conf_file_path = temp_dir.path().join("config.conf");
+        std::fs::write(&conf_file_path, "[Settings]\nfree_tries = 10\n").unwrap();
+
+        let build = |name: &str| {
+            Settings::build(
+                Some(User::new(9999, name, 9999)),
+                vec![],
+                0,
+                Some(conf_file_path.clone()),
+                "test",
+                None,
+            )
+            .unwrap()
+        };
+
+        // Calls of different users share the snapshot of the PAM line
+        let first = build("test_user_a");
+        let second = build("test_user_b");
+        assert!(std::ptr::eq::<Settings>(&*first, &*second));
+        assert_eq!(first.user.name(), "test_user_a");
+        assert_eq!(second.user.name(), "test_user_b");
+        assert_eq!(second.free_tries, 10);
+    }
+
+    #[test]
+    fn test_build_settings_with_service_overlay_and_args() {
+        let temp_dir = TempDir::new("test_build_settings_with_service_overlay").unwrap();
+        let conf_file_path = temp_dir.path().join("config.conf");
+
+        std::fs::write(
+            &conf_file_path,
+            "[Settings]\nfree_tries = 10\nbase_delay_seconds = 15\n\n[Service.sshd]\nfree_tries = 3\nfail_fast = true\n",
+        )
+        .unwrap();
+
+        let build = |args: Vec<&CStr>, service: Option<&str>| {
+            Settings::build(
+                Some(User::new(9999, "test_user", 9999)),
+                args,
+                0,
+                Some(conf_file_path.clone()),
+                "test",
+                service,
+            )
+            .unwrap()
+        };
+
+        // Other services use the [Settings] section
+        let settings = build(vec![], Some("sudo"));
+        assert_eq!(settings.free_tries, 10);
+        assert_eq!(settings.service.as_deref(), Some("sudo"));
+
+        // The service section overlays the [Settings] section
+        let settings = build(vec![], Some("sshd"));
+        assert_eq!((settings.free_tries, settings.base_delay_seconds), (3, 15));
+        assert_eq!(settings.fail_fast, true);
+
+        // Module arguments overlay the service section and recompile the delay table
+        let args = [
+            CStr::from_bytes_with_nul(b"authfail\0").unwrap(),
+            CStr::from_bytes_with_nul(b"base_delay_seconds=5\0").unwrap(),
+            CStr::from_bytes_with_nul(b"tally_backend=mmap\0").unwrap(),
+        ];
+        let settings = build(args.to_vec(), Some("sshd"));
+        assert_eq!(settings.action, Some(Actions::AUTHFAIL));
+        assert_eq!((settings.free_tries, settings.base_delay_seconds), (3, 5));
+        assert_eq!(settings.tally_backend, TallyBackend::Mmap);
+        assert_eq!(settings.delay_table.get(1), chrono::Duration::seconds(5));
+
+        // The resolved overlay is cached until the file changes
+        let first = Settings::load_cached_overlay(&conf_file_path, Some("sshd"), &args);
+        let second = Settings::load_cached_overlay(&conf_file_path, Some("sshd"), &args);
+        assert!(Arc::ptr_eq(&first, &second));
+
+        std::fs::write(&conf_file_path, "[Service.sshd]\nfree_tries = 4\n").unwrap();
+        let settings = build(vec![], Some("sshd"));
+        assert_eq!(settings.free_tries, 4);
+    }
+
+    #[test]
+    fn test_delay_curve_is_compiled_on_load() {
+        let temp_dir = TempDir::new("test_delay_curve_is_compiled_on_load").unwrap();
+        let conf_file_path = temp_dir.path().join("config.conf");
+
+        // An integer ramp_multiplier is not ignored
+        std::fs::write(
+            &conf_file_path,
+            "[Settings]\nbase_delay_seconds = 10\nramp_multiplier = 2\ndelay_curve = \"exponential\"\n",
+        )
+        .unwrap();
+        let (settings, _) = Settings::load_conf_file(&conf_file_path);
+        assert_eq!(settings.ramp_multiplier, 2.0);
+        assert_eq!(settings.delay_curve, DelayCurve::Exponential);
+        assert_eq!(settings.delay_table.get(3), chrono::Duration::seconds(40));
+
+        std::fs::write(
+            &conf_file_path,
+            "[Settings]\ndelay_curve = \"stepped\"\ndelay_steps = [5, 60, 600]\n",
+        )
+        .unwrap();
+        let (settings, _) = Settings::load_conf_file(&conf_file_path);
+        assert_eq!(settings.delay_curve, DelayCurve::Stepped(vec![5, 60, 600]));
+        assert_eq!(settings.delay_table.get(2), chrono::Duration::seconds(60));
+        assert_eq!(settings.delay_table.get(20), chrono::Duration::seconds(600));
+    }
+
+    #[test]
+    fn test_countdown_refresh_policies() {
+        use std::time::Duration;
+
+        assert_eq!(CountdownRefresh::Start.next_refresh(1), None);
+
+        assert_eq!(
+            CountdownRefresh::Interval(10).next_refresh(1),
+            Some(Duration::from_secs(10))
+        );
+
+        let exponential: Vec<_> = (1..5)
+            .map(|sent| CountdownRefresh::Exponential.next_refresh(sent).unwrap())
+            .collect();
+        assert_eq!(exponential, [1, 2, 4, 8].map(Duration::from_secs).to_vec());
+        assert_eq!(
+            CountdownRefresh::Exponential.next_refresh(100),
+            Some(Duration::from_secs(MAX_COUNTDOWN_REFRESH_SECONDS))
+        );
+
+        let parse = |s: &str| {
+            let table: toml::value::Table = toml::from_str(s).unwrap();
+            CountdownRefresh::from_value(&table["countdown_refresh"])
+        };
+        assert_eq!(
+            parse("countdown_refresh = \"start\""),
+            Some(CountdownRefresh::Start)
+        );
+        assert_eq!(
+            parse("countdown_refresh = 30"),
+            Some(CountdownRefresh::Interval(30))
+        );
+        assert_eq!(parse("countdown_refresh = 0"), None);
+        assert_eq!(parse("countdown_refresh = \"never\""), None);
+    }
 }
@@ -0,0 +1,632 @@
+//! # Simulate Module
+//!
+//! The `simulate` module replays authentication logs against candidate policies offline, to
+//! choose `free_tries`, `base_delay_seconds`, `ramp_multiplier` and the delay curve from real
+//! attack traces instead of guessing. The replay runs the `Tally` state machine and its delays
+//! with the recorded instants as the clock and keeps the tallies in memory, so millions of
+//! events replay in seconds without root or a PAM stack.
+//!
+//! ## Traces
+//!
+//! The `Failed` and `Accepted` lines of sshd are read from `auth.log`/`secure` files or
+//! `journalctl -o short-iso` exports. rsyslog's `message repeated N times` lines count `N`
+//! times. Failed `publickey` attempts do not pass PAM and are skipped. Timestamps without a
+//! year are read as UTC in the given year, moving to the next year when they wrap around.
+//!
+//! A user and remote host pair that succeeded at least once in the trace is legitimate, all
+//! other attempts are attacker attempts. Attempts on invalid users keep no tally.
+//!
+//! ## Model
+//!
+//! Attempts arrive at their recorded instants. An attempt on a locked account waits for the
+//! unlock and then runs with its recorded outcome, unless the unlock is further away than the
+//! login grace time of the server, which drops it. With `fail_fast` it is rejected right away.
+//! A failure that locks the account also holds its session until the unlock, like the
+//! `authfail` hook. Attackers do not adapt to the policy: their later attempts keep their
+//! recorded instants. Remote host tracking and the admission control are not replayed.
+//!
+//! For every policy the replay reports the attacker attempts that reached the password check,
+//! the delay and rejections of legitimate users, and the peak of concurrently waiting sessions.
+//!
+//! ## License
+//!
+//! pam-authramp
+//! Copyright (C) 2023 github.com/34N0
+//!
+//! This program is free software: you can redistribute it and/or modify
+//! it under the terms of the GNU General Public License as published by
+//! the Free Software Foundation, either version 3 of the License, or
+//! (at your option) any later version.
+//!
+//! This program is distributed in the hope that it will be useful,
+//! but WITHOUT ANY WARRANTY; without even the implied warranty of
+//! MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//! GNU General Public License for more details.
+//!
+//! You should have received a copy of the GNU General Public License
+//! along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+use std::cmp::{min, Reverse};
+use std::collections::{BinaryHeap, HashMap, HashSet};
+use std::io::{self, BufRead};
+use std::panic;
+use std::thread;
+
+use chrono::{DateTime, Duration, NaiveDateTime, Utc};
+
+use crate::settings::Settings;
+use crate::tally::Tally;
+use crate::Actions;
+
+/// Outcome of an authentication attempt.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum Outcome {
+    Failure,
+    Success,
+}
+
+/// An sshd authentication log line.
+#[derive(Debug, PartialEq)]
+pub struct LogRecord<'a> {
+    /// The instant of the attempt.
+    pub instant: DateTime<Utc>,
+    /// The user name.
+    pub user: &'a str,
+    /// The remote host.
+    pub rhost: &'a str,
+    pub outcome: Outcome,
+    /// The user does not exist on the host.
+    pub unknown_user: bool,
+    /// Number of attempts of the line, more than 1 for repeated messages.
+    pub repeated: u32,
+    /// The timestamp had no year.
+    pub without_year: bool,
+}
+
+/// An authentication attempt of a trace.
+#[derive(Debug, Clone, PartialEq)]
+pub struct AuthEvent {
+    /// The instant the attempt started.
+    pub instant: DateTime<Utc>,
+    /// Index of the user in `Trace::users`.
+    pub user: u32,
+    pub outcome: Outcome,
+    /// The user does not exist on the host, no tally is kept.
+    pub unknown_user: bool,
+    /// The user succeeded from the remote host at least once in the trace.
+    pub legitimate: bool,
+}
+
+/// Authentication attempts sorted by instant.
+#[derive(Debug, Default)]
+pub struct Trace {
+    /// The user names.
+    pub users: Vec<String>,
+    pub events: Vec<AuthEvent>,
+}
+
+/// Builds a `Trace` from log lines.
+#[derive(Debug, Default)]
+pub struct TraceBuilder {
+    year: i32,
+    last_without_year: Option<DateTime<Utc>>,
+    users: HashMap<String, u32>,
+    rhosts: HashMap<String, u32>,
+    names: Vec<String>,
+    events: Vec<(AuthEvent, u32)>,
+}
+
+impl TraceBuilder {
+    /// Creates a builder reading timestamps without a year in `year`.
+    pub fn new(year: i32) -> Self {
+        TraceBuilder {
+            year,
+            ..Default::default()
+        }
+    }
+
+    /// Interns a name, returning its index.
+    fn intern(map: &mut HashMap<String, u32>, name: &str) -> u32 {
+        match map.get(name) {
+            Some(&index) => index,
+            None => {
+                let index = map.len() as u32;
+                map.insert(name.to_string(), index);
+                index
+            }
+        }
+    }
+
+    /// Adds the attempts of a log line.
+    ///
+    /// # Arguments
+    /// - `line`: The log line
+    ///
+    /// # Returns
+    /// Whether the line was an sshd authentication line.
+    pub fn push_line(&mut self, line: &str) -> bool {
+        let Some(mut record) = parse_line(line, self.year) else {
+            return false;
+        };
+
+        // Syslog timestamps have no year, a jump back into the past starts the next year
+        if record.without_year {
+            if let Some(last) = self.last_without_year {
+                if record.instant < last - Duration::days(30) {
+                    self.year += 1;
+                    match parse_line(line, self.year) {
+                        Some(next) => record = next,
+                        None => return false,
+                    }
+                }
+            }
+            self.last_without_year = Some(record.instant);
+        }
+
+        let user = Self::intern(&mut self.users, record.user);
+        if user as usize == self.names.len() {
+            self.names.push(record.user.to_string());
+        }
+        let rhost = Self::intern(&mut self.rhosts, record.rhost);
+
+        for _ in 0..record.repeated {
+            self.events.push((
+                AuthEvent {
+                    instant: record.instant,
+                    user,
+                    outcome: record.outcome,
+                    unknown_user: record.unknown_user,
+                    legitimate: false,
+                },
+                rhost,
+            ));
+        }
+        true
+    }
+
+    /// Adds the attempts of all lines of `reader`. Lines that are not valid UTF-8 are read
+    /// lossily.
+    ///
+    /// # Arguments
+    /// - `reader`: The log
+    ///
+    /// # Returns
+    /// The number of sshd authentication lines, or the error that occurred while reading.
+    pub fn read<R: BufRead>(&mut self, mut reader: R) -> io::Result<usize> {
+        let mut line = Vec::with_capacity(256);
+        let mut parsed = 0;
+        loop {
+            line.clear();
+            if reader.read_until(b'\n', &mut line)? == 0 {
+                return Ok(parsed);
+            }
+            if self.push_line(String::from_utf8_lossy(&line).trim_end()) {
+                parsed += 1;
+            }
+        }
+    }
+
+    /// Sorts the attempts by instant and marks the legitimate ones.
+    pub fn finish(mut self) -> Trace {
+        // The sort is stable, so attempts of the same instant keep the order of the logs
+        self.events.sort_by_key(|(event, _)| event.instant);
+
+        let legitimate: HashSet<(u32, u32)> = self
+            .events
+            .iter()
+            .filter(|(event, _)| event.outcome == Outcome::Success)
+            .map(|(event, rhost)| (event.user, *rhost))
+            .collect();
+
+        Trace {
+            users: self.names,
+            events: self
+                .events
+                .into_iter()
+                .map(|(mut event, rhost)| {
+                    event.legitimate = legitimate.contains(&(event.user, rhost));
+                    event
+                })
+                .collect(),
+        }
+    }
+}
+
+/// Splits the first whitespace separated token off `s`.
+fn split_token(s: &str) -> Option<(&str, &str)> {
+    let s = s.trim_start();
+    match s.split_once(char::is_whitespace) {
+        Some((token, rest)) => Some((token, rest)),
+        None if !s.is_empty() => Some((s, "")),
+        None => None,
+    }
+}
+
+/// Parses the timestamp at the start of a log line.
+///
+/// # Returns
+/// The instant, the rest of the line and whether the timestamp had no year.
+fn parse_timestamp(line: &str, year: i32) -> Option<(DateTime<Utc>, &str, bool)> {
+    let (first, rest) = split_token(line)?;
+
+    if first.starts_with(|c: char| c.is_ascii_digit()) {
+        let instant = DateTime::parse_from_rfc3339(first)
+            .or_else(|_| DateTime::parse_from_str(first, "%Y-%m-%dT%H:%M:%S%.f%z"))
+            .ok()?;
+        return Some((instant.with_timezone(&Utc), rest, false));
+    }
+
+    let (day, rest) = split_token(rest)?;
+    let (time, rest) = split_token(rest)?;
+    let instant = NaiveDateTime::parse_from_str(
+        &format!("{} {} {} {}", year, first, day, time),
+        "%Y %b %d %H:%M:%S",
+    )
+    .ok()?;
+    Some((instant.and_utc(), rest, true))
+}
+
+/// Parses an sshd `Failed` or `Accepted` message.
+///
+/// # Returns
+/// The outcome, whether the user is invalid, the user and the remote host.
+fn parse_message(message: &str) -> Option<(Outcome, bool, &str, &str)> {
+    let (outcome, rest) = match (
+        message.strip_prefix("Failed "),
+        message.strip_prefix("Accepted "),
+    ) {
+        (Some(rest), _) => (Outcome::Failure, rest),
+        (_, Some(rest)) => (Outcome::Success, rest),
+        _ => return None,
+    };
+
+    let (method, rest) = rest.split_once(" for ")?;
+    // Only these failures pass the PAM stack
+    if outcome == Outcome::Failure && !matches!(method, "password" | "keyboard-interactive/pam") {
+        return None;
+    }
+
+    // "from" may be part of an invalid user name, the remote host follows the last one
+    let (who, from) = rest.rsplit_once(" from ")?;
+    let (unknown_user, user) = match who.strip_prefix("invalid user ") {
+        Some(user) => (true, user),
+        None => (false, who),
+    };
+    let rhost = from.split(' ').next().filter(|rhost| !rhost.is_empty())?;
+
+    Some((outcome, unknown_user, user, rhost))
+}
+
+/// Parses an sshd authentication log line.
+///
+/// # Arguments
+/// - `line`: The log line, in the syslog or the ISO 8601 timestamp format
+/// - `year`: The year of timestamps without a year
+///
+/// # Returns
+/// The record, `None` if the line is not an sshd authentication line.
+pub fn parse_line(line: &str, year: i32) -> Option<LogRecord<'_>> {
+    let (instant, rest, without_year) = parse_timestamp(line, year)?;
+    let (_host, rest) = split_token(rest)?;
+    let (program, message) = split_token(rest)?;
+    if !program.starts_with("sshd") {
+        return None;
+    }
+    let message = message.trim_start();
+
+    let (repeated, message) = match message.strip_prefix("message repeated ") {
+        Some(rest) => {
+            let (count, inner) = rest.split_once(" times: [")?;
+            let inner = inner.trim_start();
+            (
+                count.parse().ok()?,
+                inner.strip_suffix(']').unwrap_or(inner),
+            )
+        }
+        None => (1, message),
+    };
+
+    let (outcome, unknown_user, user, rhost) = parse_message(message)?;
+    Some(LogRecord {
+        instant,
+        user,
+        rhost,
+        outcome,
+        unknown_user,
+        repeated,
+        without_year,
+    })
+}
+
+/// Result of replaying a trace with a policy.
+#[derive(Debug, Default, Clone, PartialEq)]
+pub struct SimReport {
+    /// Attempts of users that never succeeded from the remote host.
+    pub attacker_attempts: u64,
+    /// Attacker attempts that reached the password check.
+    pub attacker_allowed: u64,
+    /// Attempts on invalid users, which keep no tally.
+    pub unknown_user_attempts: u64,
+    /// Attempts of users that succeeded from the remote host.
+    pub legitimate_attempts: u64,
+    /// Legitimate attempts that waited for an unlock.
+    pub legitimate_delayed: u64,
+    /// Legitimate attempts rejected with `fail_fast` or dropped after the login grace time.
+    pub legitimate_rejected: u64,
+    /// Total wait of the legitimate attempts.
+    pub legitimate_delay: Duration,
+    /// Longest wait of a legitimate attempt.
+    pub legitimate_max_delay: Duration,
+    /// Most sessions waiting for an unlock at the same time.
+    pub peak_blocked: usize,
+}
+
+/// Returns until when the tally locks the account at `now`, `None` if it does not.
+fn locked_until(tally: &Tally, settings: &Settings, now: DateTime<Utc>) -> Option<DateTime<Utc>> {
+    (tally.failures_count > settings.free_tries)
+        .then(|| {
+            tally
+                .unlock_instant
+                .unwrap_or(tally.failure_instant + tally.get_delay(settings))
+        })
+        .filter(|unlock| *unlock > now)
+}
+
+/// Returns the most intervals that overlap at one instant.
+fn peak_concurrency(intervals: &[(DateTime<Utc>, DateTime<Utc>)]) -> usize {
+    let mut points: Vec<(DateTime<Utc>, i32)> = intervals
+        .iter()
+        .flat_map(|&(start, end)| [(start, 1), (end, -1)])
+        .collect();
+    // An interval that ends at an instant is closed before one that starts at it
+    points.sort_unstable();
+
+    let mut current = 0i64;
+    let mut peak = 0i64;
+    for (_, delta) in points {
+        current += delta as i64;
+        peak = peak.max(current);
+    }
+    peak as usize
+}
+
+/// Replays a trace with a policy.
+///
+/// # Arguments
+/// - `trace`: The authentication attempts
+/// - `settings`: The policy
+/// - `login_grace`: Time after which the server drops a waiting session, e.g.
+///   `LoginGraceTime` of sshd
+///
+/// # Returns
+/// The report of the replay
+pub fn simulate(trace: &Trace, settings: &Settings, login_grace: Duration) -> SimReport {
+    let mut report = SimReport::default();
+    let mut tallies = vec![Tally::default(); trace.users.len()];
+    let mut blocked = Vec::new();
+    let mut waiting: BinaryHeap<Reverse<(DateTime<Utc>, usize)>> = BinaryHeap::new();
+    let mut next = 0;
+
+    loop {
+        // Waiting attempts run before attempts that arrive at their unlock
+        let (now, index, arrived) = match (trace.events.get(next), waiting.peek()) {
+            (Some(event), Some(&Reverse((unlock, index)))) if unlock <= event.instant => {
+                waiting.pop();
+                (unlock, index, false)
+            }
+            (Some(event), _) => {
+                next += 1;
+                (event.instant, next - 1, true)
+            }
+            (None, Some(&Reverse((unlock, index)))) => {
+                waiting.pop();
+                (unlock, index, false)
+            }
+            (None, None) => break,
+        };
+        let event = &trace.events[index];
+
+        if arrived {
+            match (event.unknown_user, event.legitimate) {
+                (true, _) => report.unknown_user_attempts += 1,
+                (false, true) => report.legitimate_attempts += 1,
+                (false, false) => report.attacker_attempts += 1,
+            }
+        }
+        if event.unknown_user {
+            continue;
+        }
+
+        let tally = &mut tallies[event.user as usize];
+        tally.expire_at(settings, now);
+
+        if let Some(unlock) = locked_until(tally, settings, now) {
+            if settings.fail_fast || unlock - event.instant > login_grace {
+                if !settings.fail_fast {
+                    blocked.push((event.instant, event.instant + login_grace));
+                }
+                if event.legitimate {
+                    report.legitimate_rejected += 1;
+                }
+            } else {
+                waiting.push(Reverse((unlock, index)));
+            }
+            continue;
+        }
+
+        let wait = now - event.instant;
+        if wait > Duration::zero() {
+            blocked.push((event.instant, now));
+            if event.legitimate {
+                report.legitimate_delayed += 1;
+                report.legitimate_delay = report.legitimate_delay + wait;
+                report.legitimate_max_delay = report.legitimate_max_delay.max(wait);
+            }
+        }
+
+        match event.outcome {
+            Outcome::Success => {
+                tally.apply_action_at(Actions::AUTHSUCC, settings, now);
+            }
+            Outcome::Failure => {
+                if !event.legitimate {
+                    report.attacker_allowed += 1;
+                }
+                tally.apply_action_at(Actions::AUTHFAIL, settings, now);
+
+                // The authfail hook holds the failed session until the unlock as well
+                if !settings.fail_fast {
+                    if let Some(unlock) = locked_until(tally, settings, now) {
+                        blocked.push((now, min(unlock, now + login_grace)));
+                    }
+                }
+            }
+        }
+    }
+
+    report.peak_blocked = peak_concurrency(&blocked);
+    report
+}
+
+/// Replays a trace with every policy, in parallel. A panic of a replay is propagated.
+///
+/// # Arguments
+/// - `trace`: The authentication attempts
+/// - `policies`: The policies
+/// - `login_grace`: Time after which the server drops a waiting session
+///
+/// # Returns
+/// The reports in the order of the policies
+pub fn simulate_policies(
+    trace: &Trace,
+    policies: &[Settings],
+    login_grace: Duration,
+) -> Vec<SimReport> {
+    thread::scope(|scope| {
+        let replays: Vec<_> = policies
+            .iter()
+            .map(|settings| scope.spawn(move || simulate(trace, settings, login_grace)))
+            .collect();
+        replays
+            .into_iter()
+            .map(|replay| replay.join().unwrap_or_else(|e| panic::resume_unwind(e)))
+            .collect()
+    })
+}
+
+// Unit Tests
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_parse_sshd_lines() {
+        let record = parse_line(
+            "Dec 25 01:48:03 fedora sshd[1234]: Failed password for root from 10.0.0.1 port 22 ssh2",
+            2023,
+        )
+        .unwrap();
+        assert_eq!(record.instant.to_rfc3339(), "2023-12-25T01:48:03+00:00");
+        assert_eq!((record.user, record.rhost), ("root", "10.0.0.1"));
+        assert_eq!(record.outcome, Outcome::Failure);
+        assert!(!record.unknown_user && record.without_year);
+
+        let record = parse_line(
+            "2023-12-25T01:48:03+0100 fedora sshd[1234]: Failed password for invalid user admin from 10.0.0.1 port 22 ssh2",
+            2000,
+        )
+        .unwrap();
+        assert_eq!(record.instant.to_rfc3339(), "2023-12-25T00:48:03+00:00");
+        assert!(record.unknown_user && !record.without_year);
+        assert_eq!(record.user, "admin");
+
+        let record = parse_line(
+            "2023-12-25T01:48:03.123456+00:00 fedora sshd-session[1234]: Accepted publickey for alice from 10.0.0.2 port 22 ssh2: ED25519 SHA256:x",
+            2000,
+        )
+        .unwrap();
+        assert_eq!(record.outcome, Outcome::Success);
+        assert_eq!(record.user, "alice");
+
+        let record = parse_line(
+            "Dec  5 01:48:03 fedora sshd[1234]: message repeated 3 times: [ Failed password for root from 10.0.0.1 port 22 ssh2]",
+            2023,
+        )
+        .unwrap();
+        assert_eq!(record.repeated, 3);
+
+        // Publickey failures do not pass PAM, other programs are ignored
+        assert!(parse_line(
+            "Dec 25 01:48:03 fedora sshd[1234]: Failed publickey for root from 10.0.0.1 port 22 ssh2",
+            2023
+        )
+        .is_none());
+        assert!(parse_line(
+            "Dec 25 01:48:03 fedora sudo[1234]: Failed password for root from 10.0.0.1",
+            2023
+        )
+        .is_none());
+    }
+
+    #[test]
+    fn test_trace_marks_legitimate_users_and_wraps_years() {
+        let mut builder = TraceBuilder::new(2023);
+        for line in [
+            "Dec 31 23:59:00 host sshd[1]: Failed password for alice from 10.0.0.2 port 22 ssh2",
+            "Dec 31 23:59:30 host sshd[2]: Failed password for alice from 10.0.0.1 port 22 ssh2",
+            "Jan  1 00:00:10 host sshd[3]: Accepted password for alice from 10.0.0.2 port 22 ssh2",
+            "Jan  1 00:00:20 host kernel: unrelated",
+        ] {
+            builder.push_line(line);
+        }
+        let trace = builder.finish();
+
+        assert_eq!(trace.users, vec!["alice"]);
+        assert_eq!(trace.events.len(), 3);
+        assert_eq!(
+            trace.events[2].instant.to_rfc3339(),
+            "2024-01-01T00:00:10+00:00"
+        );
+        let legitimate: Vec<bool> = trace.events.iter().map(|e| e.legitimate).collect();
+        assert_eq!(legitimate, vec![true, false, true]);
+    }
+
+    #[test]
+    fn test_stricter_policy_allows_fewer_attacker_attempts() {
+        let start: DateTime<Utc> = "2023-12-25T00:00:00Z".parse().unwrap();
+        let mut builder = TraceBuilder::new(2023);
+        // A brute force on root and a user who mistypes twice
+        for second in 0..3600 {
+            builder.push_line(&format!(
+                "{} host sshd[1]: Failed password for root from 10.0.0.1 port 22 ssh2",
+                (start + Duration::seconds(second)).to_rfc3339()
+            ));
+        }
+        for (second, outcome) in [(100, "Failed"), (110, "Failed"), (120, "Accepted")] {
+            builder.push_line(&format!(
+                "{} host sshd[2]: {} password for alice from 10.0.0.2 port 22 ssh2",
+                (start + Duration::seconds(second)).to_rfc3339(),
+                outcome
+            ));
+        }
+        let trace = builder.finish();
+
+        let lenient = Settings::default();
+        let strict = Settings::default().with_args(&["free_tries=2", "base_delay_seconds=300"]);
+        let grace = Duration::seconds(120);
+        let reports = simulate_policies(&trace, &[lenient.clone(), strict], grace);
+
+        assert_eq!(reports[0].attacker_attempts, 3600);
+        assert!(reports[0].attacker_allowed < 3600);
+        assert!(reports[1].attacker_allowed < reports[0].attacker_allowed);
+        assert!(reports[0].peak_blocked > 0);
+
+        // Two typos stay within the free tries of the lenient policy
+        assert_eq!(reports[0].legitimate_attempts, 3);
+        assert_eq!(reports[0].legitimate_delayed, 0);
+        assert_eq!(reports[0].legitimate_rejected, 0);
+
+        // The replay is deterministic
+        assert_eq!(simulate(&trace, &lenient, grace), reports[0]);
+    }
+}
@@ -0,0 +1,474 @@
+//! # Admission Control
+//!
+//! Limits the sessions that wait for an unlock host-wide. Every waiting session holds a PAM
+//! process, so an attack from many sources could otherwise fill the host with sleeping sshd
+//! children. A bounced attempt is rejected right away, like with `fail_fast`, when
+//! `bounce_max_sessions` sessions already wait, or when the host saw `bounce_shed_failures`
+//! failures within `bounce_shed_window_seconds`.
+//!
+//! ## Layout
+//!
+//! The state is mapped from a file in the tally directory and shared by all processes. The file
+//! starts with a 64 byte header (magic, version, number of session slots, the current window and
+//! the failure counts of the current and the previous window) followed by the session slots.
+//!
+//! A waiting session claims a slot with its process id and releases it when it stops waiting. A
+//! process that was killed while waiting cannot release its slot, so slots of processes that no
+//! longer exist are taken over once all slots are claimed.
+//!
+//! The failure rate is estimated over a sliding window from the counts of the current and the
+//! previous window, weighting the previous one by the part of it that is still in the window.
+//!
+//! ## License
+//!
+//! pam-authramp
+//! Copyright (C) 2023 github.com/34N0
+//!
+//! This program is free software: you can redistribute it and/or modify
+//! it under the terms of the GNU General Public License as published by
+//! the Free Software Foundation, either version 3 of the License, or
+//! (at your option) any later version.
+//!
+//! This program is distributed in the hope that it will be useful,
+//! but WITHOUT ANY WARRANTY; without even the implied warranty of
+//! MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//! GNU General Public License for more details.
+//!
+//! You should have received a copy of the GNU General Public License
+//! along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+use std::collections::HashMap;
+use std::fs::{self, File, OpenOptions};
+use std::io;
+use std::os::unix::fs::{FileExt, MetadataExt, OpenOptionsExt};
+use std::path::{Path, PathBuf};
+use std::ptr::NonNull;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, RwLock};
+
+use chrono::Utc;
+use once_cell::sync::Lazy;
+
+use super::shared::{map_shared, FileLock};
+use crate::settings::Settings;
+use crate::syslog_error;
+
+/// Name of the admission file inside the tally directory.
+pub const ADMISSION_FILE: &str = "authramp-admission.db";
+
+/// Number of session slots, the upper bound of `bounce_max_sessions`.
+pub const SESSION_SLOTS: u32 = 4096;
+const MAGIC: [u8; 8] = *b"ARTLADM\x01";
+const VERSION: u32 = 1;
+const HEADER_SIZE: usize = 64;
+const EPOCH_OFFSET: usize = 16;
+const FAILURES_OFFSET: usize = 24;
+const GENERATIONS: usize = 2;
+const WORD_SIZE: usize = 8;
+
+/// Process-wide cache of mapped admission tables, keyed by path.
+static ADMISSION_TABLES: Lazy<RwLock<HashMap<PathBuf, Arc<AdmissionTable>>>> =
+    Lazy::new(|| RwLock::new(HashMap::new()));
+
+/// Why a bounced attempt is rejected instead of waiting.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum ShedReason {
+    /// `bounce_max_sessions` sessions wait already.
+    Sessions,
+    /// The host-wide failures reached `bounce_shed_failures`.
+    FailureRate,
+}
+
+/// A claimed session slot, released when dropped.
+pub struct SessionSlot {
+    table: Arc<AdmissionTable>,
+    index: usize,
+}
+
+impl Drop for SessionSlot {
+    fn drop(&mut self) {
+        self.table.slot(self.index).store(0, Ordering::Release);
+    }
+}
+
+/// The admission state mapped from a file.
+pub struct AdmissionTable {
+    map: NonNull<u8>,
+    len: usize,
+    slots: usize,
+    dev: u64,
+    ino: u64,
+}
+
+// The mapping is only accessed through atomics.
+unsafe impl Send for AdmissionTable {}
+unsafe impl Sync for AdmissionTable {}
+
+impl AdmissionTable {
+    /// Returns the mapped table at `path` from the process-wide cache, opening it if it is not
+    /// mapped yet or if the file was replaced since it was mapped.
+    ///
+    /// # Arguments
+    /// - `path`: Path of the admission file
+    ///
+    /// # Returns
+    /// The mapped table or the error that occurred while opening it.
+    pub fn open_cached(path: &Path) -> io::Result<Arc<AdmissionTable>> {
+        let meta = fs::metadata(path).ok();
+        let is_current = |table: &AdmissionTable| {
+            meta.as_ref()
+                .map_or(false, |m| m.dev() == table.dev && m.ino() == table.ino)
+        };
+
+        if let Ok(tables) = ADMISSION_TABLES.read() {
+            if let Some(table) = tables.get(path).filter(|table| is_current(table)) {
+                return Ok(Arc::clone(table));
+            }
+        }
+
+        let table = Arc::new(Self::open(path)?);
+
+        if let Ok(mut tables) = ADMISSION_TABLES.write() {
+            tables.insert(path.to_path_buf(), Arc::clone(&table));
+        }
+
+        Ok(table)
+    }
+
+    /// Opens and maps the table at `path`, creating it if it does not exist.
+    ///
+    /// # Arguments
+    /// - `path`: Path of the admission file
+    ///
+    /// # Returns
+    /// The mapped table or the error that occurred while opening it.
+    pub fn open(path: &Path) -> io::Result<AdmissionTable> {
+        if let Some(dir) = path.parent() {
+            fs::create_dir_all(dir)?;
+        }
+
+        let file = OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create(true)
+            .mode(0o600)
+            .open(path)?;
+
+        let slots = Self::init_header(&file)?;
+        let len = Self::file_len(slots);
+
+        if file.metadata()?.len() < len as u64 {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "admission table is truncated",
+            ));
+        }
+
+        let meta = file.metadata()?;
+        Ok(AdmissionTable {
+            map: map_shared(&file, len)?,
+            len,
+            slots,
+            dev: meta.dev(),
+            ino: meta.ino(),
+        })
+    }
+
+    /// Size of an admission file with `slots` session slots.
+    fn file_len(slots: usize) -> usize {
+        HEADER_SIZE + slots * WORD_SIZE
+    }
+
+    /// Writes the header to an empty admission file and reads the number of slots from it.
+    /// Held under an exclusive `flock` so concurrent processes do not initialize the file twice.
+    fn init_header(file: &File) -> io::Result<usize> {
+        let _lock = FileLock::exclusive(file)?;
+
+        if file.metadata()?.len() == 0 {
+            let mut header = [0u8; HEADER_SIZE];
+            header[0..8].copy_from_slice(&MAGIC);
+            header[8..12].copy_from_slice(&VERSION.to_le_bytes());
+            header[12..16].copy_from_slice(&SESSION_SLOTS.to_le_bytes());
+
+            file.set_len(Self::file_len(SESSION_SLOTS as usize) as u64)?;
+            file.write_all_at(&header, 0)?;
+        }
+
+        let mut header = [0u8; HEADER_SIZE];
+        file.read_exact_at(&mut header, 0)?;
+
+        let version = u32::from_le_bytes([header[8], header[9], header[10], header[11]]);
+        let slots = u32::from_le_bytes([header[12], header[13], header[14], header[15]]);
+
+        if header[0..8] != MAGIC || version != VERSION || slots == 0 {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "invalid admission table header",
+            ));
+        }
+
+        Ok(slots as usize)
+    }
+
+    /// Returns the header word at `offset`.
+    fn header_word(&self, offset: usize) -> &AtomicU64 {
+        unsafe { &*(self.map.as_ptr().add(offset) as *const AtomicU64) }
+    }
+
+    /// Returns the failure count of a generation.
+    fn failures(&self, generation: usize) -> &AtomicU64 {
+        self.header_word(FAILURES_OFFSET + generation * WORD_SIZE)
+    }
+
+    /// Returns the session slot at `index`.
+    fn slot(&self, index: usize) -> &AtomicU64 {
+        let offset = HEADER_SIZE + index * WORD_SIZE;
+        debug_assert!(offset + WORD_SIZE <= self.len);
+        unsafe { &*(self.map.as_ptr().add(offset) as *const AtomicU64) }
+    }
+
+    /// Moves the failure counts to the window `epoch`, clearing the windows that expired.
+    ///
+    /// # Returns
+    /// The generations of the current and the previous window.
+    fn rotate(&self, epoch: u64) -> (usize, usize) {
+        let current = (epoch % GENERATIONS as u64) as usize;
+        let previous = (current + 1) % GENERATIONS;
+
+        let epoch_word = self.header_word(EPOCH_OFFSET);
+        let stored = epoch_word.load(Ordering::Acquire);
+        if stored < epoch
+            && epoch_word
+                .compare_exchange(stored, epoch, Ordering::AcqRel, Ordering::Acquire)
+                .is_ok()
+        {
+            // The process that moves the window clears the expired counts
+            self.failures(current).store(0, Ordering::Release);
+            if stored + 1 != epoch {
+                self.failures(previous).store(0, Ordering::Release);
+            }
+        }
+        (current, previous)
+    }
+
+    /// Counts a failure of the host.
+    ///
+    /// # Arguments
+    /// - `now`: The current instant in seconds since the epoch
+    /// - `window_seconds`: Length of the counting window
+    pub fn add_failure(&self, now: u64, window_seconds: u64) {
+        let window_seconds = window_seconds.max(1);
+        let (current, _) = self.rotate(now / window_seconds);
+        self.failures(current).fetch_add(1, Ordering::AcqRel);
+    }
+
+    /// Estimates the failures of the host within the last `window_seconds`.
+    ///
+    /// # Arguments
+    /// - `now`: The current instant in seconds since the epoch
+    /// - `window_seconds`: Length of the counting window
+    pub fn failure_rate(&self, now: u64, window_seconds: u64) -> u64 {
+        let window_seconds = window_seconds.max(1);
+        let (current, previous) = self.rotate(now / window_seconds);
+        let remaining = window_seconds - now % window_seconds;
+
+        self.failures(current).load(Ordering::Acquire)
+            + self.failures(previous).load(Ordering::Acquire) * remaining / window_seconds
+    }
+
+    /// Claims a session slot if fewer than `max_sessions` sessions wait.
+    ///
+    /// # Arguments
+    /// - `max_sessions`: Maximum number of waiting sessions, at most `SESSION_SLOTS`
+    ///
+    /// # Returns
+    /// The claimed slot, `None` if all slots are claimed by running processes.
+    pub fn claim(self: &Arc<Self>, max_sessions: u32) -> Option<SessionSlot> {
+        let limit = (max_sessions as usize).min(self.slots);
+        if limit == 0 {
+            return None;
+        }
+
+        let pid = std::process::id() as u64;
+        let start = pid as usize % limit;
+        let slots = || (0..limit).map(|i| (start + i) % limit);
+
+        let claimed = slots()
+            .find(|&index| {
+                self.slot(index)
+                    .compare_exchange(0, pid, Ordering::AcqRel, Ordering::Acquire)
+                    .is_ok()
+            })
+            .or_else(|| {
+                // Take over the slots of processes that were killed while waiting
+                slots().find(|&index| {
+                    let stored = self.slot(index).load(Ordering::Acquire);
+                    stored != 0
+                        && !is_running(stored)
+                        && self
+                            .slot(index)
+                            .compare_exchange(stored, pid, Ordering::AcqRel, Ordering::Acquire)
+                            .is_ok()
+                })
+            })?;
+
+        Some(SessionSlot {
+            table: Arc::clone(self),
+            index: claimed,
+        })
+    }
+}
+
+impl Drop for AdmissionTable {
+    fn drop(&mut self) {
+        unsafe {
+            libc::munmap(self.map.as_ptr() as *mut libc::c_void, self.len);
+        }
+    }
+}
+
+/// Returns true if the process `pid` exists.
+fn is_running(pid: u64) -> bool {
+    let Ok(pid) = libc::pid_t::try_from(pid) else {
+        return false;
+    };
+    let result = unsafe { libc::kill(pid, 0) };
+    result == 0 || io::Error::last_os_error().raw_os_error() == Some(libc::EPERM)
+}
+
+/// Counts a failure of the host, if the failure rate is limited.
+///
+/// # Arguments
+/// - `settings`: A reference to the `Settings` struct.
+pub fn record_failure(settings: &Settings) {
+    if settings.bounce_shed_failures == 0 {
+        return;
+    }
+
+    match AdmissionTable::open_cached(&settings.tally_dir.join(ADMISSION_FILE)) {
+        Ok(table) => table.add_failure(
+            Utc::now().timestamp().max(0) as u64,
+            settings.bounce_shed_window_seconds,
+        ),
+        Err(e) => syslog_error!("PAM_SYSTEM_ERR: Error opening admission table: {}", e),
+    }
+}
+
+/// Decides whether a bounced session may wait for its unlock.
+///
+/// If the admission table cannot be opened the session is admitted, a broken table must not
+/// lock out every user.
+///
+/// # Arguments
+/// - `settings`: A reference to the `Settings` struct.
+///
+/// # Returns
+/// The session slot to hold while waiting, `None` if sessions are not limited, or the reason
+/// to reject the attempt.
+pub fn admit(settings: &Settings) -> Result<Option<SessionSlot>, ShedReason> {
+    if settings.bounce_max_sessions == 0 && settings.bounce_shed_failures == 0 {
+        return Ok(None);
+    }
+
+    let table = match AdmissionTable::open_cached(&settings.tally_dir.join(ADMISSION_FILE)) {
+        Ok(table) => table,
+        Err(e) => {
+            syslog_error!("PAM_SYSTEM_ERR: Error opening admission table: {}", e);
+            return Ok(None);
+        }
+    };
+
+    if settings.bounce_shed_failures > 0 {
+        let now = Utc::now().timestamp().max(0) as u64;
+        if table.failure_rate(now, settings.bounce_shed_window_seconds)
+            >= settings.bounce_shed_failures
+        {
+            return Err(ShedReason::FailureRate);
+        }
+    }
+
+    match settings.bounce_max_sessions {
+        0 => Ok(None),
+        max_sessions => table
+            .claim(max_sessions)
+            .map(Some)
+            .ok_or(ShedReason::Sessions),
+    }
+}
+
+// Unit Tests
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use tempdir::TempDir;
+
+    const WINDOW: u64 = 60;
+    const NOW: u64 = 1_700_000_040;
+
+    #[test]
+    fn test_sessions_are_limited() {
+        let temp_dir = TempDir::new("test_sessions_are_limited").unwrap();
+        let table = AdmissionTable::open_cached(&temp_dir.path().join(ADMISSION_FILE)).unwrap();
+
+        let first = table.claim(2).unwrap();
+        let second = table.claim(2).unwrap();
+        assert!(table.claim(2).is_none());
+
+        // A session that stops waiting frees its slot
+        drop(first);
+        let third = table.claim(2).unwrap();
+        assert!(table.claim(2).is_none());
+        drop((second, third));
+    }
+
+    #[test]
+    fn test_slots_of_killed_processes_are_taken_over() {
+        let temp_dir = TempDir::new("test_slots_of_killed_processes").unwrap();
+        let table = AdmissionTable::open_cached(&temp_dir.path().join(ADMISSION_FILE)).unwrap();
+
+        // A process id that is not running
+        table.slot(0).store(u32::MAX as u64, Ordering::Release);
+        let claimed = table.claim(1).unwrap();
+        assert_eq!(
+            table.slot(0).load(Ordering::Acquire),
+            std::process::id() as u64
+        );
+        drop(claimed);
+    }
+
+    #[test]
+    fn test_failure_rate_slides_over_windows() {
+        let temp_dir = TempDir::new("test_failure_rate_slides").unwrap();
+        let table = AdmissionTable::open(&temp_dir.path().join(ADMISSION_FILE)).unwrap();
+
+        for _ in 0..60 {
+            table.add_failure(NOW, WINDOW);
+        }
+        assert_eq!(table.failure_rate(NOW, WINDOW), 60);
+
+        // Half of the previous window is still in the sliding window
+        assert_eq!(table.failure_rate(NOW + WINDOW + 30, WINDOW), 30);
+
+        // Failures older than two windows expire
+        assert_eq!(table.failure_rate(NOW + 3 * WINDOW, WINDOW), 0);
+    }
+
+    #[test]
+    fn test_admit_sheds_on_failure_rate() {
+        let temp_dir = TempDir::new("test_admit_sheds_on_failure_rate").unwrap();
+        let settings = Settings {
+            tally_dir: temp_dir.path().to_path_buf(),
+            bounce_shed_failures: 3,
+            bounce_shed_window_seconds: 3600,
+            ..Default::default()
+        };
+
+        for _ in 0..2 {
+            record_failure(&settings);
+        }
+        assert!(admit(&settings).unwrap().is_none());
+
+        record_failure(&settings);
+        assert_eq!(admit(&settings).err(), Some(ShedReason::FailureRate));
+    }
+}
@@ -0,0 +1,187 @@
+//! # Binary Tally Record
+//!
+//! Fixed-size little-endian encoding of a tally. The record is small enough to be read with a
+//! single `pread` into a stack buffer, without allocating or parsing text.
+//!
+//! ## Layout
+//!
+//! | Offset | Size | Field                                       |
+//! |--------|------|---------------------------------------------|
+//! | 0      | 4    | magic `ARTL`                                |
+//! | 4      | 2    | version                                     |
+//! | 6      | 2    | flags (bit 0: unlock instant present)       |
+//! | 8      | 4    | failures count                              |
+//! | 12     | 4    | failure instant, nanoseconds                |
+//! | 16     | 8    | failure instant, seconds since the epoch    |
+//! | 24     | 8    | unlock instant, seconds since the epoch     |
+//! | 32     | 4    | unlock instant, nanoseconds                 |
+//! | 36     | 4    | FNV-1a checksum of bytes 0 to 35            |
+//!
+//! ## License
+//!
+//! pam-authramp
+//! Copyright (C) 2023 github.com/34N0
+//!
+//! This program is free software: you can redistribute it and/or modify
+//! it under the terms of the GNU General Public License as published by
+//! the Free Software Foundation, either version 3 of the License, or
+//! (at your option) any later version.
+//!
+//! This program is distributed in the hope that it will be useful,
+//! but WITHOUT ANY WARRANTY; without even the implied warranty of
+//! MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//! GNU General Public License for more details.
+//!
+//! You should have received a copy of the GNU General Public License
+//! along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+use chrono::{DateTime, TimeZone, Utc};
+
+use crate::tally::Tally;
+
+/// Size of an encoded record in bytes.
+pub const RECORD_SIZE: usize = 40;
+
+const MAGIC: [u8; 4] = *b"ARTL";
+const VERSION: u16 = 1;
+const FLAG_UNLOCK_INSTANT: u16 = 1;
+const CHECKSUM_OFFSET: usize = 36;
+
+/// Returns true if the buffer starts with the binary record magic.
+pub fn has_magic(buf: &[u8]) -> bool {
+    buf.starts_with(&MAGIC)
+}
+
+/// Encodes the tally into a binary record.
+///
+/// # Arguments
+/// - `tally`: The tally to encode
+///
+/// # Returns
+/// The encoded record
+pub fn encode(tally: &Tally) -> [u8; RECORD_SIZE] {
+    let mut buf = [0u8; RECORD_SIZE];
+    let flags = if tally.unlock_instant.is_some() {
+        FLAG_UNLOCK_INSTANT
+    } else {
+        0
+    };
+    let unlock_instant = tally.unlock_instant.unwrap_or_default();
+
+    buf[0..4].copy_from_slice(&MAGIC);
+    buf[4..6].copy_from_slice(&VERSION.to_le_bytes());
+    buf[6..8].copy_from_slice(&flags.to_le_bytes());
+    buf[8..12].copy_from_slice(&tally.failures_count.to_le_bytes());
+    buf[12..16].copy_from_slice(&tally.failure_instant.timestamp_subsec_nanos().to_le_bytes());
+    buf[16..24].copy_from_slice(&tally.failure_instant.timestamp().to_le_bytes());
+    buf[24..32].copy_from_slice(&unlock_instant.timestamp().to_le_bytes());
+    buf[32..36].copy_from_slice(&unlock_instant.timestamp_subsec_nanos().to_le_bytes());
+
+    let checksum = fnv1a(&buf[..CHECKSUM_OFFSET]);
+    buf[CHECKSUM_OFFSET..].copy_from_slice(&checksum.to_le_bytes());
+
+    buf
+}
+
+/// Decodes a binary record into the tally.
+///
+/// # Arguments
+/// - `buf`: The encoded record
+/// - `tally`: A mutable reference to the `Tally` struct to fill
+///
+/// # Returns
+/// A `Result` indicating success or a description of why the record is invalid.
+pub fn decode(buf: &[u8; RECORD_SIZE], tally: &mut Tally) -> Result<(), &'static str> {
+    if !has_magic(buf) {
+        return Err("invalid magic");
+    }
+    if u16::from_le_bytes([buf[4], buf[5]]) != VERSION {
+        return Err("unsupported version");
+    }
+    if fnv1a(&buf[..CHECKSUM_OFFSET]) != read_u32(buf, CHECKSUM_OFFSET) {
+        return Err("checksum mismatch");
+    }
+
+    let flags = u16::from_le_bytes([buf[6], buf[7]]);
+
+    tally.failures_count = read_u32(buf, 8) as i32;
+    tally.failure_instant = to_instant(read_i64(buf, 16), read_u32(buf, 12)).unwrap_or_default();
+    tally.unlock_instant = if flags & FLAG_UNLOCK_INSTANT != 0 {
+        to_instant(read_i64(buf, 24), read_u32(buf, 32))
+    } else {
+        None
+    };
+
+    Ok(())
+}
+
+fn to_instant(secs: i64, nsecs: u32) -> Option<DateTime<Utc>> {
+    Utc.timestamp_opt(secs, nsecs).single()
+}
+
+fn read_u32(buf: &[u8], offset: usize) -> u32 {
+    u32::from_le_bytes([
+        buf[offset],
+        buf[offset + 1],
+        buf[offset + 2],
+        buf[offset + 3],
+    ])
+}
+
+fn read_i64(buf: &[u8], offset: usize) -> i64 {
+    let mut bytes = [0u8; 8];
+    bytes.copy_from_slice(&buf[offset..offset + 8]);
+    i64::from_le_bytes(bytes)
+}
+
+/// 32-bit FNV-1a hash used as the record checksum.
+fn fnv1a(bytes: &[u8]) -> u32 {
+    bytes.iter().fold(0x811c_9dc5, |hash, &byte| {
+        (hash ^ byte as u32).wrapping_mul(0x0100_0193)
+    })
+}
+
+// Unit Tests
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_encode_decode_roundtrip() {
+        let tally = Tally {
+            tally_file: None,
+            failures_count: 7,
+            failure_instant: "2023-01-01T00:00:00.123456789Z".parse().unwrap(),
+            unlock_instant: Some("2023-01-01T00:00:30Z".parse().unwrap()),
+        };
+
+        let buf = encode(&tally);
+        assert!(has_magic(&buf));
+
+        let mut decoded = Tally::default();
+        assert!(decode(&buf, &mut decoded).is_ok());
+        assert_eq!(decoded, tally);
+    }
+
+    #[test]
+    fn test_decode_without_unlock_instant() {
+        let tally = Tally {
+            unlock_instant: None,
+            ..Tally::default()
+        };
+
+        let mut decoded = Tally::default();
+        decode(&encode(&tally), &mut decoded).unwrap();
+        assert_eq!(decoded.failures_count, 0);
+        assert!(decoded.unlock_instant.is_none());
+    }
+
+    #[test]
+    fn test_decode_rejects_corrupted_record() {
+        let mut buf = encode(&Tally::default());
+        buf[8] ^= 0xff;
+
+        let mut decoded = Tally::default();
+        assert_eq!(decode(&buf, &mut decoded), Err("checksum mismatch"));
+    }
+}
@@ -0,0 +1,206 @@
+//! # Tally Cache
+//!
+//! Optional cache of the per-user tally files in a POSIX shared memory segment that every
+//! process using the module maps. The segment holds a lock-free table of tallies keyed by uid,
+//! laid out like the `mmap` tally database, so a cached preauth check is a few memory loads.
+//! Every tally directory has its own segment, named after `tally_cache_name` and a hash of the
+//! tally directory, so services with different tally directories never share a tally.
+//!
+//! A slot is seeded from the tally file the first time it is used, under the exclusive lock of
+//! the tally file. Concurrent misses wait for that lock and then update the seeded slot, so no
+//! failure is lost between them.
+//!
+//! Updates are applied to the cache atomically and the slot is marked dirty. The updating
+//! process writes the slot through to its tally file under the tally file lock before the hook
+//! returns, so nothing is lost when the process exits and the module never runs a thread of its
+//! own. Slots whose write failed stay dirty and are written back by the next update of the user
+//! or by `authramp compact`.
+//!
+//! The cache is authoritative for cached users. Changing a tally file by hand does not affect a
+//! cached user until the segment is removed, e.g. with `rm /dev/shm/authramp-cache.*`. Resets of
+//! the authramp tooling clear the tally file and then the slot.
+//!
+//! ## License
+//!
+//! pam-authramp
+//! Copyright (C) 2023 github.com/34N0
+//!
+//! This program is free software: you can redistribute it and/or modify
+//! it under the terms of the GNU General Public License as published by
+//! the Free Software Foundation, either version 3 of the License, or
+//! (at your option) any later version.
+//!
+//! This program is distributed in the hope that it will be useful,
+//! but WITHOUT ANY WARRANTY; without even the implied warranty of
+//! MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//! GNU General Public License for more details.
+//!
+//! You should have received a copy of the GNU General Public License
+//! along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+use std::ffi::OsStr;
+use std::io;
+use std::os::unix::ffi::OsStrExt;
+use std::path::Path;
+use std::sync::Arc;
+
+use users::{get_user_by_name, get_user_by_uid, User};
+
+use super::file;
+use super::mmap::{Slot, TallyDb};
+use super::shared::fnv1a;
+use crate::settings::Settings;
+use crate::tally::Tally;
+
+/// Returns the name of the shared memory segment caching the tallies of the tally directory.
+///
+/// # Arguments
+/// - `settings`: Settings with the `tally_cache_name` and the tally directory
+pub fn segment_name(settings: &Settings) -> String {
+    format!(
+        "{}.{:016x}",
+        settings.tally_cache_name,
+        fnv1a(settings.tally_dir.as_os_str().as_bytes())
+    )
+}
+
+/// Returns the mapped cache of the tally directory, creating it if it does not exist.
+///
+/// # Arguments
+/// - `settings`: Settings with the cache configuration and the tally directory
+///
+/// # Returns
+/// The mapped cache or the error that occurred while opening it.
+pub fn open(settings: &Settings) -> io::Result<Arc<TallyDb>> {
+    TallyDb::open_shm_cached(&segment_name(settings), settings.tally_cache_slots)
+}
+
+/// Seeds a slot from its tally file, unless another process seeded it already. The tally file
+/// is read under its exclusive lock, so the slot starts from the latest tally file and every
+/// update after the seed is applied to the slot.
+///
+/// # Arguments
+/// - `slot`: The claimed slot of the user
+/// - `tally_file`: The tally file of the user
+///
+/// # Returns
+/// The error that occurred while locking or reading the tally file.
+pub fn seed(slot: &Slot, tally_file: &Path) -> io::Result<()> {
+    if slot.is_seeded() {
+        return Ok(());
+    }
+
+    // The lock is held until the file is closed at the end of this function
+    let _file = file::open_locked(tally_file, true)?;
+    let tally = Tally::load_tally_file(tally_file)
+        .map_err(|_| io::Error::new(io::ErrorKind::InvalidData, "invalid tally file"))?;
+    slot.seed(&tally.unwrap_or_default());
+    Ok(())
+}
+
+/// Writes the cached tally of `uid` back to its tally file if it is dirty.
+///
+/// # Arguments
+/// - `cache`: The tally cache
+/// - `uid`: Uid of the user
+/// - `name`: Name of the user, which is the name of the tally file
+/// - `settings`: Settings containing the tally directory and format
+///
+/// # Returns
+/// Whether the tally was written, or the error that occurred while writing it.
+pub fn persist_slot(
+    cache: &TallyDb,
+    uid: u32,
+    name: &OsStr,
+    settings: &Settings,
+) -> io::Result<bool> {
+    let slot = match cache.find(uid) {
+        Some(slot) if slot.take_dirty() => slot,
+        _ => return Ok(false),
+    };
+
+    let mut tally = Tally::default();
+    slot.load(&mut tally);
+
+    Tally::save_tally_file(&tally, &settings.tally_dir.join(name), settings)
+        .map(|()| true)
+        .map_err(|e| {
+            slot.mark_dirty();
+            e
+        })
+}
+
+/// Resets the cached tally of the user of a tally file. Called under the lock of the reset tally
+/// file, so a concurrent miss seeds the slot from the reset tally file.
+///
+/// # Arguments
+/// - `tally_file`: The reset tally file
+/// - `settings`: Settings with the cache configuration
+/// - `user`: The user of the tally file if it is known already
+///
+/// # Returns
+/// The cached failures count before the reset, `None` if the cached tally was clear, or the
+/// error that occurred while opening the cache.
+pub fn reset_slot(
+    tally_file: &Path,
+    settings: &Settings,
+    user: Option<&User>,
+) -> io::Result<Option<i32>> {
+    let Some(name) = tally_file.file_name() else {
+        return Ok(None);
+    };
+    let uid = match user.filter(|user| user.name() == name) {
+        Some(user) => user.uid(),
+        None => match get_user_by_name(name) {
+            Some(user) => user.uid(),
+            None => return Ok(None),
+        },
+    };
+    let cache = open(settings)?;
+    let Some(slot) = cache.find(uid) else {
+        return Ok(None);
+    };
+
+    let mut tally = Tally::default();
+    slot.load(&mut tally);
+    if tally.is_clear() {
+        return Ok(None);
+    }
+    slot.reset();
+    Ok(Some(tally.failures_count))
+}
+
+/// Writes all dirty cached tallies back to their tally files.
+///
+/// # Arguments
+/// - `cache`: The tally cache
+/// - `settings`: Settings containing the tally directory and format
+///
+/// # Returns
+/// The number of tallies written.
+pub fn flush_dirty(cache: &TallyDb, settings: &Settings) -> usize {
+    cache
+        .entries()
+        .filter(|(_, slot)| slot.is_dirty())
+        .filter_map(|(uid, _)| get_user_by_uid(uid))
+        .filter(|user| persist_slot(cache, user.uid(), user.name(), settings).unwrap_or(false))
+        .count()
+}
+
+// Unit Tests
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::path::PathBuf;
+
+    #[test]
+    fn test_segment_name_depends_on_tally_dir() {
+        let settings = Settings::default();
+        let other = Settings {
+            tally_dir: PathBuf::from("/var/lib/authramp-sshd"),
+            ..Default::default()
+        };
+        assert!(segment_name(&settings).starts_with("/authramp-cache."));
+        assert_ne!(segment_name(&settings), segment_name(&other));
+    }
+}
@@ -0,0 +1,284 @@
+//! # Tally Compaction
+//!
+//! Removes tally files that no longer hold a lockout: tallies without failures and tallies older
+//! than `tally_ttl`. Expired tallies are already treated as absent when they are read, so the
+//! compaction only reclaims the space and never changes a lockout decision.
+//!
+//! The tally directory is streamed in batches with a pause between them, so a compaction of a
+//! large directory can run next to live logins. A tally file is only removed if its lock can be
+//! taken without waiting, and it is checked again once locked. Tally files that are in use are
+//! skipped and picked up by the next run.
+//!
+//! The tally filter is created if it is missing and rebuilt after the tally files, so users whose
+//! tally was cleared leave it. The PAM module never creates it.
+//!
+//! The slots of the `mmap` tally database cannot be freed, because lookups stop probing at the
+//! first empty slot. Expired slots are cleared instead.
+//!
+//! ## License
+//!
+//! pam-authramp
+//! Copyright (C) 2023 github.com/34N0
+//!
+//! This program is free software: you can redistribute it and/or modify
+//! it under the terms of the GNU General Public License as published by
+//! the Free Software Foundation, either version 3 of the License, or
+//! (at your option) any later version.
+//!
+//! This program is distributed in the hope that it will be useful,
+//! but WITHOUT ANY WARRANTY; without even the implied warranty of
+//! MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//! GNU General Public License for more details.
+//!
+//! You should have received a copy of the GNU General Public License
+//! along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+use std::fs;
+use std::io;
+use std::path::Path;
+use std::thread;
+use std::time::{Duration, SystemTime};
+
+use chrono::Utc;
+
+use super::file;
+use super::filter::TallyFilter;
+#[cfg(feature = "mmap")]
+use super::mmap::TallyDb;
+use super::scan::is_reserved_name;
+#[cfg(feature = "mmap")]
+use super::TALLY_DB_FILE;
+use crate::settings::Settings;
+use crate::tally::Tally;
+
+/// Age after which a temporary file is left over from a crashed update.
+const STALE_TEMP_AGE: Duration = Duration::from_secs(3600);
+
+/// Result of a compaction run.
+#[derive(Debug, Default, PartialEq)]
+pub struct CompactStats {
+    /// Number of tally files and database slots looked at.
+    pub scanned: usize,
+    /// Number of removed tally files and left over temporary files.
+    pub removed: usize,
+    /// Number of cleared database slots.
+    pub cleared: usize,
+    /// Number of removable tally files that were in use.
+    pub skipped: usize,
+}
+
+/// Returns true if the tally file holds no lockout and can be removed.
+fn is_removable(tally_file: &Path, settings: &Settings) -> bool {
+    match Tally::load_tally_file(tally_file) {
+        Ok(Some(tally)) => tally.is_clear() || tally.is_expired(settings, Utc::now()),
+        // An empty tally file was created but never written
+        Ok(None) => true,
+        Err(_) => false,
+    }
+}
+
+/// Returns true if the file was modified more than `STALE_TEMP_AGE` ago.
+fn is_stale(metadata: &fs::Metadata) -> bool {
+    metadata
+        .modified()
+        .ok()
+        .and_then(|modified| SystemTime::now().duration_since(modified).ok())
+        .map_or(false, |age| age > STALE_TEMP_AGE)
+}
+
+/// Removes clear and expired tally files from the tally directory.
+///
+/// # Arguments
+/// - `settings`: A reference to the `Settings` struct.
+/// - `batch_size`: Number of directory entries processed between pauses
+/// - `pause`: Time to sleep after every batch
+///
+/// # Returns
+/// The statistics of the run or the error that occurred while reading the tally directory.
+pub fn compact_tally_dir(
+    settings: &Settings,
+    batch_size: usize,
+    pause: Duration,
+) -> io::Result<CompactStats> {
+    let mut stats = CompactStats::default();
+    let entries = match fs::read_dir(&settings.tally_dir) {
+        Ok(entries) => entries,
+        Err(e) if e.kind() == io::ErrorKind::NotFound => return Ok(stats),
+        Err(e) => return Err(e),
+    };
+
+    let mut in_batch = 0;
+    for entry in entries {
+        let entry = entry?;
+        let name = entry.file_name();
+        // Stale temporary files are removed below
+        if is_reserved_name(&name) && !file::is_temp_file(&name) {
+            continue;
+        }
+
+        // The entry may have been removed by a concurrent update
+        let Ok(metadata) = entry.metadata() else {
+            continue;
+        };
+        if !metadata.is_file() {
+            continue;
+        }
+
+        if in_batch == batch_size.max(1) {
+            in_batch = 0;
+            thread::sleep(pause);
+        }
+        in_batch += 1;
+
+        let path = entry.path();
+        if file::is_temp_file(&name) {
+            if is_stale(&metadata) && fs::remove_file(&path).is_ok() {
+                stats.removed += 1;
+            }
+            continue;
+        }
+
+        stats.scanned += 1;
+        if !is_removable(&path, settings) {
+            continue;
+        }
+
+        // The tally may have been updated after the unlocked check
+        match file::remove_unlocked(&path, || is_removable(&path, settings)) {
+            Ok(true) => stats.removed += 1,
+            Ok(false) => stats.skipped += 1,
+            Err(_) => stats.skipped += 1,
+        }
+    }
+
+    // Users whose tally was cleared leave the tally filter, a missing filter is created
+    if settings.tally_filter {
+        TallyFilter::create(settings)?.rebuild(settings)?;
+    }
+
+    Ok(stats)
+}
+
+/// Clears the expired slots of the `mmap` tally database, if there is one.
+///
+/// # Arguments
+/// - `settings`: A reference to the `Settings` struct.
+///
+/// # Returns
+/// The statistics of the run or the error that occurred while opening the database.
+#[cfg(feature = "mmap")]
+pub fn compact_tally_db(settings: &Settings) -> io::Result<CompactStats> {
+    let mut stats = CompactStats::default();
+    let path = settings.tally_dir.join(TALLY_DB_FILE);
+    if !path.is_file() {
+        return Ok(stats);
+    }
+
+    let db = TallyDb::open_cached(&path, settings.tally_db_slots)?;
+    let now = Utc::now();
+    for (_, slot) in db.entries() {
+        stats.scanned += 1;
+        let mut tally = Tally::default();
+        slot.load(&mut tally);
+        // A slot changed by a concurrent failure since the load is not expired anymore
+        if !tally.is_clear() && tally.is_expired(settings, now) && slot.reset_unchanged(&tally) {
+            stats.cleared += 1;
+        }
+    }
+
+    Ok(stats)
+}
+
+// Unit Tests
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use tempdir::TempDir;
+
+    const EXPIRED: &str = "[Fails]\ncount = 8\ninstant = \"2023-01-01T00:00:00Z\"";
+
+    #[test]
+    fn test_compact_removes_clear_and_expired_tallies() {
+        let temp_dir = TempDir::new("test_compact_removes_tallies").unwrap();
+        let tally_dir = temp_dir.path();
+        fs::write(
+            tally_dir.join("clear"),
+            "[Fails]\ncount = 0\ninstant = \"2023-01-01T00:00:00Z\"",
+        )
+        .unwrap();
+        fs::write(tally_dir.join("expired"), EXPIRED).unwrap();
+        fs::write(
+            tally_dir.join("locked"),
+            format!("[Fails]\ncount = 8\ninstant = \"{}\"", Utc::now()),
+        )
+        .unwrap();
+        fs::write(tally_dir.join(".fresh.1.1.tmp"), "").unwrap();
+
+        let settings = Settings {
+            tally_dir: tally_dir.to_path_buf(),
+            tally_ttl: 86400,
+            ..Default::default()
+        };
+
+        let stats = compact_tally_dir(&settings, 1, Duration::ZERO).unwrap();
+        assert_eq!(
+            stats,
+            CompactStats {
+                scanned: 3,
+                removed: 2,
+                cleared: 0,
+                skipped: 0,
+            }
+        );
+        assert!(!tally_dir.join("clear").exists());
+        assert!(!tally_dir.join("expired").exists());
+        assert!(tally_dir.join("locked").exists());
+        // Temporary files of running updates are kept
+        assert!(tally_dir.join(".fresh.1.1.tmp").exists());
+    }
+
+    #[test]
+    fn test_compact_keeps_tallies_without_ttl() {
+        let temp_dir = TempDir::new("test_compact_keeps_tallies").unwrap();
+        fs::write(temp_dir.path().join("expired"), EXPIRED).unwrap();
+
+        let settings = Settings {
+            tally_dir: temp_dir.path().to_path_buf(),
+            ..Default::default()
+        };
+
+        let stats = compact_tally_dir(&settings, 100, Duration::ZERO).unwrap();
+        assert_eq!(stats.removed, 0);
+        assert!(temp_dir.path().join("expired").exists());
+    }
+
+    #[test]
+    #[cfg(feature = "mmap")]
+    fn test_compact_clears_expired_db_slots() {
+        let temp_dir = TempDir::new("test_compact_clears_db_slots").unwrap();
+        let settings = Settings {
+            tally_dir: temp_dir.path().to_path_buf(),
+            tally_db_slots: 16,
+            tally_ttl: 86400,
+            ..Default::default()
+        };
+
+        let db = TallyDb::open_cached(&temp_dir.path().join(TALLY_DB_FILE), 16).unwrap();
+        let mut tally = Tally {
+            failures_count: 8,
+            failure_instant: "2023-01-01T00:00:00Z".parse().unwrap(),
+            ..Default::default()
+        };
+        db.find_or_insert(1000).unwrap().store(&tally);
+        tally.failure_instant = Utc::now();
+        db.find_or_insert(1001).unwrap().store(&tally);
+
+        let stats = compact_tally_db(&settings).unwrap();
+        assert_eq!((stats.scanned, stats.cleared), (2, 1));
+
+        db.find(1000).unwrap().load(&mut tally);
+        assert!(tally.is_clear());
+        db.find(1001).unwrap().load(&mut tally);
+        assert_eq!(tally.failures_count, 8);
+    }
+}
@@ -0,0 +1,462 @@
+//! # Daemon Protocol
+//!
+//! Client side of the `authrampd` daemon. The daemon holds the settings and all tallies in
+//! memory and answers tally requests over a Unix datagram socket, so a PAM transaction costs a
+//! single round trip instead of parsing the configuration and the tally file.
+//!
+//! Every request is answered with exactly one response datagram. Both are fixed-size and
+//! little-endian. The client binds an abstract socket whose name the kernel picks (autobind), so
+//! no other process can take it beforehand, and connects it to the daemon socket, so the kernel
+//! only delivers datagrams sent by the daemon. The daemon rejects user names that are not a plain
+//! file name in the tally directory.
+//!
+//! A client that does not get an answer within `daemon_timeout_ms` falls back to the tally
+//! files. Every request carries the deadline of its client, and the daemon drops requests that
+//! are past it without applying them, so a failure is not counted by both.
+//!
+//! ## Request Layout
+//!
+//! | Offset | Size | Field                                       |
+//! |--------|------|---------------------------------------------|
+//! | 0      | 4    | magic `ARTQ`                                |
+//! | 4      | 2    | version                                     |
+//! | 6      | 1    | action (0 preauth, 1 authsucc, 2 authfail)  |
+//! | 7      | 1    | length of the user name                     |
+//! | 8      | 8    | request id                                  |
+//! | 16     | 4    | uid                                         |
+//! | 20     | 4    | deadline, `CLOCK_MONOTONIC` ms, wrapping    |
+//! | 24     | 32   | user name, zero padded                      |
+//!
+//! ## Response Layout
+//!
+//! | Offset | Size | Field                                       |
+//! |--------|------|---------------------------------------------|
+//! | 0      | 4    | magic `ARTR`                                |
+//! | 4      | 2    | version                                     |
+//! | 6      | 1    | status (0: ok, 1: failed)                   |
+//! | 7      | 1    | reserved                                    |
+//! | 8      | 8    | request id                                  |
+//! | 16     | 4    | failures count                              |
+//! | 20     | 4    | failures count before the request           |
+//! | 24     | 8    | failure instant, ns since the epoch         |
+//! | 32     | 8    | unlock instant, ns since the epoch, or zero |
+//!
+//! ## License
+//!
+//! pam-authramp
+//! Copyright (C) 2023 github.com/34N0
+//!
+//! This program is free software: you can redistribute it and/or modify
+//! it under the terms of the GNU General Public License as published by
+//! the Free Software Foundation, either version 3 of the License, or
+//! (at your option) any later version.
+//!
+//! This program is distributed in the hope that it will be useful,
+//! but WITHOUT ANY WARRANTY; without even the implied warranty of
+//! MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//! GNU General Public License for more details.
+//!
+//! You should have received a copy of the GNU General Public License
+//! along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+use std::ffi::OsStr;
+use std::io;
+use std::mem;
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::io::AsRawFd;
+use std::os::unix::net::UnixDatagram;
+use std::process;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::Duration;
+
+use users::User;
+
+use super::file::monotonic_nanos;
+use super::scan::is_reserved_name;
+use super::shared::{from_nanos, to_nanos};
+use crate::settings::Settings;
+use crate::tally::Tally;
+use crate::Actions;
+
+/// Size of an encoded request in bytes.
+pub const REQUEST_SIZE: usize = 56;
+/// Size of an encoded response in bytes.
+pub const RESPONSE_SIZE: usize = 40;
+/// Longest user name that fits into a request.
+pub const MAX_NAME_LEN: usize = 32;
+
+const REQUEST_MAGIC: [u8; 4] = *b"ARTQ";
+const RESPONSE_MAGIC: [u8; 4] = *b"ARTR";
+const VERSION: u16 = 2;
+const NAME_OFFSET: usize = 24;
+const STATUS_OK: u8 = 0;
+const STATUS_FAILED: u8 = 1;
+
+/// Counter for the request ids of this process.
+static REQUEST_COUNTER: AtomicU64 = AtomicU64::new(0);
+
+/// A decoded tally request.
+#[derive(Debug, PartialEq)]
+pub struct Request<'a> {
+    /// Id echoed in the response.
+    pub id: u64,
+    /// Authentication action to apply.
+    pub action: Actions,
+    /// Uid of the user.
+    pub uid: u32,
+    /// Name of the user, used for the tally file.
+    pub name: &'a [u8],
+    /// Instant the client stops waiting for the response, see `deadline_after`.
+    pub deadline_ms: u32,
+}
+
+impl Request<'_> {
+    /// Returns whether the client has stopped waiting and falls back to the tally files.
+    pub fn is_expired(&self) -> bool {
+        monotonic_ms().wrapping_sub(self.deadline_ms) as i32 >= 0
+    }
+}
+
+/// Milliseconds of the system-wide `CLOCK_MONOTONIC`, wrapping every 49 days. Deadlines are
+/// compared with wrapping arithmetic, so the wrap does not matter for short timeouts.
+fn monotonic_ms() -> u32 {
+    (monotonic_nanos() / 1_000_000) as u32
+}
+
+/// Returns the deadline of a request the client waits `timeout` for.
+pub fn deadline_after(timeout: Duration) -> u32 {
+    monotonic_ms().wrapping_add(timeout.as_millis().min(i32::MAX as u128) as u32)
+}
+
+/// A decoded tally response.
+#[derive(Debug, PartialEq)]
+pub struct Response {
+    /// Id of the answered request.
+    pub id: u64,
+    /// Failures count before the request was applied.
+    pub previous_failures_count: i32,
+    /// The tally after the request was applied.
+    pub tally: Tally,
+}
+
+/// Encodes a tally request.
+///
+/// # Arguments
+/// - `id`: Id of the request
+/// - `action`: Authentication action to apply
+/// - `uid`: Uid of the user
+/// - `name`: Name of the user
+/// - `deadline_ms`: Instant the client stops waiting, see `deadline_after`
+///
+/// # Returns
+/// The encoded request, or an error if the user name is too long.
+pub fn encode_request(
+    id: u64,
+    action: Actions,
+    uid: u32,
+    name: &[u8],
+    deadline_ms: u32,
+) -> io::Result<[u8; REQUEST_SIZE]> {
+    if name.len() > MAX_NAME_LEN {
+        return Err(io::Error::new(
+            io::ErrorKind::InvalidInput,
+            "user name is too long for a daemon request",
+        ));
+    }
+
+    let action = match action {
+        Actions::PREAUTH => 0u8,
+        Actions::AUTHSUCC => 1,
+        Actions::AUTHFAIL => 2,
+    };
+
+    let mut buf = [0u8; REQUEST_SIZE];
+    buf[0..4].copy_from_slice(&REQUEST_MAGIC);
+    buf[4..6].copy_from_slice(&VERSION.to_le_bytes());
+    buf[6] = action;
+    buf[7] = name.len() as u8;
+    buf[8..16].copy_from_slice(&id.to_le_bytes());
+    buf[16..20].copy_from_slice(&uid.to_le_bytes());
+    buf[20..24].copy_from_slice(&deadline_ms.to_le_bytes());
+    buf[NAME_OFFSET..NAME_OFFSET + name.len()].copy_from_slice(name);
+    Ok(buf)
+}
+
+/// Decodes a tally request.
+///
+/// # Arguments
+/// - `buf`: The encoded request
+///
+/// # Returns
+/// The request borrowing the user name from `buf`, or a description of the error.
+pub fn decode_request(buf: &[u8; REQUEST_SIZE]) -> Result<Request<'_>, &'static str> {
+    if buf[0..4] != REQUEST_MAGIC {
+        return Err("not an authramp daemon request");
+    }
+    if u16::from_le_bytes([buf[4], buf[5]]) != VERSION {
+        return Err("unsupported daemon protocol version");
+    }
+
+    let action = match buf[6] {
+        0 => Actions::PREAUTH,
+        1 => Actions::AUTHSUCC,
+        2 => Actions::AUTHFAIL,
+        _ => return Err("unknown action"),
+    };
+
+    let name_len = buf[7] as usize;
+    if name_len == 0 || name_len > MAX_NAME_LEN {
+        return Err("invalid user name length");
+    }
+
+    // The name is joined onto the tally directory
+    let name = &buf[NAME_OFFSET..NAME_OFFSET + name_len];
+    if name.contains(&b'/')
+        || name.contains(&0)
+        || name == b"."
+        || name == b".."
+        || is_reserved_name(OsStr::from_bytes(name))
+    {
+        return Err("user name is not a tally file name");
+    }
+
+    Ok(Request {
+        id: u64::from_le_bytes(buf[8..16].try_into().unwrap()),
+        action,
+        uid: u32::from_le_bytes(buf[16..20].try_into().unwrap()),
+        name,
+        deadline_ms: u32::from_le_bytes(buf[20..24].try_into().unwrap()),
+    })
+}
+
+/// Encodes a tally response.
+///
+/// # Arguments
+/// - `id`: Id of the answered request
+/// - `result`: The failures count before the request and the updated tally, or `None` if the
+///   request failed
+///
+/// # Returns
+/// The encoded response
+pub fn encode_response(id: u64, result: Option<(i32, &Tally)>) -> [u8; RESPONSE_SIZE] {
+    let mut buf = [0u8; RESPONSE_SIZE];
+    buf[0..4].copy_from_slice(&RESPONSE_MAGIC);
+    buf[4..6].copy_from_slice(&VERSION.to_le_bytes());
+    buf[8..16].copy_from_slice(&id.to_le_bytes());
+
+    match result {
+        Some((previous_failures_count, tally)) => {
+            buf[6] = STATUS_OK;
+            buf[16..20].copy_from_slice(&tally.failures_count.to_le_bytes());
+            buf[20..24].copy_from_slice(&previous_failures_count.to_le_bytes());
+            buf[24..32].copy_from_slice(&to_nanos(Some(tally.failure_instant)).to_le_bytes());
+            buf[32..40].copy_from_slice(&to_nanos(tally.unlock_instant).to_le_bytes());
+        }
+        None => buf[6] = STATUS_FAILED,
+    }
+    buf
+}
+
+/// Decodes a tally response.
+///
+/// # Arguments
+/// - `buf`: The encoded response
+///
+/// # Returns
+/// The response, or a description of the error. A failed request is an error.
+pub fn decode_response(buf: &[u8; RESPONSE_SIZE]) -> Result<Response, &'static str> {
+    if buf[0..4] != RESPONSE_MAGIC {
+        return Err("not an authramp daemon response");
+    }
+    if u16::from_le_bytes([buf[4], buf[5]]) != VERSION {
+        return Err("unsupported daemon protocol version");
+    }
+    if buf[6] != STATUS_OK {
+        return Err("daemon failed to process the request");
+    }
+
+    let failure_ns = i64::from_le_bytes(buf[24..32].try_into().unwrap());
+    let unlock_ns = i64::from_le_bytes(buf[32..40].try_into().unwrap());
+
+    Ok(Response {
+        id: u64::from_le_bytes(buf[8..16].try_into().unwrap()),
+        previous_failures_count: i32::from_le_bytes(buf[20..24].try_into().unwrap()),
+        tally: Tally {
+            failures_count: i32::from_le_bytes(buf[16..20].try_into().unwrap()),
+            failure_instant: from_nanos(failure_ns).unwrap_or_default(),
+            unlock_instant: from_nanos(unlock_ns),
+            ..Default::default()
+        },
+    })
+}
+
+/// Binds `socket` to an unused abstract address picked by the kernel.
+fn autobind(socket: &UnixDatagram) -> io::Result<()> {
+    let mut addr: libc::sockaddr_un = unsafe { mem::zeroed() };
+    // An address of only the family asks the kernel for a name
+    let len = mem::size_of::<libc::sa_family_t>() as libc::socklen_t;
+    addr.sun_family = libc::AF_UNIX as libc::sa_family_t;
+    if unsafe {
+        libc::bind(
+            socket.as_raw_fd(),
+            &addr as *const libc::sockaddr_un as *const libc::sockaddr,
+            len,
+        )
+    } != 0
+    {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(())
+}
+
+/// Sends a tally request to the daemon and waits for the response.
+///
+/// # Arguments
+/// - `settings`: Settings with the `daemon_socket` and `daemon_timeout_ms`
+/// - `action`: Authentication action to apply
+/// - `user`: The user of the tally
+///
+/// # Returns
+/// The response, or an error if the daemon is not running or did not answer in time.
+pub fn request(settings: &Settings, action: Actions, user: &User) -> io::Result<Response> {
+    let count = REQUEST_COUNTER.fetch_add(1, Ordering::Relaxed);
+    let id = (u64::from(process::id()) << 32) | (count & u64::from(u32::MAX));
+    let timeout = Duration::from_millis(settings.daemon_timeout_ms.max(1));
+    let request = encode_request(
+        id,
+        action,
+        user.uid(),
+        user.name().as_bytes(),
+        deadline_after(timeout),
+    )?;
+
+    let socket = UnixDatagram::unbound()?;
+    autobind(&socket)?;
+    socket.connect(&settings.daemon_socket)?;
+    socket.set_read_timeout(Some(timeout))?;
+    socket.send(&request)?;
+
+    let mut buf = [0u8; RESPONSE_SIZE];
+    let len = socket.recv(&mut buf)?;
+    let response = (len == RESPONSE_SIZE)
+        .then_some(&buf)
+        .ok_or("truncated daemon response")
+        .and_then(decode_response)
+        .map_err(|e| io::Error::new(io::ErrorKind::InvalidData, e))?;
+
+    if response.id != id {
+        return Err(io::Error::new(
+            io::ErrorKind::InvalidData,
+            "daemon response does not match the request",
+        ));
+    }
+    Ok(response)
+}
+
+// Unit Tests
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use chrono::{Duration, Utc};
+    use std::thread;
+    use tempdir::TempDir;
+
+    #[test]
+    fn test_request_roundtrip() {
+        let deadline_ms = deadline_after(std::time::Duration::from_secs(60));
+        let buf = encode_request(7, Actions::AUTHFAIL, 1000, b"alice", deadline_ms).unwrap();
+        assert_eq!(
+            decode_request(&buf),
+            Ok(Request {
+                id: 7,
+                action: Actions::AUTHFAIL,
+                uid: 1000,
+                name: b"alice",
+                deadline_ms,
+            })
+        );
+        assert!(!decode_request(&buf).unwrap().is_expired());
+
+        assert!(encode_request(7, Actions::PREAUTH, 1000, &[b'a'; MAX_NAME_LEN + 1], 0).is_err());
+
+        let mut corrupt = buf;
+        corrupt[6] = 9;
+        assert!(decode_request(&corrupt).is_err());
+
+        // Names that leave the tally directory or hit its own files
+        for name in [&b"../etc"[..], b"a/b", b"..", b"authramp.db"] {
+            let buf = encode_request(7, Actions::AUTHFAIL, 1000, name, deadline_ms).unwrap();
+            assert!(decode_request(&buf).is_err());
+        }
+    }
+
+    #[test]
+    fn test_request_expires_at_deadline() {
+        let buf = encode_request(
+            7,
+            Actions::AUTHFAIL,
+            1000,
+            b"alice",
+            deadline_after(std::time::Duration::from_millis(20)),
+        )
+        .unwrap();
+        let request = decode_request(&buf).unwrap();
+        assert!(!request.is_expired());
+        thread::sleep(std::time::Duration::from_millis(30));
+        assert!(request.is_expired());
+    }
+
+    #[test]
+    fn test_response_roundtrip() {
+        let now = Utc::now();
+        let tally = Tally {
+            failures_count: 7,
+            failure_instant: now,
+            unlock_instant: Some(now + Duration::seconds(30)),
+            ..Default::default()
+        };
+
+        let response = decode_response(&encode_response(42, Some((6, &tally)))).unwrap();
+        assert_eq!(response.id, 42);
+        assert_eq!(response.previous_failures_count, 6);
+        assert_eq!(response.tally, tally);
+
+        assert!(decode_response(&encode_response(42, None)).is_err());
+    }
+
+    #[test]
+    fn test_request_to_daemon_socket() {
+        let temp_dir = TempDir::new("test_request_to_daemon_socket").unwrap();
+        let settings = Settings {
+            daemon_socket: temp_dir.path().join("authrampd.sock"),
+            daemon_timeout_ms: 1000,
+            ..Default::default()
+        };
+        let user = User::new(1000, "alice", 1000);
+
+        // Nobody is listening yet
+        assert!(request(&settings, Actions::PREAUTH, &user).is_err());
+
+        let server = UnixDatagram::bind(&settings.daemon_socket).unwrap();
+        let handle = thread::spawn(move || {
+            let mut buf = [0u8; REQUEST_SIZE];
+            let (_, addr) = server.recv_from(&mut buf).unwrap();
+            let request = decode_request(&buf).unwrap();
+            assert_eq!(request.action, Actions::AUTHFAIL);
+            assert_eq!(request.name, b"alice");
+
+            let tally = Tally {
+                failures_count: 1,
+                ..Default::default()
+            };
+            server
+                .send_to_addr(&encode_response(request.id, Some((0, &tally))), &addr)
+                .unwrap();
+        });
+
+        let response = request(&settings, Actions::AUTHFAIL, &user).unwrap();
+        handle.join().unwrap();
+        assert_eq!(response.tally.failures_count, 1);
+        assert_eq!(response.previous_failures_count, 0);
+    }
+}
@@ -0,0 +1,387 @@
+//! # Tally File Primitives
+//!
+//! Concurrency-safe access to the per-user tally files. Every tally file is protected by an
+//! `flock` on the file itself, so concurrent PAM processes only serialize on the same user and
+//! never on the whole tally directory. Updates are written to a temporary file in the tally
+//! directory and renamed over the tally file, so readers never observe a truncated tally.
+//!
+//! Because an update replaces the inode of the tally file, a process that waited for the lock
+//! checks that the locked file is still the one at the tally path and retries otherwise.
+//!
+//! ## Durability
+//!
+//! By default updates are not synced, which is all a tally directory on tmpfs needs. On
+//! persistent storage the `durability` setting syncs the update before (`rename`) or also after
+//! (`fsync`) the rename. With `group-commit`, writers do not sync their own update. They queue on
+//! the lock of the `SYNC_FILE` in the tally directory instead, and the first in the queue waits
+//! `group_commit_ms` for more updates and syncs the whole filesystem once. Every writer whose
+//! update finished before that sync started finds it covered and returns without syncing, so a
+//! burst of failed logins across all processes shares one sync.
+//!
+//! ## License
+//!
+//! pam-authramp
+//! Copyright (C) 2023 github.com/34N0
+//!
+//! This program is free software: you can redistribute it and/or modify
+//! it under the terms of the GNU General Public License as published by
+//! the Free Software Foundation, either version 3 of the License, or
+//! (at your option) any later version.
+//!
+//! This program is distributed in the hope that it will be useful,
+//! but WITHOUT ANY WARRANTY; without even the implied warranty of
+//! MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//! GNU General Public License for more details.
+//!
+//! You should have received a copy of the GNU General Public License
+//! along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+use std::ffi::{OsStr, OsString};
+use std::fs::{self, File, OpenOptions};
+use std::io::{self, Write};
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::fs::FileExt;
+use std::os::unix::fs::MetadataExt;
+use std::os::unix::io::AsRawFd;
+use std::path::{Path, PathBuf};
+use std::process;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::thread;
+use std::time::Duration;
+
+use super::shared::FileLock;
+use super::Durability;
+
+/// Number of attempts to lock a tally file that is replaced concurrently.
+const MAX_LOCK_ATTEMPTS: usize = 32;
+
+/// Suffix of temporary files. Files with this suffix in the tally directory are not tallies.
+const TEMP_SUFFIX: &str = ".tmp";
+
+/// Name of the group commit state inside the tally directory.
+pub const SYNC_FILE: &str = "authramp-sync.lock";
+
+/// Counter making temporary file names unique between threads of one process.
+static TEMP_COUNTER: AtomicU64 = AtomicU64::new(0);
+
+/// Opens the tally file, creating it and the tally directory if needed, and locks it.
+///
+/// The lock is held until the returned file is closed. A newly created tally file is empty.
+///
+/// # Arguments
+/// - `path`: Path of the tally file
+/// - `exclusive`: Take an exclusive lock for writing instead of a shared lock for reading
+///
+/// # Returns
+/// The locked tally file or the error that occurred.
+pub fn open_locked(path: &Path, exclusive: bool) -> io::Result<File> {
+    for _ in 0..MAX_LOCK_ATTEMPTS {
+        let file = match open_or_create(path) {
+            Err(e) if e.kind() == io::ErrorKind::NotFound => {
+                if let Some(dir) = path.parent() {
+                    fs::create_dir_all(dir)?;
+                }
+                open_or_create(path)?
+            }
+            result => result?,
+        };
+
+        let operation = if exclusive {
+            libc::LOCK_EX
+        } else {
+            libc::LOCK_SH
+        };
+        if unsafe { libc::flock(file.as_raw_fd(), operation) } != 0 {
+            return Err(io::Error::last_os_error());
+        }
+
+        // The tally file may have been replaced while waiting for the lock
+        let locked = file.metadata()?;
+        match fs::metadata(path) {
+            Ok(current) if current.dev() == locked.dev() && current.ino() == locked.ino() => {
+                return Ok(file)
+            }
+            Ok(_) => {}
+            Err(e) if e.kind() == io::ErrorKind::NotFound => {}
+            Err(e) => return Err(e),
+        }
+    }
+
+    Err(io::Error::new(
+        io::ErrorKind::WouldBlock,
+        "tally file is replaced concurrently",
+    ))
+}
+
+fn open_or_create(path: &Path) -> io::Result<File> {
+    OpenOptions::new()
+        .read(true)
+        .write(true)
+        .create(true)
+        .open(path)
+}
+
+/// Removes the tally file at `path` if no other process holds its lock and `removable` still
+/// holds once it is locked. Never waits for a lock, so concurrent logins are not stalled.
+///
+/// # Arguments
+/// - `path`: Path of the tally file
+/// - `removable`: Checks the locked tally file again before it is removed
+///
+/// # Returns
+/// Whether the tally file was removed.
+pub fn remove_unlocked<F>(path: &Path, removable: F) -> io::Result<bool>
+where
+    F: FnOnce() -> bool,
+{
+    let file = match File::open(path) {
+        Ok(file) => file,
+        Err(e) if e.kind() == io::ErrorKind::NotFound => return Ok(false),
+        Err(e) => return Err(e),
+    };
+
+    if unsafe { libc::flock(file.as_raw_fd(), libc::LOCK_EX | libc::LOCK_NB) } != 0 {
+        let e = io::Error::last_os_error();
+        return match e.kind() {
+            io::ErrorKind::WouldBlock => Ok(false),
+            _ => Err(e),
+        };
+    }
+
+    // The tally file may have been replaced before it was locked
+    let locked = file.metadata()?;
+    match fs::metadata(path) {
+        Ok(current) if current.dev() == locked.dev() && current.ino() == locked.ino() => {}
+        Ok(_) => return Ok(false),
+        Err(e) if e.kind() == io::ErrorKind::NotFound => return Ok(false),
+        Err(e) => return Err(e),
+    }
+
+    if !removable() {
+        return Ok(false);
+    }
+
+    // Processes waiting for the lock notice the removed path and start over
+    fs::remove_file(path)?;
+    Ok(true)
+}
+
+/// Returns true if `name` is the name of a temporary file written by `replace`.
+pub fn is_temp_file(name: &OsStr) -> bool {
+    let name = name.as_bytes();
+    name.starts_with(b".") && name.ends_with(TEMP_SUFFIX.as_bytes())
+}
+
+/// Atomically replaces the content of the file at `path`.
+///
+/// The content is written to a temporary file in the same directory, which is then renamed
+/// over `path`.
+///
+/// # Arguments
+/// - `path`: Path of the file to replace
+/// - `content`: New content of the file
+///
+/// # Returns
+/// The result of the write and rename.
+pub fn replace(path: &Path, content: &[u8]) -> io::Result<()> {
+    replace_durable(path, content, Durability::None, Duration::ZERO)
+}
+
+/// Atomically replaces the content of the file at `path` and syncs it as set by `durability`.
+///
+/// # Arguments
+/// - `path`: Path of the file to replace
+/// - `content`: New content of the file
+/// - `durability`: How the update is synced
+/// - `group_commit`: Time the first writer of a group commit waits for more updates
+///
+/// # Returns
+/// The result of the write, rename and sync.
+pub fn replace_durable(
+    path: &Path,
+    content: &[u8],
+    durability: Durability,
+    group_commit: Duration,
+) -> io::Result<()> {
+    let temp_path = temp_path(path);
+
+    let result = OpenOptions::new()
+        .write(true)
+        .create_new(true)
+        .open(&temp_path)
+        .and_then(|mut file| {
+            file.write_all(content)?;
+            match durability {
+                Durability::Rename | Durability::Fsync => file.sync_data(),
+                Durability::None | Durability::GroupCommit => Ok(()),
+            }
+        })
+        .and_then(|()| fs::rename(&temp_path, path));
+
+    if result.is_err() {
+        let _ = fs::remove_file(&temp_path);
+        return result;
+    }
+
+    let dir = match path.parent() {
+        Some(dir) if !dir.as_os_str().is_empty() => dir,
+        _ => Path::new("."),
+    };
+    match durability {
+        Durability::None | Durability::Rename => Ok(()),
+        Durability::Fsync => File::open(dir)?.sync_all(),
+        Durability::GroupCommit => group_sync(dir, monotonic_nanos(), group_commit),
+    }
+}
+
+/// Makes sure a filesystem sync of `dir` started after `written`, joining the group commit of
+/// all processes writing to `dir`.
+///
+/// # Arguments
+/// - `dir`: The tally directory
+/// - `written`: Monotonic instant at which the update was complete
+/// - `group_commit`: Time the first writer waits for more updates before it syncs
+///
+/// # Returns
+/// The result of the sync.
+fn group_sync(dir: &Path, written: i64, group_commit: Duration) -> io::Result<()> {
+    let file = open_or_create(&dir.join(SYNC_FILE))?;
+    let _lock = FileLock::exclusive(&file)?;
+
+    // The monotonic clock restarts at boot. A start from a previous boot is either later than
+    // now or earlier than this update, so it never covers an update by mistake.
+    let mut start = [0u8; 8];
+    let last_start = match file.read_at(&mut start, 0)? {
+        8 => i64::from_le_bytes(start),
+        _ => i64::MIN,
+    };
+    if last_start >= written && last_start <= monotonic_nanos() {
+        return Ok(());
+    }
+
+    // Updates finishing while the lock is held are covered by this sync
+    thread::sleep(group_commit);
+    let start = monotonic_nanos();
+    if unsafe { libc::syncfs(file.as_raw_fd()) } != 0 {
+        return Err(io::Error::last_os_error());
+    }
+    file.write_all_at(&start.to_le_bytes(), 0)
+}
+
+/// Returns the system-wide monotonic clock in nanoseconds.
+pub(crate) fn monotonic_nanos() -> i64 {
+    let mut ts = libc::timespec {
+        tv_sec: 0,
+        tv_nsec: 0,
+    };
+    unsafe {
+        libc::clock_gettime(libc::CLOCK_MONOTONIC, &mut ts);
+    }
+    ts.tv_sec as i64 * 1_000_000_000 + ts.tv_nsec as i64
+}
+
+/// Returns a temporary path unique to this process and thread next to `path`.
+pub(crate) fn temp_path(path: &Path) -> PathBuf {
+    let mut name = OsString::from(".");
+    name.push(path.file_name().unwrap_or_default());
+    name.push(format!(
+        ".{}.{}{}",
+        process::id(),
+        TEMP_COUNTER.fetch_add(1, Ordering::Relaxed),
+        TEMP_SUFFIX
+    ));
+    path.with_file_name(name)
+}
+
+// Unit Tests
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use tempdir::TempDir;
+
+    #[test]
+    fn test_open_locked_creates_tally_dir() {
+        let temp_dir = TempDir::new("test_open_locked_creates_tally_dir").unwrap();
+        let path = temp_dir.path().join("authramp").join("user");
+
+        let file = open_locked(&path, true).unwrap();
+        assert_eq!(file.metadata().unwrap().len(), 0);
+        assert!(path.exists());
+    }
+
+    #[test]
+    fn test_replace_leaves_no_temp_file() {
+        let temp_dir = TempDir::new("test_replace_leaves_no_temp_file").unwrap();
+        let path = temp_dir.path().join("user");
+
+        replace(&path, b"first").unwrap();
+        replace(&path, b"second").unwrap();
+
+        assert_eq!(fs::read(&path).unwrap(), b"second");
+        assert_eq!(fs::read_dir(temp_dir.path()).unwrap().count(), 1);
+    }
+
+    #[test]
+    fn test_replace_durable_modes() {
+        let temp_dir = TempDir::new("test_replace_durable_modes").unwrap();
+        let path = temp_dir.path().join("user");
+
+        for durability in [
+            Durability::None,
+            Durability::Rename,
+            Durability::Fsync,
+            Durability::GroupCommit,
+        ] {
+            replace_durable(&path, b"tally", durability, Duration::ZERO).unwrap();
+            assert_eq!(fs::read(&path).unwrap(), b"tally");
+        }
+
+        // Only the group commit state is left next to the tally file
+        let mut names = fs::read_dir(temp_dir.path())
+            .unwrap()
+            .map(|entry| entry.unwrap().file_name())
+            .collect::<Vec<_>>();
+        names.sort();
+        assert_eq!(names, [OsString::from(SYNC_FILE), OsString::from("user")]);
+    }
+
+    #[test]
+    fn test_group_sync_is_shared() {
+        let temp_dir = TempDir::new("test_group_sync_is_shared").unwrap();
+        let sync_file = temp_dir.path().join(SYNC_FILE);
+
+        let written = monotonic_nanos();
+        group_sync(temp_dir.path(), written, Duration::ZERO).unwrap();
+        let synced = fs::read(&sync_file).unwrap();
+        assert!(i64::from_le_bytes(synced[..8].try_into().unwrap()) >= written);
+
+        // An update that finished before the last sync started is already covered
+        group_sync(temp_dir.path(), written, Duration::ZERO).unwrap();
+        assert_eq!(fs::read(&sync_file).unwrap(), synced);
+    }
+
+    #[test]
+    fn test_remove_unlocked_skips_locked_file() {
+        let temp_dir = TempDir::new("test_remove_unlocked_skips_locked_file").unwrap();
+        let path = temp_dir.path().join("user");
+        replace(&path, b"tally").unwrap();
+
+        // Held by a concurrent login
+        let locked = open_locked(&path, false).unwrap();
+        assert!(!remove_unlocked(&path, || true).unwrap());
+        drop(locked);
+
+        assert!(!remove_unlocked(&path, || false).unwrap());
+        assert!(remove_unlocked(&path, || true).unwrap());
+        assert!(!path.exists());
+    }
+
+    #[test]
+    fn test_is_temp_file() {
+        let temp_dir = TempDir::new("test_is_temp_file").unwrap();
+        let path = temp_dir.path().join("user");
+
+        assert!(is_temp_file(temp_path(&path).file_name().unwrap()));
+        assert!(!is_temp_file(path.file_name().unwrap()));
+    }
+}
@@ -0,0 +1,606 @@
+//! # Tally Filter
+//!
+//! A Bloom filter of the users that may have a tally, mapped from a file in the tally directory
+//! and shared by all processes. Most logins are users without failures. If the filter does not
+//! contain a user, PREAUTH and AUTHSUCC of the file backend return a clear tally without touching
+//! the tally directory.
+//!
+//! A user is added to the filter before a tally with failures is written, under a shared `flock`
+//! of the filter file that is held until the tally file is replaced. Every service marks the
+//! filter, also those that do not use it for lookups. The filter can therefore only report users
+//! without a tally as present, never the other way around. The filter is only removed under its
+//! exclusive `flock`, and a writer checks that its filter is still in place once it holds the
+//! shared one.
+//!
+//! The PAM module never creates or fills the filter, a missing or invalid filter contains every
+//! user. The compaction creates it: the new filter starts with every bit of the live bitmap set
+//! and is put in place with its header, then emptied by a rebuild. While there is no filter,
+//! writers hold a shared `flock` of the tally directory instead, which the creation takes
+//! exclusively once the filter is in place, so the rebuild finds the tallies they wrote.
+//!
+//! Users cannot be removed from a Bloom filter. The compaction rebuilds it from the tally files
+//! instead: while a rebuild runs, writers add users to both the live and the rebuilt bitmap, and
+//! the rebuilt bitmap replaces the live one under the exclusive lock.
+//!
+//! ## Layout
+//!
+//! The file starts with a 64 byte header (magic, version, number of bits and the start of a
+//! running rebuild) followed by the live and the rebuilt bitmap in 64 bit words.
+//!
+//! ## License
+//!
+//! pam-authramp
+//! Copyright (C) 2023 github.com/34N0
+//!
+//! This program is free software: you can redistribute it and/or modify
+//! it under the terms of the GNU General Public License as published by
+//! the Free Software Foundation, either version 3 of the License, or
+//! (at your option) any later version.
+//!
+//! This program is distributed in the hope that it will be useful,
+//! but WITHOUT ANY WARRANTY; without even the implied warranty of
+//! MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//! GNU General Public License for more details.
+//!
+//! You should have received a copy of the GNU General Public License
+//! along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+use std::collections::HashMap;
+use std::ffi::OsStr;
+use std::fs::{self, File, OpenOptions};
+use std::io;
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::fs::{FileExt, MetadataExt, OpenOptionsExt};
+use std::os::unix::io::AsRawFd;
+use std::path::{Path, PathBuf};
+use std::ptr::NonNull;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, RwLock};
+
+use chrono::Utc;
+use once_cell::sync::Lazy;
+
+use super::file;
+use super::scan::{is_reserved_name, parallel_map, read_file_names};
+use super::shared::{fnv1a, map_shared, FileLock};
+use crate::settings::Settings;
+use crate::tally::Tally;
+
+/// Name of the filter file inside the tally directory.
+pub const TALLY_FILTER_FILE: &str = "authramp-filter.db";
+
+/// Number of bits of the filter, 128 KiB per bitmap.
+const FILTER_BITS: u64 = 1 << 20;
+/// Largest number of bits accepted from a filter header.
+const MAX_FILTER_BITS: u64 = 1 << 36;
+/// Number of bits set per user.
+const HASHES: u64 = 4;
+const MAGIC: [u8; 8] = *b"ARTLBLM\x01";
+const VERSION: u32 = 1;
+const HEADER_SIZE: usize = 64;
+const REBUILD_OFFSET: usize = 16;
+const WORD_SIZE: usize = 8;
+/// Attempts to open or mark a filter that other processes replace at the same time.
+const OPEN_ATTEMPTS: usize = 8;
+/// Seconds after which a rebuild is taken over, its process has likely died.
+const STALE_REBUILD_SECONDS: u64 = 3600;
+
+/// Process-wide cache of mapped filters, keyed by filter path.
+static TALLY_FILTERS: Lazy<RwLock<HashMap<PathBuf, Arc<TallyFilter>>>> =
+    Lazy::new(|| RwLock::new(HashMap::new()));
+
+/// A Bloom filter of the users with a tally, mapped from a file.
+pub struct TallyFilter {
+    file: File,
+    path: PathBuf,
+    map: NonNull<u8>,
+    len: usize,
+    words: usize,
+    dev: u64,
+    ino: u64,
+}
+
+// The mapping is only accessed through atomics.
+unsafe impl Send for TallyFilter {}
+unsafe impl Sync for TallyFilter {}
+
+/// Shared lock of the filter, or of the tally directory if there is no filter, held while a tally
+/// with failures is written. The file is opened again for every mark, because an `flock` belongs
+/// to the open file and would be shared by all threads of the process otherwise.
+pub struct FilterMark(#[allow(dead_code)] File);
+
+impl TallyFilter {
+    /// Returns the mapped filter of the tally directory from the process-wide cache, opening it
+    /// if it is not mapped yet or if the file was replaced since it was mapped.
+    ///
+    /// # Arguments
+    /// - `settings`: A reference to the `Settings` struct.
+    ///
+    /// # Returns
+    /// The mapped filter, `None` if there is no valid filter, or the error that occurred while
+    /// opening it.
+    pub fn open_cached(settings: &Settings) -> io::Result<Option<Arc<TallyFilter>>> {
+        let path = settings.tally_dir.join(TALLY_FILTER_FILE);
+        let meta = match fs::metadata(&path) {
+            Ok(meta) => meta,
+            Err(e) if e.kind() == io::ErrorKind::NotFound => return Ok(None),
+            Err(e) => return Err(e),
+        };
+
+        if let Ok(filters) = TALLY_FILTERS.read() {
+            if let Some(filter) = filters
+                .get(&path)
+                .filter(|filter| meta.dev() == filter.dev && meta.ino() == filter.ino)
+            {
+                return Ok(Some(Arc::clone(filter)));
+            }
+        }
+
+        let Some(filter) = Self::open(&path)? else {
+            return Ok(None);
+        };
+        let filter = Arc::new(filter);
+
+        if let Ok(mut filters) = TALLY_FILTERS.write() {
+            filters.insert(path, Arc::clone(&filter));
+        }
+
+        Ok(Some(filter))
+    }
+
+    /// Opens and maps a filter file.
+    ///
+    /// # Arguments
+    /// - `path`: Path of the filter file
+    ///
+    /// # Returns
+    /// The mapped filter, `None` if there is no filter or its header is invalid, or the error
+    /// that occurred while opening it.
+    pub fn open(path: &Path) -> io::Result<Option<TallyFilter>> {
+        let file = match OpenOptions::new().read(true).write(true).open(path) {
+            Ok(file) => file,
+            Err(e) if e.kind() == io::ErrorKind::NotFound => return Ok(None),
+            Err(e) => return Err(e),
+        };
+
+        let meta = file.metadata()?;
+        let Some(bits) = Self::read_header(&file, meta.len())? else {
+            return Ok(None);
+        };
+
+        let len = Self::file_len(bits);
+        Ok(Some(TallyFilter {
+            map: map_shared(&file, len)?,
+            file,
+            path: path.to_path_buf(),
+            len,
+            words: (bits / 64) as usize,
+            dev: meta.dev(),
+            ino: meta.ino(),
+        }))
+    }
+
+    /// Returns the filter of the tally directory, creating it if there is no valid filter. A new
+    /// filter contains every user until it is rebuilt, see `rebuild`. Used by the compaction
+    /// only, because the tally directory is locked exclusively while the filter is put in place.
+    ///
+    /// # Arguments
+    /// - `settings`: A reference to the `Settings` struct.
+    ///
+    /// # Returns
+    /// The mapped filter or the error that occurred while creating it.
+    pub fn create(settings: &Settings) -> io::Result<Arc<TallyFilter>> {
+        fs::create_dir_all(&settings.tally_dir)?;
+
+        let path = settings.tally_dir.join(TALLY_FILTER_FILE);
+        for _ in 0..OPEN_ATTEMPTS {
+            if let Some(filter) = Self::open_cached(settings)? {
+                return Ok(filter);
+            }
+
+            // No process uses a filter without a valid header
+            remove_filter(&settings.tally_dir)?;
+
+            let temp_path = file::temp_path(&path);
+            let result =
+                Self::write_new(&temp_path).and_then(|()| fs::hard_link(&temp_path, &path));
+            let _ = fs::remove_file(&temp_path);
+            match result {
+                Ok(()) => {}
+                Err(e) if e.kind() == io::ErrorKind::AlreadyExists => continue,
+                Err(e) => return Err(e),
+            }
+
+            // Writers that found no filter are done before the first rebuild reads the tallies
+            let dir = File::open(&settings.tally_dir)?;
+            drop(FileLock::exclusive(&dir)?);
+        }
+        Err(io::Error::new(
+            io::ErrorKind::Other,
+            "tally filter keeps being replaced",
+        ))
+    }
+
+    /// Writes a new filter file that contains every user.
+    fn write_new(path: &Path) -> io::Result<()> {
+        let file = OpenOptions::new()
+            .write(true)
+            .create_new(true)
+            .mode(0o600)
+            .open(path)?;
+        file.set_len(Self::file_len(FILTER_BITS) as u64)?;
+        file.write_all_at(
+            &vec![u8::MAX; (FILTER_BITS / 8) as usize],
+            HEADER_SIZE as u64,
+        )?;
+
+        let mut header = [0u8; HEADER_SIZE];
+        header[0..8].copy_from_slice(&MAGIC);
+        header[8..12].copy_from_slice(&VERSION.to_le_bytes());
+        header[24..32].copy_from_slice(&FILTER_BITS.to_le_bytes());
+        file.write_all_at(&header, 0)
+    }
+
+    /// Reads the header of a filter file of `file_len` bytes.
+    ///
+    /// # Returns
+    /// The number of bits per bitmap, `None` if the header is invalid or the file is truncated.
+    fn read_header(file: &File, file_len: u64) -> io::Result<Option<u64>> {
+        let mut header = [0u8; HEADER_SIZE];
+        match file.read_exact_at(&mut header, 0) {
+            Ok(()) => {}
+            Err(e) if e.kind() == io::ErrorKind::UnexpectedEof => return Ok(None),
+            Err(e) => return Err(e),
+        }
+
+        let version = u32::from_le_bytes([header[8], header[9], header[10], header[11]]);
+        let bits = u64::from_le_bytes(header[24..32].try_into().unwrap_or_default());
+        let is_valid = header[0..8] == MAGIC
+            && version == VERSION
+            && bits.is_power_of_two()
+            && (64..=MAX_FILTER_BITS).contains(&bits)
+            && file_len >= Self::file_len(bits) as u64;
+        Ok(is_valid.then_some(bits))
+    }
+
+    /// Size of a filter file with `bits` bits per bitmap.
+    fn file_len(bits: u64) -> usize {
+        HEADER_SIZE + 2 * (bits / 8) as usize
+    }
+
+    /// Returns the names of all tally files that may hold failures. Unreadable tally files are
+    /// included.
+    fn tallied_names(settings: &Settings) -> io::Result<Vec<std::ffi::OsString>> {
+        let mut names = match read_file_names(&settings.tally_dir) {
+            Ok(names) => names,
+            Err(e) if e.kind() == io::ErrorKind::NotFound => return Ok(Vec::new()),
+            Err(e) => return Err(e),
+        };
+        names.retain(|name| !is_reserved_name(name));
+
+        let tallied = parallel_map(&names, |name| {
+            match Tally::load_tally_file(&settings.tally_dir.join(name)) {
+                Ok(Some(tally)) => !tally.is_clear(),
+                Ok(None) => false,
+                Err(_) => true,
+            }
+        });
+
+        Ok(names
+            .into_iter()
+            .zip(tallied)
+            .filter_map(|(name, tallied)| tallied.then_some(name))
+            .collect())
+    }
+
+    /// Returns the start of the running rebuild in seconds since the epoch, 0 if none runs.
+    fn rebuild_start(&self) -> &AtomicU64 {
+        unsafe { &*(self.map.as_ptr().add(REBUILD_OFFSET) as *const AtomicU64) }
+    }
+
+    /// Returns a word of the live (0) or the rebuilt (1) bitmap.
+    fn word(&self, bitmap: usize, index: usize) -> &AtomicU64 {
+        let offset = HEADER_SIZE + (bitmap * self.words + index) * WORD_SIZE;
+        debug_assert!(offset + WORD_SIZE <= self.len);
+        unsafe { &*(self.map.as_ptr().add(offset) as *const AtomicU64) }
+    }
+
+    /// Returns the bits of `name`.
+    fn bits(&self, name: &OsStr) -> [usize; HASHES as usize] {
+        // Double hashing derives the bits from a single 64 bit hash
+        let h1 = fnv1a(name.as_bytes());
+        let h2 = h1.wrapping_mul(0x9e37_79b9_7f4a_7c15) | 1;
+        let mask = (self.words * 64 - 1) as u64;
+
+        let mut bits = [0; HASHES as usize];
+        for (i, bit) in bits.iter_mut().enumerate() {
+            *bit = ((h1.wrapping_add((i as u64).wrapping_mul(h2)) >> 32) & mask) as usize;
+        }
+        bits
+    }
+
+    /// Sets the bits of `name` in a bitmap.
+    fn insert(&self, bitmap: usize, name: &OsStr) {
+        for bit in self.bits(name) {
+            self.word(bitmap, bit / 64)
+                .fetch_or(1 << (bit % 64), Ordering::AcqRel);
+        }
+    }
+
+    /// Returns false if the user has no tally with failures, true if it may have one.
+    ///
+    /// # Arguments
+    /// - `name`: The name of the user
+    pub fn contains(&self, name: &OsStr) -> bool {
+        self.bits(name)
+            .iter()
+            .all(|&bit| self.word(0, bit / 64).load(Ordering::Acquire) & (1 << (bit % 64)) != 0)
+    }
+
+    /// Adds a user to the filter before a tally with failures is written. The returned mark has
+    /// to be held until the tally file is replaced.
+    ///
+    /// # Arguments
+    /// - `name`: The name of the user
+    ///
+    /// # Returns
+    /// The mark or the error that occurred while locking the filter.
+    pub fn mark(&self, name: &OsStr) -> io::Result<FilterMark> {
+        let file = File::open(&self.path)?;
+        if unsafe { libc::flock(file.as_raw_fd(), libc::LOCK_SH) } != 0 {
+            return Err(io::Error::last_os_error());
+        }
+
+        // The filter is only removed under the exclusive lock, a filter that is still in place
+        // once the lock is held stays in place until the tally is written
+        let is_current = |meta: fs::Metadata| meta.dev() == self.dev && meta.ino() == self.ino;
+        if !is_current(file.metadata()?) || !fs::metadata(&self.path).map_or(false, is_current) {
+            return Err(io::Error::new(
+                io::ErrorKind::NotFound,
+                "tally filter was replaced",
+            ));
+        }
+
+        self.insert(0, name);
+        if self.rebuild_start().load(Ordering::Acquire) != 0 {
+            self.insert(1, name);
+        }
+        Ok(FilterMark(file))
+    }
+
+    /// Rebuilds the filter from the tally files, so users whose tally was cleared leave it.
+    ///
+    /// # Arguments
+    /// - `settings`: A reference to the `Settings` struct.
+    ///
+    /// # Returns
+    /// Whether the filter was rebuilt, false if another rebuild is running, or the error that
+    /// occurred while reading the tally directory.
+    pub fn rebuild(&self, settings: &Settings) -> io::Result<bool> {
+        let now = Utc::now().timestamp().max(1) as u64;
+        {
+            let _lock = FileLock::exclusive(&self.file)?;
+            let start = self.rebuild_start().load(Ordering::Acquire);
+            if start != 0 && now.saturating_sub(start) < STALE_REBUILD_SECONDS {
+                return Ok(false);
+            }
+            for index in 0..self.words {
+                self.word(1, index).store(0, Ordering::Relaxed);
+            }
+            // From here on writers also mark the rebuilt bitmap
+            self.rebuild_start().store(now, Ordering::Release);
+        }
+
+        // Every tally written before the rebuild started is in the tally directory now
+        let names = Self::tallied_names(settings);
+
+        let _lock = FileLock::exclusive(&self.file)?;
+        let names = match names {
+            Ok(names) => names,
+            Err(e) => {
+                self.rebuild_start().store(0, Ordering::Release);
+                return Err(e);
+            }
+        };
+        for name in names {
+            self.insert(1, &name);
+        }
+
+        // A word only loses the bits of users without a tally, concurrent lookups stay correct
+        for index in 0..self.words {
+            let word = self.word(1, index).load(Ordering::Acquire);
+            self.word(0, index).store(word, Ordering::Release);
+        }
+        self.rebuild_start().store(0, Ordering::Release);
+        Ok(true)
+    }
+}
+
+impl Drop for TallyFilter {
+    fn drop(&mut self) {
+        unsafe {
+            libc::munmap(self.map.as_ptr() as *mut libc::c_void, self.len);
+        }
+    }
+}
+
+/// Marks a user before a tally with failures is written, see `TallyFilter::mark`. Without a valid
+/// filter, the shared lock of the tally directory is taken instead, so a filter that is created
+/// meanwhile finds the tally, see `TallyFilter::create`. The returned mark has to be held until
+/// the tally file is replaced.
+///
+/// # Arguments
+/// - `settings`: A reference to the `Settings` struct.
+/// - `name`: The name of the user
+///
+/// # Returns
+/// The mark or the error that occurred while locking the filter or the tally directory.
+pub fn mark(settings: &Settings, name: &OsStr) -> io::Result<FilterMark> {
+    for _ in 0..OPEN_ATTEMPTS {
+        if let Some(filter) = TallyFilter::open_cached(settings)? {
+            match filter.mark(name) {
+                // The filter was removed or replaced, mark its successor
+                Err(e) if e.kind() == io::ErrorKind::NotFound => continue,
+                result => return result,
+            }
+        }
+
+        let dir = File::open(&settings.tally_dir)?;
+        if unsafe { libc::flock(dir.as_raw_fd(), libc::LOCK_SH) } != 0 {
+            return Err(io::Error::last_os_error());
+        }
+        // A filter created before the lock was taken is marked instead
+        if TallyFilter::open_cached(settings)?.is_none() {
+            return Ok(FilterMark(dir));
+        }
+    }
+    Err(io::Error::new(
+        io::ErrorKind::Other,
+        "tally filter keeps being replaced",
+    ))
+}
+
+/// Removes the filter of the tally directory, because it cannot be marked. The filter is removed under its exclusive lock, so tallies that
+/// are written with a mark of the filter are in the tally directory before it is gone.
+///
+/// # Arguments
+/// - `tally_dir`: The tally directory
+///
+/// # Returns
+/// The error that occurred while removing the filter.
+pub fn remove_filter(tally_dir: &Path) -> io::Result<()> {
+    let path = tally_dir.join(TALLY_FILTER_FILE);
+    let file = match File::open(&path) {
+        Ok(file) => file,
+        Err(e) if e.kind() == io::ErrorKind::NotFound => return Ok(()),
+        Err(e) => return Err(e),
+    };
+    let _lock = FileLock::exclusive(&file)?;
+
+    // Another process may have removed or replaced the filter while waiting for the lock
+    let meta = file.metadata()?;
+    match fs::metadata(&path) {
+        Ok(current) if current.dev() == meta.dev() && current.ino() == meta.ino() => {}
+        Ok(_) => return Ok(()),
+        Err(e) if e.kind() == io::ErrorKind::NotFound => return Ok(()),
+        Err(e) => return Err(e),
+    }
+    match fs::remove_file(&path) {
+        Err(e) if e.kind() != io::ErrorKind::NotFound => Err(e),
+        _ => Ok(()),
+    }
+}
+
+// Unit Tests
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use tempdir::TempDir;
+
+    const LOCKED: &str = "[Fails]\ncount = 8\ninstant = \"2023-01-01T00:00:00Z\"";
+    const CLEAR: &str = "[Fails]\ncount = 0\ninstant = \"2023-01-01T00:00:00Z\"";
+
+    #[test]
+    fn test_new_filter_contains_existing_tallies() {
+        let temp_dir = TempDir::new("test_new_filter_contains_existing_tallies").unwrap();
+        fs::write(temp_dir.path().join("locked"), LOCKED).unwrap();
+        fs::write(temp_dir.path().join("clear"), CLEAR).unwrap();
+        let settings = Settings {
+            tally_dir: temp_dir.path().to_path_buf(),
+            ..Default::default()
+        };
+
+        // There is no filter until the compaction creates one
+        assert!(TallyFilter::open_cached(&settings).unwrap().is_none());
+        let filter = TallyFilter::create(&settings).unwrap();
+        assert!(filter.contains(OsStr::new("clear")));
+
+        assert!(filter.rebuild(&settings).unwrap());
+        assert!(filter.contains(OsStr::new("locked")));
+        assert!(!filter.contains(OsStr::new("clear")));
+        assert!(!filter.contains(OsStr::new("never_failed")));
+
+        drop(mark(&settings, OsStr::new("never_failed")).unwrap());
+        assert!(filter.contains(OsStr::new("never_failed")));
+
+        // Another process maps the same filter
+        let other = TallyFilter::open(&temp_dir.path().join(TALLY_FILTER_FILE))
+            .unwrap()
+            .unwrap();
+        assert!(other.contains(OsStr::new("locked")));
+        assert!(other.contains(OsStr::new("never_failed")));
+    }
+
+    #[test]
+    fn test_rebuild_removes_cleared_tallies() {
+        let temp_dir = TempDir::new("test_rebuild_removes_cleared_tallies").unwrap();
+        fs::write(temp_dir.path().join("locked"), LOCKED).unwrap();
+        fs::write(temp_dir.path().join("reset"), LOCKED).unwrap();
+        let settings = Settings {
+            tally_dir: temp_dir.path().to_path_buf(),
+            ..Default::default()
+        };
+
+        let filter = TallyFilter::create(&settings).unwrap();
+        assert!(filter.rebuild(&settings).unwrap());
+        assert!(filter.contains(OsStr::new("reset")));
+
+        fs::write(temp_dir.path().join("reset"), CLEAR).unwrap();
+        assert!(filter.rebuild(&settings).unwrap());
+        assert!(filter.contains(OsStr::new("locked")));
+        assert!(!filter.contains(OsStr::new("reset")));
+    }
+
+    #[test]
+    fn test_invalid_filter_is_not_used() {
+        let temp_dir = TempDir::new("test_invalid_filter_is_not_used").unwrap();
+        fs::write(temp_dir.path().join("locked"), LOCKED).unwrap();
+        let settings = Settings {
+            tally_dir: temp_dir.path().to_path_buf(),
+            ..Default::default()
+        };
+
+        // A zeroed file of full length has no valid header
+        let path = temp_dir.path().join(TALLY_FILTER_FILE);
+        File::create(&path)
+            .unwrap()
+            .set_len(TallyFilter::file_len(FILTER_BITS) as u64)
+            .unwrap();
+        assert!(TallyFilter::open_cached(&settings).unwrap().is_none());
+
+        // Writers lock the tally directory instead
+        drop(mark(&settings, OsStr::new("locked")).unwrap());
+
+        // The compaction replaces it
+        let filter = TallyFilter::create(&settings).unwrap();
+        assert!(filter.rebuild(&settings).unwrap());
+        assert!(filter.contains(OsStr::new("locked")));
+        assert!(!filter.contains(OsStr::new("never_failed")));
+    }
+
+    #[test]
+    fn test_filter_is_removed_after_marked_writes() {
+        let temp_dir = TempDir::new("test_filter_is_removed_after_marked_writes").unwrap();
+        let settings = Settings {
+            tally_dir: temp_dir.path().to_path_buf(),
+            ..Default::default()
+        };
+        let filter = TallyFilter::create(&settings).unwrap();
+        let path = temp_dir.path().join(TALLY_FILTER_FILE);
+
+        // The removal waits for the tally write of the mark
+        let mark = filter.mark(OsStr::new("locked")).unwrap();
+        let remove = {
+            let tally_dir = settings.tally_dir.clone();
+            std::thread::spawn(move || remove_filter(&tally_dir).unwrap())
+        };
+        std::thread::sleep(std::time::Duration::from_millis(50));
+        assert!(path.exists());
+        drop(mark);
+        remove.join().unwrap();
+        assert!(!path.exists());
+
+        // A removed filter is not marked anymore
+        assert!(filter.mark(OsStr::new("locked")).is_err());
+    }
+}
@@ -0,0 +1,447 @@
+//! # Gossip Protocol
+//!
+//! Shares the failures of every account between the `authrampd` daemons of a cluster, so an
+//! attacker spreading attempts over the nodes behind a load balancer still ramps up a single
+//! delay. The PAM module keeps talking to its local daemon only; the daemons exchange updates in
+//! the background over UDP, so no network round trip is ever on the path of a PAM hook.
+//!
+//! ## Cluster Tally
+//!
+//! The failures of an account are a counter per node since the last reset. A node only ever
+//! increases its own counter and gossips it, the cluster failures count is the sum over all
+//! nodes. A reset is a wall clock instant: an update with a later reset clears all counters,
+//! updates with an earlier reset are stale and ignored. Merging is idempotent and commutative,
+//! so lost, duplicated and reordered datagrams do not matter as long as some update of every
+//! node gets through. The clocks of the nodes should be synchronized with NTP.
+//!
+//! ## Message Layout
+//!
+//! | Offset | Size | Field                                       |
+//! |--------|------|---------------------------------------------|
+//! | 0      | 4    | magic `ARTG`                                |
+//! | 4      | 2    | version                                     |
+//! | 6      | 1    | length of the user name                     |
+//! | 7      | 1    | reserved                                    |
+//! | 8      | 8    | node id                                     |
+//! | 16     | 8    | reset instant, ns since the epoch           |
+//! | 24     | 4    | failures of the node since the reset        |
+//! | 28     | 4    | reserved                                    |
+//! | 32     | 8    | last failure of the node, ns since epoch    |
+//! | 40     | 32   | user name, zero padded                      |
+//! | 72     | 8    | SipHash-2-4 MAC of bytes 0 to 71            |
+//!
+//! Accounts are identified by name, because uids may differ between nodes. The MAC is keyed with
+//! the first 16 bytes of `gossip_key_file`, which has to be the same on all nodes. Without the
+//! key, forged updates cannot unlock or lock an account, and replayed updates are merged away.
+//!
+//! ## License
+//!
+//! pam-authramp
+//! Copyright (C) 2023 github.com/34N0
+//!
+//! This program is free software: you can redistribute it and/or modify
+//! it under the terms of the GNU General Public License as published by
+//! the Free Software Foundation, either version 3 of the License, or
+//! (at your option) any later version.
+//!
+//! This program is distributed in the hope that it will be useful,
+//! but WITHOUT ANY WARRANTY; without even the implied warranty of
+//! MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//! GNU General Public License for more details.
+//!
+//! You should have received a copy of the GNU General Public License
+//! along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+use std::collections::HashMap;
+use std::fs;
+use std::hash::Hasher;
+use std::io;
+use std::path::Path;
+
+use chrono::{DateTime, Utc};
+
+use super::daemon::MAX_NAME_LEN;
+use super::shared::{from_nanos, to_nanos};
+use crate::tally::Tally;
+
+/// Size of an encoded message in bytes.
+pub const MESSAGE_SIZE: usize = 80;
+
+const MAGIC: [u8; 4] = *b"ARTG";
+const VERSION: u16 = 1;
+const NAME_OFFSET: usize = 40;
+const MAC_OFFSET: usize = 72;
+const KEY_LEN: usize = 16;
+
+/// A decoded gossip update: the counter of one node for one account.
+#[derive(Debug, PartialEq)]
+pub struct Update<'a> {
+    /// Id of the sending node.
+    pub node: u64,
+    /// Reset instant the counter is based on, ns since the epoch.
+    pub reset: i64,
+    /// Failures counted by the node since the reset.
+    pub count: u32,
+    /// Last failure counted by the node, ns since the epoch.
+    pub last_failure: i64,
+    /// Name of the account.
+    pub name: &'a [u8],
+}
+
+/// Key of the message MAC.
+#[derive(Clone)]
+pub struct GossipKey {
+    k0: u64,
+    k1: u64,
+}
+
+impl GossipKey {
+    /// Creates a key from 16 bytes.
+    pub fn new(bytes: [u8; KEY_LEN]) -> Self {
+        GossipKey {
+            k0: u64::from_le_bytes(bytes[0..8].try_into().unwrap()),
+            k1: u64::from_le_bytes(bytes[8..16].try_into().unwrap()),
+        }
+    }
+
+    /// Loads the key from the first 16 bytes of a key file.
+    ///
+    /// # Arguments
+    /// - `path`: Path of the key file
+    ///
+    /// # Returns
+    /// The key, or an error if the file cannot be read or is shorter than 16 bytes.
+    pub fn load(path: &Path) -> io::Result<Self> {
+        let bytes = fs::read(path)?;
+        match bytes.get(..KEY_LEN) {
+            Some(key) => Ok(Self::new(key.try_into().unwrap())),
+            None => Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "gossip key file holds less than 16 bytes",
+            )),
+        }
+    }
+
+    /// Returns the MAC of `data`.
+    fn mac(&self, data: &[u8]) -> u64 {
+        // SipHash-2-4 is a keyed PRF designed for authenticating short messages
+        #[allow(deprecated)]
+        let mut hasher = std::hash::SipHasher::new_with_keys(self.k0, self.k1);
+        hasher.write(data);
+        hasher.finish()
+    }
+}
+
+/// Encodes a gossip update.
+///
+/// # Arguments
+/// - `update`: The update
+/// - `key`: Key of the message MAC
+///
+/// # Returns
+/// The encoded message, or an error if the user name is too long.
+pub fn encode(update: &Update, key: &GossipKey) -> io::Result<[u8; MESSAGE_SIZE]> {
+    if update.name.is_empty() || update.name.len() > MAX_NAME_LEN {
+        return Err(io::Error::new(
+            io::ErrorKind::InvalidInput,
+            "user name does not fit into a gossip message",
+        ));
+    }
+
+    let mut buf = [0u8; MESSAGE_SIZE];
+    buf[0..4].copy_from_slice(&MAGIC);
+    buf[4..6].copy_from_slice(&VERSION.to_le_bytes());
+    buf[6] = update.name.len() as u8;
+    buf[8..16].copy_from_slice(&update.node.to_le_bytes());
+    buf[16..24].copy_from_slice(&update.reset.to_le_bytes());
+    buf[24..28].copy_from_slice(&update.count.to_le_bytes());
+    buf[32..40].copy_from_slice(&update.last_failure.to_le_bytes());
+    buf[NAME_OFFSET..NAME_OFFSET + update.name.len()].copy_from_slice(update.name);
+    let mac = key.mac(&buf[..MAC_OFFSET]);
+    buf[MAC_OFFSET..].copy_from_slice(&mac.to_le_bytes());
+    Ok(buf)
+}
+
+/// Decodes and authenticates a gossip message.
+///
+/// # Arguments
+/// - `buf`: The encoded message
+/// - `key`: Key of the message MAC
+///
+/// # Returns
+/// The update borrowing the user name from `buf`, or a description of the error.
+pub fn decode<'a>(
+    buf: &'a [u8; MESSAGE_SIZE],
+    key: &GossipKey,
+) -> Result<Update<'a>, &'static str> {
+    let mac = u64::from_le_bytes(buf[MAC_OFFSET..].try_into().unwrap());
+    if mac != key.mac(&buf[..MAC_OFFSET]) {
+        return Err("gossip message is not authentic");
+    }
+    if buf[0..4] != MAGIC {
+        return Err("not an authramp gossip message");
+    }
+    if u16::from_le_bytes([buf[4], buf[5]]) != VERSION {
+        return Err("unsupported gossip protocol version");
+    }
+
+    let name_len = buf[6] as usize;
+    if name_len == 0 || name_len > MAX_NAME_LEN {
+        return Err("invalid user name length");
+    }
+
+    Ok(Update {
+        node: u64::from_le_bytes(buf[8..16].try_into().unwrap()),
+        reset: i64::from_le_bytes(buf[16..24].try_into().unwrap()),
+        count: u32::from_le_bytes(buf[24..28].try_into().unwrap()),
+        last_failure: i64::from_le_bytes(buf[32..40].try_into().unwrap()),
+        name: &buf[NAME_OFFSET..NAME_OFFSET + name_len],
+    })
+}
+
+/// Returns a random node id.
+pub fn random_node_id() -> u64 {
+    let mut bytes = [0u8; 8];
+    let filled = unsafe { libc::getrandom(bytes.as_mut_ptr() as *mut libc::c_void, 8, 0) };
+    if filled == 8 {
+        return u64::from_le_bytes(bytes);
+    }
+
+    // Unique enough without getrandom, the id only has to differ between the nodes
+    let now = Utc::now().timestamp_nanos_opt().unwrap_or_default() as u64;
+    now ^ (u64::from(std::process::id()) << 48)
+}
+
+/// Counter of one node.
+#[derive(Debug, Default, Clone, Copy, PartialEq)]
+struct NodeCount {
+    count: u32,
+    last_failure: i64,
+}
+
+/// The failures of one account across the cluster.
+#[derive(Debug, Default, Clone, PartialEq)]
+pub struct ClusterTally {
+    reset: i64,
+    nodes: HashMap<u64, NodeCount>,
+}
+
+impl ClusterTally {
+    /// Counts the failures of a local tally that the cluster tally does not know about as
+    /// failures of `node`. Used once per account when its tally file is loaded, so the
+    /// failures from before a daemon restart are kept. Failures written to the tally file from
+    /// other nodes may be counted twice until the next reset, but never lost.
+    pub fn seed(&mut self, node: u64, tally: &Tally) {
+        let missing = tally.failures_count.saturating_sub(self.failures_count());
+        if missing > 0 {
+            let own = self.nodes.entry(node).or_default();
+            own.count = own.count.saturating_add(missing as u32);
+            own.last_failure = own.last_failure.max(to_nanos(Some(tally.failure_instant)));
+        }
+    }
+
+    /// Counts a failure of `node` at `instant`.
+    pub fn add_failure(&mut self, node: u64, instant: DateTime<Utc>) {
+        let own = self.nodes.entry(node).or_default();
+        own.count = own.count.saturating_add(1);
+        own.last_failure = own.last_failure.max(to_nanos(Some(instant)));
+    }
+
+    /// Clears the failures of all nodes at `instant`.
+    pub fn reset(&mut self, instant: DateTime<Utc>) {
+        self.reset = self.reset.max(to_nanos(Some(instant)));
+        self.nodes.clear();
+    }
+
+    /// Merges the update of another node into the cluster tally of `node`.
+    ///
+    /// A later reset clears the failures of all nodes, except the own failures of `node` if the
+    /// last one came after the reset. Those may include failures from before the reset, they are
+    /// counted until the next reset, but a failure after the reset is never lost.
+    ///
+    /// # Returns
+    /// Whether the cluster tally changed.
+    pub fn merge(&mut self, node: u64, update: &Update) -> bool {
+        if update.reset < self.reset {
+            return false;
+        }
+
+        let mut changed = false;
+        if update.reset > self.reset {
+            self.reset = update.reset;
+            self.nodes
+                .retain(|&id, counter| id == node && counter.last_failure > update.reset);
+            changed = true;
+        }
+
+        let counter = self.nodes.entry(update.node).or_default();
+        if update.count > counter.count {
+            counter.count = update.count;
+            counter.last_failure = counter.last_failure.max(update.last_failure);
+            changed = true;
+        }
+        changed
+    }
+
+    /// Returns the failures of all nodes since the last reset.
+    pub fn failures_count(&self) -> i32 {
+        let sum = self
+            .nodes
+            .values()
+            .fold(0u64, |sum, node| sum + u64::from(node.count));
+        i32::try_from(sum).unwrap_or(i32::MAX)
+    }
+
+    /// Returns the last failure on any node, `None` if there is none since the last reset.
+    pub fn last_failure(&self) -> Option<DateTime<Utc>> {
+        self.nodes
+            .values()
+            .filter(|node| node.count > 0)
+            .map(|node| node.last_failure)
+            .max()
+            .and_then(from_nanos)
+    }
+
+    /// Returns the update gossiping the counter of `node`.
+    pub fn update<'a>(&self, node: u64, name: &'a [u8]) -> Update<'a> {
+        let own = self.nodes.get(&node).copied().unwrap_or_default();
+        Update {
+            node,
+            reset: self.reset,
+            count: own.count,
+            last_failure: own.last_failure,
+            name,
+        }
+    }
+}
+
+// Unit Tests
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use chrono::TimeZone;
+
+    const KEY: [u8; KEY_LEN] = *b"0123456789abcdef";
+
+    fn at(seconds: i64) -> DateTime<Utc> {
+        Utc.timestamp_opt(1_700_000_000 + seconds, 0).unwrap()
+    }
+
+    #[test]
+    fn test_encode_and_decode() {
+        let key = GossipKey::new(KEY);
+        let update = Update {
+            node: 7,
+            reset: 11,
+            count: 3,
+            last_failure: 13,
+            name: b"test_user",
+        };
+
+        let mut buf = encode(&update, &key).unwrap();
+        assert_eq!(decode(&buf, &key).unwrap(), update);
+
+        // Tampered messages and foreign keys are rejected
+        assert!(decode(&buf, &GossipKey::new(*b"fedcba9876543210")).is_err());
+        buf[24] = 0;
+        assert!(decode(&buf, &key).is_err());
+
+        let long = Update {
+            name: &[b'a'; MAX_NAME_LEN + 1],
+            ..update
+        };
+        assert!(encode(&long, &key).is_err());
+    }
+
+    #[test]
+    fn test_counters_of_all_nodes_add_up() {
+        let mut a = ClusterTally::default();
+        let mut b = ClusterTally::default();
+
+        a.add_failure(1, at(1));
+        a.add_failure(1, at(2));
+        b.add_failure(2, at(3));
+
+        assert!(b.merge(2, &a.update(1, b"user")));
+        assert!(a.merge(1, &b.update(2, b"user")));
+        // Duplicates change nothing
+        assert!(!a.merge(1, &b.update(2, b"user")));
+
+        assert_eq!((a.failures_count(), b.failures_count()), (3, 3));
+        assert_eq!(a.last_failure(), Some(at(3)));
+        assert_eq!(a, b);
+    }
+
+    #[test]
+    fn test_later_reset_wins() {
+        let mut a = ClusterTally::default();
+        let mut b = ClusterTally::default();
+        a.add_failure(1, at(1));
+        b.merge(2, &a.update(1, b"user"));
+        b.add_failure(2, at(2));
+
+        a.reset(at(3));
+        let stale = b.update(2, b"user");
+        assert!(b.merge(2, &a.update(1, b"user")));
+        assert_eq!(b.failures_count(), 0);
+        assert_eq!(b.last_failure(), None);
+
+        // Updates from before the reset are ignored
+        assert!(!a.merge(1, &stale));
+        assert_eq!(a.failures_count(), 0);
+
+        b.add_failure(2, at(4));
+        assert!(a.merge(1, &b.update(2, b"user")));
+        assert_eq!(a.failures_count(), 1);
+    }
+
+    #[test]
+    fn test_reset_keeps_own_failures_after_it() {
+        let mut a = ClusterTally::default();
+        let mut b = ClusterTally::default();
+        a.add_failure(1, at(1));
+        b.merge(2, &a.update(1, b"user"));
+        b.add_failure(2, at(2));
+
+        // The reset on a reaches b after a local failure that came later. b keeps its own
+        // failures, including the one from before the reset, and drops those of a.
+        a.reset(at(3));
+        b.add_failure(2, at(4));
+        assert!(b.merge(2, &a.update(1, b"user")));
+        assert_eq!(b.failures_count(), 2);
+        assert_eq!(b.last_failure(), Some(at(4)));
+
+        // The own failures of b are gossiped with the new reset and not dropped by a
+        assert!(a.merge(1, &b.update(2, b"user")));
+        assert_eq!(a.failures_count(), 2);
+        assert_eq!(a.last_failure(), Some(at(4)));
+
+        // Own failures from before a reset are cleared
+        a.add_failure(1, at(5));
+        b.reset(at(6));
+        assert!(a.merge(1, &b.update(2, b"user")));
+        assert_eq!(a.failures_count(), 0);
+    }
+
+    #[test]
+    fn test_seed_counts_missing_local_failures() {
+        let tally = Tally {
+            failures_count: 4,
+            failure_instant: at(5),
+            ..Default::default()
+        };
+        let mut cluster = ClusterTally::default();
+        cluster.seed(1, &tally);
+        assert_eq!(cluster.failures_count(), 4);
+        assert_eq!(cluster.last_failure(), Some(at(5)));
+        assert_eq!(cluster.update(1, b"user").count, 4);
+
+        // Failures the cluster already knows are not counted again
+        let mut cluster = ClusterTally::default();
+        cluster.add_failure(2, at(1));
+        cluster.add_failure(2, at(2));
+        cluster.seed(1, &tally);
+        assert_eq!(cluster.failures_count(), 4);
+        assert_eq!(cluster.update(1, b"user").count, 2);
+    }
+}
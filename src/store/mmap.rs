@@ -0,0 +1,631 @@
+//! # Memory-Mapped Tally Database
+//!
+//! Stores the tallies of all users in a single file that is mapped into every process using the
+//! module. The file is an open-addressed hash table keyed by uid with linear probing. Slots are
+//! updated in place with atomic operations, so concurrent PAM processes never lose an increment
+//! and looking up a user costs a few memory loads instead of a path lookup per user.
+//!
+//! ## Layout
+//!
+//! The file starts with a 64 byte header (magic, version and slot count) followed by
+//! `slot_count` slots of 32 bytes each. A slot holds the key (uid + 1, zero marks an empty
+//! slot), the failure and unlock instants in nanoseconds since the epoch (zero if unset) and the
+//! failures count and a dirty mark used when the table caches tallies of another backend. Slots
+//! are never removed, so a lookup can stop at the first empty slot.
+//!
+//! The same table can also be mapped from a POSIX shared memory segment instead of a file, see
+//! the `cache` module.
+//!
+//! ## License
+//!
+//! pam-authramp
+//! Copyright (C) 2023 github.com/34N0
+//!
+//! This program is free software: you can redistribute it and/or modify
+//! it under the terms of the GNU General Public License as published by
+//! the Free Software Foundation, either version 3 of the License, or
+//! (at your option) any later version.
+//!
+//! This program is distributed in the hope that it will be useful,
+//! but WITHOUT ANY WARRANTY; without even the implied warranty of
+//! MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//! GNU General Public License for more details.
+//!
+//! You should have received a copy of the GNU General Public License
+//! along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+use std::collections::HashMap;
+use std::ffi::CString;
+use std::fs::{self, File, OpenOptions};
+use std::io;
+use std::os::unix::fs::{FileExt, MetadataExt, OpenOptionsExt};
+use std::os::unix::io::FromRawFd;
+use std::path::{Path, PathBuf};
+use std::ptr::{self, NonNull};
+use std::sync::atomic::{AtomicI64, AtomicU32, AtomicU64, Ordering};
+use std::sync::{Arc, RwLock};
+
+use once_cell::sync::Lazy;
+
+use super::shared::{from_nanos, map_shared, to_nanos, FileLock, INSTANT_NONE};
+use crate::tally::Tally;
+
+/// Directory backing POSIX shared memory objects.
+const SHM_DIR: &str = "/dev/shm";
+
+const MAGIC: [u8; 8] = *b"ARTLDB\0\x01";
+const VERSION: u32 = 1;
+const HEADER_SIZE: usize = 64;
+const SLOT_SIZE: usize = 32;
+/// Largest number of slots of a new database, 2 GiB of slots.
+const MAX_SLOTS: u32 = 1 << 26;
+const EMPTY_KEY: u64 = 0;
+/// Flag of a slot changed since it was last persisted.
+const FLAG_DIRTY: u32 = 1;
+/// Flag of a tally cache slot that was seeded from its tally file.
+const FLAG_SEEDED: u32 = 2;
+
+/// Process-wide cache of mapped databases, keyed by database path.
+static TALLY_DBS: Lazy<RwLock<HashMap<PathBuf, Arc<TallyDb>>>> =
+    Lazy::new(|| RwLock::new(HashMap::new()));
+
+/// A single tally slot in the mapped file.
+#[repr(C)]
+pub struct Slot {
+    key: AtomicU64,
+    failure_ns: AtomicI64,
+    unlock_ns: AtomicI64,
+    count: AtomicU32,
+    flags: AtomicU32,
+}
+
+impl Slot {
+    /// Loads the slot values into the tally.
+    pub fn load(&self, tally: &mut Tally) {
+        tally.failures_count = self.count.load(Ordering::Acquire) as i32;
+        tally.failure_instant =
+            from_nanos(self.failure_ns.load(Ordering::Acquire)).unwrap_or_default();
+        tally.unlock_instant = from_nanos(self.unlock_ns.load(Ordering::Acquire));
+    }
+
+    /// Atomically adds a failure, wakes the sessions waiting for the slot and returns the new
+    /// failures count.
+    pub fn add_failure(&self) -> i32 {
+        let count = self.count.fetch_add(1, Ordering::AcqRel).wrapping_add(1) as i32;
+        self.wake();
+        count
+    }
+
+    /// Stores the failure and unlock instants of the tally and wakes the sessions waiting for
+    /// the slot, so they follow an extended lock.
+    pub fn store_instants(&self, tally: &Tally) {
+        self.failure_ns
+            .store(to_nanos(Some(tally.failure_instant)), Ordering::Release);
+        self.unlock_ns
+            .store(to_nanos(tally.unlock_instant), Ordering::Release);
+        self.wake();
+    }
+
+    /// Clears the failures count and unlock instant and wakes the sessions waiting for the
+    /// slot, see `wait_count`.
+    pub fn reset(&self) {
+        self.unlock_ns.store(INSTANT_NONE, Ordering::Release);
+        self.count.store(0, Ordering::Release);
+        self.wake();
+    }
+
+    /// Clears the slot like `reset`, but only if it still holds the failures count and failure
+    /// instant of `tally`, as loaded with `load`. A failure counted since then changes the count,
+    /// so it is never wiped.
+    ///
+    /// # Returns
+    /// Whether the slot was cleared.
+    pub fn reset_unchanged(&self, tally: &Tally) -> bool {
+        if self.failure_ns.load(Ordering::Acquire) != to_nanos(Some(tally.failure_instant)) {
+            return false;
+        }
+        let count = tally.failures_count as u32;
+        if self
+            .count
+            .compare_exchange(count, 0, Ordering::AcqRel, Ordering::Acquire)
+            .is_err()
+        {
+            return false;
+        }
+        self.unlock_ns.store(INSTANT_NONE, Ordering::Release);
+        self.wake();
+        true
+    }
+
+    /// Wakes all sessions waiting for the slot, see `wait_count`.
+    fn wake(&self) {
+        unsafe {
+            libc::syscall(
+                libc::SYS_futex,
+                self.count.as_ptr(),
+                libc::FUTEX_WAKE,
+                i32::MAX,
+            );
+        }
+    }
+
+    /// Loads the failures count, to be passed to `wait_count`.
+    pub fn load_count(&self) -> u32 {
+        self.count.load(Ordering::Acquire)
+    }
+
+    /// Sleeps while the failures count is `count`, until the slot is changed or the absolute
+    /// `CLOCK_REALTIME` `deadline` has passed. The futex is shared between all processes
+    /// mapping the table.
+    ///
+    /// # Returns
+    /// Whether the slot may have changed, or the error that occurred while waiting.
+    pub fn wait_count(&self, count: u32, deadline: &libc::timespec) -> io::Result<bool> {
+        let result = unsafe {
+            libc::syscall(
+                libc::SYS_futex,
+                self.count.as_ptr(),
+                libc::FUTEX_WAIT_BITSET | libc::FUTEX_CLOCK_REALTIME,
+                count,
+                deadline as *const libc::timespec,
+                ptr::null::<u32>(),
+                libc::FUTEX_BITSET_MATCH_ANY,
+            )
+        };
+        if result == 0 {
+            return Ok(true);
+        }
+
+        let e = io::Error::last_os_error();
+        match e.raw_os_error() {
+            Some(libc::ETIMEDOUT) => Ok(false),
+            // The count changed before the wait started
+            Some(libc::EAGAIN) | Some(libc::EINTR) => Ok(true),
+            _ => Err(e),
+        }
+    }
+
+    /// Overwrites the slot with the values of the tally.
+    pub fn store(&self, tally: &Tally) {
+        self.count
+            .store(tally.failures_count as u32, Ordering::Release);
+        self.store_instants(tally);
+    }
+
+    /// Stores the tally into a slot that was not seeded yet and marks it as seeded. Seeds are
+    /// serialized by the caller, a slot is only seeded once.
+    ///
+    /// # Returns
+    /// Whether the slot was seeded with the tally.
+    pub fn seed(&self, tally: &Tally) -> bool {
+        if self.is_seeded() {
+            return false;
+        }
+        self.store(tally);
+        self.flags.fetch_or(FLAG_SEEDED, Ordering::AcqRel) & FLAG_SEEDED == 0
+    }
+
+    /// Returns whether the slot was seeded, see `seed`.
+    pub fn is_seeded(&self) -> bool {
+        self.flags.load(Ordering::Acquire) & FLAG_SEEDED != 0
+    }
+
+    /// Marks the slot as changed since it was last persisted.
+    pub fn mark_dirty(&self) {
+        self.flags.fetch_or(FLAG_DIRTY, Ordering::AcqRel);
+    }
+
+    /// Returns whether the slot is marked as changed.
+    pub fn is_dirty(&self) -> bool {
+        self.flags.load(Ordering::Acquire) & FLAG_DIRTY != 0
+    }
+
+    /// Clears the dirty mark and returns whether it was set.
+    /// A slot that is marked again afterwards is persisted again.
+    pub fn take_dirty(&self) -> bool {
+        self.flags.fetch_and(!FLAG_DIRTY, Ordering::AcqRel) & FLAG_DIRTY != 0
+    }
+}
+
+/// A mapped tally database file.
+pub struct TallyDb {
+    map: NonNull<u8>,
+    len: usize,
+    slot_count: usize,
+    dev: u64,
+    ino: u64,
+}
+
+// The mapping is only accessed through atomics.
+unsafe impl Send for TallyDb {}
+unsafe impl Sync for TallyDb {}
+
+impl TallyDb {
+    /// Returns the mapped database at `path` from the process-wide cache, opening it if it is not
+    /// mapped yet or if the file was replaced since it was mapped.
+    ///
+    /// # Arguments
+    /// - `path`: Path of the database file
+    /// - `slots`: Number of slots used when the file is created
+    ///
+    /// # Returns
+    /// The mapped database or the error that occurred while opening it.
+    pub fn open_cached(path: &Path, slots: u32) -> io::Result<Arc<TallyDb>> {
+        Self::cached(path, || TallyDb::open(path, slots))
+    }
+
+    /// Returns the mapped POSIX shared memory segment `name` from the process-wide cache,
+    /// opening it if it is not mapped yet or if it was replaced since it was mapped.
+    ///
+    /// # Arguments
+    /// - `name`: Name of the shared memory object, e.g. `/authramp-cache`
+    /// - `slots`: Number of slots used when the segment is created
+    ///
+    /// # Returns
+    /// The mapped segment or the error that occurred while opening it.
+    pub fn open_shm_cached(name: &str, slots: u32) -> io::Result<Arc<TallyDb>> {
+        // Linux backs POSIX shared memory objects with files in /dev/shm
+        let path = Path::new(SHM_DIR).join(name.trim_start_matches('/'));
+        Self::cached(&path, || TallyDb::open_shm(name, slots))
+    }
+
+    /// Looks up `path` in the process-wide cache and validates it against the inode currently at
+    /// `path`. Calls `open` and caches the result otherwise.
+    fn cached<F>(path: &Path, open: F) -> io::Result<Arc<TallyDb>>
+    where
+        F: FnOnce() -> io::Result<TallyDb>,
+    {
+        let meta = fs::metadata(path).ok();
+        let is_current = |db: &TallyDb| {
+            meta.as_ref()
+                .map_or(false, |m| m.dev() == db.dev && m.ino() == db.ino)
+        };
+
+        if let Ok(dbs) = TALLY_DBS.read() {
+            if let Some(db) = dbs.get(path).filter(|db| is_current(db)) {
+                return Ok(Arc::clone(db));
+            }
+        }
+
+        let db = Arc::new(open()?);
+
+        if let Ok(mut dbs) = TALLY_DBS.write() {
+            dbs.insert(path.to_path_buf(), Arc::clone(&db));
+        }
+
+        Ok(db)
+    }
+
+    /// Opens and maps the database at `path`, creating it with `slots` slots (rounded up to a
+    /// power of two) if it does not exist.
+    ///
+    /// # Arguments
+    /// - `path`: Path of the database file
+    /// - `slots`: Number of slots used when the file is created
+    ///
+    /// # Returns
+    /// The mapped database or the error that occurred while opening it.
+    pub fn open(path: &Path, slots: u32) -> io::Result<TallyDb> {
+        if let Some(dir) = path.parent() {
+            fs::create_dir_all(dir)?;
+        }
+
+        let file = OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create(true)
+            .mode(0o600)
+            .open(path)?;
+
+        Self::map(file, slots)
+    }
+
+    /// Opens and maps the POSIX shared memory segment `name`, creating it with `slots` slots
+    /// (rounded up to a power of two) if it does not exist.
+    ///
+    /// # Arguments
+    /// - `name`: Name of the shared memory object, e.g. `/authramp-cache`
+    /// - `slots`: Number of slots used when the segment is created
+    ///
+    /// # Returns
+    /// The mapped segment or the error that occurred while opening it.
+    pub fn open_shm(name: &str, slots: u32) -> io::Result<TallyDb> {
+        let c_name = CString::new(name)?;
+        let fd = unsafe { libc::shm_open(c_name.as_ptr(), libc::O_RDWR | libc::O_CREAT, 0o600) };
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+
+        Self::map(unsafe { File::from_raw_fd(fd) }, slots)
+    }
+
+    /// Initializes the header of the database file if needed and maps the file.
+    fn map(file: File, slots: u32) -> io::Result<TallyDb> {
+        let slot_count = Self::init_header(&file, slots)?;
+        let len = HEADER_SIZE + slot_count * SLOT_SIZE;
+
+        if file.metadata()?.len() < len as u64 {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "tally database is truncated",
+            ));
+        }
+
+        let meta = file.metadata()?;
+        Ok(TallyDb {
+            map: map_shared(&file, len)?,
+            len,
+            slot_count,
+            dev: meta.dev(),
+            ino: meta.ino(),
+        })
+    }
+
+    /// Writes the header to an empty database file and reads the slot count from it.
+    /// Held under an exclusive `flock` so concurrent processes do not initialize the file twice.
+    fn init_header(file: &File, slots: u32) -> io::Result<usize> {
+        let _lock = FileLock::exclusive(file)?;
+
+        if file.metadata()?.len() == 0 {
+            let slot_count = slots.clamp(1, MAX_SLOTS).next_power_of_two();
+
+            let mut header = [0u8; HEADER_SIZE];
+            header[0..8].copy_from_slice(&MAGIC);
+            header[8..12].copy_from_slice(&VERSION.to_le_bytes());
+            header[12..16].copy_from_slice(&slot_count.to_le_bytes());
+
+            file.set_len((HEADER_SIZE + slot_count as usize * SLOT_SIZE) as u64)?;
+            file.write_all_at(&header, 0)?;
+        }
+
+        let mut header = [0u8; HEADER_SIZE];
+        file.read_exact_at(&mut header, 0)?;
+
+        let version = u32::from_le_bytes([header[8], header[9], header[10], header[11]]);
+        let slot_count = u32::from_le_bytes([header[12], header[13], header[14], header[15]]);
+
+        if header[0..8] != MAGIC || version != VERSION || !slot_count.is_power_of_two() {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "invalid tally database header",
+            ));
+        }
+
+        Ok(slot_count as usize)
+    }
+
+    /// Returns the slot of the given index.
+    fn slot(&self, index: usize) -> &Slot {
+        debug_assert!(index < self.slot_count);
+        unsafe { &*(self.map.as_ptr().add(HEADER_SIZE + index * SLOT_SIZE) as *const Slot) }
+    }
+
+    /// Iterates over the probe sequence of `key`.
+    fn probe(&self, key: u64) -> impl Iterator<Item = &Slot> {
+        // Fibonacci hashing spreads sequential uids over the table
+        let start = (key.wrapping_mul(0x9e37_79b9_7f4a_7c15) >> 32) as usize;
+        let mask = self.slot_count - 1;
+        (0..self.slot_count).map(move |i| self.slot((start + i) & mask))
+    }
+
+    /// Iterates over the uids and slots of all occupied slots.
+    pub fn entries(&self) -> impl Iterator<Item = (u32, &Slot)> {
+        (0..self.slot_count).filter_map(move |index| {
+            let slot = self.slot(index);
+            match slot.key.load(Ordering::Acquire) {
+                EMPTY_KEY => None,
+                key => Some(((key - 1) as u32, slot)),
+            }
+        })
+    }
+
+    /// Finds the slot of `uid` without inserting it.
+    pub fn find(&self, uid: u32) -> Option<&Slot> {
+        let key = uid as u64 + 1;
+        for slot in self.probe(key) {
+            match slot.key.load(Ordering::Acquire) {
+                EMPTY_KEY => return None,
+                k if k == key => return Some(slot),
+                _ => {}
+            }
+        }
+        None
+    }
+
+    /// Finds the slot of `uid`, claiming an empty slot for it if it does not exist yet.
+    ///
+    /// # Returns
+    /// The slot of `uid` or an error if the table is full.
+    pub fn find_or_insert(&self, uid: u32) -> io::Result<&Slot> {
+        let key = uid as u64 + 1;
+        for slot in self.probe(key) {
+            match slot
+                .key
+                .compare_exchange(EMPTY_KEY, key, Ordering::AcqRel, Ordering::Acquire)
+            {
+                // Claimed an empty slot or found the existing one
+                Ok(_) => return Ok(slot),
+                Err(k) if k == key => return Ok(slot),
+                Err(_) => {}
+            }
+        }
+        Err(io::Error::new(
+            io::ErrorKind::Other,
+            "tally database is full",
+        ))
+    }
+}
+
+impl Drop for TallyDb {
+    fn drop(&mut self) {
+        unsafe {
+            libc::munmap(self.map.as_ptr() as *mut libc::c_void, self.len);
+        }
+    }
+}
+
+// Unit Tests
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::store::TALLY_DB_FILE;
+    use chrono::Utc;
+    use tempdir::TempDir;
+
+    #[test]
+    fn test_insert_and_find() {
+        let temp_dir = TempDir::new("test_insert_and_find").unwrap();
+        let db = TallyDb::open(&temp_dir.path().join(TALLY_DB_FILE), 8).unwrap();
+
+        assert!(db.find(1000).is_none());
+
+        let slot = db.find_or_insert(1000).unwrap();
+        assert_eq!(slot.add_failure(), 1);
+        assert_eq!(slot.add_failure(), 2);
+
+        let mut tally = Tally::default();
+        db.find(1000).unwrap().load(&mut tally);
+        assert_eq!(tally.failures_count, 2);
+        assert!(tally.unlock_instant.is_none());
+
+        db.find(1000).unwrap().reset();
+        db.find(1000).unwrap().load(&mut tally);
+        assert_eq!(tally.failures_count, 0);
+    }
+
+    #[test]
+    fn test_reset_unchanged_skips_changed_slots() {
+        let temp_dir = TempDir::new("test_reset_unchanged_skips_changed_slots").unwrap();
+        let db = TallyDb::open(&temp_dir.path().join(TALLY_DB_FILE), 8).unwrap();
+        let slot = db.find_or_insert(1000).unwrap();
+        let mut tally = Tally {
+            failures_count: 3,
+            failure_instant: "2023-01-01T00:00:00Z".parse().unwrap(),
+            unlock_instant: Some("2023-01-02T00:00:00Z".parse().unwrap()),
+            ..Default::default()
+        };
+        slot.store(&tally);
+
+        // A failure counted after the load keeps the slot
+        let mut loaded = Tally::default();
+        slot.load(&mut loaded);
+        slot.add_failure();
+        assert!(!slot.reset_unchanged(&loaded));
+
+        // So does a failure instant stored after the load
+        slot.load(&mut loaded);
+        tally.failure_instant = Utc::now();
+        slot.store_instants(&tally);
+        assert!(!slot.reset_unchanged(&loaded));
+        slot.load(&mut tally);
+        assert_eq!(tally.failures_count, 4);
+
+        // An unchanged slot is cleared
+        slot.load(&mut loaded);
+        assert!(slot.reset_unchanged(&loaded));
+        slot.load(&mut tally);
+        assert!(tally.is_clear());
+    }
+
+    #[test]
+    fn test_slot_is_seeded_once() {
+        let temp_dir = TempDir::new("test_slot_is_seeded_once").unwrap();
+        let db = TallyDb::open(&temp_dir.path().join(TALLY_DB_FILE), 8).unwrap();
+        let slot = db.find_or_insert(1000).unwrap();
+        assert!(!slot.is_seeded());
+
+        let seeded = Tally {
+            failures_count: 3,
+            ..Default::default()
+        };
+        assert!(slot.seed(&seeded));
+        slot.add_failure();
+        slot.mark_dirty();
+
+        // A late seed does not overwrite the failure counted after the first one
+        assert!(!slot.seed(&Tally::default()));
+        let mut tally = Tally::default();
+        slot.load(&mut tally);
+        assert_eq!(tally.failures_count, 4);
+        assert!(slot.take_dirty() && slot.is_seeded() && !slot.is_dirty());
+    }
+
+    #[test]
+    fn test_full_table() {
+        let temp_dir = TempDir::new("test_full_table").unwrap();
+        let db = TallyDb::open(&temp_dir.path().join(TALLY_DB_FILE), 4).unwrap();
+
+        for uid in 0..4 {
+            db.find_or_insert(uid).unwrap().add_failure();
+        }
+
+        // All uids are found despite collisions
+        for uid in 0..4 {
+            assert!(db.find(uid).is_some());
+        }
+
+        assert!(db.find(4).is_none());
+        assert!(db.find_or_insert(4).is_err());
+    }
+
+    #[test]
+    fn test_values_persist_across_mappings() {
+        let temp_dir = TempDir::new("test_values_persist_across_mappings").unwrap();
+        let path = temp_dir.path().join(TALLY_DB_FILE);
+
+        let tally = Tally {
+            failures_count: 1,
+            unlock_instant: Some(Utc::now()),
+            ..Tally::default()
+        };
+
+        {
+            let db = TallyDb::open(&path, 16).unwrap();
+            let slot = db.find_or_insert(42).unwrap();
+            slot.add_failure();
+            slot.store_instants(&tally);
+        }
+
+        // Slot count of an existing file takes precedence
+        let db = TallyDb::open(&path, 1024).unwrap();
+        assert_eq!(db.slot_count, 16);
+
+        let mut loaded = Tally::default();
+        db.find(42).unwrap().load(&mut loaded);
+        assert_eq!(loaded, tally);
+    }
+
+    #[test]
+    fn test_shm_segment_is_shared() {
+        let name = format!("/authramp-test-{}", std::process::id());
+
+        let first = TallyDb::open_shm(&name, 8).unwrap();
+        let second = TallyDb::open_shm(&name, 8).unwrap();
+
+        first.find_or_insert(7).unwrap().add_failure();
+        assert!(!second.find(7).unwrap().take_dirty());
+        assert_eq!(
+            second.entries().map(|(uid, _)| uid).collect::<Vec<_>>(),
+            [7]
+        );
+
+        let c_name = CString::new(name).unwrap();
+        unsafe { libc::shm_unlink(c_name.as_ptr()) };
+    }
+
+    #[test]
+    fn test_slot_count_is_clamped() {
+        let temp_dir = TempDir::new("test_slot_count_is_clamped").unwrap();
+        let file = File::options()
+            .read(true)
+            .write(true)
+            .create(true)
+            .truncate(false)
+            .open(temp_dir.path().join(TALLY_DB_FILE))
+            .unwrap();
+        assert_eq!(
+            TallyDb::init_header(&file, u32::MAX).unwrap(),
+            MAX_SLOTS as usize
+        );
+    }
+}
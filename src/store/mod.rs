@@ -0,0 +1,214 @@
+//! # Store Module
+//!
+//! The `store` module contains the on-disk representations of the account tally. The `Tally`
+//! struct in the `tally` module implements the lockout logic, while the submodules here define
+//! how a tally is laid out in storage.
+//!
+//! ## Formats
+//!
+//! - `toml`: The human-readable `[Fails]` TOML file. This is the default format.
+//! - `binary`: A fixed-size little-endian record that can be read with a single `pread`.
+//!
+//! The format of an existing tally file is detected when reading, so tally files in the old
+//! format are migrated to the configured format on the next access.
+//!
+//! How tally file writes are synced to disk is set with `durability`, see the `file` module.
+//!
+//! ## Backends
+//!
+//! - `file`: One tally file per user in the tally directory, written in the configured format.
+//!   Updates are locked per user and atomic, see the `file` module.
+//! - `mmap`: A single memory-mapped hash table keyed by uid, see the `mmap` module.
+//! - `daemon`: Tally decisions are requested from the `authrampd` daemon over a Unix datagram
+//!   socket, see the `daemon` module. The `file` backend is used if the daemon is not running.
+//!   The daemons of several nodes can share their tallies, see the `gossip` module.
+//!
+//! The `file` backend can be fronted by a shared memory tally cache, see the `cache` module.
+//!
+//! Independent of the backend, failures can also be counted per remote host in a fixed-size
+//! sketch, see the `sketch` module.
+//!
+//! The state of the log storm suppression is kept next to the tallies as well, see the `storm`
+//! module.
+//!
+//! Clear tallies and tallies older than `tally_ttl` are removed by the compaction in the
+//! `compact` module. The `scan` module reads all tallies of the tally directory for listings.
+//!
+//! Users without failures are answered from the tally filter of the `filter` module without
+//! reading their tally file.
+//!
+//! Bounced sessions wait for their unlock or a change of their tally with the `watch` module.
+//! The `admission` module limits how many of them wait host-wide.
+//!
+//! ## Features
+//!
+//! The `binary` format and the `mmap` and `daemon` backends are Cargo features, all enabled by
+//! default. The `file` backend and the TOML format are always built, because the other
+//! backends fall back to them. A backend that is configured but not compiled in is replaced by
+//! the `file` backend, and without `binary` tally files are written as TOML.
+//!
+//! ## License
+//!
+//! pam-authramp
+//! Copyright (C) 2023 github.com/34N0
+//!
+//! This program is free software: you can redistribute it and/or modify
+//! it under the terms of the GNU General Public License as published by
+//! the Free Software Foundation, either version 3 of the License, or
+//! (at your option) any later version.
+//!
+//! This program is distributed in the hope that it will be useful,
+//! but WITHOUT ANY WARRANTY; without even the implied warranty of
+//! MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//! GNU General Public License for more details.
+//!
+//! You should have received a copy of the GNU General Public License
+//! along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+pub mod admission;
+#[cfg(feature = "binary")]
+pub mod binary;
+#[cfg(feature = "mmap")]
+pub mod cache;
+pub mod compact;
+#[cfg(feature = "daemon")]
+pub mod daemon;
+pub mod file;
+pub mod filter;
+#[cfg(feature = "daemon")]
+pub mod gossip;
+#[cfg(feature = "mmap")]
+pub mod mmap;
+pub mod scan;
+pub(crate) mod shared;
+pub mod sketch;
+pub mod storm;
+pub mod watch;
+
+use std::str::FromStr;
+
+use pam::constants::PamResultCode;
+
+use crate::settings::HookSettings;
+use crate::tally::Tally;
+
+/// Name of the `mmap` tally database file inside the tally directory.
+pub const TALLY_DB_FILE: &str = "authramp.db";
+
+/// Format used to persist a tally file.
+#[derive(Debug, Default, Clone, Copy, PartialEq)]
+pub enum TallyFormat {
+    /// Human-readable `[Fails]` TOML table.
+    #[default]
+    Toml,
+    /// Fixed-size little-endian binary record.
+    Binary,
+}
+
+impl FromStr for TallyFormat {
+    type Err = ();
+
+    /// Parses the `tally_format` setting value.
+    fn from_str(s: &str) -> Result<Self, Self::Err> {
+        match s {
+            "toml" => Ok(TallyFormat::Toml),
+            "binary" => Ok(TallyFormat::Binary),
+            _ => Err(()),
+        }
+    }
+}
+
+impl TallyFormat {
+    /// Returns the format tally files are actually written in. Without the `binary` feature
+    /// every tally file is written as TOML.
+    pub fn written(self) -> Self {
+        if cfg!(feature = "binary") {
+            self
+        } else {
+            TallyFormat::Toml
+        }
+    }
+}
+
+/// Storage backend used for the tallies.
+#[derive(Debug, Default, Clone, Copy, PartialEq)]
+pub enum TallyBackend {
+    /// One tally file per user in the tally directory.
+    #[default]
+    File,
+    /// Single memory-mapped tally database in the tally directory.
+    Mmap,
+    /// The authramp daemon, falling back to the tally files if it is not running.
+    Daemon,
+}
+
+impl FromStr for TallyBackend {
+    type Err = ();
+
+    /// Parses the `tally_backend` setting value.
+    fn from_str(s: &str) -> Result<Self, Self::Err> {
+        match s {
+            "file" => Ok(TallyBackend::File),
+            "mmap" => Ok(TallyBackend::Mmap),
+            "daemon" => Ok(TallyBackend::Daemon),
+            _ => Err(()),
+        }
+    }
+}
+
+/// How tally file writes are made durable.
+#[derive(Debug, Default, Clone, Copy, PartialEq)]
+pub enum Durability {
+    /// Atomic replace without syncing. Enough for a tally directory on tmpfs.
+    #[default]
+    None,
+    /// The new content is synced before it replaces the tally file, so a crash leaves either
+    /// the old or the new tally.
+    Rename,
+    /// Like `rename`, and the tally directory is synced too, so the update survives a crash.
+    Fsync,
+    /// Concurrent writers of all processes share one periodic filesystem sync, see the `file`
+    /// module.
+    GroupCommit,
+}
+
+impl FromStr for Durability {
+    type Err = ();
+
+    /// Parses the `durability` setting value.
+    fn from_str(s: &str) -> Result<Self, Self::Err> {
+        match s {
+            "none" => Ok(Durability::None),
+            "rename" => Ok(Durability::Rename),
+            "fsync" => Ok(Durability::Fsync),
+            "group-commit" => Ok(Durability::GroupCommit),
+            _ => Err(()),
+        }
+    }
+}
+
+/// A storage backend for the tallies.
+///
+/// Backends are unit types dispatched statically with `Tally::open_with`, so a backend that is
+/// not compiled in costs nothing in the module.
+pub trait TallyStore {
+    /// Loads the tally of the user in the settings and applies the action of the settings.
+    ///
+    /// # Arguments
+    /// - `settings`: A reference to the `HookSettings` of the call.
+    ///
+    /// # Returns
+    /// A `Result` containing either the `Tally` struct or a PAM error code.
+    fn open(settings: &HookSettings) -> Result<Tally, PamResultCode>;
+}
+
+/// The `file` backend, fronted by the tally cache if enabled.
+pub struct FileStore;
+
+/// The `mmap` backend.
+#[cfg(feature = "mmap")]
+pub struct MmapStore;
+
+/// The `daemon` backend.
+#[cfg(feature = "daemon")]
+pub struct DaemonStore;
@@ -0,0 +1,277 @@
+//! # Tally Directory Scan
+//!
+//! Reads all tallies of the tally directory for the `authramp` tool. The directory is read with
+//! `getdents64` into a 64 KiB buffer, so a directory of a few hundred thousand tally files is
+//! listed with a few hundred system calls instead of one `readdir` round trip per entry. The
+//! tally files are then parsed with the `Tally` parsing code by one thread per CPU.
+//!
+//! A scan is a snapshot. Tallies that change while the directory is read are reported with
+//! either their old or their new value, because tally files are replaced atomically.
+//!
+//! ## License
+//!
+//! pam-authramp
+//! Copyright (C) 2023 github.com/34N0
+//!
+//! This program is free software: you can redistribute it and/or modify
+//! it under the terms of the GNU General Public License as published by
+//! the Free Software Foundation, either version 3 of the License, or
+//! (at your option) any later version.
+//!
+//! This program is distributed in the hope that it will be useful,
+//! but WITHOUT ANY WARRANTY; without even the implied warranty of
+//! MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//! GNU General Public License for more details.
+//!
+//! You should have received a copy of the GNU General Public License
+//! along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+use std::ffi::{OsStr, OsString};
+use std::fs::File;
+use std::io;
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::io::AsRawFd;
+use std::panic;
+use std::path::Path;
+use std::thread;
+
+use super::admission::ADMISSION_FILE;
+use super::file::{self, SYNC_FILE};
+use super::filter::TALLY_FILTER_FILE;
+use super::sketch::RHOST_SKETCH_FILE;
+use super::storm::LOG_STORM_FILE;
+use super::TALLY_DB_FILE;
+use crate::settings::Settings;
+use crate::tally::Tally;
+
+/// Size of the `getdents64` buffer in 8 byte words.
+const DIRENT_BUF_WORDS: usize = 8192;
+
+/// Offset of `d_reclen` in a `linux_dirent64` record.
+const DIRENT_RECLEN: usize = 16;
+/// Offset of `d_name` in a `linux_dirent64` record.
+const DIRENT_NAME: usize = 19;
+
+/// Lists below this size are processed on the calling thread.
+const MIN_PARALLEL_ITEMS: usize = 1024;
+
+/// A tally file of the tally directory.
+#[derive(Debug)]
+pub struct TallyEntry {
+    /// Name of the tally file, the name of the user.
+    pub name: OsString,
+    /// The tally as stored in the tally file.
+    pub tally: Tally,
+}
+
+/// Result of a scan of the tally directory.
+#[derive(Debug, Default)]
+pub struct TallyScan {
+    /// The tallies, sorted by name.
+    pub entries: Vec<TallyEntry>,
+    /// Number of tally files that could not be read.
+    pub unreadable: usize,
+}
+
+/// Returns true if `name` is a file of the tally directory that does not hold a user tally.
+pub fn is_reserved_name(name: &OsStr) -> bool {
+    name == TALLY_DB_FILE
+        || name == TALLY_FILTER_FILE
+        || name == ADMISSION_FILE
+        || name == RHOST_SKETCH_FILE
+        || name == LOG_STORM_FILE
+        || name == SYNC_FILE
+        || file::is_temp_file(name)
+}
+
+/// Reads the names of all regular files in `dir` with batched `getdents64` calls.
+///
+/// # Arguments
+/// - `dir`: The directory to read
+///
+/// # Returns
+/// The file names or the error that occurred while reading the directory.
+pub fn read_file_names(dir: &Path) -> io::Result<Vec<OsString>> {
+    let dir = File::open(dir)?;
+    let mut buf = vec![0u64; DIRENT_BUF_WORDS];
+    let mut names = Vec::new();
+
+    loop {
+        let len = unsafe {
+            libc::syscall(
+                libc::SYS_getdents64,
+                dir.as_raw_fd(),
+                buf.as_mut_ptr(),
+                buf.len() * 8,
+            )
+        };
+        if len < 0 {
+            let e = io::Error::last_os_error();
+            if e.kind() == io::ErrorKind::Interrupted {
+                continue;
+            }
+            return Err(e);
+        }
+        if len == 0 {
+            return Ok(names);
+        }
+
+        // Safety: the kernel wrote `len` bytes of records into the buffer
+        let records =
+            unsafe { std::slice::from_raw_parts(buf.as_ptr() as *const u8, len as usize) };
+        let mut offset = 0;
+        while offset + DIRENT_NAME < records.len() {
+            let record = &records[offset..];
+            let reclen =
+                u16::from_ne_bytes([record[DIRENT_RECLEN], record[DIRENT_RECLEN + 1]]) as usize;
+            if reclen == 0 || reclen > record.len() {
+                break;
+            }
+            offset += reclen;
+
+            // Directories and links are skipped, a file system without d_type is checked later
+            let d_type = record[DIRENT_RECLEN + 2];
+            if d_type != libc::DT_REG && d_type != libc::DT_UNKNOWN {
+                continue;
+            }
+
+            let name = &record[DIRENT_NAME..reclen];
+            let name = &name[..name.iter().position(|&b| b == 0).unwrap_or(name.len())];
+            if name != b"." && name != b".." {
+                names.push(OsStr::from_bytes(name).to_os_string());
+            }
+        }
+    }
+}
+
+/// Applies `f` to all items on one thread per CPU.
+///
+/// # Arguments
+/// - `items`: The items
+/// - `f`: Function applied to each item
+///
+/// # Returns
+/// The results in the order of the items. A panic of `f` is propagated to the caller, a missing
+/// chunk would shift the results against the items.
+pub fn parallel_map<T, R, F>(items: &[T], f: F) -> Vec<R>
+where
+    T: Sync,
+    R: Send,
+    F: Fn(&T) -> R + Sync,
+{
+    let threads = thread::available_parallelism().map_or(1, |n| n.get());
+    if threads == 1 || items.len() < MIN_PARALLEL_ITEMS {
+        return items.iter().map(f).collect();
+    }
+
+    let chunk_size = items.len().div_ceil(threads);
+    let f = &f;
+    thread::scope(|scope| {
+        let workers: Vec<_> = items
+            .chunks(chunk_size)
+            .map(|chunk| scope.spawn(move || chunk.iter().map(f).collect::<Vec<R>>()))
+            .collect();
+
+        workers
+            .into_iter()
+            .flat_map(|worker| worker.join().unwrap_or_else(|e| panic::resume_unwind(e)))
+            .collect()
+    })
+}
+
+/// Reads all tallies of the tally directory.
+///
+/// # Arguments
+/// - `settings`: A reference to the `Settings` struct.
+///
+/// # Returns
+/// The tallies or the error that occurred while reading the tally directory. A missing tally
+/// directory has no tallies.
+pub fn scan_tally_dir(settings: &Settings) -> io::Result<TallyScan> {
+    let mut names = match read_file_names(&settings.tally_dir) {
+        Ok(names) => names,
+        Err(e) if e.kind() == io::ErrorKind::NotFound => return Ok(TallyScan::default()),
+        Err(e) => return Err(e),
+    };
+    names.retain(|name| !is_reserved_name(name));
+    names.sort_unstable();
+
+    let tallies = parallel_map(&names, |name| {
+        let path = settings.tally_dir.join(name);
+        match Tally::load_tally_file(&path) {
+            // A file system without d_type may list directories
+            Err(_) if path.is_dir() => Ok(None),
+            result => result,
+        }
+    });
+
+    let mut scan = TallyScan::default();
+    for (name, tally) in names.into_iter().zip(tallies) {
+        match tally {
+            Ok(Some(tally)) => scan.entries.push(TallyEntry { name, tally }),
+            // Created but never written, or removed since the directory was read
+            Ok(None) => {}
+            Err(_) => scan.unreadable += 1,
+        }
+    }
+
+    Ok(scan)
+}
+
+// Unit Tests
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::fs;
+    use tempdir::TempDir;
+
+    #[test]
+    fn test_read_file_names_skips_directories() {
+        let temp_dir = TempDir::new("test_read_file_names").unwrap();
+        for i in 0..2000 {
+            fs::write(temp_dir.path().join(format!("user_{}", i)), "").unwrap();
+        }
+        fs::create_dir(temp_dir.path().join("subdir")).unwrap();
+
+        let mut names = read_file_names(temp_dir.path()).unwrap();
+        names.sort();
+        assert_eq!(names.len(), 2000);
+        assert!(!names.iter().any(|name| name == "subdir"));
+    }
+
+    #[test]
+    #[should_panic(expected = "item 1500")]
+    fn test_parallel_map_propagates_panics() {
+        let items: Vec<usize> = (0..2000).collect();
+        parallel_map(&items, |&item| {
+            if item == 1500 {
+                panic!("item {}", item);
+            }
+            item
+        });
+    }
+
+    #[test]
+    fn test_scan_tally_dir_reads_tallies_in_parallel() {
+        let temp_dir = TempDir::new("test_scan_tally_dir").unwrap();
+        for i in 0..1500 {
+            fs::write(
+                temp_dir.path().join(format!("user_{:04}", i)),
+                format!("[Fails]\ncount = {}\ninstant = \"2023-01-01T00:00:00Z\"", i),
+            )
+            .unwrap();
+        }
+        fs::write(temp_dir.path().join("broken"), "not a tally").unwrap();
+        fs::write(temp_dir.path().join(LOG_STORM_FILE), "").unwrap();
+
+        let settings = Settings {
+            tally_dir: temp_dir.path().to_path_buf(),
+            ..Default::default()
+        };
+
+        let scan = scan_tally_dir(&settings).unwrap();
+        assert_eq!((scan.entries.len(), scan.unreadable), (1500, 1));
+        assert_eq!(scan.entries[42].name, "user_0042");
+        assert_eq!(scan.entries[42].tally.failures_count, 42);
+    }
+}
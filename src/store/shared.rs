@@ -0,0 +1,91 @@
+//! # Shared Mappings
+//!
+//! Helpers shared by the memory-mapped tables of the `store` module and the metrics segment:
+//! shared file mappings, exclusive file locks and the encoding of instants in shared memory.
+//!
+//! ## License
+//!
+//! pam-authramp
+//! Copyright (C) 2023 github.com/34N0
+//!
+//! This program is free software: you can redistribute it and/or modify
+//! it under the terms of the GNU General Public License as published by
+//! the Free Software Foundation, either version 3 of the License, or
+//! (at your option) any later version.
+//!
+//! This program is distributed in the hope that it will be useful,
+//! but WITHOUT ANY WARRANTY; without even the implied warranty of
+//! MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//! GNU General Public License for more details.
+//!
+//! You should have received a copy of the GNU General Public License
+//! along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+use std::fs::File;
+use std::io;
+use std::os::unix::io::AsRawFd;
+use std::ptr::{self, NonNull};
+
+#[cfg(any(feature = "mmap", feature = "daemon"))]
+use chrono::{DateTime, TimeZone, Utc};
+
+/// Encoding of an unset instant.
+#[cfg(any(feature = "mmap", feature = "daemon"))]
+pub(crate) const INSTANT_NONE: i64 = 0;
+
+/// Maps `len` bytes of `file` read-write and shared with all other processes mapping it.
+pub(crate) fn map_shared(file: &File, len: usize) -> io::Result<NonNull<u8>> {
+    let map = unsafe {
+        libc::mmap(
+            ptr::null_mut(),
+            len,
+            libc::PROT_READ | libc::PROT_WRITE,
+            libc::MAP_SHARED,
+            file.as_raw_fd(),
+            0,
+        )
+    };
+    if map == libc::MAP_FAILED {
+        return Err(io::Error::last_os_error());
+    }
+    NonNull::new(map as *mut u8).ok_or_else(io::Error::last_os_error)
+}
+
+/// Exclusive `flock` that is released when dropped.
+pub(crate) struct FileLock<'a>(&'a File);
+
+impl<'a> FileLock<'a> {
+    pub(crate) fn exclusive(file: &'a File) -> io::Result<Self> {
+        if unsafe { libc::flock(file.as_raw_fd(), libc::LOCK_EX) } != 0 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(FileLock(file))
+    }
+}
+
+impl Drop for FileLock<'_> {
+    fn drop(&mut self) {
+        unsafe {
+            libc::flock(self.0.as_raw_fd(), libc::LOCK_UN);
+        }
+    }
+}
+
+#[cfg(any(feature = "mmap", feature = "daemon"))]
+pub(crate) fn to_nanos(instant: Option<DateTime<Utc>>) -> i64 {
+    instant
+        .and_then(|i| i.timestamp_nanos_opt())
+        .unwrap_or(INSTANT_NONE)
+}
+
+#[cfg(any(feature = "mmap", feature = "daemon"))]
+pub(crate) fn from_nanos(nanos: i64) -> Option<DateTime<Utc>> {
+    (nanos != INSTANT_NONE).then(|| Utc.timestamp_nanos(nanos))
+}
+
+/// 64 bit FNV-1a hash.
+pub(crate) fn fnv1a(bytes: &[u8]) -> u64 {
+    bytes.iter().fold(0xcbf2_9ce4_8422_2325, |hash, &byte| {
+        (hash ^ byte as u64).wrapping_mul(0x0000_0100_0000_01b3)
+    })
+}
@@ -0,0 +1,442 @@
+//! # Remote Host Sketch
+//!
+//! Counts authentication failures per remote host (`PAM_RHOST`) in a count-min sketch that is
+//! mapped into every process using the module. The sketch has a fixed size, so memory and disk
+//! use stay the same no matter how many distinct hosts or user names an attack uses. Hash
+//! collisions can only overestimate the failures of a host, never hide them.
+//!
+//! ## Layout
+//!
+//! The file starts with a 64 byte header (magic, version, width and the current epoch) followed
+//! by two generations of `DEPTH` rows of `width` failure counters, and `DEPTH` rows of `width`
+//! last failure timestamps in seconds since the epoch. All cells are 32 bit and updated with
+//! atomic operations.
+//!
+//! Failures are counted in windows of `rhost_window_seconds`. The estimate covers the current and
+//! the previous window. When a new window starts, the generation of the window before the
+//! previous one is cleared and reused, so old failures expire without a sweep.
+//!
+//! ## License
+//!
+//! pam-authramp
+//! Copyright (C) 2023 github.com/34N0
+//!
+//! This program is free software: you can redistribute it and/or modify
+//! it under the terms of the GNU General Public License as published by
+//! the Free Software Foundation, either version 3 of the License, or
+//! (at your option) any later version.
+//!
+//! This program is distributed in the hope that it will be useful,
+//! but WITHOUT ANY WARRANTY; without even the implied warranty of
+//! MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//! GNU General Public License for more details.
+//!
+//! You should have received a copy of the GNU General Public License
+//! along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+use std::collections::HashMap;
+use std::fs::{self, File, OpenOptions};
+use std::io;
+use std::os::unix::fs::{FileExt, MetadataExt, OpenOptionsExt};
+use std::path::{Path, PathBuf};
+use std::ptr::NonNull;
+use std::sync::atomic::{AtomicU32, AtomicU64, Ordering};
+use std::sync::{Arc, RwLock};
+
+use chrono::{DateTime, TimeZone, Utc};
+use once_cell::sync::Lazy;
+
+use super::shared::{fnv1a, map_shared, FileLock};
+
+/// Name of the sketch file inside the tally directory.
+pub const RHOST_SKETCH_FILE: &str = "authramp-rhost.db";
+
+/// Number of hash rows of the sketch.
+const DEPTH: usize = 4;
+const GENERATIONS: usize = 2;
+const MIN_WIDTH: u32 = 64;
+/// Largest width of a new sketch, 768 MiB of counters.
+const MAX_WIDTH: u32 = 1 << 24;
+const MAGIC: [u8; 8] = *b"ARTLCMS\x01";
+const VERSION: u32 = 1;
+const HEADER_SIZE: usize = 64;
+const EPOCH_OFFSET: usize = 16;
+const CELL_SIZE: usize = 4;
+
+/// Process-wide cache of mapped sketches, keyed by sketch path.
+static RHOST_SKETCHES: Lazy<RwLock<HashMap<PathBuf, Arc<RhostSketch>>>> =
+    Lazy::new(|| RwLock::new(HashMap::new()));
+
+/// Estimated failures of a remote host.
+#[derive(Debug, PartialEq)]
+pub struct RhostEstimate {
+    /// Failures in the current and the previous window.
+    pub failures_count: u32,
+    /// The last failure, `None` if the host never failed.
+    pub last_failure: Option<DateTime<Utc>>,
+}
+
+/// A count-min sketch of remote host failures mapped from a file.
+pub struct RhostSketch {
+    map: NonNull<u8>,
+    len: usize,
+    width: usize,
+    dev: u64,
+    ino: u64,
+}
+
+// The mapping is only accessed through atomics.
+unsafe impl Send for RhostSketch {}
+unsafe impl Sync for RhostSketch {}
+
+impl RhostSketch {
+    /// Returns the mapped sketch at `path` from the process-wide cache, opening it if it is not
+    /// mapped yet or if the file was replaced since it was mapped.
+    ///
+    /// # Arguments
+    /// - `path`: Path of the sketch file
+    /// - `width`: Number of counters per row used when the file is created
+    ///
+    /// # Returns
+    /// The mapped sketch or the error that occurred while opening it.
+    pub fn open_cached(path: &Path, width: u32) -> io::Result<Arc<RhostSketch>> {
+        let meta = fs::metadata(path).ok();
+        let is_current = |sketch: &RhostSketch| {
+            meta.as_ref()
+                .map_or(false, |m| m.dev() == sketch.dev && m.ino() == sketch.ino)
+        };
+
+        if let Ok(sketches) = RHOST_SKETCHES.read() {
+            if let Some(sketch) = sketches.get(path).filter(|sketch| is_current(sketch)) {
+                return Ok(Arc::clone(sketch));
+            }
+        }
+
+        let sketch = Arc::new(Self::open(path, width)?);
+
+        if let Ok(mut sketches) = RHOST_SKETCHES.write() {
+            sketches.insert(path.to_path_buf(), Arc::clone(&sketch));
+        }
+
+        Ok(sketch)
+    }
+
+    /// Opens and maps the sketch at `path`, creating it with `width` counters per row (rounded
+    /// up to a power of two) if it does not exist.
+    ///
+    /// # Arguments
+    /// - `path`: Path of the sketch file
+    /// - `width`: Number of counters per row used when the file is created
+    ///
+    /// # Returns
+    /// The mapped sketch or the error that occurred while opening it.
+    pub fn open(path: &Path, width: u32) -> io::Result<RhostSketch> {
+        if let Some(dir) = path.parent() {
+            fs::create_dir_all(dir)?;
+        }
+
+        let file = OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create(true)
+            .mode(0o600)
+            .open(path)?;
+
+        let width = Self::init_header(&file, width)?;
+        let len = Self::file_len(width);
+
+        if file.metadata()?.len() < len as u64 {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "rhost sketch is truncated",
+            ));
+        }
+
+        let meta = file.metadata()?;
+        Ok(RhostSketch {
+            map: map_shared(&file, len)?,
+            len,
+            width,
+            dev: meta.dev(),
+            ino: meta.ino(),
+        })
+    }
+
+    /// Size of a sketch file with `width` counters per row.
+    fn file_len(width: usize) -> usize {
+        HEADER_SIZE + (GENERATIONS + 1) * DEPTH * width * CELL_SIZE
+    }
+
+    /// Writes the header to an empty sketch file and reads the width from it.
+    /// Held under an exclusive `flock` so concurrent processes do not initialize the file twice.
+    fn init_header(file: &File, width: u32) -> io::Result<usize> {
+        let _lock = FileLock::exclusive(file)?;
+
+        if file.metadata()?.len() == 0 {
+            let width = width.clamp(MIN_WIDTH, MAX_WIDTH).next_power_of_two();
+
+            let mut header = [0u8; HEADER_SIZE];
+            header[0..8].copy_from_slice(&MAGIC);
+            header[8..12].copy_from_slice(&VERSION.to_le_bytes());
+            header[12..16].copy_from_slice(&width.to_le_bytes());
+
+            file.set_len(Self::file_len(width as usize) as u64)?;
+            file.write_all_at(&header, 0)?;
+        }
+
+        let mut header = [0u8; HEADER_SIZE];
+        file.read_exact_at(&mut header, 0)?;
+
+        let version = u32::from_le_bytes([header[8], header[9], header[10], header[11]]);
+        let width = u32::from_le_bytes([header[12], header[13], header[14], header[15]]);
+
+        if header[0..8] != MAGIC || version != VERSION || !width.is_power_of_two() {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "invalid rhost sketch header",
+            ));
+        }
+
+        Ok(width as usize)
+    }
+
+    /// Returns the window of the current generation.
+    fn epoch(&self) -> &AtomicU64 {
+        unsafe { &*(self.map.as_ptr().add(EPOCH_OFFSET) as *const AtomicU64) }
+    }
+
+    /// Returns the cell at `index` of the cell area.
+    fn cell(&self, index: usize) -> &AtomicU32 {
+        debug_assert!(HEADER_SIZE + (index + 1) * CELL_SIZE <= self.len);
+        unsafe { &*(self.map.as_ptr().add(HEADER_SIZE + index * CELL_SIZE) as *const AtomicU32) }
+    }
+
+    /// Returns the failure counter of a generation.
+    fn counter(&self, generation: usize, row: usize, column: usize) -> &AtomicU32 {
+        self.cell((generation * DEPTH + row) * self.width + column)
+    }
+
+    /// Returns the last failure timestamp.
+    fn last_failure(&self, row: usize, column: usize) -> &AtomicU32 {
+        self.cell((GENERATIONS * DEPTH + row) * self.width + column)
+    }
+
+    /// Returns the column of `rhost` in every row.
+    fn columns(&self, rhost: &str) -> [usize; DEPTH] {
+        // Double hashing derives the rows from a single 64 bit hash
+        let h1 = fnv1a(rhost.as_bytes());
+        let h2 = h1.wrapping_mul(0x9e37_79b9_7f4a_7c15) | 1;
+        let mask = self.width - 1;
+
+        let mut columns = [0; DEPTH];
+        for (row, column) in columns.iter_mut().enumerate() {
+            *column = ((h1.wrapping_add((row as u64).wrapping_mul(h2)) >> 32) as usize) & mask;
+        }
+        columns
+    }
+
+    /// Moves the sketch to the window `epoch`, clearing the generations that expired.
+    ///
+    /// # Returns
+    /// The generations of the current and the previous window.
+    fn rotate(&self, epoch: u64) -> (usize, usize) {
+        let current = (epoch % GENERATIONS as u64) as usize;
+        let previous = (current + 1) % GENERATIONS;
+
+        let stored = self.epoch().load(Ordering::Acquire);
+        if stored != epoch
+            && self
+                .epoch()
+                .compare_exchange(stored, epoch, Ordering::AcqRel, Ordering::Acquire)
+                .is_ok()
+        {
+            // The process that moves the epoch clears the expired generations
+            let expired: &[usize] = if stored + 1 == epoch {
+                &[current]
+            } else {
+                &[current, previous]
+            };
+            for &generation in expired {
+                for row in 0..DEPTH {
+                    for column in 0..self.width {
+                        self.counter(generation, row, column)
+                            .store(0, Ordering::Relaxed);
+                    }
+                }
+            }
+        }
+
+        (current, previous)
+    }
+
+    /// Adds a failure of `rhost`.
+    ///
+    /// # Arguments
+    /// - `rhost`: The remote host
+    /// - `now`: The instant of the failure
+    /// - `window_seconds`: Length of a counting window
+    ///
+    /// # Returns
+    /// The estimate including the added failure
+    pub fn add(&self, rhost: &str, now: DateTime<Utc>, window_seconds: u64) -> RhostEstimate {
+        let (current, _) = self.rotate(window(now, window_seconds));
+        let seconds = now.timestamp().clamp(0, u32::MAX as i64) as u32;
+
+        for (row, column) in self.columns(rhost).into_iter().enumerate() {
+            self.counter(current, row, column)
+                .fetch_add(1, Ordering::AcqRel);
+            self.last_failure(row, column)
+                .fetch_max(seconds, Ordering::AcqRel);
+        }
+
+        self.estimate(rhost, now, window_seconds)
+    }
+
+    /// Estimates the failures of `rhost` in the current and the previous window.
+    ///
+    /// # Arguments
+    /// - `rhost`: The remote host
+    /// - `now`: The current instant
+    /// - `window_seconds`: Length of a counting window
+    ///
+    /// # Returns
+    /// The smallest count and last failure over all rows
+    pub fn estimate(&self, rhost: &str, now: DateTime<Utc>, window_seconds: u64) -> RhostEstimate {
+        let (current, previous) = self.rotate(window(now, window_seconds));
+
+        let mut failures_count = u32::MAX;
+        let mut last_failure = u32::MAX;
+        for (row, column) in self.columns(rhost).into_iter().enumerate() {
+            let count = self
+                .counter(current, row, column)
+                .load(Ordering::Acquire)
+                .saturating_add(self.counter(previous, row, column).load(Ordering::Acquire));
+            failures_count = failures_count.min(count);
+            last_failure = last_failure.min(self.last_failure(row, column).load(Ordering::Acquire));
+        }
+
+        RhostEstimate {
+            failures_count,
+            last_failure: (failures_count > 0 && last_failure > 0)
+                .then(|| Utc.timestamp_opt(last_failure as i64, 0).single())
+                .flatten(),
+        }
+    }
+}
+
+impl Drop for RhostSketch {
+    fn drop(&mut self) {
+        unsafe {
+            libc::munmap(self.map.as_ptr() as *mut libc::c_void, self.len);
+        }
+    }
+}
+
+/// Returns the counting window of `now`.
+fn window(now: DateTime<Utc>, window_seconds: u64) -> u64 {
+    now.timestamp().max(0) as u64 / window_seconds.max(1)
+}
+
+// Unit Tests
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use chrono::Duration;
+    use tempdir::TempDir;
+
+    const WINDOW: u64 = 3600;
+
+    #[test]
+    fn test_add_and_estimate() {
+        let temp_dir = TempDir::new("test_rhost_add_and_estimate").unwrap();
+        let sketch = RhostSketch::open(&temp_dir.path().join(RHOST_SKETCH_FILE), 1024).unwrap();
+        let now = Utc.timestamp_opt(1_700_000_000, 0).unwrap();
+
+        assert_eq!(
+            sketch.estimate("192.0.2.1", now, WINDOW),
+            RhostEstimate {
+                failures_count: 0,
+                last_failure: None,
+            }
+        );
+
+        for _ in 0..5 {
+            sketch.add("192.0.2.1", now, WINDOW);
+        }
+        sketch.add("192.0.2.2", now, WINDOW);
+
+        let estimate = sketch.estimate("192.0.2.1", now, WINDOW);
+        assert_eq!(estimate.failures_count, 5);
+        assert_eq!(estimate.last_failure, Some(now));
+        assert_eq!(sketch.estimate("192.0.2.2", now, WINDOW).failures_count, 1);
+    }
+
+    #[test]
+    fn test_failures_expire_after_two_windows() {
+        let temp_dir = TempDir::new("test_rhost_failures_expire").unwrap();
+        let sketch = RhostSketch::open(&temp_dir.path().join(RHOST_SKETCH_FILE), 64).unwrap();
+        let now = Utc.timestamp_opt(1_700_000_000, 0).unwrap();
+
+        sketch.add("192.0.2.1", now, WINDOW);
+
+        // The previous window still counts
+        let next_window = now + Duration::seconds(WINDOW as i64);
+        sketch.add("192.0.2.1", next_window, WINDOW);
+        assert_eq!(
+            sketch
+                .estimate("192.0.2.1", next_window, WINDOW)
+                .failures_count,
+            2
+        );
+
+        let later = next_window + Duration::seconds(WINDOW as i64);
+        assert_eq!(
+            sketch.estimate("192.0.2.1", later, WINDOW).failures_count,
+            1
+        );
+
+        let much_later = later + Duration::seconds(10 * WINDOW as i64);
+        assert_eq!(
+            sketch
+                .estimate("192.0.2.1", much_later, WINDOW)
+                .failures_count,
+            0
+        );
+    }
+
+    #[test]
+    fn test_size_is_fixed() {
+        let temp_dir = TempDir::new("test_rhost_size_is_fixed").unwrap();
+        let path = temp_dir.path().join(RHOST_SKETCH_FILE);
+        let sketch = RhostSketch::open(&path, 100).unwrap();
+        let len = fs::metadata(&path).unwrap().len();
+        assert_eq!(len as usize, RhostSketch::file_len(128));
+
+        let now = Utc::now();
+        for i in 0..10_000 {
+            sketch.add(&format!("198.51.100.{}", i), now, WINDOW);
+        }
+        assert_eq!(fs::metadata(&path).unwrap().len(), len);
+
+        // Reopening keeps the counts
+        drop(sketch);
+        let sketch = RhostSketch::open(&path, 4096).unwrap();
+        assert!(sketch.estimate("198.51.100.1", now, WINDOW).failures_count >= 1);
+    }
+
+    #[test]
+    fn test_width_is_clamped() {
+        let temp_dir = TempDir::new("test_rhost_width_is_clamped").unwrap();
+        let file = File::options()
+            .read(true)
+            .write(true)
+            .create(true)
+            .truncate(false)
+            .open(temp_dir.path().join(RHOST_SKETCH_FILE))
+            .unwrap();
+        assert_eq!(
+            RhostSketch::init_header(&file, u32::MAX).unwrap(),
+            MAX_WIDTH as usize
+        );
+    }
+}
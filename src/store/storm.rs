@@ -0,0 +1,475 @@
+//! # Log Storm Table
+//!
+//! Keeps the state of the log storm suppression in a fixed-size hash table that is mapped into
+//! every process using the module, next to the tallies in the tally directory. An entry exists
+//! per account and log event and holds the instant of the last logged message and the number of
+//! messages suppressed since. All processes share the table, so a storm is collapsed no matter
+//! how many sshd children take part in it.
+//!
+//! ## Layout
+//!
+//! The file starts with a 64 byte header (magic, version and number of slots) followed by the
+//! slots. A slot is three 64 bit words: the key, the last logged instant in seconds since the
+//! epoch and the suppressed count. All words are updated with atomic operations.
+//!
+//! Lookups probe at most `MAX_PROBE` slots. An entry that logged nothing for two windows is taken
+//! over by a new key, so the table never fills up; the count of an account that stopped failing
+//! is dropped with it. If all probed slots are busy, the message is logged without suppression.
+//!
+//! ## License
+//!
+//! pam-authramp
+//! Copyright (C) 2023 github.com/34N0
+//!
+//! This program is free software: you can redistribute it and/or modify
+//! it under the terms of the GNU General Public License as published by
+//! the Free Software Foundation, either version 3 of the License, or
+//! (at your option) any later version.
+//!
+//! This program is distributed in the hope that it will be useful,
+//! but WITHOUT ANY WARRANTY; without even the implied warranty of
+//! MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//! GNU General Public License for more details.
+//!
+//! You should have received a copy of the GNU General Public License
+//! along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+use std::collections::HashMap;
+use std::fs::{self, File, OpenOptions};
+use std::io;
+use std::os::unix::fs::{FileExt, MetadataExt, OpenOptionsExt};
+use std::path::{Path, PathBuf};
+use std::ptr::NonNull;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, RwLock};
+
+use once_cell::sync::Lazy;
+
+use super::shared::{map_shared, FileLock};
+
+/// Name of the log storm table inside the tally directory.
+pub const LOG_STORM_FILE: &str = "authramp-logstorm.db";
+
+/// Number of slots of a newly created table.
+const SLOTS: u32 = 4096;
+const MAX_PROBE: usize = 16;
+const MAGIC: [u8; 8] = *b"ARTLSTM\x01";
+const VERSION: u32 = 1;
+const HEADER_SIZE: usize = 64;
+const SLOT_SIZE: usize = 24;
+/// Marks a used key, so the key of uid 0 is not mistaken for an empty slot.
+const KEY_USED: u64 = 1 << 63;
+
+/// Process-wide cache of mapped tables, keyed by table path.
+static LOG_STORM_TABLES: Lazy<RwLock<HashMap<PathBuf, Arc<LogStormTable>>>> =
+    Lazy::new(|| RwLock::new(HashMap::new()));
+
+/// Log events that are collapsed while they repeat.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum LogEvent {
+    /// A locked account is getting bounced.
+    Bounce = 1,
+    /// A failure added to the tally of a locked account.
+    Lockout = 2,
+    /// A bounced attempt rejected by the admission control.
+    Shed = 3,
+}
+
+impl LogEvent {
+    /// Plural noun of the event used in summary lines.
+    pub fn plural(self) -> &'static str {
+        match self {
+            LogEvent::Bounce => "bounces",
+            LogEvent::Lockout => "lockouts",
+            LogEvent::Shed => "rejected bounces",
+        }
+    }
+
+    /// Returns the event of a stored key.
+    fn from_key(key: u64) -> Option<LogEvent> {
+        match key & 0xff {
+            1 => Some(LogEvent::Bounce),
+            2 => Some(LogEvent::Lockout),
+            3 => Some(LogEvent::Shed),
+            _ => None,
+        }
+    }
+}
+
+/// Messages suppressed for an account whose slot was taken over before they were reported.
+#[derive(Debug, PartialEq)]
+pub struct Summary {
+    /// The account of the messages.
+    pub uid: u32,
+    /// The log event of the messages.
+    pub event: LogEvent,
+    /// Number of suppressed messages.
+    pub suppressed: u64,
+    /// Seconds since the last logged message of the account.
+    pub seconds: u64,
+}
+
+/// Decision for a message of a log event.
+#[derive(Debug, PartialEq)]
+pub enum LogDecision {
+    /// Log the message, after a summary of the messages suppressed in the last `seconds` if
+    /// `suppressed` is not 0.
+    Log { suppressed: u64, seconds: u64 },
+    /// The message repeats within the window and is only counted.
+    Suppress,
+}
+
+/// A log storm table mapped from a file.
+pub struct LogStormTable {
+    map: NonNull<u8>,
+    len: usize,
+    slots: usize,
+    dev: u64,
+    ino: u64,
+}
+
+// The mapping is only accessed through atomics.
+unsafe impl Send for LogStormTable {}
+unsafe impl Sync for LogStormTable {}
+
+impl LogStormTable {
+    /// Returns the mapped table at `path` from the process-wide cache, opening it if it is not
+    /// mapped yet or if the file was replaced since it was mapped.
+    ///
+    /// # Arguments
+    /// - `path`: Path of the table file
+    ///
+    /// # Returns
+    /// The mapped table or the error that occurred while opening it.
+    pub fn open_cached(path: &Path) -> io::Result<Arc<LogStormTable>> {
+        let meta = fs::metadata(path).ok();
+        let is_current = |table: &LogStormTable| {
+            meta.as_ref()
+                .map_or(false, |m| m.dev() == table.dev && m.ino() == table.ino)
+        };
+
+        if let Ok(tables) = LOG_STORM_TABLES.read() {
+            if let Some(table) = tables.get(path).filter(|table| is_current(table)) {
+                return Ok(Arc::clone(table));
+            }
+        }
+
+        let table = Arc::new(Self::open(path)?);
+
+        if let Ok(mut tables) = LOG_STORM_TABLES.write() {
+            tables.insert(path.to_path_buf(), Arc::clone(&table));
+        }
+
+        Ok(table)
+    }
+
+    /// Opens and maps the table at `path`, creating it if it does not exist.
+    ///
+    /// # Arguments
+    /// - `path`: Path of the table file
+    ///
+    /// # Returns
+    /// The mapped table or the error that occurred while opening it.
+    pub fn open(path: &Path) -> io::Result<LogStormTable> {
+        if let Some(dir) = path.parent() {
+            fs::create_dir_all(dir)?;
+        }
+
+        let file = OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create(true)
+            .mode(0o600)
+            .open(path)?;
+
+        let slots = Self::init_header(&file)?;
+        let len = Self::file_len(slots);
+
+        if file.metadata()?.len() < len as u64 {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "log storm table is truncated",
+            ));
+        }
+
+        let meta = file.metadata()?;
+        Ok(LogStormTable {
+            map: map_shared(&file, len)?,
+            len,
+            slots,
+            dev: meta.dev(),
+            ino: meta.ino(),
+        })
+    }
+
+    /// Size of a table file with `slots` slots.
+    fn file_len(slots: usize) -> usize {
+        HEADER_SIZE + slots * SLOT_SIZE
+    }
+
+    /// Writes the header to an empty table file and reads the number of slots from it.
+    /// Held under an exclusive `flock` so concurrent processes do not initialize the file twice.
+    fn init_header(file: &File) -> io::Result<usize> {
+        let _lock = FileLock::exclusive(file)?;
+
+        if file.metadata()?.len() == 0 {
+            let mut header = [0u8; HEADER_SIZE];
+            header[0..8].copy_from_slice(&MAGIC);
+            header[8..12].copy_from_slice(&VERSION.to_le_bytes());
+            header[12..16].copy_from_slice(&SLOTS.to_le_bytes());
+
+            file.set_len(Self::file_len(SLOTS as usize) as u64)?;
+            file.write_all_at(&header, 0)?;
+        }
+
+        let mut header = [0u8; HEADER_SIZE];
+        file.read_exact_at(&mut header, 0)?;
+
+        let version = u32::from_le_bytes([header[8], header[9], header[10], header[11]]);
+        let slots = u32::from_le_bytes([header[12], header[13], header[14], header[15]]);
+
+        if header[0..8] != MAGIC || version != VERSION || slots == 0 {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "invalid log storm table header",
+            ));
+        }
+
+        Ok(slots as usize)
+    }
+
+    /// Returns the word `word` of the slot at `index`.
+    fn word(&self, index: usize, word: usize) -> &AtomicU64 {
+        let offset = HEADER_SIZE + index * SLOT_SIZE + word * 8;
+        debug_assert!(offset + 8 <= self.len);
+        unsafe { &*(self.map.as_ptr().add(offset) as *const AtomicU64) }
+    }
+
+    /// Finds the slot of `key`, taking over an empty or idle slot if there is none.
+    ///
+    /// # Returns
+    /// The index of the slot and the unreported messages of an idle slot that was taken over.
+    fn slot(&self, key: u64, now: u64, window_seconds: u64) -> Option<(usize, Option<Summary>)> {
+        let start = (splitmix64(key) % self.slots as u64) as usize;
+        let mut idle = None;
+
+        for probe in 0..MAX_PROBE.min(self.slots) {
+            let index = (start + probe) % self.slots;
+            match self.word(index, 0).load(Ordering::Acquire) {
+                stored if stored == key => return Some((index, None)),
+                0 => {
+                    match self.word(index, 0).compare_exchange(
+                        0,
+                        key,
+                        Ordering::AcqRel,
+                        Ordering::Acquire,
+                    ) {
+                        Ok(_) => return Some((index, None)),
+                        Err(stored) if stored == key => return Some((index, None)),
+                        Err(_) => continue,
+                    }
+                }
+                stored => {
+                    let logged = self.word(index, 1).load(Ordering::Acquire);
+                    if idle.is_none() && now.saturating_sub(logged) >= 2 * window_seconds {
+                        idle = Some((index, stored));
+                    }
+                }
+            }
+        }
+
+        // A slot taken over by a concurrent process keeps its key and is logged unsuppressed
+        let (index, stored) = idle?;
+        self.word(index, 0)
+            .compare_exchange(stored, key, Ordering::AcqRel, Ordering::Acquire)
+            .ok()?;
+        let logged = self.word(index, 1).swap(0, Ordering::AcqRel);
+        let suppressed = self.word(index, 2).swap(0, Ordering::AcqRel);
+
+        // The repeats of the previous account are reported by the process that takes it over
+        let summary = LogEvent::from_key(stored)
+            .filter(|_| suppressed > 0)
+            .map(|event| Summary {
+                uid: (stored >> 8) as u32,
+                event,
+                suppressed,
+                seconds: now.saturating_sub(logged),
+            });
+        Some((index, summary))
+    }
+
+    /// Decides whether a message of `event` for the account `uid` is logged.
+    ///
+    /// The first message of a window is logged. Repeats within `window_seconds` of the last
+    /// logged message are counted, and the count is returned with the first message after
+    /// the window.
+    ///
+    /// # Arguments
+    /// - `uid`: The account of the message
+    /// - `event`: The log event of the message
+    /// - `now`: The current instant in seconds since the epoch
+    /// - `window_seconds`: Minimum time between two logged messages
+    ///
+    /// # Returns
+    /// The decision for the message, and the unreported messages of another account whose idle
+    /// slot was taken over for this one
+    pub fn check(
+        &self,
+        uid: u32,
+        event: LogEvent,
+        now: u64,
+        window_seconds: u64,
+    ) -> (LogDecision, Option<Summary>) {
+        let key = KEY_USED | (uid as u64) << 8 | event as u64;
+        let Some((index, summary)) = self.slot(key, now, window_seconds) else {
+            let decision = LogDecision::Log {
+                suppressed: 0,
+                seconds: 0,
+            };
+            return (decision, None);
+        };
+        (self.decide(index, now, window_seconds), summary)
+    }
+
+    /// Decides whether a message is logged for the slot at `index`, see `check`.
+    fn decide(&self, index: usize, now: u64, window_seconds: u64) -> LogDecision {
+        let logged = self.word(index, 1);
+        let last = logged.load(Ordering::Acquire);
+        if now.saturating_sub(last) >= window_seconds
+            && logged
+                .compare_exchange(last, now, Ordering::AcqRel, Ordering::Acquire)
+                .is_ok()
+        {
+            // The process that starts the window reports the suppressed messages
+            let suppressed = self.word(index, 2).swap(0, Ordering::AcqRel);
+            return LogDecision::Log {
+                suppressed,
+                seconds: now.saturating_sub(last),
+            };
+        }
+
+        self.word(index, 2).fetch_add(1, Ordering::AcqRel);
+        LogDecision::Suppress
+    }
+}
+
+impl Drop for LogStormTable {
+    fn drop(&mut self) {
+        unsafe {
+            libc::munmap(self.map.as_ptr() as *mut libc::c_void, self.len);
+        }
+    }
+}
+
+/// Spreads the bits of a key over the table.
+fn splitmix64(key: u64) -> u64 {
+    let mut z = key.wrapping_add(0x9e37_79b9_7f4a_7c15);
+    z = (z ^ (z >> 30)).wrapping_mul(0xbf58_476d_1ce4_e5b9);
+    z = (z ^ (z >> 27)).wrapping_mul(0x94d0_49bb_1331_11eb);
+    z ^ (z >> 31)
+}
+
+// Unit Tests
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use tempdir::TempDir;
+
+    const WINDOW: u64 = 60;
+    const NOW: u64 = 1_700_000_000;
+
+    #[test]
+    fn test_repeats_are_collapsed_per_window() {
+        let temp_dir = TempDir::new("test_log_storm_collapsed").unwrap();
+        let table = LogStormTable::open(&temp_dir.path().join(LOG_STORM_FILE)).unwrap();
+
+        assert_eq!(
+            table.check(1000, LogEvent::Bounce, NOW, WINDOW).0,
+            LogDecision::Log {
+                suppressed: 0,
+                seconds: NOW,
+            }
+        );
+        for second in 1..=5 {
+            assert_eq!(
+                table.check(1000, LogEvent::Bounce, NOW + second, WINDOW).0,
+                LogDecision::Suppress
+            );
+        }
+
+        // Other accounts and events have their own window
+        assert!(matches!(
+            table.check(1001, LogEvent::Bounce, NOW + 1, WINDOW).0,
+            LogDecision::Log { suppressed: 0, .. }
+        ));
+        assert!(matches!(
+            table.check(1000, LogEvent::Lockout, NOW + 1, WINDOW).0,
+            LogDecision::Log { suppressed: 0, .. }
+        ));
+
+        assert_eq!(
+            table
+                .check(1000, LogEvent::Bounce, NOW + WINDOW + 3, WINDOW)
+                .0,
+            LogDecision::Log {
+                suppressed: 5,
+                seconds: WINDOW + 3,
+            }
+        );
+    }
+
+    #[test]
+    fn test_state_is_shared_between_mappings() {
+        let temp_dir = TempDir::new("test_log_storm_shared").unwrap();
+        let path = temp_dir.path().join(LOG_STORM_FILE);
+        let first = LogStormTable::open(&path).unwrap();
+        let second = LogStormTable::open(&path).unwrap();
+
+        first.check(0, LogEvent::Lockout, NOW, WINDOW);
+        assert_eq!(
+            second.check(0, LogEvent::Lockout, NOW + 1, WINDOW).0,
+            LogDecision::Suppress
+        );
+        assert_eq!(
+            first.check(0, LogEvent::Lockout, NOW + WINDOW, WINDOW).0,
+            LogDecision::Log {
+                suppressed: 1,
+                seconds: WINDOW,
+            }
+        );
+    }
+
+    #[test]
+    fn test_idle_slots_are_reused() {
+        let temp_dir = TempDir::new("test_log_storm_reused").unwrap();
+        let table = LogStormTable::open(&temp_dir.path().join(LOG_STORM_FILE)).unwrap();
+
+        // Far more accounts than slots only fit because quiet entries are taken over
+        for uid in 0..2 * SLOTS {
+            let now = NOW + (uid as u64 / 64) * WINDOW;
+            table.check(uid, LogEvent::Bounce, now, WINDOW);
+            let (decision, summary) = table.check(uid, LogEvent::Bounce, now, WINDOW);
+            assert_eq!(decision, LogDecision::Suppress, "uid {}", uid);
+            assert!(summary.is_none());
+        }
+    }
+
+    #[test]
+    fn test_taken_over_slots_report_suppressed_messages() {
+        let temp_dir = TempDir::new("test_log_storm_taken_over").unwrap();
+        let table = LogStormTable::open(&temp_dir.path().join(LOG_STORM_FILE)).unwrap();
+
+        // A burst that stops leaves repeats behind in every slot
+        for uid in 0..SLOTS {
+            table.check(uid, LogEvent::Bounce, NOW, WINDOW);
+            table.check(uid, LogEvent::Bounce, NOW + 1, WINDOW);
+        }
+
+        // Taking over a slot reports them
+        let (_, summary) = table.check(SLOTS, LogEvent::Lockout, NOW + 2 * WINDOW, WINDOW);
+        let summary = summary.unwrap();
+        assert!(summary.uid < SLOTS);
+        assert_eq!(summary.event, LogEvent::Bounce);
+        assert_eq!((summary.suppressed, summary.seconds), (1, 2 * WINDOW));
+    }
+}
@@ -0,0 +1,379 @@
+//! # Tally Watch
+//!
+//! Lets a bounced session sleep until its unlock instant or until its tally changes, whichever
+//! comes first, without waking up in between. An admin reset or a successful login from another
+//! session releases a waiting session right away.
+//!
+//! - `file` and `daemon` backends: an inotify watch on the tally file of the user. Tally files
+//!   are replaced by a rename, which is reported on the watched inode, so only sessions of the
+//!   changed user wake up. The deadline is an absolute `CLOCK_REALTIME` timerfd, so it is met
+//!   exactly even if the clock is adjusted while waiting.
+//! - `mmap` backend: a futex on the failures count of the database slot, with an absolute
+//!   `CLOCK_REALTIME` timeout. A reset, a failure or a new unlock instant wakes all waiters of
+//!   the slot.
+//!
+//! A wake-up only means that the tally may have changed. The waiter loads the tally again after
+//! every wake-up and timeout and decides whether it is still locked.
+//!
+//! ## License
+//!
+//! pam-authramp
+//! Copyright (C) 2023 github.com/34N0
+//!
+//! This program is free software: you can redistribute it and/or modify
+//! it under the terms of the GNU General Public License as published by
+//! the Free Software Foundation, either version 3 of the License, or
+//! (at your option) any later version.
+//!
+//! This program is distributed in the hope that it will be useful,
+//! but WITHOUT ANY WARRANTY; without even the implied warranty of
+//! MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//! GNU General Public License for more details.
+//!
+//! You should have received a copy of the GNU General Public License
+//! along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+use std::fs::File;
+use std::io;
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::io::{AsRawFd, FromRawFd};
+use std::path::PathBuf;
+use std::ptr;
+#[cfg(feature = "mmap")]
+use std::sync::Arc;
+
+use chrono::{DateTime, Utc};
+
+#[cfg(feature = "mmap")]
+use super::mmap::TallyDb;
+#[cfg(feature = "mmap")]
+use super::TallyBackend;
+#[cfg(feature = "mmap")]
+use super::TALLY_DB_FILE;
+use crate::settings::HookSettings;
+use crate::tally::Tally;
+
+/// Events of the watched tally file inode that may change the tally.
+const FILE_EVENTS: u32 = libc::IN_MODIFY
+    | libc::IN_CLOSE_WRITE
+    | libc::IN_ATTRIB
+    | libc::IN_MOVE_SELF
+    | libc::IN_DELETE_SELF;
+
+/// Source of tally change events.
+enum Source {
+    /// inotify watch on the tally file and a timerfd for the deadline.
+    File {
+        inotify: File,
+        timer: File,
+        path: PathBuf,
+    },
+    /// Futex on the failures count of the database slot.
+    #[cfg(feature = "mmap")]
+    Slot {
+        db: Arc<TallyDb>,
+        uid: u32,
+        count: u32,
+    },
+}
+
+/// Waits for the unlock instant or a change of the tally of a user.
+pub struct TallyWatch {
+    source: Source,
+}
+
+impl TallyWatch {
+    /// Sets up the event source of the configured backend.
+    ///
+    /// # Arguments
+    /// - `settings`: A reference to the `HookSettings` of the call.
+    ///
+    /// # Returns
+    /// The watch or the error that occurred while creating the event source.
+    pub fn new(settings: &HookSettings) -> io::Result<Self> {
+        let user = &settings.user;
+
+        #[cfg(feature = "mmap")]
+        if settings.tally_backend == TallyBackend::Mmap {
+            let db = TallyDb::open_cached(
+                &settings.tally_dir.join(TALLY_DB_FILE),
+                settings.tally_db_slots,
+            )?;
+            return Ok(TallyWatch {
+                source: Source::Slot {
+                    db,
+                    uid: user.uid(),
+                    count: 0,
+                },
+            });
+        }
+
+        let inotify = unsafe { libc::inotify_init1(libc::IN_CLOEXEC | libc::IN_NONBLOCK) };
+        if inotify < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        let inotify = unsafe { File::from_raw_fd(inotify) };
+
+        let timer = unsafe { libc::timerfd_create(libc::CLOCK_REALTIME, libc::TFD_CLOEXEC) };
+        if timer < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        let timer = unsafe { File::from_raw_fd(timer) };
+
+        Ok(TallyWatch {
+            source: Source::File {
+                inotify,
+                timer,
+                path: settings.tally_dir.join(user.name()),
+            },
+        })
+    }
+
+    /// Loads the current tally and arms the watch for changes after it was loaded.
+    ///
+    /// # Returns
+    /// The tally, `None` if the user has no tally anymore, or the error that occurred.
+    pub fn load(&mut self) -> io::Result<Option<Tally>> {
+        match &mut self.source {
+            Source::File { inotify, path, .. } => {
+                // Watch before reading, so a change after the read is never missed
+                let c_path = std::ffi::CString::new(path.as_os_str().as_bytes())?;
+                let wd = unsafe {
+                    libc::inotify_add_watch(inotify.as_raw_fd(), c_path.as_ptr(), FILE_EVENTS)
+                };
+                if wd < 0 {
+                    let e = io::Error::last_os_error();
+                    return match e.kind() {
+                        io::ErrorKind::NotFound => Ok(None),
+                        _ => Err(e),
+                    };
+                }
+
+                Tally::load_tally_file(path)
+                    .map_err(|_| io::Error::new(io::ErrorKind::InvalidData, "invalid tally file"))
+            }
+            #[cfg(feature = "mmap")]
+            Source::Slot { db, uid, count } => Ok(db.find(*uid).map(|slot| {
+                let mut tally = Tally::default();
+                *count = slot.load_count();
+                slot.load(&mut tally);
+                tally
+            })),
+        }
+    }
+
+    /// Sleeps until `deadline` or until the tally may have changed since the last `load`.
+    ///
+    /// # Arguments
+    /// - `deadline`: The instant to wake up at the latest.
+    ///
+    /// # Returns
+    /// Whether the watch reported a change, or the error that occurred while waiting.
+    pub fn wait(&mut self, deadline: DateTime<Utc>) -> io::Result<bool> {
+        let deadline = libc::timespec {
+            tv_sec: deadline.timestamp() as libc::time_t,
+            tv_nsec: deadline.timestamp_subsec_nanos() as libc::c_long,
+        };
+
+        match &mut self.source {
+            Source::File { inotify, timer, .. } => {
+                let spec = libc::itimerspec {
+                    it_interval: libc::timespec {
+                        tv_sec: 0,
+                        tv_nsec: 0,
+                    },
+                    it_value: deadline,
+                };
+                if unsafe {
+                    libc::timerfd_settime(
+                        timer.as_raw_fd(),
+                        libc::TFD_TIMER_ABSTIME,
+                        &spec,
+                        ptr::null_mut(),
+                    )
+                } != 0
+                {
+                    return Err(io::Error::last_os_error());
+                }
+
+                let mut fds = [
+                    libc::pollfd {
+                        fd: inotify.as_raw_fd(),
+                        events: libc::POLLIN,
+                        revents: 0,
+                    },
+                    libc::pollfd {
+                        fd: timer.as_raw_fd(),
+                        events: libc::POLLIN,
+                        revents: 0,
+                    },
+                ];
+                if unsafe { libc::poll(fds.as_mut_ptr(), fds.len() as libc::nfds_t, -1) } < 0 {
+                    let e = io::Error::last_os_error();
+                    return match e.kind() {
+                        io::ErrorKind::Interrupted => Ok(true),
+                        _ => Err(e),
+                    };
+                }
+
+                if fds[0].revents == 0 {
+                    return Ok(false);
+                }
+
+                // Drain the events, the tally is loaded again anyway
+                let mut buf = [0u8; 4096];
+                while unsafe {
+                    libc::read(
+                        inotify.as_raw_fd(),
+                        buf.as_mut_ptr() as *mut libc::c_void,
+                        buf.len(),
+                    )
+                } > 0
+                {}
+                Ok(true)
+            }
+            #[cfg(feature = "mmap")]
+            Source::Slot { db, uid, count } => {
+                let Some(slot) = db.find(*uid) else {
+                    return Ok(true);
+                };
+                slot.wait_count(*count, &deadline)
+            }
+        }
+    }
+}
+
+// Unit Tests
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::settings::Settings;
+    use crate::Actions;
+    use chrono::Duration;
+    use std::sync::Arc;
+    use std::thread;
+    use std::time::Instant;
+    use tempdir::TempDir;
+    use users::User;
+
+    #[test]
+    fn test_file_watch_wakes_on_reset() {
+        let temp_dir = TempDir::new("test_file_watch_wakes_on_reset").unwrap();
+        let settings = Settings {
+            tally_dir: temp_dir.path().to_path_buf(),
+            action: Some(Actions::AUTHFAIL),
+            ..Default::default()
+        };
+        let settings = HookSettings::new(
+            Arc::new(settings),
+            User::new(9999, "test_user", 9999),
+            "test",
+        );
+        let tally_file = temp_dir.path().join("test_user");
+        std::fs::write(
+            &tally_file,
+            "[Fails]\ncount = 9\ninstant = \"2023-01-01T00:00:00Z\"\nunlock_instant = \"2099-01-01T00:00:00Z\"",
+        )
+        .unwrap();
+
+        let mut watch = TallyWatch::new(&settings).unwrap();
+        assert_eq!(watch.load().unwrap().unwrap().failures_count, 9);
+
+        // The deadline is met without a change
+        let start = Instant::now();
+        assert!(!watch.wait(Utc::now() + Duration::milliseconds(50)).unwrap());
+        assert!(start.elapsed() >= std::time::Duration::from_millis(40));
+
+        // A reset wakes the watch long before the deadline
+        let reset = {
+            let settings = settings.clone();
+            thread::spawn(move || {
+                thread::sleep(std::time::Duration::from_millis(50));
+                Tally::reset_tally_file(&tally_file, &settings, None).unwrap();
+            })
+        };
+        let start = Instant::now();
+        assert!(watch.wait(Utc::now() + Duration::seconds(30)).unwrap());
+        assert!(start.elapsed() < std::time::Duration::from_secs(10));
+        reset.join().unwrap();
+        assert!(watch.load().unwrap().unwrap().is_clear());
+    }
+
+    #[test]
+    #[cfg(feature = "mmap")]
+    fn test_slot_watch_wakes_on_reset() {
+        let temp_dir = TempDir::new("test_slot_watch_wakes_on_reset").unwrap();
+        let settings = Settings {
+            tally_dir: temp_dir.path().to_path_buf(),
+            tally_backend: TallyBackend::Mmap,
+            tally_db_slots: 16,
+            ..Default::default()
+        };
+        let settings = HookSettings::new(
+            Arc::new(settings),
+            User::new(9999, "test_user", 9999),
+            "test",
+        );
+        let db = TallyDb::open_cached(&temp_dir.path().join(TALLY_DB_FILE), 16).unwrap();
+        db.find_or_insert(9999).unwrap().add_failure();
+
+        let mut watch = TallyWatch::new(&settings).unwrap();
+        assert_eq!(watch.load().unwrap().unwrap().failures_count, 1);
+        assert!(!watch.wait(Utc::now() + Duration::milliseconds(20)).unwrap());
+
+        let reset = thread::spawn(move || {
+            thread::sleep(std::time::Duration::from_millis(50));
+            db.find(9999).unwrap().reset();
+        });
+        let start = Instant::now();
+        assert!(watch.wait(Utc::now() + Duration::seconds(30)).unwrap());
+        assert!(start.elapsed() < std::time::Duration::from_secs(10));
+        reset.join().unwrap();
+        assert!(watch.load().unwrap().unwrap().is_clear());
+    }
+
+    #[test]
+    #[cfg(feature = "mmap")]
+    fn test_slot_watch_wakes_on_failure() {
+        let temp_dir = TempDir::new("test_slot_watch_wakes_on_failure").unwrap();
+        let settings = Settings {
+            tally_dir: temp_dir.path().to_path_buf(),
+            tally_backend: TallyBackend::Mmap,
+            tally_db_slots: 16,
+            ..Default::default()
+        };
+        let settings = HookSettings::new(
+            Arc::new(settings),
+            User::new(9999, "test_user", 9999),
+            "test",
+        );
+        let db = TallyDb::open_cached(&temp_dir.path().join(TALLY_DB_FILE), 16).unwrap();
+        db.find_or_insert(9999).unwrap().add_failure();
+
+        let mut watch = TallyWatch::new(&settings).unwrap();
+        assert_eq!(watch.load().unwrap().unwrap().failures_count, 1);
+
+        // A failure of another session extends the lock
+        let unlock_instant = Utc::now() + Duration::hours(1);
+        let fail = thread::spawn(move || {
+            thread::sleep(std::time::Duration::from_millis(50));
+            let slot = db.find(9999).unwrap();
+            slot.add_failure();
+            slot.store_instants(&Tally {
+                unlock_instant: Some(unlock_instant),
+                ..Default::default()
+            });
+        });
+        let start = Instant::now();
+        assert!(watch.wait(Utc::now() + Duration::seconds(30)).unwrap());
+        assert!(start.elapsed() < std::time::Duration::from_secs(10));
+        fail.join().unwrap();
+
+        let tally = watch.load().unwrap().unwrap();
+        assert_eq!(tally.failures_count, 2);
+        assert_eq!(
+            tally.unlock_instant.map(|i| i.timestamp_micros()),
+            Some(unlock_instant.timestamp_micros())
+        );
+    }
+}
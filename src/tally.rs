@@ -36,19 +36,37 @@
 //! You should have received a copy of the GNU General Public License
 //! along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
+#[cfg(feature = "binary")]
+use std::os::unix::fs::FileExt;
 use std::{
-    fs,
+    fs::File,
+    io::{self, Read},
     path::{Path, PathBuf},
 };
 
-use crate::{settings::Settings, syslog_error, syslog_info, Actions};
+#[cfg(feature = "binary")]
+use crate::store::binary;
+#[cfg(feature = "mmap")]
+use crate::store::mmap::{Slot, TallyDb};
+use crate::store::filter::TallyFilter;
+use crate::store::sketch::{RhostSketch, RHOST_SKETCH_FILE};
+use crate::store::storm::LogEvent;
+#[cfg(feature = "daemon")]
+use crate::store::DaemonStore;
+#[cfg(feature = "mmap")]
+use crate::store::{MmapStore, TALLY_DB_FILE};
+use crate::store::{self, FileStore, TallyBackend, TallyFormat, TallyStore};
+use crate::utils::metrics::{self, Counter};
+use crate::utils;
+use crate::settings::{HookSettings, Settings};
+use crate::{syslog_error, syslog_info, Actions};
 use chrono::{DateTime, Duration, Utc};
 use pam::constants::PamResultCode;
 use users::User;
 
 /// The `Tally` struct represents the account lockout information, including
 /// the number of authentication failures and the timestamp of the last failure.
-#[derive(Debug, PartialEq)]
+#[derive(Debug, Clone, PartialEq)]
 pub struct Tally {
     /// An optional `PathBuf` representing the path to the file storing tally information.
     pub tally_file: Option<PathBuf>,
@@ -73,54 +91,452 @@ impl Default for Tally {
 }
 
 impl Tally {
-    /// Calculates the delay based on the number of authentication failures and settings.
-    /// Uses the authramp formula: delay=ramp_multiplier×(fails − free_tries)×ln(fails − free_tries)+base_delay_seconds
+    /// Looks up the delay for the number of authentication failures in the delay table of the
+    /// settings. The delay follows the configured `delay_curve` and is capped at 24 hours.
     ///
     /// # Arguments
-    /// - `fails`: Number of authentication failures
     /// - `settings`: Settings for the authramp module
     ///
     /// # Returns
-    /// Calculated delay as a floating-point number
+    /// The delay after the last failure
     pub fn get_delay(&self, settings: &Settings) -> Duration {
-        Duration::seconds(
-            (settings.ramp_multiplier as f64
-                * (self.failures_count as f64 - settings.free_tries as f64)
-                * ((self.failures_count as f64 - settings.free_tries as f64).ln())
-                + settings.base_delay_seconds as f64) as i64,
-        )
+        settings
+            .delay_table
+            .get(self.failures_count.saturating_sub(settings.free_tries))
     }
 
-    /// Opens or creates the tally file based on the provided `Settings`.
+    /// Sets the unlock instant according to the delay after the failure instant.
     ///
-    /// If the file exists, loads the values; if not, creates the file with default values.
-    /// Updates the tally based on authentication actions, such as successful or failed attempts.
+    /// # Arguments
+    /// - `settings`: Settings for the authramp module
+    fn set_unlock_instant(&mut self, settings: &Settings) {
+        self.unlock_instant = Some(self.failure_instant + self.get_delay(settings));
+    }
+
+    /// Loads the tally from the configured tally backend and updates it based on the
+    /// authentication action, such as successful or failed attempts.
     ///
     /// # Arguments
-    /// - `settings`: A reference to the `Settings` struct.
+    /// - `settings`: A reference to the `HookSettings` of the call.
     ///
     /// # Returns
     /// A `Result` containing either the `Tally` struct or a `PAM_AUTH_ERR`.
-    pub fn new_from_tally_file(settings: &Settings) -> Result<Self, PamResultCode> {
+    pub fn new_from_tally_file(settings: &HookSettings) -> Result<Self, PamResultCode> {
+        match settings.tally_backend {
+            TallyBackend::File => Self::open_with::<FileStore>(settings),
+            #[cfg(feature = "mmap")]
+            TallyBackend::Mmap => Self::open_with::<MmapStore>(settings),
+            #[cfg(feature = "daemon")]
+            TallyBackend::Daemon => Self::open_with::<DaemonStore>(settings),
+            #[allow(unreachable_patterns)]
+            backend => {
+                syslog_error!(
+                    "PAM_SYSTEM_ERR: Tally backend {:?} is not compiled in, using tally files",
+                    backend
+                );
+                Self::open_with::<FileStore>(settings)
+            }
+        }
+    }
+
+    /// Loads the tally from the tally store `S` and updates it based on the authentication
+    /// action. The store is resolved at compile time, so no dynamic dispatch is involved.
+    ///
+    /// # Arguments
+    /// - `settings`: A reference to the `HookSettings` of the call.
+    ///
+    /// # Returns
+    /// A `Result` containing either the `Tally` struct or a `PAM_AUTH_ERR`.
+    pub fn open_with<S: TallyStore>(settings: &HookSettings) -> Result<Self, PamResultCode> {
+        let tally = S::open(settings)?;
+
+        if settings.rhost_tracking {
+            Ok(tally.merge_rhost_tally(settings))
+        } else {
+            Ok(tally)
+        }
+    }
+
+    /// Counts the failure of the remote host on AUTHFAIL and returns the tally of the remote host
+    /// instead of the user tally if the remote host is locked longer.
+    ///
+    /// The failures of the remote host beyond `rhost_free_tries` continue the ramp after
+    /// `free_tries`, so the delay of a remote host follows the same curve as the delay of a user.
+    /// The user tally on disk is not changed.
+    ///
+    /// # Arguments
+    /// - `settings`: A reference to the `HookSettings` of the call.
+    ///
+    /// # Returns
+    /// The tally to bounce the attempt with.
+    fn merge_rhost_tally(self, settings: &HookSettings) -> Self {
+        let (Some(rhost), Ok(action)) = (settings.rhost.as_deref(), settings.get_action()) else {
+            return self;
+        };
+        if action == Actions::AUTHSUCC {
+            return self;
+        }
+
+        let sketch = match RhostSketch::open_cached(
+            &settings.tally_dir.join(RHOST_SKETCH_FILE),
+            settings.rhost_sketch_width,
+        ) {
+            Ok(sketch) => sketch,
+            Err(e) => {
+                syslog_error!("PAM_SYSTEM_ERR: Error opening rhost sketch: {}", e);
+                return self;
+            }
+        };
+
+        let now = Utc::now();
+        let estimate = if action == Actions::AUTHFAIL {
+            sketch.add(rhost, now, settings.rhost_window_seconds)
+        } else {
+            sketch.estimate(rhost, now, settings.rhost_window_seconds)
+        };
+
+        let excess = i32::try_from(estimate.failures_count)
+            .unwrap_or(i32::MAX)
+            .saturating_sub(settings.rhost_free_tries);
+        let Some(last_failure) = estimate.last_failure.filter(|_| excess > 0) else {
+            return self;
+        };
+
+        let mut rhost_tally = Tally {
+            failures_count: settings.free_tries.saturating_add(excess),
+            failure_instant: last_failure,
+            ..Default::default()
+        };
+        rhost_tally.set_unlock_instant(settings);
+
+        let locked_longer = match (rhost_tally.unlock_instant, self.unlock_instant) {
+            (Some(rhost_unlock), Some(user_unlock)) => {
+                rhost_unlock > user_unlock || self.failures_count <= settings.free_tries
+            }
+            _ => true,
+        };
+
+        if locked_longer && rhost_tally.unlock_instant > Some(now) {
+            if action == Actions::AUTHFAIL {
+                syslog_info!(
+                    "PAM_AUTH_ERR: Added tally ({} failures) for the remote host {:?}. Remote host is locked until {}.",
+                    estimate.failures_count,
+                    rhost,
+                    rhost_tally.unlock_instant.unwrap_or(now)
+                );
+            }
+            rhost_tally
+        } else {
+            self
+        }
+    }
+
+    /// Loads and updates the tally file, through the shared memory tally cache if enabled and
+    /// compiled in.
+    ///
+    /// # Arguments
+    /// - `settings`: A reference to the `HookSettings` of the call.
+    ///
+    /// # Returns
+    /// A `Result` containing either the `Tally` struct or a `PAM_SYSTEM_ERR`.
+    fn new_from_tally_files(settings: &HookSettings) -> Result<Self, PamResultCode> {
+        #[cfg(feature = "mmap")]
+        if settings.tally_cache {
+            return Self::new_from_tally_cache(settings);
+        }
+        #[cfg(not(feature = "mmap"))]
+        if settings.tally_cache {
+            syslog_error!("PAM_SYSTEM_ERR: Tally cache is not compiled in, using tally files");
+        }
+        Self::new_from_file_backend(settings)
+    }
+
+    /// Requests the tally decision from the authramp daemon.
+    ///
+    /// If the daemon is not running or does not answer within `daemon_timeout_ms`, the tally
+    /// files are used directly.
+    ///
+    /// # Arguments
+    /// - `settings`: A reference to the `HookSettings` of the call.
+    ///
+    /// # Returns
+    /// A `Result` containing either the `Tally` struct or a `PAM_SYSTEM_ERR`.
+    #[cfg(feature = "daemon")]
+    fn new_from_daemon(settings: &HookSettings) -> Result<Self, PamResultCode> {
+        let user = &settings.user;
+        let action = settings.get_action()?;
+
+        match store::daemon::request(settings, action, user) {
+            Ok(response) => {
+                match action {
+                    Actions::PREAUTH => {}
+                    Actions::AUTHSUCC => Self::log_cleared(response.previous_failures_count, user),
+                    Actions::AUTHFAIL => Self::log_locked(&response.tally, user, settings),
+                }
+                Ok(response.tally)
+            }
+            Err(e) => {
+                syslog_error!(
+                    "Error requesting tally from daemon, using tally files: {}",
+                    e
+                );
+                Self::new_from_tally_files(settings)
+            }
+        }
+    }
+
+    /// Opens the tally file based on the provided `Settings`.
+    ///
+    /// If the file exists, loads the values. A tally file is only created by AUTHFAIL. With
+    /// `tally_filter` enabled, PREAUTH and AUTHSUCC of users that are not in the tally filter
+    /// return a clear tally without touching the tally directory.
+    ///
+    /// # Arguments
+    /// - `settings`: A reference to the `HookSettings` of the call.
+    ///
+    /// # Returns
+    /// A `Result` containing either the `Tally` struct or a `PAM_AUTH_ERR`.
+    fn new_from_file_backend(settings: &HookSettings) -> Result<Self, PamResultCode> {
         let mut tally = Tally::default();
-        let user = settings.get_user()?;
+        let user = &settings.user;
 
         let tally_file = settings.tally_dir.join(user.name());
+        let action = settings.get_action()?;
+
+        if settings.tally_filter && action != Actions::AUTHFAIL {
+            match TallyFilter::open_cached(settings) {
+                Ok(Some(filter)) if !filter.contains(user.name()) => return Ok(tally),
+                // Without a filter every user may have a tally
+                Ok(_) => {}
+                Err(e) => syslog_error!("PAM_SYSTEM_ERR: Error opening tally filter: {}", e),
+            }
+        }
 
-        if tally_file.exists() {
-            Self::load_tally_from_file(&mut tally, user, &tally_file, settings)?
+        // AUTHSUCC only takes the lock if there is something to reset. Tally files are
+        // replaced atomically, so the check does not need a lock.
+        if action == Actions::AUTHSUCC {
+            match Self::load_tally_file(&tally_file)? {
+                Some(mut tally) => {
+                    tally.expire(settings);
+                    if tally.is_clear() {
+                        return Ok(tally);
+                    }
+                }
+                None => return Ok(tally),
+            }
+        }
+
+        // PREAUTH does not create a tally file for a user without one
+        if action == Actions::PREAUTH && !tally_file.exists() {
+            return Ok(tally);
+        }
+
+        // Only PREAUTH is read-only, everything else serializes on the user's tally
+        let exclusive = action != Actions::PREAUTH;
+
+        // The lock is held until the file is closed at the end of this function
+        let file = store::file::open_locked(&tally_file, exclusive).map_err(|e| {
+            syslog_error!("PAM_SYSTEM_ERR: Error opening tally file: {}", e);
+            PamResultCode::PAM_SYSTEM_ERR
+        })?;
+
+        let is_new = file.metadata().map(|m| m.len() == 0).unwrap_or(true);
+
+        if is_new {
+            // The tally file was created but not written yet, only AUTHFAIL writes it
+            if action == Actions::AUTHFAIL {
+                Self::update_tally_from_section(&mut tally, user, &tally_file, settings)?
+            }
         } else {
-            Self::create_tally_file(&mut tally, &tally_file, settings)?
+            Self::load_tally_from_file(&mut tally, user, &file, &tally_file, settings)?
         };
 
         Ok(tally)
     }
 
+    /// Loads and updates the tally in the memory-mapped tally database.
+    ///
+    /// The database slot of the user is updated in place with atomic operations. PREAUTH and
+    /// AUTHSUCC do not claim a slot for users without a tally.
+    ///
+    /// # Arguments
+    /// - `settings`: A reference to the `HookSettings` of the call.
+    ///
+    /// # Returns
+    /// A `Result` containing either the `Tally` struct or a `PAM_SYSTEM_ERR`.
+    #[cfg(feature = "mmap")]
+    fn new_from_tally_db(settings: &HookSettings) -> Result<Self, PamResultCode> {
+        let mut tally = Tally::default();
+        let user = &settings.user;
+
+        let db = TallyDb::open_cached(
+            &settings.tally_dir.join(TALLY_DB_FILE),
+            settings.tally_db_slots,
+        )
+        .map_err(|e| {
+            syslog_error!("PAM_SYSTEM_ERR: Error opening tally database: {}", e);
+            PamResultCode::PAM_SYSTEM_ERR
+        })?;
+
+        let slot = match settings.get_action()? {
+            Actions::AUTHFAIL => Some(db.find_or_insert(user.uid()).map_err(|e| {
+                metrics::count(Counter::WriteErrors);
+                syslog_error!("PAM_SYSTEM_ERR: Error writing tally database: {}", e);
+                PamResultCode::PAM_SYSTEM_ERR
+            })?),
+            _ => db.find(user.uid()),
+        };
+
+        if let Some(slot) = slot {
+            Self::update_tally_slot(&mut tally, slot, user, settings)?;
+        }
+
+        Ok(tally)
+    }
+
+    /// Loads and updates the tally through the shared memory tally cache.
+    ///
+    /// Cached tallies are updated in shared memory and written through to the tally file. On a
+    /// cache miss the slot is seeded from the tally file first. Users without a tally file are
+    /// only cached from their first failure on. If the cache cannot be opened or is full, the
+    /// tally file is used directly.
+    ///
+    /// # Arguments
+    /// - `settings`: A reference to the `HookSettings` of the call.
+    ///
+    /// # Returns
+    /// A `Result` containing either the `Tally` struct or a `PAM_SYSTEM_ERR`.
+    #[cfg(feature = "mmap")]
+    fn new_from_tally_cache(settings: &HookSettings) -> Result<Self, PamResultCode> {
+        let user = &settings.user;
+        let action = settings.get_action()?;
+
+        let cache = match store::cache::open(settings) {
+            Ok(cache) => cache,
+            Err(e) => {
+                syslog_error!("PAM_SYSTEM_ERR: Error opening tally cache: {}", e);
+                return Self::new_from_file_backend(settings);
+            }
+        };
+
+        let tally_file = settings.tally_dir.join(user.name());
+        let slot = match cache.find(user.uid()) {
+            Some(slot) if slot.is_seeded() => slot,
+            _ if action != Actions::AUTHFAIL && !tally_file.exists() => {
+                return Self::new_from_file_backend(settings);
+            }
+            // A full cache only means the tally file keeps being used for this user
+            _ => match cache.find_or_insert(user.uid()) {
+                Ok(slot) => {
+                    store::cache::seed(slot, &tally_file).map_err(|e| {
+                        syslog_error!("PAM_SYSTEM_ERR: Error seeding tally cache: {}", e);
+                        PamResultCode::PAM_SYSTEM_ERR
+                    })?;
+                    slot
+                }
+                Err(_) => return Self::new_from_file_backend(settings),
+            },
+        };
+
+        let mut tally = Tally::default();
+        if Self::update_tally_slot(&mut tally, slot, user, settings)? {
+            slot.mark_dirty();
+            // A failed write leaves the slot dirty for the next update or `authramp compact`
+            if let Err(e) = store::cache::persist_slot(&cache, user.uid(), user.name(), settings) {
+                metrics::count(Counter::WriteErrors);
+                syslog_error!("PAM_SYSTEM_ERR: Error writing back tally cache: {}", e);
+            }
+        }
+        Ok(tally)
+    }
+
+    /// Updates the tally in a slot of a mapped tally table based on the action.
+    ///
+    /// # Arguments
+    /// - `tally`: A mutable reference to the `Tally` struct.
+    /// - `slot`: The slot of the user.
+    /// - `user`: The user of the tally.
+    /// - `settings`: A reference to the `Settings` struct.
+    ///
+    /// # Returns
+    /// A `Result` indicating whether the slot was changed.
+    #[cfg(feature = "mmap")]
+    fn update_tally_slot(
+        tally: &mut Tally,
+        slot: &Slot,
+        user: &User,
+        settings: &Settings,
+    ) -> Result<bool, PamResultCode> {
+        match settings.get_action()? {
+            Actions::PREAUTH => {
+                slot.load(tally);
+                tally.expire(settings);
+                Ok(false)
+            }
+            Actions::AUTHSUCC => {
+                slot.load(tally);
+                tally.expire(settings);
+                if tally.is_clear() {
+                    return Ok(false);
+                }
+                slot.reset();
+                Self::log_cleared(tally.failures_count, user);
+                tally.failures_count = 0;
+                tally.unlock_instant = None;
+                Ok(true)
+            }
+            Actions::AUTHFAIL => {
+                // An expired tally starts counting again
+                slot.load(tally);
+                if tally.is_expired(settings, Utc::now()) {
+                    slot.reset();
+                }
+                tally.failures_count = slot.add_failure();
+                tally.failure_instant = Utc::now();
+                tally.set_unlock_instant(settings);
+                slot.store_instants(tally);
+                Self::log_locked(tally, user, settings);
+                Ok(true)
+            }
+        }
+    }
+
+    /// Logs and counts the reset of a tally that had failures.
+    fn log_cleared(failures_count: i32, user: &User) {
+        if failures_count > 0 {
+            metrics::count(Counter::Resets);
+            syslog_info!(
+                "PAM_SUCCESS: Clear tally ({} failures) for the {:?} account. Account is unlocked.",
+                failures_count,
+                user.name()
+            );
+        }
+    }
+
+    /// Logs a failure that locks the account.
+    fn log_locked(tally: &Tally, user: &User, settings: &Settings) {
+        if tally.failures_count > settings.free_tries {
+            if let Some(unlock_instant) = tally.unlock_instant {
+                utils::syslog::log_collapsed(settings, user, LogEvent::Lockout, || {
+                    syslog_info!(
+                        "PAM_AUTH_ERR: Added tally ({} failures) for the {:?} account. Account is locked until {}.",
+                        tally.failures_count,
+                        user.name(),
+                        unlock_instant
+                    )
+                });
+            }
+        }
+    }
+
     /// Loads tally information from an existing file.
     ///
+    /// Tally files in a format other than the configured `tally_format` are migrated.
+    ///
     /// # Arguments
-    /// - `tally_file`: A reference to the tally file `Path`.
     /// - `tally`: A mutable reference to the `Tally` struct.
+    /// - `file`: The opened and locked tally file.
+    /// - `tally_file`: A reference to the tally file `Path`.
     /// - `settings`: A reference to the `Settings` struct.
     ///
     /// # Returns
@@ -128,172 +544,424 @@ impl Tally {
     fn load_tally_from_file(
         tally: &mut Tally,
         user: &User,
+        file: &File,
         tally_file: &Path,
         settings: &Settings,
     ) -> Result<(), PamResultCode> {
-        toml::from_str::<toml::Value>(&std::fs::read_to_string(tally_file).map_err(|e| {
+        let format = Self::read_tally_file(tally, file)?;
+        tally.expire(settings);
+
+        Self::update_tally_from_section(tally, user, tally_file, settings)?;
+
+        // PREAUTH does not write the tally, migrate it here
+        if format != settings.tally_format.written() && settings.get_action()? == Actions::PREAUTH {
+            Self::write_tally_file(tally, tally_file, settings).map_err(|e| {
+                syslog_error!("PAM_SYSTEM_ERR: Error migrating tally file: {}", e);
+                PamResultCode::PAM_SYSTEM_ERR
+            })?;
+        }
+
+        Ok(())
+    }
+
+    /// Reads the tally file in either the binary or the TOML format.
+    ///
+    /// A binary record is read with a single positioned read into a stack buffer. Anything that
+    /// does not start with the binary record magic is parsed as a TOML tally file.
+    ///
+    /// # Arguments
+    /// - `tally`: A mutable reference to the `Tally` struct.
+    /// - `file`: The opened and locked tally file.
+    ///
+    /// # Returns
+    /// A `Result` containing the detected `TallyFormat` or a `PAM_SYSTEM_ERR` in case of errors.
+    fn read_tally_file(tally: &mut Tally, mut file: &File) -> Result<TallyFormat, PamResultCode> {
+        #[cfg(feature = "binary")]
+        {
+            let mut buf = [0u8; binary::RECORD_SIZE];
+            if file.read_exact_at(&mut buf, 0).is_ok() && binary::has_magic(&buf) {
+                binary::decode(&buf, tally).map_err(|e| {
+                    metrics::count(Counter::ParseErrors);
+                    syslog_error!("PAM_SYSTEM_ERR: Error parsing tally file: {}", e);
+                    PamResultCode::PAM_SYSTEM_ERR
+                })?;
+                return Ok(TallyFormat::Binary);
+            }
+        }
+
+        let mut content = String::new();
+        file.read_to_string(&mut content).map_err(|e| {
             syslog_error!("PAM_SYSTEM_ERR: Error reading tally file: {}", e);
             PamResultCode::PAM_SYSTEM_ERR
-        })?)
-        .map_err(|e| {
-            syslog_error!("PAM_SYSTEM_ERR: Error parsing tally file: {}", e);
-            PamResultCode::PAM_SYSTEM_ERR
-        })
-        .and_then(|value| {
-            // Extract values from the "Fails" table
-            if let Some(fails_table) = value.get("Fails").and_then(|v| v.as_table()) {
-                tally.failures_count = fails_table
-                    .get("count")
-                    .and_then(|count| count.as_integer())
-                    .map(|count| count as i32)
-                    .unwrap_or_default();
-
-                tally.failure_instant = fails_table
-                    .get("instant")
-                    .and_then(|instant| instant.as_str())
-                    .and_then(|instant| instant.parse().ok())
-                    .unwrap_or_default();
-
-                tally.unlock_instant = fails_table
-                    .get("unlock_instant")
-                    .and_then(|unlock_instant| unlock_instant.as_str())
-                    .and_then(|unlock_instant| unlock_instant.parse().ok());
-            } else {
-                // If the "Fails" table doesn't exist, return an error
-                syslog_error!(
-                    "PAM_SYSTEM_ERR: Error reading tally file: [Fails] table does not exist"
+        })?;
+
+        toml::from_str::<toml::Value>(&content)
+            .map_err(|e| {
+                metrics::count(Counter::ParseErrors);
+                syslog_error!("PAM_SYSTEM_ERR: Error parsing tally file: {}", e);
+                PamResultCode::PAM_SYSTEM_ERR
+            })
+            .and_then(|value| {
+                // Extract values from the "Fails" table
+                if let Some(fails_table) = value.get("Fails").and_then(|v| v.as_table()) {
+                    tally.failures_count = fails_table
+                        .get("count")
+                        .and_then(|count| count.as_integer())
+                        .map(|count| count as i32)
+                        .unwrap_or_default();
+
+                    tally.failure_instant = fails_table
+                        .get("instant")
+                        .and_then(|instant| instant.as_str())
+                        .and_then(|instant| instant.parse().ok())
+                        .unwrap_or_default();
+
+                    tally.unlock_instant = fails_table
+                        .get("unlock_instant")
+                        .and_then(|unlock_instant| unlock_instant.as_str())
+                        .and_then(|unlock_instant| unlock_instant.parse().ok());
+
+                    Ok(TallyFormat::Toml)
+                } else {
+                    // If the "Fails" table doesn't exist, return an error
+                    metrics::count(Counter::ParseErrors);
+                    syslog_error!(
+                        "PAM_SYSTEM_ERR: Error reading tally file: [Fails] table does not exist"
+                    );
+                    Err(PamResultCode::PAM_SYSTEM_ERR)
+                }
+            })
+    }
+
+    /// Writes the tally to the tally file in the configured `tally_format`.
+    /// The tally file is replaced atomically. The caller holds the exclusive lock of the tally
+    /// file, see `store::file::open_locked`.
+    ///
+    /// # Arguments
+    /// - `tally`: A reference to the `Tally` struct.
+    /// - `tally_file`: A reference to the tally file `Path`.
+    /// - `settings`: A reference to the `Settings` struct.
+    ///
+    /// # Returns
+    /// The result of the underlying write.
+    pub fn write_tally_file(
+        tally: &Tally,
+        tally_file: &Path,
+        settings: &Settings,
+    ) -> io::Result<()> {
+        // A tally with failures is added to the tally filter before it is written, also by
+        // services that do not use the filter. A filter that misses the tally is removed after
+        // the write until the compaction creates it again, a filter error never stops the tally
+        // from being counted.
+        let mut remove_filter = false;
+        let _mark = match tally_file.file_name() {
+            Some(name) if !tally.is_clear() => match store::filter::mark(settings, name) {
+                Ok(mark) => Some(mark),
+                Err(e) => {
+                    syslog_error!("PAM_SYSTEM_ERR: Error marking tally filter: {}", e);
+                    remove_filter = true;
+                    None
+                }
+            },
+            _ => None,
+        };
+
+        let result = match settings.tally_format.written() {
+            #[cfg(feature = "binary")]
+            TallyFormat::Binary => store::file::replace_durable(
+                tally_file,
+                &binary::encode(tally),
+                settings.durability,
+                std::time::Duration::from_millis(settings.group_commit_ms),
+            ),
+            _ => {
+                let mut toml_str = format!(
+                    "[Fails]\ncount = {}\ninstant = \"{}\"",
+                    tally.failures_count, tally.failure_instant
                 );
-                return Err(PamResultCode::PAM_SYSTEM_ERR);
+                if let Some(unlock_instant) = tally.unlock_instant {
+                    toml_str.push_str(&format!("\nunlock_instant = \"{}\"", unlock_instant));
+                }
+                store::file::replace_durable(
+                    tally_file,
+                    toml_str.as_bytes(),
+                    settings.durability,
+                    std::time::Duration::from_millis(settings.group_commit_ms),
+                )
             }
+        };
+        if result.is_err() {
+            metrics::count(Counter::WriteErrors);
+        } else if remove_filter {
+            if let Err(e) = store::filter::remove_filter(&settings.tally_dir) {
+                syslog_error!("PAM_SYSTEM_ERR: Error removing tally filter: {}", e);
+            }
+        }
+        result
+    }
 
-            Self::update_tally_from_section(tally, user, tally_file, settings)
-        })
+    /// Writes the tally to the tally file under an exclusive lock.
+    ///
+    /// # Arguments
+    /// - `tally`: A reference to the `Tally` struct.
+    /// - `tally_file`: A reference to the tally file `Path`.
+    /// - `settings`: A reference to the `Settings` struct.
+    ///
+    /// # Returns
+    /// The result of the locked write.
+    pub fn save_tally_file(
+        tally: &Tally,
+        tally_file: &Path,
+        settings: &Settings,
+    ) -> io::Result<()> {
+        // The lock is held until the file is closed at the end of this function
+        let _file = store::file::open_locked(tally_file, true)?;
+        Self::write_tally_file(tally, tally_file, settings)
     }
 
-    /// Updates tally information based on a section from the tally file.
+    /// Resets the tally file of a user, if it has failures.
     ///
-    /// AUTHSUCC deteltes the tally
-    /// AUTHERR increases the tally
-    /// PREAUTH is ignored;
+    /// The reset is written under the exclusive lock of the tally file, so it is ordered with
+    /// concurrent updates of the PAM module and never undone by one of them. With `tally_cache`
+    /// enabled, the cached tally is reset after the tally file under the same lock. A user
+    /// without a tally file is left alone.
     ///
     /// # Arguments
-    /// - `fails_section`: A reference to the "Fails" section of the INI file.
-    /// - `tally`: A mutable reference to the `Tally` struct.
+    /// - `tally_file`: A reference to the tally file `Path`.
     /// - `settings`: A reference to the `Settings` struct.
+    /// - `user`: The user of the tally file if it is known already, saves the user lookup of a
+    ///   cached tally.
     ///
     /// # Returns
-    /// A `Result` indicating success or a `PAM_SYSTEM_ERR` in case of errors.
-    fn update_tally_from_section(
-        tally: &mut Tally,
-        user: &User,
+    /// The failures count before the reset, `None` if there was nothing to reset, or the error
+    /// that occurred while reading or writing the tally file.
+    #[cfg_attr(not(feature = "mmap"), allow(unused_variables))]
+    pub fn reset_tally_file(
         tally_file: &Path,
         settings: &Settings,
-    ) -> Result<(), PamResultCode> {
-        // Handle specific actions based on settings.action
-        match settings.get_action()? {
-            Actions::PREAUTH => Ok(()),
-            Actions::AUTHSUCC => {
-                // total failures for logging
-                let total_failures = tally.failures_count;
-    
-                // If action is AUTHFAIL, update count
+        user: Option<&User>,
+    ) -> io::Result<Option<i32>> {
+        let invalid = |_| io::Error::new(io::ErrorKind::InvalidData, "invalid tally file");
+
+        // Clear tallies need no lock, tally files are replaced atomically. A cached tally may
+        // hold failures whose write back failed.
+        let is_cached = cfg!(feature = "mmap") && settings.tally_cache;
+        match Self::load_tally_file(tally_file).map_err(invalid)? {
+            Some(tally) if !tally.is_clear() => {}
+            Some(_) if is_cached => {}
+            _ => return Ok(None),
+        }
+
+        // The lock is held until the file is closed at the end of this function
+        let file = store::file::open_locked(tally_file, true)?;
+        let mut previous_failures_count = None;
+        if file.metadata()?.len() > 0 {
+            let mut tally = Tally::default();
+            Self::read_tally_file(&mut tally, &file).map_err(invalid)?;
+            if !tally.is_clear() {
+                previous_failures_count = Some(tally.failures_count);
                 tally.failures_count = 0;
-    
-                // Reset unlock_instant to None on AUTHSUCC
                 tally.unlock_instant = None;
-    
-                // Write the updated values back to the file
-                let toml_str = format!(
-                    "[Fails]\ncount = {}",
-                    tally.failures_count
-                );
-                std::fs::write(tally_file, toml_str).map_err(|e| {
-                    syslog_error!("PAM_SYSTEM_ERR: Error resetting tally: {}", e);
-                    PamResultCode::PAM_SYSTEM_ERR
-                })?;
-    
-                // log account unlock
-                if total_failures > 0 {
-                    syslog_info!(
-                        "PAM_SUCCESS: Clear tally ({} failures) for the {:?} account. Account is unlocked.",
-                        total_failures,
-                        user.name()
-                    );
-                }
-                Ok(())
+                Self::write_tally_file(&tally, tally_file, settings)?;
+            }
+        }
+
+        // A concurrent cache miss seeds the slot from the reset tally file, and a pending write
+        // back writes the reset slot
+        #[cfg(feature = "mmap")]
+        if is_cached {
+            let cached = store::cache::reset_slot(tally_file, settings, user)?;
+            previous_failures_count = previous_failures_count.max(cached);
+        }
+        Ok(previous_failures_count)
+    }
+
+    /// Loads a tally file without updating it.
+    ///
+    /// Tally files are replaced atomically, so no lock is needed to read a consistent tally.
+    ///
+    /// # Arguments
+    /// - `tally_file`: A reference to the tally file `Path`.
+    ///
+    /// # Returns
+    /// A `Result` containing the `Tally`, `None` if there is no tally file or a `PAM_SYSTEM_ERR`
+    /// in case of errors.
+    pub fn load_tally_file(tally_file: &Path) -> Result<Option<Self>, PamResultCode> {
+        let file = match File::open(tally_file) {
+            Ok(file) => file,
+            Err(e) if e.kind() == io::ErrorKind::NotFound => return Ok(None),
+            Err(e) => {
+                syslog_error!("PAM_SYSTEM_ERR: Error opening tally file: {}", e);
+                return Err(PamResultCode::PAM_SYSTEM_ERR);
+            }
+        };
+
+        // An empty tally file was created but never written
+        if file.metadata().map(|m| m.len() == 0).unwrap_or(true) {
+            return Ok(None);
+        }
+
+        let mut tally = Tally {
+            tally_file: Some(tally_file.to_path_buf()),
+            ..Default::default()
+        };
+        Self::read_tally_file(&mut tally, &file)?;
+        Ok(Some(tally))
+    }
+
+    /// Returns true if the tally has no failures and no unlock instant.
+    pub fn is_clear(&self) -> bool {
+        self.failures_count == 0 && self.unlock_instant.is_none()
+    }
+
+    /// Returns true if the tally is older than `tally_ttl` and no longer locked.
+    ///
+    /// # Arguments
+    /// - `settings`: A reference to the `Settings` struct.
+    /// - `now`: The current instant.
+    pub fn is_expired(&self, settings: &Settings, now: DateTime<Utc>) -> bool {
+        settings.tally_ttl > 0
+            && self.unlock_instant.map_or(true, |unlock| unlock <= now)
+            && u64::try_from((now - self.failure_instant).num_seconds())
+                .map_or(false, |age| age >= settings.tally_ttl)
+    }
+
+    /// Clears the tally if it is expired, so expired tallies are treated like absent ones.
+    /// The tally file is left for the compaction to remove.
+    ///
+    /// # Arguments
+    /// - `settings`: A reference to the `Settings` struct.
+    pub fn expire(&mut self, settings: &Settings) {
+        self.expire_at(settings, Utc::now());
+    }
+
+    /// Clears the tally if it is expired at the instant `now`, see `expire`.
+    ///
+    /// # Arguments
+    /// - `settings`: A reference to the `Settings` struct.
+    /// - `now`: The current instant.
+    pub fn expire_at(&mut self, settings: &Settings, now: DateTime<Utc>) {
+        if self.is_expired(settings, now) {
+            self.failures_count = 0;
+            self.unlock_instant = None;
+        }
+    }
+
+    /// Applies an authentication action to the tally in memory.
+    ///
+    /// AUTHSUCC resets the tally
+    /// AUTHFAIL increases the tally and sets the unlock instant
+    /// PREAUTH is ignored
+    ///
+    /// # Arguments
+    /// - `action`: The authentication action.
+    /// - `settings`: A reference to the `Settings` struct.
+    ///
+    /// # Returns
+    /// Whether the tally changed and has to be written back. Resetting a clear tally is not a
+    /// change.
+    pub fn apply_action(&mut self, action: Actions, settings: &Settings) -> bool {
+        self.apply_action_at(action, settings, Utc::now())
+    }
+
+    /// Applies an authentication action to the tally in memory at the instant `now`, see
+    /// `apply_action`. Used to replay authentication events with their recorded instants.
+    ///
+    /// # Arguments
+    /// - `action`: The authentication action.
+    /// - `settings`: A reference to the `Settings` struct.
+    /// - `now`: The instant of the action.
+    ///
+    /// # Returns
+    /// Whether the tally changed.
+    pub fn apply_action_at(
+        &mut self,
+        action: Actions,
+        settings: &Settings,
+        now: DateTime<Utc>,
+    ) -> bool {
+        match action {
+            Actions::PREAUTH => false,
+            Actions::AUTHSUCC => {
+                let changed = !self.is_clear();
+                self.failures_count = 0;
+                self.unlock_instant = None;
+                changed
             }
             Actions::AUTHFAIL => {
-                // If action is AUTHFAIL, update count and instant
-                tally.failures_count += 1;
-                tally.failure_instant = Utc::now();
-    
-                let mut delay = tally.get_delay(settings);
-    
-                // Cap unlock_instant at 24 hours from now
-                if delay > Duration::hours(24) {
-                    delay = Duration::hours(24);
-                }
-    
-                tally.unlock_instant = Some(tally.failure_instant + delay);
-    
-                // Write the updated values back to the file
-                let toml_str = format!(
-                    "[Fails]\ncount = {}\ninstant = \"{}\"\nunlock_instant = \"{}\"",
-                    tally.failures_count,
-                    tally.failure_instant,
-                    tally.unlock_instant.unwrap()
-                );
-                std::fs::write(tally_file, toml_str).map_err(|e| {
-                    syslog_error!("PAM_SYSTEM_ERR: Error writing tally file: {}", e);
-                    PamResultCode::PAM_SYSTEM_ERR
-                })?;
-    
-                if tally.failures_count > settings.free_tries {
-                    // log account unlock
-                    syslog_info!(
-                        "PAM_AUTH_ERR: Added tally ({} failures) for the {:?} account. Account is locked until {}.",
-                        tally.failures_count,
-                        user.name(),
-                        tally.unlock_instant.unwrap()
-                    );
-                }
-                Ok(())
+                self.failures_count += 1;
+                self.failure_instant = now;
+                self.set_unlock_instant(settings);
+                true
             }
         }
-    }    
+    }
 
-    /// Creates a new tally file with default values.
+    /// Updates tally information based on a section from the tally file.
+    ///
+    /// The action is applied with `apply_action` and the tally file is only written back if the
+    /// tally changed.
     ///
     /// # Arguments
-    /// - `tally_file`: A reference to the tally file `Path`.
     /// - `tally`: A mutable reference to the `Tally` struct.
+    /// - `user`: The user of the tally.
+    /// - `tally_file`: A reference to the tally file `Path`.
     /// - `settings`: A reference to the `Settings` struct.
     ///
     /// # Returns
     /// A `Result` indicating success or a `PAM_SYSTEM_ERR` in case of errors.
-    fn create_tally_file(
+    fn update_tally_from_section(
         tally: &mut Tally,
+        user: &User,
         tally_file: &Path,
-        _settings: &Settings,
+        settings: &Settings,
     ) -> Result<(), PamResultCode> {
-        fs::create_dir_all(tally_file.parent().unwrap()).map_err(|e| {
-            syslog_error!("PAM_SYSTEM_ERR: Error creating tally file: {}", e);
-            PamResultCode::PAM_SYSTEM_ERR
-        })?;
-    
-        let toml_str = format!(
-            "[Fails]\ncount = {}\ninstant = \"{}\"",
-            tally.failures_count, tally.failure_instant
-        );
-    
-        // Write the TOML string to disk
-        std::fs::write(tally_file, toml_str).map_err(|e| {
-            syslog_error!("PAM_SYSTEM_ERR: Error writing tally file: {}", e);
-            PamResultCode::PAM_SYSTEM_ERR
-        })?;
-    
+        let action = settings.get_action()?;
+        let previous_failures_count = tally.failures_count;
+
+        if !tally.apply_action(action, settings) {
+            return Ok(());
+        }
+
+        // Write the updated values back to the file
+        if action == Actions::AUTHSUCC {
+            // log account unlock
+            Self::log_cleared(previous_failures_count, user);
+
+            Self::write_tally_file(tally, tally_file, settings).map_err(|e| {
+                syslog_error!("PAM_SYSTEM_ERR: Error resetting tally: {}", e);
+                PamResultCode::PAM_SYSTEM_ERR
+            })?;
+        } else {
+            Self::write_tally_file(tally, tally_file, settings).map_err(|e| {
+                syslog_error!("PAM_SYSTEM_ERR: Error writing tally file: {}", e);
+                PamResultCode::PAM_SYSTEM_ERR
+            })?;
+
+            Self::log_locked(tally, user, settings);
+        }
         Ok(())
-    }    
+    }
+}
+
+impl TallyStore for FileStore {
+    fn open(settings: &HookSettings) -> Result<Tally, PamResultCode> {
+        Tally::new_from_tally_files(settings)
+    }
+}
+
+#[cfg(feature = "mmap")]
+impl TallyStore for MmapStore {
+    fn open(settings: &HookSettings) -> Result<Tally, PamResultCode> {
+        Tally::new_from_tally_db(settings)
+    }
+}
+
+#[cfg(feature = "daemon")]
+impl TallyStore for DaemonStore {
+    fn open(settings: &HookSettings) -> Result<Tally, PamResultCode> {
+        Tally::new_from_daemon(settings)
+    }
 }
 
 // Unit Tests
@@ -301,9 +969,29 @@ impl Tally {
 mod tests {
     use super::*;
     use std::fs;
+    use std::sync::Arc;
     use tempdir::TempDir;
     use users::User;
 
+    /// Returns the settings of a hook call of `user`.
+    fn hook_settings(settings: Settings, user: User) -> HookSettings {
+        HookSettings::new(Arc::new(settings), user, "test")
+    }
+
+    /// Returns the settings of a hook call of the same user with other settings.
+    fn with_settings(call: &HookSettings, settings: Settings) -> HookSettings {
+        hook_settings(settings, call.user.clone())
+    }
+
+    /// Returns the settings of a hook call of the same user with another action.
+    fn with_action(call: &HookSettings, action: Actions) -> HookSettings {
+        let settings = Settings {
+            action: Some(action),
+            ..Settings::clone(call)
+        };
+        with_settings(call, settings)
+    }
+
     #[test]
     fn test_open_existing_tally_file() {
         // Create a temporary directory
@@ -321,11 +1009,11 @@ mod tests {
 
         // Create settings and call new_from_tally_file
         let settings = Settings {
-            user: Some(User::new(9999, "test_user_a", 9999)),
             tally_dir: temp_dir.path().to_path_buf(),
             action: Some(Actions::PREAUTH),
             ..Default::default()
         };
+        let settings = hook_settings(settings, User::new(9999, "test_user_a", 9999));
 
         // Test: Open existing tally file
         let result = Tally::new_from_tally_file(&settings);
@@ -352,10 +1040,10 @@ mod tests {
 
         // Create settings and call open
         let settings = Settings {
-            user: Some(User::new(9999, "test_user_b", 9999)),
             tally_dir: temp_dir.path().to_path_buf(),
             ..Default::default()
         };
+        let settings = hook_settings(settings, User::new(9999, "test_user_b", 9999));
 
         // Test: Open nonexistent tally file
         let result = Tally::new_from_tally_file(&settings);
@@ -366,12 +1054,68 @@ mod tests {
         assert_eq!(tally.failures_count, 0);
         assert!(tally.unlock_instant.is_none());
 
-        // Check if the TOML file has been created with default values
-        let toml_content = fs::read_to_string(tally_file_path).unwrap();
-        println!("{}", &toml_content);
-        assert!(toml_content.contains("[Fails]"));
-        assert!(toml_content.contains("count = 0"));
-        assert!(!toml_content.contains("unlock_instant = "));
+        // Check that no tally file has been created for a user without failures
+        assert!(!tally_file_path.exists());
+
+        // The same holds without the tally filter
+        let other = Settings {
+            tally_filter: false,
+            ..Settings::clone(&settings)
+        };
+        let settings = with_settings(&settings, other);
+        let tally = Tally::new_from_tally_file(&settings).unwrap();
+        assert_eq!(tally.failures_count, 0);
+        assert!(!tally_file_path.exists());
+    }
+
+    #[test]
+    fn test_tally_filter_skips_users_without_failures() {
+        let temp_dir = TempDir::new("test_tally_filter_skips_users").unwrap();
+        let settings = Settings {
+            tally_dir: temp_dir.path().to_path_buf(),
+            action: Some(Actions::AUTHFAIL),
+            free_tries: 6,
+            ..Default::default()
+        };
+        let settings = hook_settings(settings, User::new(9999, "test_user", 9999));
+
+        // The compaction creates the filter, the first failure adds the user to it
+        let filter = TallyFilter::create(&settings).unwrap();
+        filter.rebuild(&settings).unwrap();
+        assert!(!filter.contains(std::ffi::OsStr::new("test_user")));
+        let tally = Tally::new_from_tally_file(&settings).unwrap();
+        assert_eq!(tally.failures_count, 1);
+        assert!(filter.contains(std::ffi::OsStr::new("test_user")));
+
+        // A tally written around the filter is hidden from PREAUTH until the filter is rebuilt
+        let mut settings = with_action(&settings, Actions::PREAUTH);
+        settings.user = User::new(9998, "hidden_user", 9998);
+        fs::write(
+            temp_dir.path().join("hidden_user"),
+            format!("[Fails]\ncount = 3\ninstant = \"{}\"", Utc::now()),
+        )
+        .unwrap();
+        assert_eq!(Tally::new_from_tally_file(&settings).unwrap().failures_count, 0);
+
+        filter.rebuild(&settings).unwrap();
+        assert_eq!(Tally::new_from_tally_file(&settings).unwrap().failures_count, 3);
+    }
+
+    #[test]
+    fn test_tally_filter_error_does_not_block_failures() {
+        let temp_dir = TempDir::new("test_tally_filter_error").unwrap();
+        // A filter that cannot be opened or removed
+        fs::create_dir(temp_dir.path().join(store::filter::TALLY_FILTER_FILE)).unwrap();
+        let settings = Settings {
+            tally_dir: temp_dir.path().to_path_buf(),
+            action: Some(Actions::AUTHFAIL),
+            free_tries: 6,
+            ..Default::default()
+        };
+        let settings = hook_settings(settings, User::new(9999, "test_user", 9999));
+
+        assert_eq!(Tally::new_from_tally_file(&settings).unwrap().failures_count, 1);
+        assert_eq!(Tally::new_from_tally_file(&settings).unwrap().failures_count, 2);
     }
 
     #[test]
@@ -391,15 +1135,15 @@ mod tests {
 
         // Create settings and call new_from_tally_file with AUTHFAIL action
         let settings = Settings {
-            user: Some(User::new(9999, "test_user_c", 9999)),
             tally_dir: temp_dir.path().to_path_buf(),
             action: Some(Actions::AUTHFAIL),
             free_tries: 6,
-            ramp_multiplier: 50,
+            ramp_multiplier: 50.0,
             base_delay_seconds: 30,
-            pam_hook: String::from("test"),
             even_deny_root: false,
+            ..Default::default()
         };
+        let settings = hook_settings(settings, User::new(9999, "test_user_c", 9999));
 
         let tally = Tally::new_from_tally_file(&settings).unwrap();
 
@@ -432,15 +1176,15 @@ mod tests {
 
         // Create settings and call new_from_tally_file with AUTHSUCC action
         let settings = Settings {
-            user: Some(User::new(9999, "test_user_d", 9999)),
             tally_dir: temp_dir.path().to_path_buf(),
             action: Some(Actions::AUTHSUCC),
             free_tries: 6,
-            ramp_multiplier: 50,
+            ramp_multiplier: 50.0,
             base_delay_seconds: 30,
-            pam_hook: String::from("test"),
-            even_deny_root: false
+            even_deny_root: false,
+            ..Default::default()
         };
+        let settings = hook_settings(settings, User::new(9999, "test_user_d", 9999));
 
         let _tally = Tally::new_from_tally_file(&settings).unwrap();
 
@@ -452,4 +1196,370 @@ mod tests {
         );
         assert!(!toml_content.contains("unlock_instant = "));
     }
+
+    #[test]
+    fn test_auth_succ_on_clear_tally_does_not_write() {
+        use std::os::unix::fs::MetadataExt;
+
+        let temp_dir = TempDir::new("test_auth_succ_on_clear_tally").unwrap();
+        let tally_file_path = temp_dir.path().join("test_user_l");
+        fs::write(
+            &tally_file_path,
+            "[Fails]\ncount = 0\ninstant = \"2023-01-01T00:00:00Z\"",
+        )
+        .unwrap();
+        let ino = fs::metadata(&tally_file_path).unwrap().ino();
+
+        let settings = Settings {
+            tally_dir: temp_dir.path().to_path_buf(),
+            action: Some(Actions::AUTHSUCC),
+            ..Default::default()
+        };
+        let settings = hook_settings(settings, User::new(9999, "test_user_l", 9999));
+
+        let tally = Tally::new_from_tally_file(&settings).unwrap();
+        assert_eq!(tally.failures_count, 0);
+
+        // The tally file was not replaced
+        assert_eq!(fs::metadata(&tally_file_path).unwrap().ino(), ino);
+
+        // A tally with failures is still reset
+        let fail_settings = with_action(&settings, Actions::AUTHFAIL);
+        Tally::new_from_tally_file(&fail_settings).unwrap();
+        Tally::new_from_tally_file(&settings).unwrap();
+        let tally = Tally::load_tally_file(&tally_file_path).unwrap().unwrap();
+        assert!(tally.is_clear());
+    }
+
+    #[test]
+    fn test_reset_tally_file_clears_failures() {
+        let temp_dir = TempDir::new("test_reset_tally_file").unwrap();
+        let tally_file_path = temp_dir.path().join("test_user_k");
+        let settings = Settings {
+            tally_dir: temp_dir.path().to_path_buf(),
+            ..Default::default()
+        };
+
+        // Nothing to reset without a tally file
+        assert_eq!(
+            Tally::reset_tally_file(&tally_file_path, &settings, None).unwrap(),
+            None
+        );
+        assert!(!tally_file_path.exists());
+
+        fs::write(
+            &tally_file_path,
+            "[Fails]\ncount = 9\ninstant = \"2023-01-01T00:00:00Z\"\nunlock_instant = \"2099-01-01T00:00:00Z\"",
+        )
+        .unwrap();
+        assert_eq!(
+            Tally::reset_tally_file(&tally_file_path, &settings, None).unwrap(),
+            Some(9)
+        );
+
+        let tally = Tally::load_tally_file(&tally_file_path).unwrap().unwrap();
+        assert!(tally.is_clear());
+        assert_eq!(
+            Tally::reset_tally_file(&tally_file_path, &settings, None).unwrap(),
+            None
+        );
+    }
+
+    #[test]
+    fn test_expired_tally_is_treated_as_absent() {
+        let temp_dir = TempDir::new("test_expired_tally_is_treated_as_absent").unwrap();
+        let tally_file_path = temp_dir.path().join("test_user_n");
+        fs::write(
+            &tally_file_path,
+            "[Fails]\ncount = 8\ninstant = \"2023-01-01T00:00:00Z\"\nunlock_instant = \"2023-01-02T00:00:00Z\"",
+        )
+        .unwrap();
+
+        let settings = Settings {
+            tally_dir: temp_dir.path().to_path_buf(),
+            action: Some(Actions::PREAUTH),
+            tally_ttl: 86400,
+            ..Default::default()
+        };
+        let settings = hook_settings(settings, User::new(9999, "test_user_n", 9999));
+
+        let tally = Tally::new_from_tally_file(&settings).unwrap();
+        assert!(tally.is_clear());
+
+        // Without a ttl the old tally still counts
+        let other = Settings {
+            tally_ttl: 0,
+            ..Settings::clone(&settings)
+        };
+        let tally = Tally::new_from_tally_file(&with_settings(&settings, other)).unwrap();
+        assert_eq!(tally.failures_count, 8);
+
+        let tally = Tally::new_from_tally_file(&with_action(&settings, Actions::AUTHFAIL)).unwrap();
+        assert_eq!(tally.failures_count, 1);
+        assert!(!tally.is_expired(&settings, Utc::now()));
+    }
+
+    #[test]
+    #[cfg(feature = "binary")]
+    fn test_auth_fail_writes_binary_record() {
+        let temp_dir = TempDir::new("test_auth_fail_writes_binary_record").unwrap();
+        let tally_file_path = temp_dir.path().join("test_user_e");
+
+        let settings = Settings {
+            tally_dir: temp_dir.path().to_path_buf(),
+            action: Some(Actions::AUTHFAIL),
+            tally_format: TallyFormat::Binary,
+            ..Default::default()
+        };
+        let settings = hook_settings(settings, User::new(9999, "test_user_e", 9999));
+
+        // The first failure creates the tally
+        Tally::new_from_tally_file(&settings).unwrap();
+
+        // Expect a binary record on disk
+        let content = fs::read(&tally_file_path).unwrap();
+        assert_eq!(content.len(), binary::RECORD_SIZE);
+        assert!(binary::has_magic(&content));
+
+        // Expect the record to be read back
+        let settings = with_action(&settings, Actions::PREAUTH);
+        let tally = Tally::new_from_tally_file(&settings).unwrap();
+        assert_eq!(tally.failures_count, 1);
+        assert!(tally.unlock_instant.is_some());
+    }
+
+    #[test]
+    #[cfg(feature = "binary")]
+    fn test_preauth_migrates_toml_to_binary() {
+        let temp_dir = TempDir::new("test_preauth_migrates_toml_to_binary").unwrap();
+        let tally_file_path = temp_dir.path().join("test_user_f");
+
+        let toml_str = r#"
+        [Fails]
+        count = 3
+        instant = "2023-01-01T00:00:00Z"
+        unlock_instant = "2023-01-02T00:00:00Z"
+    "#;
+        std::fs::write(&tally_file_path, toml_str).unwrap();
+
+        let settings = Settings {
+            tally_dir: temp_dir.path().to_path_buf(),
+            action: Some(Actions::PREAUTH),
+            tally_format: TallyFormat::Binary,
+            ..Default::default()
+        };
+        let settings = hook_settings(settings, User::new(9999, "test_user_f", 9999));
+
+        let tally = Tally::new_from_tally_file(&settings).unwrap();
+        assert_eq!(tally.failures_count, 3);
+
+        // Expect the TOML file to be replaced by an equivalent binary record
+        let content = fs::read(&tally_file_path).unwrap();
+        assert!(binary::has_magic(&content));
+
+        let migrated = Tally::new_from_tally_file(&settings).unwrap();
+        assert_eq!(migrated, tally);
+    }
+
+    #[test]
+    #[cfg(feature = "daemon")]
+    fn test_daemon_backend_falls_back_to_tally_file() {
+        let temp_dir = TempDir::new("test_daemon_backend_falls_back").unwrap();
+
+        let settings = Settings {
+            tally_dir: temp_dir.path().to_path_buf(),
+            action: Some(Actions::AUTHFAIL),
+            tally_backend: TallyBackend::Daemon,
+            daemon_socket: temp_dir.path().join("authrampd.sock"),
+            ..Default::default()
+        };
+        let settings = hook_settings(settings, User::new(9999, "test_user_k", 9999));
+
+        // No daemon is listening, the tally file is used
+        let tally = Tally::new_from_tally_file(&settings).unwrap();
+        assert_eq!(tally.failures_count, 1);
+
+        let on_disk = Tally::load_tally_file(&temp_dir.path().join("test_user_k"))
+            .unwrap()
+            .unwrap();
+        assert_eq!(on_disk.failures_count, 1);
+    }
+
+    #[test]
+    fn test_rhost_failures_across_users_lock_the_rhost() {
+        let temp_dir = TempDir::new("test_rhost_failures_across_users").unwrap();
+
+        let settings = |name: &str, action: Actions, rhost: &str| {
+            let settings = Settings {
+                tally_dir: temp_dir.path().to_path_buf(),
+                action: Some(action),
+                rhost_tracking: true,
+                rhost_free_tries: 3,
+                ..Default::default()
+            };
+            let mut settings = hook_settings(settings, User::new(9999, name, 9999));
+            settings.rhost = Some(String::from(rhost));
+            settings
+        };
+
+        // One failure for each of many users
+        for i in 0..5 {
+            let name = format!("sprayed_user_{}", i);
+            Tally::new_from_tally_file(&settings(&name, Actions::AUTHFAIL, "203.0.113.9")).unwrap();
+        }
+
+        // A clean user is bounced when coming from the spraying host
+        let tally =
+            Tally::new_from_tally_file(&settings("clean_user", Actions::PREAUTH, "203.0.113.9"))
+                .unwrap();
+        assert!(tally.failures_count > 6);
+        assert!(tally.unlock_instant.unwrap() > Utc::now());
+
+        // But not from another host
+        let tally =
+            Tally::new_from_tally_file(&settings("clean_user", Actions::PREAUTH, "192.0.2.1"))
+                .unwrap();
+        assert_eq!(tally.failures_count, 0);
+    }
+
+    #[test]
+    #[cfg(feature = "mmap")]
+    fn test_mmap_backend_updates_tally_db() {
+        let temp_dir = TempDir::new("test_mmap_backend_updates_tally_db").unwrap();
+
+        let settings = Settings {
+            tally_dir: temp_dir.path().to_path_buf(),
+            action: Some(Actions::PREAUTH),
+            tally_backend: TallyBackend::Mmap,
+            tally_db_slots: 64,
+            ..Default::default()
+        };
+        let settings = hook_settings(settings, User::new(9999, "test_user_g", 9999));
+
+        // Clean user has no tally
+        let tally = Tally::new_from_tally_file(&settings).unwrap();
+        assert_eq!(tally.failures_count, 0);
+
+        // Failures are added in the database
+        let fail_settings = with_action(&settings, Actions::AUTHFAIL);
+        Tally::new_from_tally_file(&fail_settings).unwrap();
+        let tally = Tally::new_from_tally_file(&fail_settings).unwrap();
+        assert_eq!(tally.failures_count, 2);
+        assert!(tally.unlock_instant.is_some());
+
+        // No per-user tally file is created
+        assert!(!temp_dir.path().join("test_user_g").exists());
+        assert!(temp_dir.path().join(TALLY_DB_FILE).exists());
+
+        let tally = Tally::new_from_tally_file(&settings).unwrap();
+        assert_eq!(tally.failures_count, 2);
+
+        // Success clears the tally
+        let succ_settings = with_action(&settings, Actions::AUTHSUCC);
+        Tally::new_from_tally_file(&succ_settings).unwrap();
+        let tally = Tally::new_from_tally_file(&settings).unwrap();
+        assert_eq!(tally.failures_count, 0);
+        assert!(tally.unlock_instant.is_none());
+    }
+
+    #[test]
+    fn test_concurrent_auth_fails_are_not_lost() {
+        let temp_dir = TempDir::new("test_concurrent_auth_fails_are_not_lost").unwrap();
+        let tally_file_path = temp_dir.path().join("test_user_h");
+
+        let settings = Settings {
+            tally_dir: temp_dir.path().to_path_buf(),
+            action: Some(Actions::PREAUTH),
+            ..Default::default()
+        };
+        let settings = hook_settings(settings, User::new(9999, "test_user_h", 9999));
+
+        // Create the tally file
+        Tally::new_from_tally_file(&settings).unwrap();
+
+        let fail_settings = with_action(&settings, Actions::AUTHFAIL);
+
+        let threads = 8;
+        let fails_per_thread = 10;
+
+        std::thread::scope(|scope| {
+            for _ in 0..threads {
+                scope.spawn(|| {
+                    for _ in 0..fails_per_thread {
+                        Tally::new_from_tally_file(&fail_settings).unwrap();
+                    }
+                });
+            }
+        });
+
+        let tally = Tally::new_from_tally_file(&settings).unwrap();
+        assert_eq!(tally.failures_count, threads * fails_per_thread);
+
+        // Expect no temporary files left behind
+        let toml_content = fs::read_to_string(&tally_file_path).unwrap();
+        assert!(toml_content.contains(&format!("count = {}", threads * fails_per_thread)));
+        assert_eq!(fs::read_dir(temp_dir.path()).unwrap().count(), 1);
+    }
+
+    #[test]
+    #[cfg(feature = "mmap")]
+    fn test_tally_cache_writes_through() {
+        let temp_dir = TempDir::new("test_tally_cache_writes_through").unwrap();
+        let tally_file_path = temp_dir.path().join("test_user_i");
+
+        let settings = Settings {
+            tally_dir: temp_dir.path().to_path_buf(),
+            action: Some(Actions::PREAUTH),
+            tally_cache: true,
+            tally_cache_name: format!("/authramp-test-cache-{}", std::process::id()),
+            tally_cache_slots: 64,
+            ..Default::default()
+        };
+        let settings = hook_settings(settings, User::new(9999, "test_user_i", 9999));
+
+        // Cache miss of a user without failures creates no tally file
+        Tally::new_from_tally_file(&settings).unwrap();
+        assert!(!tally_file_path.exists());
+
+        // Failures are counted in the cache
+        let fail_settings = with_action(&settings, Actions::AUTHFAIL);
+        Tally::new_from_tally_file(&fail_settings).unwrap();
+        Tally::new_from_tally_file(&fail_settings).unwrap();
+
+        let tally = Tally::new_from_tally_file(&settings).unwrap();
+        assert_eq!(tally.failures_count, 2);
+
+        // The tally file is written through before the hook returns
+        assert!(fs::read_to_string(&tally_file_path)
+            .unwrap()
+            .contains("count = 2"));
+
+        // A reset clears the tally file and the cached tally
+        assert_eq!(
+            Tally::reset_tally_file(&tally_file_path, &settings, Some(&settings.user)).unwrap(),
+            Some(2)
+        );
+        assert_eq!(Tally::new_from_tally_file(&settings).unwrap().failures_count, 0);
+
+        let c_name = std::ffi::CString::new(store::cache::segment_name(&settings)).unwrap();
+        unsafe { libc::shm_unlink(c_name.as_ptr()) };
+    }
+
+    #[test]
+    #[cfg(not(feature = "mmap"))]
+    fn test_backend_not_compiled_in_uses_tally_files() {
+        let temp_dir = TempDir::new("test_backend_not_compiled_in").unwrap();
+
+        let settings = Settings {
+            tally_dir: temp_dir.path().to_path_buf(),
+            action: Some(Actions::AUTHFAIL),
+            tally_backend: TallyBackend::Mmap,
+            ..Default::default()
+        };
+        let settings = hook_settings(settings, User::new(9999, "test_user_j", 9999));
+
+        Tally::new_from_tally_file(&settings).unwrap();
+        assert!(temp_dir.path().join("test_user_j").exists());
+        assert!(!temp_dir.path().join(store::TALLY_DB_FILE).exists());
+    }
 }
@@ -0,0 +1,471 @@
+//! # Asynchronous Syslog Sink
+//!
+//! The `async_log` module is the logger used with `log_mode = "async"`. It never blocks the
+//! authentication on a backlogged syslog daemon.
+//!
+//! ## Overview
+//!
+//! Every message is formatted into a fixed-size record on the stack, longer messages are
+//! truncated, and pushed into a bounded lock-free ring buffer. The ring is then drained to the
+//! syslog socket with non-blocking sends. When the socket is backlogged, the records stay in the
+//! ring and are sent by the next message. When the ring is full, the message is dropped and
+//! counted. The number of dropped messages is logged as soon as the socket accepts records again.
+//!
+//! The ring and the count only live in the memory of the process, so `finish` makes a last
+//! non-blocking attempt to send the queued records before the PAM transaction ends, and discards
+//! the rest. Every dropped message is also added to the `authramp_log_dropped_total` metric, which
+//! outlives processes that exit before they could log the notice.
+//!
+//! No thread is spawned, the ring is drained by whichever thread logs. Only one thread drains at
+//! a time, the others only push.
+//!
+//! ## License
+//!
+//! pam-authramp
+//! Copyright (C) 2023 github.com/34N0
+//!
+//! This program is free software: you can redistribute it and/or modify
+//! it under the terms of the GNU General Public License as published by
+//! the Free Software Foundation, either version 3 of the License, or
+//! (at your option) any later version.
+//!
+//! This program is distributed in the hope that it will be useful,
+//! but WITHOUT ANY WARRANTY; without even the implied warranty of
+//! MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//! GNU General Public License for more details.
+//!
+//! You should have received a copy of the GNU General Public License
+//! along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+use std::cell::UnsafeCell;
+use std::fmt::{self, Write};
+use std::io;
+use std::os::unix::net::UnixDatagram;
+use std::process;
+use std::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
+
+use chrono::Local;
+use log::{Level, Log, Metadata, Record};
+
+use crate::utils::metrics::{self, Counter};
+
+/// Maximum length of a syslog record, longer messages are truncated.
+pub const RECORD_SIZE: usize = 512;
+
+/// Number of records the ring buffer holds while the syslog socket is backlogged.
+pub const RING_SLOTS: usize = 256;
+
+/// Syslog sockets, in the order they are tried.
+const SYSLOG_SOCKETS: [&str; 3] = ["/dev/log", "/var/run/syslog", "/var/run/log"];
+
+/// Syslog facility LOG_USER.
+const FACILITY_USER: u8 = 1 << 3;
+
+/// A message formatted into a fixed-size buffer.
+struct RecordBuf {
+    data: [u8; RECORD_SIZE],
+    len: usize,
+}
+
+impl RecordBuf {
+    fn new() -> Self {
+        RecordBuf {
+            data: [0; RECORD_SIZE],
+            len: 0,
+        }
+    }
+
+    fn as_bytes(&self) -> &[u8] {
+        &self.data[..self.len]
+    }
+}
+
+impl Write for RecordBuf {
+    /// Appends to the record and silently truncates at `RECORD_SIZE`.
+    fn write_str(&mut self, s: &str) -> fmt::Result {
+        let n = s.len().min(RECORD_SIZE - self.len);
+        self.data[self.len..self.len + n].copy_from_slice(&s.as_bytes()[..n]);
+        self.len += n;
+        Ok(())
+    }
+}
+
+/// A slot of the ring. `seq` tells producers and the consumer whose turn it is.
+struct Slot {
+    seq: AtomicUsize,
+    len: UnsafeCell<usize>,
+    data: UnsafeCell<[u8; RECORD_SIZE]>,
+}
+
+/// Bounded ring buffer of records with lock-free producers and a single consumer at a time.
+struct Ring {
+    slots: Box<[Slot]>,
+    mask: usize,
+    tail: AtomicUsize,
+    head: AtomicUsize,
+    consuming: AtomicBool,
+}
+
+// Slots are only accessed by the thread that claimed them through `seq`.
+unsafe impl Sync for Ring {}
+
+impl Ring {
+    /// Creates a ring with `capacity` slots, rounded up to a power of two.
+    fn new(capacity: usize) -> Self {
+        let capacity = capacity.max(2).next_power_of_two();
+        Ring {
+            slots: (0..capacity)
+                .map(|i| Slot {
+                    seq: AtomicUsize::new(i),
+                    len: UnsafeCell::new(0),
+                    data: UnsafeCell::new([0; RECORD_SIZE]),
+                })
+                .collect(),
+            mask: capacity - 1,
+            tail: AtomicUsize::new(0),
+            head: AtomicUsize::new(0),
+            consuming: AtomicBool::new(false),
+        }
+    }
+
+    /// Appends a record. Returns false if the ring is full.
+    fn push(&self, record: &[u8]) -> bool {
+        let mut pos = self.tail.load(Ordering::Relaxed);
+        loop {
+            let slot = &self.slots[pos & self.mask];
+            let seq = slot.seq.load(Ordering::Acquire);
+            match (seq as isize).wrapping_sub(pos as isize) {
+                0 => match self.tail.compare_exchange_weak(
+                    pos,
+                    pos.wrapping_add(1),
+                    Ordering::Relaxed,
+                    Ordering::Relaxed,
+                ) {
+                    Ok(_) => {
+                        let len = record.len().min(RECORD_SIZE);
+                        unsafe {
+                            (&mut *slot.data.get())[..len].copy_from_slice(&record[..len]);
+                            *slot.len.get() = len;
+                        }
+                        slot.seq.store(pos.wrapping_add(1), Ordering::Release);
+                        return true;
+                    }
+                    Err(current) => pos = current,
+                },
+                // The slot still holds a record from the previous round
+                diff if diff < 0 => return false,
+                _ => pos = self.tail.load(Ordering::Relaxed),
+            }
+        }
+    }
+
+    /// Becomes the consumer of the ring, unless another thread already is.
+    fn consumer(&self) -> Option<Consumer<'_>> {
+        self.consuming
+            .compare_exchange(false, true, Ordering::Acquire, Ordering::Relaxed)
+            .ok()
+            .map(|_| Consumer(self))
+    }
+}
+
+/// Exclusive access to the front of the ring, released when dropped.
+struct Consumer<'a>(&'a Ring);
+
+impl Consumer<'_> {
+    /// Returns the oldest record without removing it.
+    fn peek(&self) -> Option<&[u8]> {
+        let pos = self.0.head.load(Ordering::Relaxed);
+        let slot = &self.0.slots[pos & self.0.mask];
+        if slot.seq.load(Ordering::Acquire) != pos.wrapping_add(1) {
+            return None;
+        }
+        // Producers do not touch the slot until `advance` hands it back
+        unsafe { Some(&(&*slot.data.get())[..*slot.len.get()]) }
+    }
+
+    /// Removes the oldest record.
+    fn advance(&mut self) {
+        let pos = self.0.head.load(Ordering::Relaxed);
+        let slot = &self.0.slots[pos & self.0.mask];
+        slot.seq
+            .store(pos.wrapping_add(self.0.mask + 1), Ordering::Release);
+        self.0.head.store(pos.wrapping_add(1), Ordering::Relaxed);
+    }
+}
+
+impl Drop for Consumer<'_> {
+    fn drop(&mut self) {
+        self.0.consuming.store(false, Ordering::Release);
+    }
+}
+
+/// Returns the syslog severity of a log level.
+fn severity(level: Level) -> u8 {
+    match level {
+        Level::Error => 3,
+        Level::Warn => 4,
+        Level::Info => 6,
+        Level::Debug | Level::Trace => 7,
+    }
+}
+
+/// Non-blocking syslog logger.
+pub struct AsyncSink {
+    socket: UnixDatagram,
+    process: String,
+    prefix: String,
+    ring: Ring,
+    dropped: AtomicU64,
+}
+
+impl AsyncSink {
+    /// Connects a non-blocking datagram socket to the local syslog daemon.
+    ///
+    /// # Arguments
+    /// - `process`: Process name of the syslog header
+    /// - `prefix`: Prefix of the dropped messages notice, e.g. `pam_authramp(sshd:auth)`
+    ///
+    /// # Returns
+    /// The sink or the error of the last syslog socket tried.
+    pub fn connect(process: String, prefix: String) -> io::Result<Self> {
+        let mut last_error = io::Error::from(io::ErrorKind::NotFound);
+        for path in SYSLOG_SOCKETS {
+            let socket = UnixDatagram::unbound()?;
+            match socket.connect(path) {
+                Ok(()) => return Self::new(socket, process, prefix),
+                Err(e) => last_error = e,
+            }
+        }
+        Err(last_error)
+    }
+
+    /// Creates a sink sending to the connected `socket`.
+    fn new(socket: UnixDatagram, process: String, prefix: String) -> io::Result<Self> {
+        socket.set_nonblocking(true)?;
+        Ok(AsyncSink {
+            socket,
+            process,
+            prefix,
+            ring: Ring::new(RING_SLOTS),
+            dropped: AtomicU64::new(0),
+        })
+    }
+
+    /// Formats a syslog record in the RFC 3164 layout of the synchronous logger.
+    fn format(&self, level: Level, args: fmt::Arguments) -> RecordBuf {
+        let mut buf = RecordBuf::new();
+        let _ = write!(
+            buf,
+            "<{}>{} {}[{}]: {}",
+            FACILITY_USER | severity(level),
+            Local::now().format("%b %e %T"),
+            self.process,
+            process::id(),
+            args
+        );
+        buf
+    }
+
+    /// Sends queued records until the ring is empty or the socket is backlogged.
+    fn drain(&self) {
+        let Some(mut consumer) = self.ring.consumer() else {
+            return;
+        };
+
+        let dropped = self.dropped.load(Ordering::Relaxed);
+        if dropped > 0 {
+            let notice = self.format(
+                Level::Error,
+                format_args!(
+                    "{}: Dropped {} log messages, the syslog socket is backlogged.",
+                    self.prefix, dropped
+                ),
+            );
+            match self.socket.send(notice.as_bytes()) {
+                Ok(_) => {
+                    self.dropped.fetch_sub(dropped, Ordering::Relaxed);
+                }
+                Err(_) => return,
+            }
+        }
+
+        while let Some(record) = consumer.peek() {
+            match self.socket.send(record) {
+                Ok(_) => {}
+                Err(e) if e.kind() == io::ErrorKind::WouldBlock => return,
+                // The record can not be delivered, e.g. while the syslog daemon restarts
+                Err(_) => self.count_dropped(),
+            }
+            consumer.advance();
+        }
+    }
+
+    /// Makes a last attempt to send the queued records, without blocking.
+    ///
+    /// The records the socket does not take are discarded and counted as dropped. Called when the
+    /// PAM transaction ends, as the process may exit right after.
+    pub fn finish(&self) {
+        self.drain();
+
+        let Some(mut consumer) = self.ring.consumer() else {
+            return;
+        };
+        while consumer.peek().is_some() {
+            self.count_dropped();
+            consumer.advance();
+        }
+    }
+
+    /// Counts a dropped message, for the notice and the shared metric.
+    fn count_dropped(&self) {
+        self.dropped.fetch_add(1, Ordering::Relaxed);
+        metrics::count(Counter::LogDropped);
+    }
+
+    /// Returns the number of dropped messages that were not reported yet.
+    pub fn dropped(&self) -> u64 {
+        self.dropped.load(Ordering::Relaxed)
+    }
+}
+
+impl Log for AsyncSink {
+    fn enabled(&self, metadata: &Metadata) -> bool {
+        metadata.level() <= Level::Info
+    }
+
+    fn log(&self, record: &Record) {
+        if !self.enabled(record.metadata()) {
+            return;
+        }
+
+        let buf = self.format(record.level(), *record.args());
+        if !self.ring.push(buf.as_bytes()) {
+            self.count_dropped();
+        }
+        self.drain();
+    }
+
+    fn flush(&self) {
+        self.drain();
+    }
+}
+
+// Unit Tests
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn log(sink: &AsyncSink, message: &str) {
+        sink.log(
+            &Record::builder()
+                .args(format_args!("{}", message))
+                .level(Level::Info)
+                .build(),
+        );
+    }
+
+    fn recv(socket: &UnixDatagram) -> Option<String> {
+        let mut buf = [0u8; RECORD_SIZE];
+        socket
+            .recv(&mut buf)
+            .ok()
+            .map(|len| String::from_utf8_lossy(&buf[..len]).into_owned())
+    }
+
+    #[test]
+    fn test_ring_is_bounded_and_ordered() {
+        let ring = Ring::new(4);
+        for i in 0..4u8 {
+            assert!(ring.push(&[i]));
+        }
+        assert!(!ring.push(&[4]));
+
+        let mut consumer = ring.consumer().unwrap();
+        // Only one consumer at a time
+        assert!(ring.consumer().is_none());
+
+        assert_eq!(consumer.peek(), Some(&[0u8][..]));
+        consumer.advance();
+        assert!(ring.push(&[4]));
+        for i in 1..5u8 {
+            assert_eq!(consumer.peek(), Some(&[i][..]));
+            consumer.advance();
+        }
+        assert_eq!(consumer.peek(), None);
+    }
+
+    #[test]
+    fn test_record_is_truncated() {
+        let mut buf = RecordBuf::new();
+        let _ = write!(buf, "{}", "x".repeat(RECORD_SIZE * 2));
+        assert_eq!(buf.as_bytes().len(), RECORD_SIZE);
+    }
+
+    #[test]
+    fn test_backlogged_socket_drops_and_reports() {
+        let (sender, receiver) = UnixDatagram::pair().unwrap();
+        receiver.set_nonblocking(true).unwrap();
+        let sink = AsyncSink::new(sender, "test".into(), "pam_authramp(test:auth)".into()).unwrap();
+
+        log(&sink, "first");
+        let first = recv(&receiver).unwrap();
+        assert!(first.starts_with("<14>"));
+        assert!(first.contains(&format!(" test[{}]: first", process::id())));
+
+        // Fill the socket and the ring without blocking
+        let mut sent = 0;
+        while sink.dropped() == 0 {
+            log(&sink, "flood");
+            sent += 1;
+        }
+        assert!(sent > RING_SLOTS);
+
+        // The backlog and the drop notice are sent once the socket is read
+        let mut received = Vec::new();
+        loop {
+            let before = received.len();
+            while let Some(message) = recv(&receiver) {
+                received.push(message);
+            }
+            if received.len() == before {
+                break;
+            }
+            sink.flush();
+        }
+        assert!(received
+            .iter()
+            .any(|m| m.ends_with("Dropped 1 log messages, the syslog socket is backlogged.")));
+
+        log(&sink, "last");
+        assert!(recv(&receiver).unwrap().ends_with(": last"));
+        assert_eq!(sink.dropped(), 0);
+    }
+
+    #[test]
+    fn test_finish_discards_and_counts_queued_records() {
+        let (sender, receiver) = UnixDatagram::pair().unwrap();
+        receiver.set_nonblocking(true).unwrap();
+        let sink = AsyncSink::new(sender, "test".into(), "pam_authramp(test:auth)".into()).unwrap();
+
+        // Fill the socket until records stay in the ring
+        while sink.ring.consumer().unwrap().peek().is_none() {
+            log(&sink, "flood");
+        }
+        assert_eq!(sink.dropped(), 0);
+
+        // Nothing is read, so all queued records are dropped without blocking
+        sink.finish();
+        assert!(sink.ring.consumer().unwrap().peek().is_none());
+        let dropped = sink.dropped();
+        assert!(dropped > 0);
+
+        // The drop notice is sent once the socket accepts records again
+        while recv(&receiver).is_some() {}
+        sink.flush();
+        assert!(recv(&receiver).unwrap().ends_with(&format!(
+            "Dropped {} log messages, the syslog socket is backlogged.",
+            dropped
+        )));
+        assert_eq!(sink.dropped(), 0);
+    }
+}
@@ -0,0 +1,407 @@
+//! # Metrics Module
+//!
+//! The `metrics` module measures the phases of a PAM hook and counts notable events. It is
+//! enabled with the `metrics` setting.
+//!
+//! ## Overview
+//!
+//! All processes using the module add to the same POSIX shared memory segment (`metrics_name`)
+//! with relaxed atomic operations, so recording a measurement is a single atomic add and never
+//! takes a lock. The segment is opened once per process.
+//!
+//! Every phase has a histogram of power of two buckets from 1µs to about 16s. The counters and
+//! histograms are rendered in the Prometheus text format by `authramp metrics`, e.g. for the
+//! node_exporter textfile collector.
+//!
+//! ## License
+//!
+//! pam-authramp
+//! Copyright (C) 2023 github.com/34N0
+//!
+//! This program is free software: you can redistribute it and/or modify
+//! it under the terms of the GNU General Public License as published by
+//! the Free Software Foundation, either version 3 of the License, or
+//! (at your option) any later version.
+//!
+//! This program is distributed in the hope that it will be useful,
+//! but WITHOUT ANY WARRANTY; without even the implied warranty of
+//! MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//! GNU General Public License for more details.
+//!
+//! You should have received a copy of the GNU General Public License
+//! along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+use std::ffi::CString;
+use std::fmt::Write;
+use std::fs::File;
+use std::io;
+use std::os::unix::fs::FileExt;
+use std::os::unix::io::FromRawFd;
+use std::ptr::NonNull;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::{Duration, Instant};
+
+use once_cell::sync::OnceCell;
+
+use crate::settings::Settings;
+use crate::store::shared::{map_shared, FileLock};
+
+const MAGIC: [u8; 8] = *b"ARTMETR\x01";
+const VERSION: u32 = 3;
+const HEADER_SIZE: usize = 64;
+/// Number of bounded histogram buckets, the last one ends at 2^24µs.
+const BUCKETS: usize = 25;
+/// Cells of a phase: the bounded buckets, the overflow bucket, the sum in ns and the count.
+const PHASE_CELLS: usize = BUCKETS + 3;
+const CELLS: usize = Counter::ALL.len() + Phase::ALL.len() * PHASE_CELLS;
+const LEN: usize = HEADER_SIZE + CELLS * 8;
+
+/// Metrics segment of this process, opened by `init`.
+static METRICS: OnceCell<Metrics> = OnceCell::new();
+
+/// A measured phase of a PAM hook.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum Phase {
+    /// Resolving the PAM user to a system user.
+    UserLookup,
+    /// `Settings::build`
+    SettingsBuild,
+    /// `init_log`
+    InitLog,
+    /// Loading and updating the tally.
+    Tally,
+    /// `bounce_auth`, including the time a locked session waits.
+    Bounce,
+}
+
+impl Phase {
+    pub const ALL: [Phase; 5] = [
+        Phase::UserLookup,
+        Phase::SettingsBuild,
+        Phase::InitLog,
+        Phase::Tally,
+        Phase::Bounce,
+    ];
+
+    fn name(self) -> &'static str {
+        match self {
+            Phase::UserLookup => "user_lookup",
+            Phase::SettingsBuild => "settings_build",
+            Phase::InitLog => "init_log",
+            Phase::Tally => "tally",
+            Phase::Bounce => "bounce",
+        }
+    }
+}
+
+/// A counted event.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum Counter {
+    /// PREAUTH hook invocations.
+    Preauth,
+    /// Attempts on a locked account.
+    Bounces,
+    /// Tallies with failures that were cleared.
+    Resets,
+    /// Tally files that could not be parsed.
+    ParseErrors,
+    /// Tally writes that failed.
+    WriteErrors,
+    /// Bounced attempts rejected by the admission control.
+    Shed,
+    /// Log messages the asynchronous logger could not deliver.
+    LogDropped,
+}
+
+impl Counter {
+    pub const ALL: [Counter; 7] = [
+        Counter::Preauth,
+        Counter::Bounces,
+        Counter::Resets,
+        Counter::ParseErrors,
+        Counter::WriteErrors,
+        Counter::Shed,
+        Counter::LogDropped,
+    ];
+
+    fn name(self) -> &'static str {
+        match self {
+            Counter::Preauth => "authramp_preauth_total",
+            Counter::Bounces => "authramp_bounces_total",
+            Counter::Resets => "authramp_resets_total",
+            Counter::ParseErrors => "authramp_parse_errors_total",
+            Counter::WriteErrors => "authramp_write_errors_total",
+            Counter::Shed => "authramp_shed_total",
+            Counter::LogDropped => "authramp_log_dropped_total",
+        }
+    }
+
+    fn help(self) -> &'static str {
+        match self {
+            Counter::Preauth => "PREAUTH hook invocations.",
+            Counter::Bounces => "Authentication attempts on a locked account.",
+            Counter::Resets => "Tallies with failures cleared after a successful authentication.",
+            Counter::ParseErrors => "Tally files that could not be parsed.",
+            Counter::WriteErrors => "Tally writes that failed.",
+            Counter::Shed => "Bounced attempts rejected by the admission control.",
+            Counter::LogDropped => "Log messages dropped while the syslog socket was backlogged.",
+        }
+    }
+}
+
+/// Returns the histogram bucket of a duration. Bucket `i` holds durations up to 2^i µs.
+fn bucket(elapsed: Duration) -> usize {
+    let micros = elapsed.as_micros().min(u64::MAX as u128) as u64;
+    if micros <= 1 {
+        return 0;
+    }
+    ((u64::BITS - (micros - 1).leading_zeros()) as usize).min(BUCKETS)
+}
+
+/// A mapped metrics segment.
+pub struct Metrics {
+    map: NonNull<u8>,
+}
+
+// The mapping is only accessed through atomics.
+unsafe impl Send for Metrics {}
+unsafe impl Sync for Metrics {}
+
+impl Metrics {
+    /// Opens and maps the POSIX shared memory segment `name`, creating it if it does not exist.
+    ///
+    /// # Arguments
+    /// - `name`: Name of the shared memory object, e.g. `/authramp-metrics`
+    ///
+    /// # Returns
+    /// The mapped segment or the error that occurred while opening it.
+    pub fn open(name: &str) -> io::Result<Metrics> {
+        let c_name = CString::new(name)?;
+        let fd = unsafe { libc::shm_open(c_name.as_ptr(), libc::O_RDWR | libc::O_CREAT, 0o600) };
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        let file = unsafe { File::from_raw_fd(fd) };
+
+        Self::init_header(&file)?;
+        Ok(Metrics {
+            map: map_shared(&file, LEN)?,
+        })
+    }
+
+    /// Writes the header to an empty segment and checks it.
+    /// Held under an exclusive `flock` so concurrent processes do not initialize it twice.
+    fn init_header(file: &File) -> io::Result<()> {
+        let _lock = FileLock::exclusive(file)?;
+
+        if file.metadata()?.len() == 0 {
+            let mut header = [0u8; HEADER_SIZE];
+            header[0..8].copy_from_slice(&MAGIC);
+            header[8..12].copy_from_slice(&VERSION.to_le_bytes());
+
+            file.set_len(LEN as u64)?;
+            file.write_all_at(&header, 0)?;
+        }
+
+        let mut header = [0u8; HEADER_SIZE];
+        file.read_exact_at(&mut header, 0)?;
+        let version = u32::from_le_bytes([header[8], header[9], header[10], header[11]]);
+
+        if header[0..8] != MAGIC || version != VERSION || file.metadata()?.len() < LEN as u64 {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "invalid metrics segment header",
+            ));
+        }
+        Ok(())
+    }
+
+    /// Returns the cell of the given index.
+    fn cell(&self, index: usize) -> &AtomicU64 {
+        debug_assert!(index < CELLS);
+        unsafe { &*(self.map.as_ptr().add(HEADER_SIZE + index * 8) as *const AtomicU64) }
+    }
+
+    /// Returns a cell of the histogram of a phase.
+    fn phase_cell(&self, phase: Phase, offset: usize) -> &AtomicU64 {
+        self.cell(Counter::ALL.len() + phase as usize * PHASE_CELLS + offset)
+    }
+
+    /// Increments a counter.
+    pub fn add(&self, counter: Counter) {
+        self.cell(counter as usize).fetch_add(1, Ordering::Relaxed);
+    }
+
+    /// Returns the value of a counter.
+    pub fn counter(&self, counter: Counter) -> u64 {
+        self.cell(counter as usize).load(Ordering::Relaxed)
+    }
+
+    /// Adds a measurement of a phase to its histogram.
+    pub fn observe(&self, phase: Phase, elapsed: Duration) {
+        let nanos = elapsed.as_nanos().min(u64::MAX as u128) as u64;
+        self.phase_cell(phase, bucket(elapsed))
+            .fetch_add(1, Ordering::Relaxed);
+        self.phase_cell(phase, BUCKETS + 1)
+            .fetch_add(nanos, Ordering::Relaxed);
+        self.phase_cell(phase, BUCKETS + 2)
+            .fetch_add(1, Ordering::Relaxed);
+    }
+
+    /// Renders all counters and histograms in the Prometheus text exposition format.
+    pub fn render(&self) -> String {
+        let mut out = String::new();
+
+        for counter in Counter::ALL {
+            let _ = writeln!(out, "# HELP {} {}", counter.name(), counter.help());
+            let _ = writeln!(out, "# TYPE {} counter", counter.name());
+            let _ = writeln!(out, "{} {}", counter.name(), self.counter(counter));
+        }
+
+        let name = "authramp_phase_duration_seconds";
+        let _ = writeln!(
+            out,
+            "# HELP {} Time spent in each phase of a PAM hook.",
+            name
+        );
+        let _ = writeln!(out, "# TYPE {} histogram", name);
+        for phase in Phase::ALL {
+            let mut cumulative = 0;
+            for i in 0..BUCKETS {
+                cumulative += self.phase_cell(phase, i).load(Ordering::Relaxed);
+                let le = (1u64 << i) as f64 / 1e6;
+                let _ = writeln!(
+                    out,
+                    "{}_bucket{{phase=\"{}\",le=\"{}\"}} {}",
+                    name,
+                    phase.name(),
+                    le,
+                    cumulative
+                );
+            }
+            // Concurrent updates may have raced the buckets, the count is the upper bound
+            let count = self.phase_cell(phase, BUCKETS + 2).load(Ordering::Relaxed);
+            let sum = self.phase_cell(phase, BUCKETS + 1).load(Ordering::Relaxed);
+            let _ = writeln!(
+                out,
+                "{}_bucket{{phase=\"{}\",le=\"+Inf\"}} {}",
+                name,
+                phase.name(),
+                count.max(cumulative)
+            );
+            let _ = writeln!(
+                out,
+                "{}_sum{{phase=\"{}\"}} {}",
+                name,
+                phase.name(),
+                sum as f64 / 1e9
+            );
+            let _ = writeln!(
+                out,
+                "{}_count{{phase=\"{}\"}} {}",
+                name,
+                phase.name(),
+                count.max(cumulative)
+            );
+        }
+
+        out
+    }
+}
+
+impl Drop for Metrics {
+    fn drop(&mut self) {
+        unsafe {
+            libc::munmap(self.map.as_ptr() as *mut libc::c_void, LEN);
+        }
+    }
+}
+
+/// Opens the metrics segment of this process if `metrics` is enabled.
+///
+/// # Arguments
+/// - `settings`: A reference to the `Settings` struct.
+pub fn init(settings: &Settings) {
+    if settings.metrics {
+        // A failed open is retried by the next hook
+        let _ = METRICS.get_or_try_init(|| Metrics::open(&settings.metrics_name));
+    }
+}
+
+/// Increments a counter if metrics are enabled.
+pub fn count(counter: Counter) {
+    if let Some(metrics) = METRICS.get() {
+        metrics.add(counter);
+    }
+}
+
+/// Records the duration of a phase if metrics are enabled.
+pub fn record(phase: Phase, elapsed: Duration) {
+    if let Some(metrics) = METRICS.get() {
+        metrics.observe(phase, elapsed);
+    }
+}
+
+/// Runs `f` and records its duration as `phase`.
+pub fn timed<T, F>(phase: Phase, f: F) -> T
+where
+    F: FnOnce() -> T,
+{
+    let start = Instant::now();
+    let result = f();
+    record(phase, start.elapsed());
+    result
+}
+
+// Unit Tests
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    struct Segment(String);
+
+    impl Drop for Segment {
+        fn drop(&mut self) {
+            let name = CString::new(self.0.as_str()).unwrap();
+            unsafe {
+                libc::shm_unlink(name.as_ptr());
+            }
+        }
+    }
+
+    #[test]
+    fn test_bucket_boundaries() {
+        assert_eq!(bucket(Duration::ZERO), 0);
+        assert_eq!(bucket(Duration::from_micros(1)), 0);
+        assert_eq!(bucket(Duration::from_micros(2)), 1);
+        assert_eq!(bucket(Duration::from_micros(3)), 2);
+        assert_eq!(bucket(Duration::from_micros(1024)), 10);
+        assert_eq!(bucket(Duration::from_secs(3600)), BUCKETS);
+    }
+
+    #[test]
+    fn test_metrics_are_shared_between_mappings() {
+        let segment = Segment(format!("/authramp-metrics-test-{}", std::process::id()));
+
+        let first = Metrics::open(&segment.0).unwrap();
+        let second = Metrics::open(&segment.0).unwrap();
+
+        first.add(Counter::Bounces);
+        second.add(Counter::Bounces);
+        first.observe(Phase::Tally, Duration::from_micros(3));
+        second.observe(Phase::Tally, Duration::from_secs(60));
+
+        assert_eq!(second.counter(Counter::Bounces), 2);
+        assert_eq!(first.counter(Counter::Resets), 0);
+
+        let text = first.render();
+        assert!(text.contains("authramp_bounces_total 2\n"));
+        assert!(text.contains(
+            "authramp_phase_duration_seconds_bucket{phase=\"tally\",le=\"0.000004\"} 1\n"
+        ));
+        assert!(text
+            .contains("authramp_phase_duration_seconds_bucket{phase=\"tally\",le=\"+Inf\"} 2\n"));
+        assert!(text.contains("authramp_phase_duration_seconds_sum{phase=\"tally\"} 60.000003\n"));
+        assert!(text.contains("authramp_phase_duration_seconds_count{phase=\"bounce\"} 0\n"));
+    }
+}
@@ -1 +1,3 @@
+pub mod async_log;
+pub mod metrics;
 pub mod syslog;
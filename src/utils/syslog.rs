@@ -6,23 +6,29 @@
 //!
 //! ## Overview
 //!
-//! The module defines a structure `SyslogState` to hold the syslog logger state, including
-//! initialization status and a pre-formatted log string. It also exposes a static variable
-//! `SYSLOG_STATE` to store the syslog state. The `init_log` function initializes the syslog logger,
-//! and the `syslog_info` and `syslog_error` macros are used for logging messages at different levels.
+//! The module defines a structure `SyslogState` to hold the pre-formatted log string of the
+//! initialized syslog logger. It is stored once in the static `SYSLOG_STATE`, so the `syslog_info`
+//! and `syslog_error` macros only do an atomic load and hook calls from many threads never wait
+//! for each other. The `init_log` function records the settings of the logger, and the
+//! `syslog_info` and `syslog_error` macros are used for logging messages at different levels.
+//!
+//! The logger is set up by the first message that is logged: the process name is resolved, the
+//! syslog socket is connected and the global logger is installed. A hook call that logs nothing,
+//! like a preauth of a user without failures, does none of this. The connection is kept for all
+//! later hook calls of the process. If the syslog socket cannot be connected, the message is
+//! dropped and the next message tries again.
 //!
 //! # Examples
 //!
 //! Initializing syslog and logging an informational message:
 //!
 //! ```
-//! use pam::module::PamHandle;
-//! use crate::settings::Settings;
+//! use crate::settings::{HookSettings, Settings};
 //!
-//! let mut pamh = PamHandle::dummy();
-//! let settings = Settings::default();
+//! let user = User::new(1000, "user", 1000);
+//! let settings = HookSettings::new(Arc::new(Settings::default()), user, "auth");
 //!
-//! my_syslog::init_log(&mut pamh, &settings).unwrap();
+//! my_syslog::init_log(&settings);
 //! syslog_info!("This is an informational message");
 //! ```
 //!
@@ -49,60 +55,96 @@
 //! You should have received a copy of the GNU General Public License
 //! along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
+use std::ffi::{OsStr, OsString};
+use std::fs;
+
+use chrono::Utc;
 use log::LevelFilter;
-use pam::module::PamHandle;
-use pam::{constants::PamResultCode, items::Service};
+use once_cell::sync::OnceCell;
+use pam::constants::PamResultCode;
+#[cfg(feature = "sysinfo")]
 use sysinfo::{Pid, System};
 use syslog::{BasicLogger, Facility, Formatter3164};
+use users::{get_user_by_uid, User};
 
-use crate::settings::Settings;
+use crate::settings::{HookSettings, LogMode, Settings};
+use crate::store::storm::{LogDecision, LogEvent, LogStormTable, Summary, LOG_STORM_FILE};
+use crate::utils::async_log::AsyncSink;
 
 extern crate syslog;
 
 /// Constants
 const MODULE_NAME: &str = "pam_authramp";
+const UNKNOWN_PROCESS: &str = "unknown-process";
+const PROC_SELF_COMM: &str = "/proc/self/comm";
 
 /// Struct to hold syslog state
 pub struct SyslogState {
-    pub logger_initialized: bool,
-    pub pre_log: Option<String>,
+    pub pre_log: String,
 }
 
-/// Static variable to hold syslog state
-pub static mut SYSLOG_STATE: SyslogState = SyslogState {
-    logger_initialized: false,
-    pre_log: None,
-};
+/// Syslog state, set once the logger is initialized
+static SYSLOG_STATE: OnceCell<SyslogState> = OnceCell::new();
+
+/// Settings the logger is set up with by the first message, recorded by the first `init_log`
+static LOG_SETTINGS: OnceCell<HookSettings> = OnceCell::new();
 
-/// Initializes syslog logging.
+/// Sink of the logger with `log_mode = "async"`, kept to finish it when the transaction ends
+static ASYNC_SINK: OnceCell<AsyncSink> = OnceCell::new();
+
+/// Records the settings of the syslog logger.
+///
+/// This function should be called once from outside the module before anything is logged.
+/// The logger is only set up when the syslog_info and syslog_error macros log the first
+/// message, see `state`.
+///
+/// # Arguments
+///
+/// * `settings` - A reference to the HookSettings of the call containing configuration
+///   information, including the PAM service and hook named in the log messages.
+pub fn init_log(settings: &HookSettings) {
+    // Later calls only load the recorded settings
+    if LOG_SETTINGS.get().is_none() {
+        let _ = LOG_SETTINGS.set(settings.clone());
+    }
+}
+
+/// Returns the syslog state, setting up the logger on the first call after `init_log`.
+///
+/// # Returns
+///
+/// The state, or `None` if `init_log` was not called or the logger cannot be set up.
+pub fn state() -> Option<&'static SyslogState> {
+    if let Some(state) = SYSLOG_STATE.get() {
+        return Some(state);
+    }
+
+    let settings = LOG_SETTINGS.get()?;
+    // Concurrent first messages wait for one initialization
+    SYSLOG_STATE.get_or_try_init(|| connect(settings)).ok()
+}
+
+/// Sets up the syslog logger.
 ///
-/// This function should be called once from outside the module to set up the syslog logger.
 /// It initializes the logger with syslog settings, such as the facility, process name, etc.
 /// The resulting logger is used by the syslog_info and syslog_error macros.
 ///
 /// # Arguments
 ///
-/// * `pamh` - A mutable reference to the PAM handle.
-/// * `settings` - A reference to the Settings struct containing configuration information.
+/// * `settings` - A reference to the HookSettings of the call containing configuration
+///   information.
 ///
 /// # Returns
 ///
-/// Returns Ok(()) on success, or Err(PamResultCode) on failure.
-pub fn init_log(pamh: &mut PamHandle, settings: &Settings) -> Result<(), PamResultCode> {
-    unsafe {
-        if !SYSLOG_STATE.logger_initialized {
-            let service_name = pamh.get_item::<Service>().ok().flatten().map_or_else(
-                || "unknown-service".to_string(),
-                |service| service.to_str().unwrap_or("unknown-service").to_string(),
-            );
+/// The syslog state on success, or Err(PamResultCode) on failure.
+fn connect(settings: &HookSettings) -> Result<SyslogState, PamResultCode> {
+    let service_name = settings.service.as_deref().unwrap_or("unknown-service");
 
-            let mut sys = System::new_all();
-            sys.refresh_all();
-
-            let process_name = sys
-                .process(Pid::from_u32(std::process::id()))
-                .map_or("unknown-process".to_string(), |p| p.name().to_string());
+    let process_name = get_process_name(settings);
+    let pre_log = format!("{}({}:{})", MODULE_NAME, service_name, settings.pam_hook);
 
+    let installed = match settings.log_mode {
+        LogMode::Sync => {
             let formatter = Formatter3164 {
                 facility: Facility::LOG_USER,
                 hostname: None,
@@ -110,21 +152,141 @@ pub fn init_log(pamh: &mut PamHandle, settings: &Settings) -> Result<(), PamResu
                 pid: 0,
             };
 
-            let logger = match syslog::unix(formatter) {
+            match syslog::unix(formatter) {
                 Err(_) => return Err(PamResultCode::PAM_SYSTEM_ERR),
-                Ok(logger) => logger,
-            };
+                Ok(logger) => log::set_boxed_logger(Box::new(BasicLogger::new(logger))),
+            }
+        }
+        LogMode::Async => {
+            match ASYNC_SINK.get_or_try_init(|| AsyncSink::connect(process_name, pre_log.clone())) {
+                Err(_) => return Err(PamResultCode::PAM_SYSTEM_ERR),
+                Ok(sink) => log::set_logger(sink),
+            }
+        }
+    };
+
+    installed
+        .map(|()| log::set_max_level(LevelFilter::Info))
+        .map_err(|_| PamResultCode::PAM_SYSTEM_ERR)?;
+
+    Ok(SyslogState { pre_log })
+}
+
+/// Finishes the asynchronous logger at the end of a PAM transaction.
+///
+/// The records still queued are sent without blocking, or counted as dropped, see
+/// `AsyncSink::finish`. Does nothing with the synchronous logger or before the first message.
+pub fn finish_log() {
+    if let Some(sink) = ASYNC_SINK.get() {
+        sink.finish();
+    }
+}
+
+/// Resolves the name of the current process for the syslog formatter.
+///
+/// By default only `/proc/self/comm` is read, which is a single small read independent of the
+/// number of processes on the host. The full sysinfo process table scan is only done when
+/// `sysinfo_process_name` is enabled in the settings and the module is built with the `sysinfo`
+/// feature.
+///
+/// # Arguments
+///
+/// * `settings` - A reference to the Settings struct containing configuration information.
+///
+/// # Returns
+///
+/// The process name, or `unknown-process` if it cannot be determined.
+#[cfg_attr(not(feature = "sysinfo"), allow(unused_variables))]
+pub fn get_process_name(settings: &Settings) -> String {
+    #[cfg(feature = "sysinfo")]
+    if settings.sysinfo_process_name {
+        let mut sys = System::new_all();
+        sys.refresh_all();
 
-            log::set_boxed_logger(Box::new(BasicLogger::new(logger)))
-                .map(|()| log::set_max_level(LevelFilter::Info))
-                .map_err(|_| PamResultCode::PAM_SYSTEM_ERR)?;
+        return sys
+            .process(Pid::from_u32(std::process::id()))
+            .map_or(UNKNOWN_PROCESS.to_string(), |p| p.name().to_string());
+    }
 
-            SYSLOG_STATE.logger_initialized = true;
+    fs::read_to_string(PROC_SELF_COMM)
+        .ok()
+        .map(|comm| comm.trim_end().to_string())
+        .filter(|comm| !comm.is_empty())
+        .unwrap_or_else(|| UNKNOWN_PROCESS.to_string())
+}
 
-            let pre_log = format!("{}({}:{})", MODULE_NAME, service_name, settings.pam_hook);
-            SYSLOG_STATE.pre_log = Some(pre_log);
+/// Logs the number of suppressed messages of an account.
+///
+/// # Arguments
+///
+/// * `name` - The name of the account.
+/// * `suppressed` - The number of suppressed messages.
+/// * `event` - The log event of the messages.
+/// * `seconds` - The seconds the messages were suppressed for.
+fn log_suppressed(name: &OsStr, suppressed: u64, event: LogEvent, seconds: u64) {
+    crate::syslog_info!(
+        "PAM_AUTH_ERR: Suppressed {} {} for the {:?} account in the last {}s.",
+        suppressed,
+        event.plural(),
+        name,
+        seconds
+    );
+}
+
+/// Logs the summary of the suppressed messages of an account whose log storm slot was taken over.
+fn log_summary(summary: &Summary) {
+    let name = get_user_by_uid(summary.uid).map_or_else(
+        || OsString::from(summary.uid.to_string()),
+        |user| user.name().to_os_string(),
+    );
+    log_suppressed(&name, summary.suppressed, summary.event, summary.seconds);
+}
+
+/// Logs a message of a repeating log event, collapsing log storms.
+///
+/// With `log_storm_window` set, only the first message of an account and event within the window
+/// is logged. The repeats are counted in the log storm table in the tally directory, which is
+/// shared by all processes, and reported in a summary line before the next message that is
+/// logged after the window. Repeats of an account whose slot is taken over by another account are
+/// reported by the process that takes it over.
+///
+/// # Arguments
+///
+/// * `settings` - A reference to the Settings struct containing configuration information.
+/// * `user` - The account of the message.
+/// * `event` - The log event of the message.
+/// * `log` - Logs the message.
+pub fn log_collapsed<F: FnOnce()>(settings: &Settings, user: &User, event: LogEvent, log: F) {
+    if settings.log_storm_window == 0 {
+        return log();
+    }
+
+    let now = Utc::now().timestamp().max(0) as u64;
+    match LogStormTable::open_cached(&settings.tally_dir.join(LOG_STORM_FILE)) {
+        Ok(table) => {
+            let (decision, summary) =
+                table.check(user.uid(), event, now, settings.log_storm_window);
+            if let Some(summary) = summary {
+                log_summary(&summary);
+            }
+            match decision {
+                LogDecision::Suppress => {}
+                LogDecision::Log {
+                    suppressed,
+                    seconds,
+                } => {
+                    if suppressed > 0 {
+                        log_suppressed(user.name(), suppressed, event, seconds);
+                    }
+                    log();
+                }
+            }
+        }
+        // Losing the suppression must not lose the message
+        Err(e) => {
+            crate::syslog_error!("PAM_SYSTEM_ERR: Error opening log storm table: {}", e);
+            log();
         }
-        Ok(())
     }
 }
 
@@ -141,12 +303,8 @@ pub fn init_log(pamh: &mut PamHandle, settings: &Settings) -> Result<(), PamResu
 macro_rules! syslog_info {
     ($($arg:tt)*) => {
         {
-            unsafe {
-                if $crate::utils::syslog::SYSLOG_STATE.logger_initialized {
-                    if let Some(ref pre_log) = $crate::utils::syslog::SYSLOG_STATE.pre_log {
-                        log::info!("{}: {}", pre_log, format_args!($($arg)*));
-                    }
-                }
+            if let Some(state) = $crate::utils::syslog::state() {
+                log::info!("{}: {}", state.pre_log, format_args!($($arg)*));
             }
         }
     };
@@ -165,13 +323,26 @@ macro_rules! syslog_info {
 macro_rules! syslog_error {
     ($($arg:tt)*) => {
         {
-            unsafe {
-                if $crate::utils::syslog::SYSLOG_STATE.logger_initialized {
-                    if let Some(ref pre_log) = $crate::utils::syslog::SYSLOG_STATE.pre_log {
-                        log::error!("{}: {}", pre_log, format_args!($($arg)*));
-                    }
-                }
+            if let Some(state) = $crate::utils::syslog::state() {
+                log::error!("{}: {}", state.pre_log, format_args!($($arg)*));
             }
         }
     };
 }
+
+// Unit Tests
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_process_name_from_proc_comm() {
+        let settings = Settings::default();
+
+        let process_name = get_process_name(&settings);
+        let comm = fs::read_to_string(PROC_SELF_COMM).unwrap();
+
+        assert_eq!(process_name, comm.trim_end());
+        assert_ne!(process_name, UNKNOWN_PROCESS);
+    }
+}
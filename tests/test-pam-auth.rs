@@ -58,6 +58,7 @@ mod test_pam_auth {
 
     use std::fs;
     use std::path::Path;
+    use std::time::{Duration, Instant};
     use tempfile::TempDir;
 
     use crate::common::utils::get_pam_context;
@@ -232,4 +233,42 @@ mod test_pam_auth {
             fs::remove_dir_all(custom_tally_dir.path()).expect("Unable to remove custom tally dir");
         });
     }
+
+    #[test]
+    fn test_fail_fast_bounce_returns_immediately() {
+        utils::init_and_clear_test(|| {
+            // Enable fail-fast lockout with a long delay
+            let config_content = "[Settings]\n\
+                free_tries = 1\n\
+                base_delay_seconds = 30\n\
+                fail_fast = true\n";
+            let config_path = "/etc/security/authramp.conf";
+            fs::write(config_path, config_content).expect("Unable to write to authramp.conf");
+
+            let mut ctx = get_pam_context(USER_NAME, "INVALID");
+
+            // Exceed the free tries
+            for _ in 0..2 {
+                let auth_result = ctx.authenticate(Flag::NONE);
+                assert!(auth_result.is_err(), "Authentication succeeded!");
+            }
+
+            // Expect the bounced attempt to be rejected without waiting for the unlock
+            let start = Instant::now();
+            let auth_result = ctx.authenticate(Flag::NONE);
+            assert!(auth_result.is_err(), "Authentication succeeded!");
+            assert!(
+                start.elapsed() < Duration::from_secs(5),
+                "Bounced authentication waited for the unlock"
+            );
+
+            let log_str = format!("{:?}", &ctx.conversation().log);
+            assert!(
+                log_str.contains("Account locked! Unlocking in"),
+                "Conversation log does not contain expected bounce message"
+            );
+
+            fs::remove_file(config_path).expect("Unable to remove test config");
+        });
+    }
 }
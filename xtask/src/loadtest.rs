@@ -0,0 +1,450 @@
+//! # Load Test
+//!
+//! Drives the installed module with concurrent PAM transactions and reports the throughput, the
+//! latency percentiles of the PAM calls and whether the final tallies are correct.
+//!
+//! ## Setup
+//!
+//! The load test needs root. It installs the release build of the module, creates system
+//! accounts `authramp-load-<n>` without a home or login shell and two PAM services:
+//!
+//! - `authramp-load-fail`: `preauth` followed by `authfail`, so every authentication fails.
+//! - `authramp-load-succ`: `preauth`, `pam_permit` and the account hook, so every
+//!   authentication succeeds and clears the tally.
+//!
+//! The configuration file is left alone. The module lines of both services carry arguments that
+//! count into their own tally directory and never lock an account, so the latencies are not
+//! hidden behind delays. Additional settings, e.g. the tally backend, are added to them with
+//! `--set`. Everything is removed afterwards.
+//!
+//! ## Correctness
+//!
+//! The accounts are split by the failure ratio: failing accounts only ever fail and success
+//! accounts only ever succeed, so their final tallies are known no matter how the attempts
+//! interleave. A failing account must end with one failure per attempt, every failure it is
+//! short of is reported as a lost increment. A success account must end clear.
+//!
+//! ## License
+//!
+//! pam-authramp
+//! Copyright (C) 2023 github.com/34N0
+//!
+//! This program is free software: you can redistribute it and/or modify
+//! it under the terms of the GNU General Public License as published by
+//! the Free Software Foundation, either version 3 of the License, or
+//! (at your option) any later version.
+//!
+//! This program is distributed in the hope that it will be useful,
+//! but WITHOUT ANY WARRANTY; without even the implied warranty of
+//! MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//! GNU General Public License for more details.
+//!
+//! You should have received a copy of the GNU General Public License
+//! along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+use anyhow::{bail, Context as _};
+use clap::Args;
+use pam_authramp::settings::{Settings, DEFAULT_CONFIG_FILE_PATH};
+use pam_authramp::tally::Tally;
+use pam_client::conv_mock::Conversation;
+use pam_client::{Context, Flag};
+use std::env;
+use std::ffi::{CStr, CString};
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+use std::thread;
+use std::time::{Duration, Instant, SystemTime, UNIX_EPOCH};
+use users::get_user_by_name;
+use xshell::{cmd, Shell};
+
+const SRV_DIR: &str = "/etc/pam.d";
+const FAIL_SRV: &str = "authramp-load-fail";
+const SUCC_SRV: &str = "authramp-load-succ";
+const USER_PREFIX: &str = "authramp-load-";
+const TALLY_DIR: &str = "/var/run/authramp-loadtest";
+/// Set when the module was installed before the load test was started again with `sudo`.
+const INSTALLED_ENV: &str = "AUTHRAMP_LOADTEST_INSTALLED";
+
+const FAIL_SRV_CONTENT: &str = "auth        required                                     libpam_authramp.so preauth {args}\n\
+                                auth        [default=die]                                libpam_authramp.so authfail {args}\n";
+
+const SUCC_SRV_CONTENT: &str = "auth        required                                     libpam_authramp.so preauth {args}\n\
+                                auth        required                                     pam_permit.so \n\
+                                account     required                                     libpam_authramp.so {args}\n";
+
+/// Arguments of `cargo xtask loadtest`
+#[derive(Args, Debug)]
+pub struct LoadTestArgs {
+    /// Number of concurrent PAM contexts
+    #[arg(long, default_value_t = 8)]
+    threads: usize,
+    /// Number of test accounts
+    #[arg(long, default_value_t = 16)]
+    users: usize,
+    /// Total number of authentication attempts
+    #[arg(long, default_value_t = 10_000)]
+    attempts: usize,
+    /// Share of the accounts and attempts that fail, from 0.0 to 1.0
+    #[arg(long, default_value_t = 0.5)]
+    failure_ratio: f64,
+    /// Additional module argument of the services, e.g. --set tally_backend=mmap
+    #[arg(long = "set")]
+    settings: Vec<String>,
+}
+
+/// Latencies of one PAM call.
+#[derive(Default)]
+struct Samples {
+    nanos: Vec<u64>,
+}
+
+impl Samples {
+    /// Returns the latency at quantile `q` of the sorted samples.
+    fn quantile(&self, q: f64) -> Duration {
+        match self.nanos.len() {
+            0 => Duration::ZERO,
+            len => {
+                let index = ((len as f64 * q).ceil() as usize).clamp(1, len) - 1;
+                Duration::from_nanos(self.nanos[index])
+            }
+        }
+    }
+
+    /// Prints count and percentiles of the samples.
+    fn report(&mut self, name: &str) {
+        self.nanos.sort_unstable();
+        println!(
+            "{:<18} {:>8} calls  p50 {:>10.3?}  p99 {:>10.3?}  p999 {:>10.3?}",
+            name,
+            self.nanos.len(),
+            self.quantile(0.5),
+            self.quantile(0.99),
+            self.quantile(0.999),
+        );
+    }
+}
+
+/// Samples recorded by one worker.
+#[derive(Default)]
+struct WorkerSamples {
+    fail_auth: Samples,
+    succ_auth: Samples,
+    acct_mgmt: Samples,
+}
+
+/// Removes everything the load test set up, also if it fails halfway.
+struct Environment {
+    created_users: Vec<String>,
+}
+
+impl Environment {
+    /// Installs the PAM services with the module arguments and the test accounts.
+    fn setup(sh: &Shell, module_args: &[String], users: &[String]) -> anyhow::Result<Environment> {
+        let mut environment = Environment {
+            created_users: Vec::new(),
+        };
+
+        let args = module_args.join(" ");
+        fs::write(
+            Path::new(SRV_DIR).join(FAIL_SRV),
+            FAIL_SRV_CONTENT.replace("{args}", &args),
+        )?;
+        fs::write(
+            Path::new(SRV_DIR).join(SUCC_SRV),
+            SUCC_SRV_CONTENT.replace("{args}", &args),
+        )?;
+        let _ = fs::remove_dir_all(TALLY_DIR);
+
+        for user in users {
+            if get_user_by_name(user).is_none() {
+                cmd!(
+                    sh,
+                    "useradd --system --no-create-home --shell /sbin/nologin {user}"
+                )
+                .run()?;
+                environment.created_users.push(user.clone());
+            }
+        }
+
+        Ok(environment)
+    }
+}
+
+impl Drop for Environment {
+    fn drop(&mut self) {
+        let Ok(sh) = Shell::new() else {
+            return;
+        };
+        for user in &self.created_users {
+            let _ = cmd!(sh, "userdel {user}").run();
+        }
+
+        let _ = fs::remove_file(Path::new(SRV_DIR).join(FAIL_SRV));
+        let _ = fs::remove_file(Path::new(SRV_DIR).join(SUCC_SRV));
+        let _ = fs::remove_dir_all(TALLY_DIR);
+    }
+}
+
+/// Returns the module arguments of the services: the own tally directory, no lockout and the
+/// `--set` settings.
+///
+/// # Arguments
+/// - `args`: Arguments of the load test
+///
+/// # Returns
+/// The `key=value` arguments, or an error if a `--set` setting would not fit on a PAM line.
+fn module_args(args: &LoadTestArgs) -> anyhow::Result<Vec<String>> {
+    let mut module_args = vec![
+        format!("tally_dir={}", TALLY_DIR),
+        format!("free_tries={}", i32::MAX),
+    ];
+    for setting in &args.settings {
+        let Some((key, value)) = setting.split_once('=') else {
+            bail!("--set {:?} is not a key=value setting", setting);
+        };
+        let arg = format!("{}={}", key.trim(), value.trim());
+        if arg.contains(char::is_whitespace) {
+            bail!(
+                "--set {:?} contains whitespace, PAM splits arguments on it",
+                setting
+            );
+        }
+        module_args.push(arg);
+    }
+    Ok(module_args)
+}
+
+/// Small xorshift generator, the attempts only need to be spread, not unpredictable.
+struct XorShift(u64);
+
+impl XorShift {
+    fn next(&mut self) -> u64 {
+        self.0 ^= self.0 << 13;
+        self.0 ^= self.0 >> 7;
+        self.0 ^= self.0 << 17;
+        self.0
+    }
+
+    /// Returns a float in [0, 1).
+    fn next_f64(&mut self) -> f64 {
+        (self.next() >> 11) as f64 / (1u64 << 53) as f64
+    }
+}
+
+/// Runs `cargo xtask loadtest`.
+///
+/// The module is built and installed first. Without root, the load test is then started again
+/// with `sudo`, so the build artifacts stay owned by the user.
+///
+/// # Arguments
+/// - `sh`: The xtask shell
+/// - `args`: The load test arguments
+///
+/// # Returns
+/// An error if the setup fails or if tally increments were lost.
+pub fn run(sh: &Shell, args: &LoadTestArgs) -> anyhow::Result<()> {
+    if args.threads == 0 || args.users == 0 {
+        bail!("--threads and --users must be at least 1");
+    }
+    if !(0.0..=1.0).contains(&args.failure_ratio) {
+        bail!("--failure-ratio must be between 0.0 and 1.0");
+    }
+    if args.users < 2 && args.failure_ratio > 0.0 && args.failure_ratio < 1.0 {
+        bail!("a mixed --failure-ratio needs at least 2 --users");
+    }
+
+    if env::var_os(INSTALLED_ENV).is_some() {
+        return drive(sh, args);
+    }
+
+    cmd!(sh, "cargo build --release --package pam-authramp").run()?;
+    cmd!(
+        sh,
+        "sudo cp target/release/libpam_authramp.so /lib64/security"
+    )
+    .run()?;
+
+    let res = if cmd!(sh, "id -u").read()?.trim() == "0" {
+        drive(sh, args)
+    } else {
+        let exe = env::current_exe()?;
+        let passed = env::args().skip(1).collect::<Vec<_>>();
+        cmd!(sh, "sudo -E {exe} {passed...}")
+            .env(INSTALLED_ENV, "1")
+            .run()
+            .map_err(Into::into)
+    };
+    let _ = cmd!(sh, "sudo rm -f /lib64/security/libpam_authramp.so").run();
+    res
+}
+
+/// Sets up the environment, runs the attempts and checks the tallies. Needs root.
+fn drive(sh: &Shell, args: &LoadTestArgs) -> anyhow::Result<()> {
+    let users = (0..args.users)
+        .map(|n| format!("{}{}", USER_PREFIX, n))
+        .collect::<Vec<_>>();
+
+    // Both kinds of accounts exist whenever both kinds of attempts do
+    let failing = match args.failure_ratio {
+        r if r == 0.0 => 0,
+        r if r == 1.0 => args.users,
+        r => ((args.users as f64 * r).round() as usize).clamp(1, args.users - 1),
+    };
+    let (failing_users, succ_users) = users.split_at(failing);
+
+    let module_args = module_args(args)?;
+    let _environment = Environment::setup(sh, &module_args, &users)?;
+
+    let fail_counts = (0..failing_users.len())
+        .map(|_| AtomicU64::new(0))
+        .collect::<Vec<_>>();
+    let errors = AtomicU64::new(0);
+    let next_attempt = AtomicUsize::new(0);
+    let seed = SystemTime::now()
+        .duration_since(UNIX_EPOCH)
+        .map_or(1, |d| d.as_nanos() as u64);
+
+    let start = Instant::now();
+    let samples = thread::scope(|scope| {
+        let workers = (0..args.threads)
+            .map(|worker| {
+                let (fail_counts, errors, next_attempt) = (&fail_counts, &errors, &next_attempt);
+                scope.spawn(move || {
+                    let mut rng = XorShift(seed ^ (worker as u64 + 1).wrapping_mul(0x9e37_79b9));
+                    let mut samples = WorkerSamples::default();
+
+                    while next_attempt.fetch_add(1, Ordering::Relaxed) < args.attempts {
+                        if rng.next_f64() < args.failure_ratio {
+                            let index = rng.next() as usize % failing_users.len();
+                            let user = &failing_users[index];
+                            let mut ctx = Context::new(
+                                FAIL_SRV,
+                                Some(user.as_str()),
+                                Conversation::with_credentials(user, ""),
+                            )
+                            .expect("Failed creating PAM context!");
+
+                            let begin = Instant::now();
+                            let res = ctx.authenticate(Flag::NONE);
+                            samples
+                                .fail_auth
+                                .nanos
+                                .push(begin.elapsed().as_nanos() as u64);
+                            match res {
+                                Err(_) => fail_counts[index].fetch_add(1, Ordering::Relaxed),
+                                Ok(()) => errors.fetch_add(1, Ordering::Relaxed),
+                            };
+                        } else {
+                            let user = &succ_users[rng.next() as usize % succ_users.len()];
+                            let mut ctx = Context::new(
+                                SUCC_SRV,
+                                Some(user.as_str()),
+                                Conversation::with_credentials(user, ""),
+                            )
+                            .expect("Failed creating PAM context!");
+
+                            let begin = Instant::now();
+                            let res = ctx.authenticate(Flag::NONE);
+                            samples
+                                .succ_auth
+                                .nanos
+                                .push(begin.elapsed().as_nanos() as u64);
+
+                            let begin = Instant::now();
+                            let res = res.and_then(|()| ctx.acct_mgmt(Flag::NONE));
+                            samples
+                                .acct_mgmt
+                                .nanos
+                                .push(begin.elapsed().as_nanos() as u64);
+                            if res.is_err() {
+                                errors.fetch_add(1, Ordering::Relaxed);
+                            }
+                        }
+                    }
+                    samples
+                })
+            })
+            .collect::<Vec<_>>();
+
+        workers
+            .into_iter()
+            .map(|worker| worker.join().expect("load test worker panicked"))
+            .collect::<Vec<_>>()
+    });
+    let elapsed = start.elapsed();
+
+    let mut total = WorkerSamples::default();
+    for mut worker in samples {
+        total.fail_auth.nanos.append(&mut worker.fail_auth.nanos);
+        total.succ_auth.nanos.append(&mut worker.succ_auth.nanos);
+        total.acct_mgmt.nanos.append(&mut worker.acct_mgmt.nanos);
+    }
+
+    println!(
+        "{} attempts with {} threads on {} accounts in {:.3?}: {:.0} attempts/s",
+        args.attempts,
+        args.threads,
+        args.users,
+        elapsed,
+        args.attempts as f64 / elapsed.as_secs_f64()
+    );
+    total.fail_auth.report("authenticate fail");
+    total.succ_auth.report("authenticate succ");
+    total.acct_mgmt.report("acct_mgmt");
+
+    // Read the tallies the way the module does, so every backend is checked
+    let mut lost = 0;
+    let mut unexpected = 0;
+    for (user, expected) in failing_users
+        .iter()
+        .zip(fail_counts.iter().map(|c| c.load(Ordering::Relaxed)))
+        .chain(succ_users.iter().map(|user| (user, 0)))
+    {
+        let failures = read_failures(user, &module_args)?;
+        if failures < expected {
+            lost += expected - failures;
+        } else if failures > expected {
+            unexpected += failures - expected;
+        }
+    }
+
+    println!(
+        "tally check: {} lost increments, {} unexpected failures, {} unexpected PAM results",
+        lost,
+        unexpected,
+        errors.load(Ordering::Relaxed)
+    );
+    if lost > 0 || unexpected > 0 {
+        bail!("the final tallies do not match the attempts");
+    }
+    Ok(())
+}
+
+/// Reads the failures of `user` through the configured backend, with the module arguments of the
+/// services.
+fn read_failures(user: &str, module_args: &[String]) -> anyhow::Result<u64> {
+    let module_args = module_args
+        .iter()
+        .map(|arg| CString::new(arg.as_str()))
+        .collect::<Result<Vec<_>, _>>()?;
+    let args = [CStr::from_bytes_with_nul(b"preauth\0")?]
+        .into_iter()
+        .chain(module_args.iter().map(CString::as_c_str))
+        .collect();
+    let settings = Settings::build(
+        get_user_by_name(user),
+        args,
+        0,
+        Some(PathBuf::from(DEFAULT_CONFIG_FILE_PATH)),
+        "auth",
+        None,
+    )
+    .ok()
+    .with_context(|| format!("Error building settings for {}", user))?;
+
+    let tally = Tally::new_from_tally_file(&settings)
+        .ok()
+        .with_context(|| format!("Error reading the tally of {}", user))?;
+    Ok(tally.failures_count.max(0) as u64)
+}
@@ -18,6 +18,9 @@
 //! - **PamTest:** Similar to the Test command but focuses on PAM authentication integration tests.
 //! - **Lint:** Check code formatting using `cargo fmt` and run clippy for linting.
 //! - **Fix:** Automatically fix linting issues using `cargo clippy --fix --allow-dirty`.
+//! - **Bench:** Run the criterion benchmarks of the PAM hook hot paths.
+//! - **LoadTest:** Drive the installed module with concurrent PAM transactions and report the
+//!   throughput, hook latencies and lost tally increments, see the `loadtest` module.
 //!
 //! ## License
 //!
@@ -44,6 +47,8 @@ use std::fs::OpenOptions;
 use std::io::Write;
 use xshell::{cmd, Shell};
 
+mod loadtest;
+
 const RUNNER: &str = " 
 [target.x86_64-unknown-linux-gnu] \n\
 runner = 'sudo -E'";
@@ -99,6 +104,14 @@ enum Commands {
     PamTest,
     Lint,
     Fix,
+    // criterion benchmarks of the hot paths
+    Bench {
+        /// Comma separated tally_dir sizes, e.g. 10,1000,1000000
+        #[arg(long)]
+        users: Option<String>,
+    },
+    // concurrent load test of the installed module
+    Loadtest(loadtest::LoadTestArgs),
 }
 
 /// Main entry point for xtask, parsing command-line arguments and executing corresponding tasks.
@@ -145,6 +158,14 @@ fn main() -> anyhow::Result<()> {
                 let _ = cmd!(sh, "sudo rm -rf /var/run/authramp").run();
             })
         }
+        Some(Commands::Bench { users }) => {
+            let bench = cmd!(sh, "cargo bench --bench hot_paths");
+            match users {
+                Some(users) => bench.env("AUTHRAMP_BENCH_USERS", users).run()?,
+                None => bench.run()?,
+            }
+        }
+        Some(Commands::Loadtest(args)) => loadtest::run(&sh, args)?,
         None => {}
     }
     Ok(())